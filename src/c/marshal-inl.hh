@@ -69,64 +69,13 @@ SeedType<T>::SeedType(Variant header, new_instance_t create,
 
 template <typename T>
 void VariantMap<T>::set(Variant key, const T &value) {
-  if (key.is_string()) {
-    strings_[key] = value;
-  } else {
-    set_generic(key, value);
-  }
-}
-
-template <typename T>
-void VariantMap<T>::set_generic(Variant key, const T &value) {
-  T *existing = get_generic(key);
-  if (existing == NULL) {
-    GenericMapping mapping = {key, value};
-    generic_.push_back(mapping);
-  } else {
-    *existing = value;
-  }
+  mappings_[key] = value;
 }
 
 template <typename T>
 T *VariantMap<T>::operator[](Variant key) {
-  if (key.is_string()) {
-    typename StringMap::iterator i = strings_.find(key);
-    return (i == strings_.end()) ? NULL : &i->second;
-  } else {
-    return get_generic(key);
-  }
-}
-
-template <typename T>
-T *VariantMap<T>::get_generic(Variant key) {
-  for (typename GenericVector::iterator i = generic_.begin();
-       i != generic_.end();
-       i++) {
-    if (i->key == key)
-      return &i->value;
-  }
-  return NULL;
-}
-
-template <typename T>
-size_t VariantMap<T>::StringHasher::operator()(const String &key) const {
-  // The msvc hasher uses the address to hash char pointers. The linux one on
-  // the other hand doesn't appear to know how to hash a std::string.
-  platform_hash<IF_MSVC(std::string, const char*)> hasher;
-  // Do we need to worry about embedded nulls? In theory strings with embedded
-  // nulls should get the same hash which is within the contract of a hash
-  // function so it should be okay.
-  return hasher(key.chars());
-}
-
-template <typename T>
-bool VariantMap<T>::StringHasher::operator()(const String &a, const String &b) {
-  size_t a_length = a.length();
-  size_t b_length = b.length();
-  if (a_length != b_length || (a_length == 0))
-    // Different lengths or empty strings can be decided based just on length.
-    return a_length < b_length;
-  return strncmp(a.chars(), b.chars(), a_length) < 0;
+  typename HashMap::iterator i = mappings_.find(key);
+  return (i == mappings_.end()) ? NULL : &i->second;
 }
 
 } // namespace plankton
@@ -9,24 +9,151 @@
 
 using namespace plankton;
 
+TypeRegistry::TypeRegistry()
+  : generation_(0)
+  , cache_(NULL) {
+  cache_guard_.initialize();
+}
+
+TypeRegistry::~TypeRegistry() {
+  for (size_t i = 0; i < fallbacks_.size(); i++) {
+    std::vector<TypeRegistry*> &dependents = fallbacks_[i]->dependents_;
+    for (size_t j = 0; j < dependents.size(); j++) {
+      if (dependents[j] == this) {
+        dependents.erase(dependents.begin() + j);
+        break;
+      }
+    }
+  }
+  delete cache_.load();
+  for (size_t i = 0; i < old_caches_.size(); i++)
+    delete old_caches_[i];
+}
+
 void TypeRegistry::register_type(AbstractSeedType *type) {
   types_.set(type->header(), type);
+  note_modified();
 }
 
 void TypeRegistry::add_fallback(TypeRegistry *fallback) {
-  if (fallback != NULL)
+  if (fallback != NULL) {
     fallbacks_.push_back(fallback);
+    fallback->dependents_.push_back(this);
+  }
+  note_modified();
+}
+
+void TypeRegistry::note_modified() {
+  generation_++;
+  for (size_t i = 0; i < dependents_.size(); i++)
+    dependents_[i]->note_modified();
 }
 
 AbstractSeedType *TypeRegistry::resolve_type(Variant header) {
   AbstractSeedType **type_ref = types_[header];
   if (type_ref != NULL)
     return *type_ref;
-  for (size_t i = 0; i < fallbacks_.size(); i++) {
-    TypeRegistry *fallback = fallbacks_[i];
-    AbstractSeedType *type = fallback->resolve_type(header);
-    if (type != NULL)
-      return type;
+  if (fallbacks_.empty())
+    return NULL;
+  return resolve_through_fallbacks(header);
+}
+
+// Returns true if the given header is a simple value that copy_header knows
+// how to copy.
+static bool is_copyable_header(Variant header) {
+  switch (header.type()) {
+    case PTON_INTEGER:
+    case PTON_FLOAT:
+    case PTON_BOOL:
+    case PTON_ID:
+    case PTON_STRING:
+    case PTON_BLOB:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns a copy of the given value owned by the given arena if it's a simple
+// value we know how to copy, otherwise null.
+static Variant copy_header(Variant header, Arena *arena) {
+  switch (header.type()) {
+    case PTON_STRING:
+      return arena->new_string(header.string_chars(), header.string_length());
+    case PTON_BLOB:
+      return arena->new_blob(header.blob_data(), header.blob_size());
+    default:
+      return is_copyable_header(header) ? header : Variant::null();
+  }
+}
+
+TypeRegistry::ResolutionCache::ResolutionCache(uint64_t generation)
+  : generation_(generation)
+  , size_(0) {
+  for (size_t i = 0; i < kSlotCount; i++)
+    slots_[i].store(NULL, std::memory_order_relaxed);
+}
+
+bool TypeRegistry::ResolutionCache::find(Variant header,
+    AbstractSeedType **type_out) {
+  size_t index = static_cast<size_t>(header.hash()) % kSlotCount;
+  while (true) {
+    Resolution *entry = slots_[index].load(std::memory_order_acquire);
+    if (entry == NULL)
+      return false;
+    if (entry->header == header) {
+      *type_out = entry->type;
+      return true;
+    }
+    index = (index + 1) % kSlotCount;
+  }
+}
+
+void TypeRegistry::ResolutionCache::add(Variant header, AbstractSeedType *type) {
+  if (is_full())
+    return;
+  Variant key = copy_header(header, &arena_);
+  if (key.is_null())
+    return;
+  size_t index = static_cast<size_t>(key.hash()) % kSlotCount;
+  while (true) {
+    Resolution *entry = slots_[index].load(std::memory_order_relaxed);
+    if (entry == NULL)
+      break;
+    if (entry->header == key)
+      // Someone else resolved the same header while we were doing it.
+      return;
+    index = (index + 1) % kSlotCount;
+  }
+  Resolution *entry = arena_.alloc_value<Resolution>();
+  entry->header = key;
+  entry->type = type;
+  slots_[index].store(entry, std::memory_order_release);
+  size_.store(size_.load(std::memory_order_relaxed) + 1,
+      std::memory_order_relaxed);
+}
+
+AbstractSeedType *TypeRegistry::resolve_through_fallbacks(Variant header) {
+  uint64_t current = generation_.load();
+  ResolutionCache *cache = cache_.load(std::memory_order_acquire);
+  bool is_current = (cache != NULL) && (cache->generation() == current);
+  AbstractSeedType *result = NULL;
+  if (is_current && cache->find(header, &result))
+    return result;
+  for (size_t i = 0; i < fallbacks_.size() && result == NULL; i++)
+    result = fallbacks_[i]->resolve_type(header);
+  if (!is_copyable_header(header) || (is_current && cache->is_full()))
+    // The resolution couldn't be cached so there's no need to lock.
+    return result;
+  cache_guard_.lock();
+  cache = cache_.load(std::memory_order_relaxed);
+  if (cache == NULL || cache->generation() != current) {
+    if (cache != NULL)
+      old_caches_.push_back(cache);
+    cache = new ResolutionCache(current);
+    cache_.store(cache, std::memory_order_release);
   }
-  return NULL;
+  cache->add(header, result);
+  cache_guard_.unlock();
+  return result;
 }
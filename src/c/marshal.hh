@@ -9,9 +9,12 @@
 #include "c/stdc.h"
 
 #include "c/stdhashmap.hh"
+#include "sync/mutex.hh"
 #include "utils/callback.hh"
 #include "variant.hh"
 
+#include <atomic>
+
 namespace plankton {
 
 // A seed type handles the process of growing a custom object in place of a
@@ -105,6 +108,7 @@ public:
   // Maps the given key to the given value. If there is already a mapping it is
   // replaced by this one. The map does not take ownership of the key, it is
   // up to the caller to ensure that it's valid as long as the map exists.
+  // Arrays and maps are compared by identity, not contents.
   void set(Variant key, const T &value);
 
   // Returns the binding for the given key, if there is one, otherwise NULL.
@@ -113,38 +117,16 @@ public:
   T *operator[](Variant key);
 
   // Returns the number of mappings in this map.
-  size_t size() { return strings_.size() + generic_.size(); }
-
-private:
-  // Controls how strings are hashed in the string map.
-  struct StringHasher {
-  public:
-    size_t operator()(const String &key) const;
-    // MSVC hash map stuff.
-    static const size_t bucket_size = 4;
-    bool operator()(const String &a, const String &b);
-  };
-
-  // A non special case mapping.
-  struct GenericMapping {
-    Variant key;
-    T value;
-  };
-
-  typedef platform_hash_map<String, T, StringHasher> StringMap;
-  typedef std::vector<GenericMapping> GenericVector;
+  size_t size() { return mappings_.size(); }
 
-  // Looks up a binding in the generic mappings.
-  T *get_generic(Variant key);
+  // Removes all mappings.
+  void clear() { mappings_.clear(); }
 
-  // Add a mapping to the generic mappings.
-  void set_generic(Variant key, const T &value);
-
-  // All string mappings are stored here, for more efficient access.
-  StringMap strings_;
+private:
+  typedef platform_hash_map<Variant, T, Variant::Hasher> HashMap;
 
-  // Mappings that don't belong anywhere else.
-  GenericVector generic_;
+  // All mappings, hashed using the structural variant hash.
+  HashMap mappings_;
 };
 
 // A registry that can resolve object types during parsing based on the seed's
@@ -158,9 +140,15 @@ public:
   virtual AbstractSeedType *resolve_type(Variant header) = 0;
 };
 
-// A simple registry based on a mapping from headers to types.
+// A simple registry based on a mapping from headers to types. Registries must
+// be set up, registering types and adding fallbacks, before they're used to
+// resolve types but once they are they can be used from any number of
+// threads.
 class TypeRegistry : public AbstractTypeRegistry {
 public:
+  TypeRegistry();
+  ~TypeRegistry();
+
   // Register the given seed type. The difference between this and the
   // non-template version is in that this uses the default seed type machinery
   // to extract the type object so if that's in place you only need to specify
@@ -179,8 +167,84 @@ public:
 
   virtual AbstractSeedType *resolve_type(Variant header);
 private:
+  // Don't cache more than this many resolutions. Headers come from the data
+  // being parsed so there's no telling how many different ones we'll see.
+  // Once the cache is full further resolutions just aren't cached.
+  static const size_t kMaxCachedResolutions = 1024;
+
+  // A cached resolution. Once an entry has been added to a cache it is never
+  // changed.
+  struct Resolution {
+    Variant header;
+    AbstractSeedType *type;
+  };
+
+  // Results of resolving headers through the fallbacks, including headers
+  // that couldn't be resolved, that were valid as of the given generation.
+  // Entries are only ever added, and only while holding the registry's
+  // guard, so the cache can be searched without locking.
+  class ResolutionCache {
+  public:
+    ResolutionCache(uint64_t generation);
+
+    // Looks up the given header, returning true and storing the type if it
+    // is in the cache.
+    bool find(Variant header, AbstractSeedType **type_out);
+
+    // Adds a resolution to this cache, unless it is full.
+    void add(Variant header, AbstractSeedType *type);
+
+    // Returns true if no more resolutions can be added to this cache.
+    bool is_full() {
+      return size_.load(std::memory_order_relaxed) >= kMaxCachedResolutions;
+    }
+
+    uint64_t generation() { return generation_; }
+
+  private:
+    // Slots are kept at most half full so probe sequences stay short.
+    static const size_t kSlotCount = 2 * kMaxCachedResolutions;
+
+    uint64_t generation_;
+    // Only changed while holding the registry's guard but read without it.
+    std::atomic<size_t> size_;
+
+    // Holds the entries and the keys they hold. The headers are usually owned
+    // by whatever is being parsed so they have to be copied.
+    Arena arena_;
+    std::atomic<Resolution*> slots_[kSlotCount];
+  };
+
+  // Bumps the generation of this registry and of every registry that uses it
+  // as a fallback, directly or indirectly.
+  void note_modified();
+
+  // Resolves the given header through the fallbacks, using and updating the
+  // resolution cache.
+  AbstractSeedType *resolve_through_fallbacks(Variant header);
+
   VariantMap<AbstractSeedType*> types_;
   std::vector<TypeRegistry*> fallbacks_;
+
+  // The registries that use this one as a fallback.
+  std::vector<TypeRegistry*> dependents_;
+
+  // Incremented whenever this registry or any of its fallbacks, direct or
+  // indirect, is modified, so resolving doesn't have to look at the
+  // fallbacks to know whether the cache is current.
+  std::atomic<uint64_t> generation_;
+
+  // The current resolution cache, NULL until there has been a resolution.
+  std::atomic<ResolutionCache*> cache_;
+
+  // Caches that have been replaced. Someone may still be searching them so
+  // they're kept until the registry is destroyed; that only happens when a
+  // registry is modified after it has been used.
+  std::vector<ResolutionCache*> old_caches_;
+
+  // Guards updates to the cache, registries are often shared between
+  // threads.
+  tclib::NativeMutex cache_guard_;
 };
 
 } // namespace plankton
@@ -14,27 +14,66 @@ using namespace plankton;
 // assembler implementation, the C++ wrapper delegates to this one.
 struct pton_assembler_t : public BinaryImplUtils {
 public:
-  // Write the given value to the stream.
-  void encode(Variant value);
+  pton_assembler_t()
+    : min_blob_gap_size_(0)
+    , blob_gaps_(NULL)
+    , blob_gap_suspensions_(0) { }
+
+  // Creates an assembler that writes into the given storage, which is owned by
+  // the caller, for as long as the code fits.
+  pton_assembler_t(uint8_t *storage, size_t capacity)
+    : bytes_(storage, capacity)
+    , min_blob_gap_size_(0)
+    , blob_gaps_(NULL)
+    , blob_gap_suspensions_(0) { }
+
+  // Makes this assembler only count the bytes it would have written.
+  void set_measure_only() { bytes_.set_measure_only(); }
+
+  // Makes blobs of at least the given size be left out of the code, with
+  // where they belong recorded in the given vector. See
+  // BinaryWriter::set_blob_gaps.
+  void set_blob_gaps(size_t min_size, std::vector<BlobGap> *gaps) {
+    min_blob_gap_size_ = min_size;
+    blob_gaps_ = gaps;
+  }
+
+  // While suspended all blobs are written in place, however large. Calls
+  // nest, each suspend must be matched by a resume.
+  void suspend_blob_gaps() { blob_gap_suspensions_++; }
+  void resume_blob_gaps() { blob_gap_suspensions_--; }
 
-  // Flush the contents of the stream, storing them in the fields of the given
-  // writer.
-  void flush(BinaryWriter *writer);
+  // Returns the number of bytes written so far.
+  size_t size() { return bytes_.length(); }
 
   bool begin_array(uint32_t length);
 
   bool begin_map(uint32_t length);
 
+  bool begin_indexed_array(uint32_t length);
+
+  bool begin_indexed_map(uint32_t size);
+
   bool begin_seed(uint32_t headerc, uint32_t fieldc);
 
+  bool begin_columns(uint32_t rows, uint32_t headerc, uint32_t keyc);
+
   bool emit_bool(bool value);
 
   bool emit_null();
 
   bool emit_int64(int64_t value);
 
+  bool emit_int64_array(const int64_t *values, uint32_t count);
+
+  bool emit_float64(double value);
+
+  bool emit_float64_array(const double *values, uint32_t count);
+
   bool emit_default_string(const char *chars, uint32_t length);
 
+  bool emit_table_string(uint32_t index);
+
   bool emit_blob(const void *data, uint32_t size);
 
   bool emit_string_with_encoding(pton_charset_t encoding, const void *chars,
@@ -58,7 +97,39 @@ private:
   // Write an untagged unsigned int64 varint.
   bool write_uint64(uint64_t value);
 
+  // An array, map, or seed that has begun but not ended. These are only
+  // tracked while within an indexed array or map.
+  struct Frame {
+    bool is_indexed;
+    // The number of values, elements or keys and values, remaining.
+    uint64_t remaining;
+    // The number of values per index table entry: 1 for arrays, 2 for maps.
+    uint32_t values_per_entry;
+    uint64_t values_seen;
+    // Where the contents start.
+    size_t data_start;
+    // For indexed frames, the offsets of the entries seen so far.
+    std::vector<uint64_t> entries;
+  };
+
+  // Called before writing each value.
+  void begin_value();
+
+  // Called after writing each value.
+  bool end_value();
+
+  // Called after writing the header of an array, map, or seed.
+  bool begin_container(bool is_indexed, uint64_t value_count,
+      uint32_t values_per_entry);
+
+  // Writes the offset table for the indexed frame on top of the stack.
+  void write_index(Frame *frame);
+
   Buffer<uint8_t> bytes_;
+  std::vector<Frame> frames_;
+  size_t min_blob_gap_size_;
+  std::vector<BlobGap> *blob_gaps_;
+  uint32_t blob_gap_suspensions_;
 };
 
 pton_assembler_t *pton_new_assembler() {
@@ -66,7 +137,9 @@ pton_assembler_t *pton_new_assembler() {
 }
 
 bool pton_assembler_t::begin_array(uint32_t length) {
-  return write_byte(boArray) && write_uint64(length);
+  begin_value();
+  return write_byte(boArray) && write_uint64(length)
+      && begin_container(false, length, 1);
 }
 
 bool pton_assembler_begin_array(pton_assembler_t *assm, uint32_t length) {
@@ -74,31 +147,73 @@ bool pton_assembler_begin_array(pton_assembler_t *assm, uint32_t length) {
 }
 
 bool pton_assembler_t::begin_map(uint32_t size) {
-  return write_byte(boMap) && write_uint64(size);
+  begin_value();
+  return write_byte(boMap) && write_uint64(size)
+      && begin_container(false, static_cast<uint64_t>(size) * 2, 2);
 }
 
 bool pton_assembler_begin_map(pton_assembler_t *assm, uint32_t size) {
   return assm->begin_map(size);
 }
 
+bool pton_assembler_t::begin_indexed_array(uint32_t length) {
+  begin_value();
+  return write_byte(boIndexedArray) && write_uint64(length)
+      && begin_container(true, length, 1);
+}
+
+bool pton_assembler_begin_indexed_array(pton_assembler_t *assm,
+    uint32_t length) {
+  return assm->begin_indexed_array(length);
+}
+
+bool pton_assembler_t::begin_indexed_map(uint32_t size) {
+  begin_value();
+  return write_byte(boIndexedMap) && write_uint64(size)
+      && begin_container(true, static_cast<uint64_t>(size) * 2, 2);
+}
+
+bool pton_assembler_begin_indexed_map(pton_assembler_t *assm, uint32_t size) {
+  return assm->begin_indexed_map(size);
+}
+
 bool pton_assembler_t::emit_bool(bool value) {
-  return write_byte(value ? boTrue : boFalse);
+  begin_value();
+  return write_byte(value ? boTrue : boFalse) && end_value();
 }
 
 bool pton_assembler_t::begin_seed(uint32_t headerc, uint32_t fieldc) {
-  return write_byte(boSeed) && write_uint64(headerc) && write_uint64(fieldc);
+  begin_value();
+  return write_byte(boSeed) && write_uint64(headerc) && write_uint64(fieldc)
+      && begin_container(false,
+          headerc + static_cast<uint64_t>(fieldc) * 2, 1);
 }
 
 bool pton_assembler_begin_seed(pton_assembler_t *assm, uint32_t headerc, uint32_t fieldc) {
   return assm->begin_seed(headerc, fieldc);
 }
 
+bool pton_assembler_t::begin_columns(uint32_t rows, uint32_t headerc,
+    uint32_t keyc) {
+  begin_value();
+  return write_byte(boColumns) && write_uint64(rows) && write_uint64(headerc)
+      && write_uint64(keyc)
+      && begin_container(false, headerc + static_cast<uint64_t>(keyc)
+          + static_cast<uint64_t>(rows) * keyc, 1);
+}
+
+bool pton_assembler_begin_columns(pton_assembler_t *assm, uint32_t rows,
+    uint32_t headerc, uint32_t keyc) {
+  return assm->begin_columns(rows, headerc, keyc);
+}
+
 bool pton_assembler_emit_bool(pton_assembler_t *assm, bool value) {
   return assm->emit_bool(value);
 }
 
 bool pton_assembler_t::emit_null() {
-  return write_byte(boNull);
+  begin_value();
+  return write_byte(boNull) && end_value();
 }
 
 bool pton_assembler_emit_null(pton_assembler_t *assm) {
@@ -106,25 +221,139 @@ bool pton_assembler_emit_null(pton_assembler_t *assm) {
 }
 
 bool pton_assembler_t::emit_int64(int64_t value) {
-  return write_byte(boInteger) && write_int64(value);
+  begin_value();
+  return write_byte(boInteger) && write_int64(value) && end_value();
 }
 
 bool pton_assembler_emit_int64(pton_assembler_t *assm, int64_t value) {
   return assm->emit_int64(value);
 }
 
+// Returns the zigzag encoding of the given value, which maps small negative
+// numbers to small unsigned ones.
+static uint64_t zigzag_encode(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+bool pton_assembler_t::emit_int64_array(const int64_t *values, uint32_t count) {
+  // Figure out which layout is smaller. Fixed-width is better for values that
+  // jump around, deltas for values that change slowly like timestamps and
+  // counters.
+  uint8_t log_width = 0;
+  uint64_t deltas_size = 0;
+  uint64_t prev = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    int64_t value = values[i];
+    while (log_width < 3) {
+      int64_t limit = static_cast<int64_t>(1) << ((8 << log_width) - 1);
+      if (-limit <= value && value < limit)
+        break;
+      log_width++;
+    }
+    uint64_t delta = static_cast<uint64_t>(value) - prev;
+    deltas_size += varint_size(zigzag_encode(static_cast<int64_t>(delta)));
+    prev = static_cast<uint64_t>(value);
+  }
+  uint64_t fixed_size = static_cast<uint64_t>(count) << log_width;
+  bool use_deltas = deltas_size < fixed_size;
+  uint64_t size = use_deltas ? deltas_size : fixed_size;
+  if (size > 0xFFFFFFFF)
+    return false;
+  begin_value();
+  write_byte(boInt64Array);
+  write_uint64(count);
+  write_byte(use_deltas ? (iaDeltas << 4) : ((iaFixed << 4) | log_width));
+  write_uint64(size);
+  if (use_deltas) {
+    uint8_t encoded[kMaxVarintSize];
+    prev = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      uint64_t delta = static_cast<uint64_t>(values[i]) - prev;
+      bytes_.write(encoded, encode_varint(zigzag_encode(static_cast<int64_t>(delta)),
+          encoded));
+      prev = static_cast<uint64_t>(values[i]);
+    }
+  } else {
+    size_t width = static_cast<size_t>(1) << log_width;
+    for (uint32_t i = 0; i < count; i++) {
+      uint64_t value = static_cast<uint64_t>(values[i]);
+      uint8_t encoded[8];
+      for (size_t j = 0; j < width; j++)
+        encoded[j] = static_cast<uint8_t>(value >> (8 * j));
+      bytes_.write(encoded, width);
+    }
+  }
+  return end_value();
+}
+
+bool pton_assembler_emit_int64_array(pton_assembler_t *assm,
+    const int64_t *values, uint32_t count) {
+  return assm->emit_int64_array(values, count);
+}
+
+bool pton_assembler_t::emit_float64(double value) {
+  begin_value();
+  uint8_t encoded[kFloat64Size];
+  encode_float64(value, encoded);
+  write_byte(boFloat64);
+  bytes_.write(encoded, kFloat64Size);
+  return end_value();
+}
+
+bool pton_assembler_emit_float64(pton_assembler_t *assm, double value) {
+  return assm->emit_float64(value);
+}
+
+bool pton_assembler_t::emit_table_string(uint32_t index) {
+  begin_value();
+  write_byte(boTableString);
+  write_uint64(index);
+  return end_value();
+}
+
+bool pton_assembler_emit_table_string(pton_assembler_t *assm, uint32_t index) {
+  return assm->emit_table_string(index);
+}
+
+bool pton_assembler_t::emit_float64_array(const double *values, uint32_t count) {
+  begin_value();
+  write_byte(boFloat64Array);
+  write_uint64(count);
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t encoded[kFloat64Size];
+    encode_float64(values[i], encoded);
+    bytes_.write(encoded, kFloat64Size);
+  }
+  return end_value();
+}
+
+bool pton_assembler_emit_float64_array(pton_assembler_t *assm,
+    const double *values, uint32_t count) {
+  return assm->emit_float64_array(values, count);
+}
+
 bool pton_assembler_t::emit_default_string(const char *chars, uint32_t length) {
+  begin_value();
   write_byte(boDefaultString);
   write_uint64(length);
   bytes_.write(reinterpret_cast<const uint8_t*>(chars), length);
-  return true;
+  return end_value();
 }
 
 bool pton_assembler_t::emit_blob(const void *data, uint32_t size) {
+  begin_value();
   write_byte(boBlob);
   write_uint64(size);
-  bytes_.write(reinterpret_cast<const uint8_t*>(data), size);
-  return true;
+  if (blob_gaps_ != NULL && size >= min_blob_gap_size_ && frames_.empty()
+      && blob_gap_suspensions_ == 0) {
+    // Within indexed containers the index gets inserted before the contents
+    // which would move the gap so those blobs are always written in place.
+    BlobGap gap = {bytes_.length(), data, size};
+    blob_gaps_->push_back(gap);
+  } else {
+    bytes_.write(reinterpret_cast<const uint8_t*>(data), size);
+  }
+  return end_value();
 }
 
 bool pton_assembler_emit_default_string(pton_assembler_t *assm, const char *chars,
@@ -138,11 +367,12 @@ bool pton_assembler_emit_blob(pton_assembler_t *assm, const void *data, uint32_t
 
 bool pton_assembler_t::emit_string_with_encoding(pton_charset_t encoding,
     const void *chars, uint32_t length) {
+  begin_value();
   write_byte(boStringWithEncoding);
   write_uint64(encoding);
   write_uint64(length);
   bytes_.write(static_cast<const uint8_t*>(chars), length);
-  return true;
+  return end_value();
 }
 
 bool pton_assembler_emit_string_with_encoding(pton_assembler_t *assm,
@@ -151,14 +381,15 @@ bool pton_assembler_emit_string_with_encoding(pton_assembler_t *assm,
 }
 
 bool pton_assembler_t::emit_id64(uint32_t size, uint64_t value) {
-  write_byte(boId);
   switch (size) {
     case 64: case 32: case 16: case 8:
-      write_byte(static_cast<byte_t>(size >> 3));
       break;
     default:
       return false;
   }
+  begin_value();
+  write_byte(boId);
+  write_byte(static_cast<byte_t>(size >> 3));
   switch (size) {
     case 64: {
       bytes_.write(reinterpret_cast<uint8_t*>(&value), 8);
@@ -180,7 +411,7 @@ bool pton_assembler_t::emit_id64(uint32_t size, uint64_t value) {
       break;
     }
   }
-  return true;
+  return end_value();
 }
 
 bool pton_assembler_emit_id64(pton_assembler_t *assm, uint32_t size,
@@ -189,7 +420,8 @@ bool pton_assembler_emit_id64(pton_assembler_t *assm, uint32_t size,
 }
 
 bool pton_assembler_t::emit_reference(uint64_t offset) {
-  return write_byte(boReference) && write_uint64(offset);
+  begin_value();
+  return write_byte(boReference) && write_uint64(offset) && end_value();
 }
 
 bool pton_assembler_emit_reference(pton_assembler_t *assm, uint64_t offset) {
@@ -226,26 +458,92 @@ bool pton_assembler_t::write_byte(uint8_t value) {
   return true;
 }
 
+void pton_assembler_t::begin_value() {
+  if (frames_.empty())
+    return;
+  Frame *top = &frames_.back();
+  if (top->is_indexed && (top->values_seen % top->values_per_entry) == 0)
+    top->entries.push_back(bytes_.length() - top->data_start);
+}
+
+bool pton_assembler_t::end_value() {
+  while (!frames_.empty()) {
+    Frame *top = &frames_.back();
+    top->values_seen++;
+    if (--top->remaining > 0)
+      break;
+    // That was the last value of the innermost container so it is done and
+    // is itself a value in the container around it.
+    if (top->is_indexed)
+      write_index(top);
+    frames_.pop_back();
+  }
+  return true;
+}
+
+bool pton_assembler_t::begin_container(bool is_indexed, uint64_t value_count,
+    uint32_t values_per_entry) {
+  if (!is_indexed && frames_.empty())
+    // We only need to keep track of the structure within indexed containers.
+    return true;
+  frames_.push_back(Frame());
+  Frame *frame = &frames_.back();
+  frame->is_indexed = is_indexed;
+  frame->remaining = value_count;
+  frame->values_per_entry = values_per_entry;
+  frame->values_seen = 0;
+  frame->data_start = bytes_.length();
+  if (value_count > 0)
+    return true;
+  // An empty container is done right away.
+  if (is_indexed)
+    write_index(frame);
+  frames_.pop_back();
+  return end_value();
+}
+
+void pton_assembler_t::write_index(Frame *frame) {
+  uint64_t data_size = bytes_.length() - frame->data_start;
+  uint8_t log_entry_size = 0;
+  while (log_entry_size < 3 && (data_size >> (8 << log_entry_size)) != 0)
+    log_entry_size++;
+  size_t entry_size = static_cast<size_t>(1) << log_entry_size;
+  frame->entries.push_back(data_size);
+  // The table goes between the header and the data which have both been
+  // written so we build it separately and move the data to make room.
+  std::vector<uint8_t> table;
+  table.push_back(static_cast<uint8_t>((kIndexLayoutVersion << 4) | log_entry_size));
+  for (size_t i = 0; i < frame->entries.size(); i++) {
+    uint64_t entry = frame->entries[i];
+    for (size_t j = 0; j < entry_size; j++)
+      table.push_back(static_cast<uint8_t>(entry >> (8 * j)));
+  }
+  bytes_.insert(frame->data_start, &table[0], table.size());
+}
+
 bool pton_assembler_t::write_int64(int64_t value) {
   uint64_t zigzag = (value << 1) ^ (value >> 63);
   return write_uint64(zigzag);
 }
 
 bool pton_assembler_t::write_uint64(uint64_t value) {
-  uint64_t current = value;
-  while (current >= 0x80) {
-    write_byte(static_cast<byte_t>((current & 0x7F) | 0x80));
-    current = (current >> 7) - 1;
-  }
-  write_byte(static_cast<byte_t>(current));
+  uint8_t encoded[kMaxVarintSize];
+  bytes_.write(encoded, encode_varint(value, encoded));
   return true;
 }
 
 namespace plankton {
 
-BinaryWriter::BinaryWriter()
+BinaryWriter::BinaryWriter(Arena *scratch)
   : bytes_(NULL)
-  , size_(0) { }
+  , size_(0)
+  , scratch_(scratch == NULL ? &own_scratch_ : scratch)
+  , emit_references_(false)
+  , index_threshold_(0)
+  , columns_threshold_(0)
+  , string_table_(NULL)
+  , min_blob_gap_size_(0)
+  , blob_gaps_(NULL) { }
 
 BinaryWriter::~BinaryWriter() {
   delete[] bytes_;
@@ -258,15 +556,56 @@ BinaryWriter::~BinaryWriter() {
 // one variant and then torn down.
 class VariantWriter {
 public:
-  VariantWriter(Assembler *assm) : assm_(assm) { }
+  VariantWriter(Assembler *assm, Arena *scratch = NULL)
+    : scratch_(scratch == NULL ? &own_scratch_ : scratch)
+    , assm_(assm)
+    , emit_references_(false)
+    , index_threshold_(0)
+    , columns_threshold_(0)
+    , string_table_(NULL)
+    , note_written_strings_(false)
+    , replacements_(NULL)
+    , record_replacements_(false)
+    , next_replacement_(0)
+    , gap_assm_(NULL)
+    , seed_count_(0) { }
+
+  // Sets whether repeated seeds and natives should be written as references.
+  void set_emit_references(bool value) { emit_references_ = value; }
+
+  // Sets the size from which arrays and maps get an offset index.
+  void set_index_threshold(uint32_t value) { index_threshold_ = value; }
+
+  // Sets the length from which arrays of same-shaped maps and seeds are
+  // written by column.
+  void set_columns_threshold(uint32_t value) { columns_threshold_ = value; }
+
+  // Sets the table of strings to write as indices and whether strings that
+  // are written in full should be noted with it.
+  void set_string_table(StringTable *table, bool note_written_strings) {
+    string_table_ = table;
+    note_written_strings_ = note_written_strings;
+  }
+
+  // Sets the list of values native objects are encoded as. If recording, the
+  // replacements are added to the list as natives are encoded, otherwise
+  // they're taken from the list in the same order rather than encoding the
+  // natives again.
+  void set_native_replacements(std::vector<Variant> *replacements,
+      bool record) {
+    replacements_ = replacements;
+    record_replacements_ = record;
+  }
+
+  // Sets the assembler behind this writer's assembler if it may leave gaps
+  // for large blobs. Native replacements live in the scratch arena which may
+  // be released before the gaps are filled so their blobs are always written
+  // in place.
+  void set_gap_assembler(pton_assembler_t *value) { gap_assm_ = value; }
 
   // Write the given value to the stream.
   void encode(Variant value);
 
-  // Flush the contents of the stream, storing them in the fields of the given
-  // writer.
-  void flush(BinaryWriter *writer);
-
   void encode_array(Array value);
 
   void encode_string(String value);
@@ -280,16 +619,105 @@ public:
   void encode_native(Native value);
 
 private:
-  Arena scratch_;
+  // Controls how object identities are hashed.
+  struct IdentityHasher {
+  public:
+    size_t operator()(const void *key) const {
+      uintptr_t value = reinterpret_cast<uintptr_t>(key);
+      return static_cast<size_t>(value ^ (value >> 4) ^ (value >> 16));
+    }
+    // MSVC hash map stuff.
+    static const size_t bucket_size = 4;
+    bool operator()(const void *a, const void *b) { return a < b; }
+  };
+
+  typedef platform_hash_map<const void*, uint64_t, IdentityHasher> IndexMap;
+
+  // If the object with the given identity has already been written, or is
+  // being written and so contains itself, writes a reference to it and returns
+  // true. Otherwise returns false.
+  bool try_emit_reference(const void *identity);
+
+  // Notes that the object with the given identity, which has the given index,
+  // is being written. Returns true if it should be forgotten again using
+  // end_seed once it has been written.
+  bool begin_seed(const void *identity, uint64_t index);
+
+  // Forgets the given object that was being written.
+  void end_seed(const void *identity);
+
+  Arena own_scratch_;
+  Arena *scratch_;
   Assembler *assm_;
   Assembler *assm() { return assm_; }
+
+  bool emit_references_;
+
+  uint32_t index_threshold_;
+
+  // Returns true if a container with the given number of elements should be
+  // written with an offset index.
+  bool use_index(uint32_t count) {
+    return (index_threshold_ > 0) && (count >= index_threshold_);
+  }
+
+  uint32_t columns_threshold_;
+
+  // If the elements of the given array are maps that all have the same keys
+  // in the same order, or seeds that also have the same header, writes the
+  // array by column and returns true. Otherwise writes nothing and returns
+  // false.
+  bool try_encode_columns(Array value);
+
+  // Returns true if all the given seeds can be written in full, that is,
+  // none of them would be written as a reference.
+  bool can_write_all_seeds(Array value);
+
+  StringTable *string_table_;
+  bool note_written_strings_;
+
+  std::vector<Variant> *replacements_;
+  bool record_replacements_;
+  size_t next_replacement_;
+
+  pton_assembler_t *gap_assm_;
+
+  // The number of seeds written so far. Each seed is given the next index,
+  // whether or not it gets referenced, since that's what the reader expects.
+  uint64_t seed_count_;
+
+  // Maps the identities of the seeds and natives written so far to their
+  // indices.
+  IndexMap seed_indices_;
+
+  // When references aren't emitted, maps the identities of the seeds and
+  // natives that are currently being written to their indices. A seed that
+  // contains itself can only be written as a reference so that's how it's
+  // written regardless.
+  IndexMap open_seeds_;
 };
 
-void VariantWriter::flush(BinaryWriter *writer) {
-  blob_t live = assm()->peek_code();
-  writer->size_ = live.size;
-  writer->bytes_ = new uint8_t[live.size];
-  memcpy(writer->bytes_, live.start, live.size);
+bool VariantWriter::try_emit_reference(const void *identity) {
+  IndexMap *indices = emit_references_ ? &seed_indices_ : &open_seeds_;
+  IndexMap::iterator i = indices->find(identity);
+  if (i == indices->end())
+    return false;
+  assm()->emit_reference(seed_count_ - i->second - 1);
+  return true;
+}
+
+bool VariantWriter::begin_seed(const void *identity, uint64_t index) {
+  if (emit_references_) {
+    seed_indices_[identity] = index;
+    return false;
+  } else {
+    open_seeds_[identity] = index;
+    return true;
+  }
+}
+
+void VariantWriter::end_seed(const void *identity) {
+  open_seeds_.erase(identity);
 }
 
 void VariantWriter::encode(Variant value) {
@@ -318,6 +746,9 @@ void VariantWriter::encode(Variant value) {
     case PTON_INTEGER:
       assm()->emit_int64(value.integer_value());
       break;
+    case PTON_FLOAT:
+      assm()->emit_float64(value.float64_value());
+      break;
     case PTON_ID:
       assm()->emit_id64(value.id_size(), value.id64_value());
       break;
@@ -329,6 +760,15 @@ void VariantWriter::encode(Variant value) {
 }
 
 void VariantWriter::encode_string(String value) {
+  if (string_table_ != NULL) {
+    uint32_t index = 0;
+    if (string_table_->find(value, &index)) {
+      assm()->emit_table_string(index);
+      return;
+    }
+    if (note_written_strings_)
+      string_table_->note_written(value);
+  }
   uint32_t length = value.length();
   pton_charset_t encoding = value.encoding();
   if (encoding == Variant::default_string_encoding()) {
@@ -343,15 +783,141 @@ void VariantWriter::encode_blob(Blob value) {
 }
 
 void VariantWriter::encode_array(Array value) {
-  uint32_t length = value.length();
-  assm()->begin_array(length);
+  const int64_t *elms = NULL;
+  uint32_t length = 0;
+  if (value.int64_span(&elms, &length)) {
+    assm()->emit_int64_array(elms, length);
+    return;
+  }
+  const double *float_elms = NULL;
+  if (value.float64_span(&float_elms, &length)) {
+    assm()->emit_float64_array(float_elms, length);
+    return;
+  }
+  length = value.length();
+  if (columns_threshold_ > 0 && length >= columns_threshold_
+      && try_encode_columns(value))
+    return;
+  if (use_index(length)) {
+    assm()->begin_indexed_array(length);
+  } else {
+    assm()->begin_array(length);
+  }
   for (uint32_t i = 0; i < length; i++)
     encode(value[i]);
 }
 
+bool VariantWriter::try_encode_columns(Array value) {
+  uint32_t rows = value.length();
+  Variant first = value[0];
+  bool is_seed = first.is_seed();
+  if (!is_seed && !first.is_map())
+    return false;
+  // All the rows must have the same keys in the same order, and the same
+  // header if they're seeds. We compare each row with the first one.
+  uint32_t keyc = is_seed ? Seed(first).field_count() : Map(first).size();
+  if (keyc == 0)
+    return false;
+  Variant header = is_seed ? Seed(first).header() : Variant::null();
+  for (uint32_t i = 1; i < rows; i++) {
+    Variant row = value[i];
+    if (is_seed) {
+      if (!row.is_seed())
+        return false;
+      Seed seed = row;
+      if (seed.field_count() != keyc || !(seed.header() == header))
+        return false;
+      Seed::Iterator a = Seed(first).fields_begin();
+      for (Seed::Iterator b = seed.fields_begin(); b != seed.fields_end(); a++, b++) {
+        if (!(a->key() == b->key()))
+          return false;
+      }
+    } else {
+      if (!row.is_map())
+        return false;
+      Map map = row;
+      if (map.size() != keyc)
+        return false;
+      Map::Iterator a = Map(first).begin();
+      for (Map::Iterator b = map.begin(); b != map.end(); a++, b++) {
+        if (!(a->key() == b->key()))
+          return false;
+      }
+    }
+  }
+  if (is_seed && !can_write_all_seeds(value))
+    return false;
+  assm()->begin_columns(rows, is_seed ? 1 : 0, keyc);
+  if (is_seed) {
+    // The rows get their indices up front, before anything within them.
+    bool is_open = false;
+    for (uint32_t i = 0; i < rows; i++) {
+      uint64_t index = seed_count_++;
+      is_open = begin_seed(value[i].to_c().payload_.as_arena_seed_, index);
+    }
+    encode(header);
+    for (Seed::Iterator k = Seed(first).fields_begin(); k != Seed(first).fields_end(); k++)
+      encode(k->key());
+    std::vector<Seed::Iterator> cursors;
+    for (uint32_t i = 0; i < rows; i++)
+      cursors.push_back(Seed(value[i]).fields_begin());
+    for (uint32_t k = 0; k < keyc; k++) {
+      for (uint32_t i = 0; i < rows; i++) {
+        encode(cursors[i]->value());
+        ++cursors[i];
+      }
+    }
+    if (is_open) {
+      for (uint32_t i = 0; i < rows; i++)
+        end_seed(value[i].to_c().payload_.as_arena_seed_);
+    }
+  } else {
+    for (Map::Iterator k = Map(first).begin(); k != Map(first).end(); k++)
+      encode(k->key());
+    std::vector<Map::Iterator> cursors;
+    for (uint32_t i = 0; i < rows; i++)
+      cursors.push_back(Map(value[i]).begin());
+    for (uint32_t k = 0; k < keyc; k++) {
+      for (uint32_t i = 0; i < rows; i++) {
+        encode(cursors[i]->value());
+        ++cursors[i];
+      }
+    }
+  }
+  return true;
+}
+
+bool VariantWriter::can_write_all_seeds(Array value) {
+  if (!emit_references_) {
+    // Only a row that is being written, so the array is within it, would have
+    // to be written as a reference.
+    for (uint32_t i = 0; i < value.length(); i++) {
+      const void *identity = value[i].to_c().payload_.as_arena_seed_;
+      if (open_seeds_.find(identity) != open_seeds_.end())
+        return false;
+    }
+    return true;
+  }
+  // A row that has been written before, or occurs twice, would have to be
+  // written as a reference.
+  IndexMap seen;
+  for (uint32_t i = 0; i < value.length(); i++) {
+    const void *identity = value[i].to_c().payload_.as_arena_seed_;
+    if (seed_indices_.find(identity) != seed_indices_.end()
+        || seen.find(identity) != seen.end())
+      return false;
+    seen[identity] = i;
+  }
+  return true;
+}
+
 void VariantWriter::encode_map(Map value) {
   uint32_t size = value.size();
-  assm()->begin_map(size);
+  if (use_index(size)) {
+    assm()->begin_indexed_map(size);
+  } else {
+    assm()->begin_map(size);
+  }
   for (Map::Iterator i = value.begin(); i != value.end(); i++) {
     encode(i->key());
     encode(i->value());
@@ -359,88 +925,242 @@ void VariantWriter::encode_map(Map value) {
 }
 
 void VariantWriter::encode_seed(Seed value) {
+  const void *identity = value.to_c().payload_.as_arena_seed_;
+  if (try_emit_reference(identity))
+    return;
+  bool is_open = begin_seed(identity, seed_count_++);
   assm()->begin_seed(1, value.field_count());
   encode(value.header());
   for (Seed::Iterator i = value.fields_begin(); i != value.fields_end(); i++) {
     encode(i->key());
     encode(i->value());
   }
+  if (is_open)
+    end_seed(identity);
 }
 
 void VariantWriter::encode_native(Native value) {
-  AbstractSeedType *type = value.type();
-  Variant replacement = type->encode_instance(value, &scratch_);
+  const void *identity = value.native_object();
+  if (try_emit_reference(identity))
+    return;
+  Variant replacement;
+  if (replacements_ != NULL && !record_replacements_
+      && next_replacement_ < replacements_->size()) {
+    replacement = (*replacements_)[next_replacement_++];
+  } else {
+    replacement = value.type()->encode_instance(value, scratch_);
+    if (replacements_ != NULL && record_replacements_)
+      replacements_->push_back(replacement);
+  }
+  bool is_open = false;
+  if (replacement.is_seed()) {
+    // Unless the replacement seed has been written before it is written next
+    // so it'll get the next index. We register the native up front so
+    // references to it from within the replacement work.
+    IndexMap *indices = emit_references_ ? &seed_indices_ : &open_seeds_;
+    IndexMap::iterator i = indices->find(
+        replacement.to_c().payload_.as_arena_seed_);
+    is_open = begin_seed(identity, (i == indices->end())
+        ? seed_count_
+        : i->second);
+  }
+  if (gap_assm_ != NULL)
+    gap_assm_->suspend_blob_gaps();
   encode(replacement);
+  if (gap_assm_ != NULL)
+    gap_assm_->resume_blob_gaps();
+  if (is_open)
+    end_seed(identity);
 }
 
-void BinaryWriter::write(Variant value) {
-  Assembler assm;
-  VariantWriter writer(&assm);
+void BinaryWriter::encode(Variant value, pton_assembler_t *assm,
+    bool is_measuring) {
+  Assembler wrapper(assm);
+  VariantWriter writer(&wrapper, scratch_);
+  writer.set_emit_references(emit_references_);
+  writer.set_index_threshold(index_threshold_);
+  writer.set_columns_threshold(columns_threshold_);
+  writer.set_string_table(string_table_, !is_measuring);
+  writer.set_gap_assembler(assm);
+  if (is_measuring) {
+    writer.set_native_replacements(&replacements_, true);
+  } else if (measured_ == value) {
+    writer.set_native_replacements(&replacements_, false);
+  }
   writer.encode(value);
-  writer.flush(this);
+  if (!is_measuring) {
+    // The replacements are only good for one write.
+    measured_ = Variant::null();
+    replacements_.clear();
+  }
 }
 
-class BinaryReaderImpl : public BinaryImplUtils {
-public:
-  BinaryReaderImpl(const void *data, size_t size, BinaryReader *reader);
+size_t BinaryWriter::measure(Variant value) {
+  replacements_.clear();
+  if (scratch_ == &own_scratch_)
+    // Nothing encoded into our own scratch arena is used after the value it
+    // belongs to has been written so there's no reason to keep it.
+    own_scratch_.reset();
+  measured_ = value;
+  pton_assembler_t assm;
+  assm.set_measure_only();
+  encode(value, &assm, true);
+  return assm.size();
+}
 
-  bool decode(Variant *result_out);
+void BinaryWriter::write(Variant value) {
+  // Measuring first means the data is written exactly once, straight into a
+  // block of the right size, rather than into a buffer that grows and then
+  // gets copied.
+  size_t size = measure(value);
+  uint8_t *bytes = new uint8_t[size];
+  pton_assembler_t assm(bytes, size);
+  encode(value, &assm, false);
+  CHECK_EQ("value changed while writing", size, assm.size());
+  delete[] bytes_;
+  bytes_ = bytes;
+  size_ = size;
+}
 
-private:
-  // Returns true iff there are more bytes to return.
-  bool has_more() { return cursor_ < size_; }
+size_t BinaryWriter::write(Variant value, void *dest, size_t capacity) {
+  size_t size = measure(value);
+  if (size > capacity)
+    return size;
+  write_measured(value, dest, size);
+  return size;
+}
 
-  // Read an array's payload.
-  bool decode_array(uint32_t length, Variant *result_out);
+size_t BinaryWriter::write_measured(Variant value, void *dest, size_t size) {
+  pton_assembler_t assm(static_cast<uint8_t*>(dest), size);
+  size_t first_gap = 0;
+  if (blob_gaps_ != NULL) {
+    assm.set_blob_gaps(min_blob_gap_size_, blob_gaps_);
+    first_gap = blob_gaps_->size();
+  }
+  encode(value, &assm, false);
+  // If the value turned out larger than measured the assembler will have
+  // moved what it wrote out of the block so we can't just carry on.
+  size_t gap_size = 0;
+  for (size_t i = first_gap; blob_gaps_ != NULL && i < blob_gaps_->size(); i++)
+    gap_size += (*blob_gaps_)[i].size;
+  CHECK_EQ("value changed since it was measured", size, assm.size() + gap_size);
+  return assm.size();
+}
 
-  // Read a map's payload.
-  bool decode_map(uint32_t size, Variant *result_out);
+uint8_t *BinaryWriter::release() {
+  uint8_t *result = bytes_;
+  bytes_ = NULL;
+  size_ = 0;
+  return result;
+}
 
-  // Read an seed's payload.
-  bool decode_seed(uint32_t headerc, uint32_t fieldc, Variant *result_out);
+String StringTable::copy_string(String value) {
+  String result = arena_.new_string(value.chars(), value.length(),
+      value.encoding());
+  result.ensure_frozen();
+  return result;
+}
 
-  // Convert default-encoding string data into a string variant.
-  bool decode_default_string(pton_instr_t *instr, Variant *result_out);
+uint32_t StringTable::add(String value) {
+  uint32_t index = 0;
+  if (find(value, &index))
+    return index;
+  index = size();
+  String copy = copy_string(value);
+  strings_.push_back(copy);
+  indices_.set(copy, index);
+  return index;
+}
 
-  // Convert a binary blob into a blob variant.
-  bool decode_blob(pton_instr_t *instr, Variant *result_out);
+bool StringTable::find(String value, uint32_t *index_out) {
+  uint32_t *index = indices_[value];
+  if (index == NULL)
+    return false;
+  *index_out = *index;
+  return true;
+}
 
-  // Convert a custom-encoding string data into a string variant.
-  bool decode_string_with_encoding(pton_instr_t *instr, Variant *result_out);
+String StringTable::get_copy(uint32_t index, Factory *factory) {
+  String value = strings_[index];
+  if (value.encoding() == Variant::default_string_encoding())
+    return factory->new_interned_string(value.chars(), value.length());
+  String result = factory->new_string(value.length(), value.encoding());
+  memcpy(result.mutable_chars(), value.chars(), value.length());
+  result.ensure_frozen();
+  return result;
+}
 
-  // Succeeds parsing of some expression, returning true.
-  bool succeed(Variant value, Variant *out);
+bool StringTable::can_add(String value) {
+  return value.length() <= kMaxLength && size() < kMaxSize;
+}
 
-  size_t size_;
-  size_t cursor_;
-  const uint8_t *data_;
-  BinaryReader *reader_;
-};
+void StringTable::note_written(String value) {
+  if (value.length() > kMaxLength || size() + candidates_.size() >= kMaxSize)
+    return;
+  uint32_t *count = write_counts_[value];
+  if (count == NULL) {
+    // Strings are only tracked while there's room, otherwise a stream of
+    // strings that are each written once would use unbounded memory.
+    if (write_counts_.size() >= 4 * kMaxSize)
+      return;
+    write_counts_.set(copy_string(value), 1);
+  } else if (++(*count) == 2) {
+    candidates_.push_back(copy_string(value));
+  }
+}
 
-BinaryReaderImpl::BinaryReaderImpl(const void *data, size_t size, BinaryReader *reader)
-  : size_(size)
-  , cursor_(0)
-  , data_(static_cast<const uint8_t*>(data))
-  , reader_(reader) { }
+void StringTable::take_candidates(std::vector<String> *out) {
+  out->insert(out->end(), candidates_.begin(), candidates_.end());
+  candidates_.clear();
+}
 
 // Utility for decoding an individual instruction.
 class InstrDecoder {
 public:
-  InstrDecoder(const uint8_t *data, size_t size)
+  // If headers_only is true the contents of strings and blobs are not required
+  // to be present, only the instruction header, and the resulting size will
+  // not include them.
+  InstrDecoder(const uint8_t *data, size_t size, bool headers_only = false)
     : data_(data)
     , size_(size)
-    , cursor_(0) { }
+    , cursor_(0)
+    , headers_only_(headers_only)
+    , is_truncated_(false) { }
 
-  // Returns true iff there are more bytes to return.
-  bool has_more() { return cursor_ < size_; }
+  // Returns true iff there are more bytes to return. If there aren't the input
+  // is considered truncated.
+  bool has_more() { return has_data(1); }
 
   // Returns true iff this decode has data enough that a block of the given size
-  // can be read.
-  bool has_data(size_t required) { return (cursor_ + required) <= size_; }
+  // can be read. If it doesn't the input is considered truncated.
+  bool has_data(size_t required) {
+    if ((cursor_ + required) <= size_)
+      return true;
+    is_truncated_ = true;
+    return false;
+  }
+
+  // Returns true if the last decode failed because the input ended before the
+  // instruction did, not because it was invalid. Had there been more input it
+  // might have succeeded.
+  bool is_truncated() { return is_truncated_; }
 
   // Advances past and returns the current byte.
   uint8_t read_byte() { return data_[cursor_++]; }
 
+  // Skips over the contents of a string or blob. Returns false if they're not
+  // all there.
+  bool skip_contents(uint64_t length) {
+    if (headers_only_)
+      return true;
+    if (length > size_ - cursor_) {
+      is_truncated_ = true;
+      return false;
+    }
+    cursor_ += length;
+    return true;
+  }
+
   bool read_bytes(uint8_t *dest, size_t size) {
     if (!has_data(size))
       return false;
@@ -457,13 +1177,25 @@ public:
 
   bool decode_uint32(uint32_t *result_out);
 
+  // Decodes a varint that takes up at most the given number of bytes.
+  bool decode_varint(uint64_t *result_out, size_t max_size);
+
+  // Decodes the part of an indexed array or map after the opcode.
+  bool decode_indexed_header(pton_instr_t *instr_out);
+
+  // Decodes the part of a packed int64 array after the opcode.
+  bool decode_int64_array_header(pton_instr_t *instr_out);
+
 private:
   const uint8_t *data_;
   size_t size_;
   size_t cursor_;
+  bool headers_only_;
+  bool is_truncated_;
 };
 
 bool InstrDecoder::decode(pton_instr_t *instr_out) {
+  is_truncated_ = false;
   if (!has_more())
     return false;
   uint8_t opcode = read_byte();
@@ -477,12 +1209,11 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
       uint32_t length = 0;
       if (!decode_uint32(&length))
         return false;
-      if (!has_data(length))
-        return false;
       instr_out->opcode = PTON_OPCODE_DEFAULT_STRING;
       instr_out->payload.default_string_data.length = length;
       instr_out->payload.default_string_data.contents = data_ + cursor_;
-      cursor_ += length;
+      if (!skip_contents(length))
+        return false;
       break;
     }
     case BinaryImplUtils::boStringWithEncoding: {
@@ -493,25 +1224,23 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
       uint32_t length = 0;
       if (!decode_uint32(&length))
         return false;
-      if (!has_data(length))
-        return false;
       instr_out->opcode = PTON_OPCODE_STRING_WITH_ENCODING;
       instr_out->payload.string_with_encoding_data.encoding = encoding;
       instr_out->payload.string_with_encoding_data.length = length;
       instr_out->payload.string_with_encoding_data.contents = data_ + cursor_;
-      cursor_ += length;
+      if (!skip_contents(length))
+        return false;
       break;
     }
     case BinaryImplUtils::boBlob: {
       uint32_t length = 0;
       if (!decode_uint32(&length))
         return false;
-      if (!has_data(length))
-        return false;
       instr_out->opcode = PTON_OPCODE_BLOB;
       instr_out->payload.blob_data.length = length;
       instr_out->payload.blob_data.contents = data_ + cursor_;
-      cursor_ += length;
+      if (!skip_contents(length))
+        return false;
       break;
     }
     case BinaryImplUtils::boArray:
@@ -524,6 +1253,43 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
         return false;
       instr_out->opcode = PTON_OPCODE_BEGIN_MAP;
       break;
+    case BinaryImplUtils::boIndexedArray:
+    case BinaryImplUtils::boIndexedMap:
+      if (!decode_indexed_header(instr_out))
+        return false;
+      instr_out->opcode = (opcode == BinaryImplUtils::boIndexedArray)
+          ? PTON_OPCODE_BEGIN_INDEXED_ARRAY
+          : PTON_OPCODE_BEGIN_INDEXED_MAP;
+      break;
+    case BinaryImplUtils::boInt64Array:
+      if (!decode_int64_array_header(instr_out))
+        return false;
+      instr_out->opcode = PTON_OPCODE_INT64_ARRAY;
+      break;
+    case BinaryImplUtils::boFloat64: {
+      uint8_t encoded[BinaryImplUtils::kFloat64Size];
+      if (!read_bytes(encoded, BinaryImplUtils::kFloat64Size))
+        return false;
+      instr_out->payload.float64_value = BinaryImplUtils::decode_float64(encoded);
+      instr_out->opcode = PTON_OPCODE_FLOAT64;
+      break;
+    }
+    case BinaryImplUtils::boFloat64Array: {
+      uint32_t count = 0;
+      if (!decode_uint32(&count))
+        return false;
+      instr_out->opcode = PTON_OPCODE_FLOAT64_ARRAY;
+      instr_out->payload.float64_array_data.count = count;
+      instr_out->payload.float64_array_data.contents = data_ + cursor_;
+      if (!skip_contents(static_cast<uint64_t>(count) * BinaryImplUtils::kFloat64Size))
+        return false;
+      break;
+    }
+    case BinaryImplUtils::boTableString:
+      if (!decode_uint32(&instr_out->payload.table_string_index))
+        return false;
+      instr_out->opcode = PTON_OPCODE_TABLE_STRING;
+      break;
     case BinaryImplUtils::boNull:
       instr_out->opcode = PTON_OPCODE_NULL;
       instr_out->size = 1;
@@ -533,6 +1299,21 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
       instr_out->opcode = PTON_OPCODE_BOOL;
       instr_out->payload.bool_value = (opcode == BinaryImplUtils::boTrue);
       break;
+    case BinaryImplUtils::boColumns:
+      if (!decode_uint32(&instr_out->payload.columns_data.rows))
+        return false;
+      if (!decode_uint32(&instr_out->payload.columns_data.headerc))
+        return false;
+      if (!decode_uint32(&instr_out->payload.columns_data.keyc))
+        return false;
+      // Rows without keys could be written much more cheaply as plain maps or
+      // seeds, and allowing them would let a short input claim any number of
+      // rows.
+      if (instr_out->payload.columns_data.keyc == 0
+          && instr_out->payload.columns_data.rows > 0)
+        return false;
+      instr_out->opcode = PTON_OPCODE_BEGIN_COLUMNS;
+      break;
     case BinaryImplUtils::boSeed:
       if (!decode_uint32(&instr_out->payload.seed_data.headerc))
         return false;
@@ -571,7 +1352,10 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
           break;
         }
         case 8: {
-          value = read_byte();
+          uint8_t smaller_value = 0;
+          if (!read_bytes(&smaller_value, 1))
+            return false;
+          value = smaller_value;
           break;
         }
         default:
@@ -590,6 +1374,64 @@ bool InstrDecoder::decode(pton_instr_t *instr_out) {
   return true;
 }
 
+bool InstrDecoder::decode_indexed_header(pton_instr_t *instr_out) {
+  uint32_t count = 0;
+  if (!decode_uint32(&count) || !has_more())
+    return false;
+  uint8_t layout = read_byte();
+  if ((layout >> 4) != BinaryImplUtils::kIndexLayoutVersion) {
+    WARN("Unknown index layout %i", layout >> 4);
+    return false;
+  }
+  uint32_t log_entry_size = layout & 0xF;
+  if (log_entry_size > 3)
+    return false;
+  instr_out->payload.indexed_data.count = count;
+  instr_out->payload.indexed_data.entry_size = 1 << log_entry_size;
+  instr_out->payload.indexed_data.table = data_ + cursor_;
+  instr_out->payload.indexed_data.data_size = 0;
+  uint64_t table_size = (static_cast<uint64_t>(count) + 1) << log_entry_size;
+  if (headers_only_)
+    // The table is treated like string contents, it doesn't have to be there.
+    return true;
+  if (!has_data(table_size))
+    return false;
+  cursor_ += table_size;
+  instr_out->payload.indexed_data.data_size =
+      pton_instr_index_entry(instr_out, count);
+  return true;
+}
+
+bool InstrDecoder::decode_int64_array_header(pton_instr_t *instr_out) {
+  uint32_t count = 0;
+  if (!decode_uint32(&count) || !has_more())
+    return false;
+  uint8_t layout = read_byte();
+  uint32_t size = 0;
+  if (!decode_uint32(&size))
+    return false;
+  switch (layout >> 4) {
+    case BinaryImplUtils::iaFixed:
+      if ((layout & 0xF) > 3
+          || (static_cast<uint64_t>(count) << (layout & 0xF)) != size)
+        return false;
+      break;
+    case BinaryImplUtils::iaDeltas:
+      // Each value takes up at least one byte.
+      if ((layout & 0xF) != 0 || size < count)
+        return false;
+      break;
+    default:
+      WARN("Unknown int64 array layout %i", layout >> 4);
+      return false;
+  }
+  instr_out->payload.int64_array_data.count = count;
+  instr_out->payload.int64_array_data.layout = layout;
+  instr_out->payload.int64_array_data.size = size;
+  instr_out->payload.int64_array_data.contents = data_ + cursor_;
+  return skip_contents(size);
+}
+
 bool InstrDecoder::decode_int64(int64_t *result_out) {
   uint64_t zigzag = 0;
   if (!decode_uint64(&zigzag))
@@ -598,57 +1440,26 @@ bool InstrDecoder::decode_int64(int64_t *result_out) {
   return true;
 }
 
-// The wire encoding of unsigned integers is similar to protobuf varints with
-// a slight twist. You might call them biased varints. Basically it's a sequence
-// of bytes where the bottom 7 bits give 7 bits of the value and the top bit
-// indicates whether there are more bytes coming. The order is backwards: the
-// first byte holds the least significant 7 bits, etc.
-//
-// The problem with using this format directly is that it allows leading zeros,
-// so these:
-//
-//   0x00
-//   0x80 0x00
-//   0x80 0x80 0x80 0x00
-//
-// are all valid representations of the same value, 0. This means that you
-// either have to declare some encodings invalid or live with having multiple
-// valid representations of the same number. It also means that you can make
-// fewer assumptions about the value represented based on the length of the
-// encoding. It would be really nice if each number had a unique representation
-// and to accomplish this, instead of concatenating the payloads directly we add
-// an implicit 1 to the payload of each byte, except the first one. This means
-// that the examples from before now correspond to different values,
-//
-//   0x00 -> 0
-//   0x80 0x00 -> 128 (= 2^7)
-//   0x80 0x80 0x00 -> 16512 (= 2^7 + 2^14)
-//   0x80 0x80 0x80 0x00 -> 2113664 (= 2^7 + 2^14 + 2^21)
-//
-// This is also slightly more space efficient -- without the bias two bytes will
-// hold up to 16383, with the bias it's 16511, but that's in the order of less
-// than 1% so it hardly matters.
-bool InstrDecoder::decode_uint64(uint64_t *result_out) {
-  if (!has_more())
+bool InstrDecoder::decode_varint(uint64_t *result_out, size_t max_size) {
+  size_t available = size_ - cursor_;
+  size_t count = BinaryImplUtils::decode_varint(data_ + cursor_,
+      (available < max_size) ? available : max_size, result_out);
+  if (count == 0) {
+    // If we saw max_size bytes the varint is too long whatever comes next.
+    is_truncated_ = (available < max_size);
     return false;
-  uint8_t next = read_byte();
-  uint64_t result = (next & 0x7F);
-  uint64_t offset = 7;
-  while (next >= 0x80) {
-    if (!has_more())
-      return false;
-    next = read_byte();
-    uint64_t payload = ((next & 0x7F) + 1);
-    result = result + (payload << offset);
-    offset += 7;
   }
-  *result_out = result;
+  cursor_ += count;
   return true;
 }
 
+bool InstrDecoder::decode_uint64(uint64_t *result_out) {
+  return decode_varint(result_out, BinaryImplUtils::kMaxVarintSize);
+}
+
 bool InstrDecoder::decode_uint32(uint32_t *result_out) {
   uint64_t next = 0;
-  if (!decode_uint64(&next))
+  if (!decode_varint(&next, BinaryImplUtils::kMaxUint32VarintSize))
     return false;
   if (next > 0xFFFFFFFF)
     return false;
@@ -656,184 +1467,934 @@ bool InstrDecoder::decode_uint32(uint32_t *result_out) {
   return true;
 }
 
+// The state of reading a binary value. Rather than recursing the reader keeps
+// an explicit stack of the arrays, maps, and seeds being read such that it can
+// stop at any point when it runs out of input and resume when given more.
+class BinaryReaderImpl : public BinaryImplUtils {
+public:
+  typedef IncrementalBinaryReader::Status Status;
 
-bool BinaryReaderImpl::decode(Variant *result_out) {
-  if (!has_more())
-    return false;
-  pton_instr_t instr;
-  if (!pton_decode_next_instruction(data_ + cursor_, size_ - cursor_, &instr))
-    return false;
-  cursor_ += instr.size;
-  switch (instr.opcode) {
+  explicit BinaryReaderImpl(BinaryReader *reader);
+
+  // Decodes as much of the given input as possible.
+  Status feed(const uint8_t *data, size_t size, size_t *consumed_out);
+
+  // Returns the value read, or null if reading isn't done.
+  Variant result() { return result_; }
+
+  // Clears all state such that another value can be read.
+  void reset();
+
+private:
+  // An array, map, seed, or columns whose contents are being read.
+  struct Frame {
+    pton_instr_opcode_t opcode;
+    // The array, map, or seed being populated. For columns, the array of
+    // rows.
+    Variant value;
+    // For seeds, the type that was resolved from the headers, the instance
+    // being built, and the position in seeds_ of its run. For columns of
+    // seeds the instance is an array of the instances of the rows created so
+    // far.
+    AbstractSeedType *type;
+    Variant instance;
+    size_t seed_run;
+    // The number of seed headers read and remaining.
+    uint32_t headers_read;
+    uint32_t headers_remaining;
+    // The number of elements, mappings, or fields remaining.
+    uint32_t remaining;
+    // For maps and seeds, the key of the current entry if it has been read.
+    // For columns, the header.
+    Variant key;
+    bool has_key;
+    // For columns, the keys read so far, how many there are in total, the
+    // number of rows, and the row and column of the next value. Rows are
+    // created as the first column is read, except that rows referenced before
+    // then are created early and kept in a map from their index to an array
+    // of the row and its instance.
+    Variant keys;
+    uint32_t keyc;
+    uint32_t rows;
+    uint32_t row;
+    uint32_t column;
+    Variant early_rows;
+  };
+
+  // A run of consecutive seed indices: either a single seed or the rows of
+  // columns of seeds. Columns claim all their indices up front but their rows
+  // are only created as they're read, so the input can't make us allocate
+  // more than it pays for.
+  struct SeedRun {
+    // The index of the first seed.
+    uint64_t first;
+    // For a single seed, what it became or null if that isn't known yet. For
+    // columns, the array of the instances of the rows created so far.
+    Variant value;
+    bool is_columns;
+    // For columns that are still being read, where their frame is on the
+    // stack.
+    bool is_open;
+    size_t depth;
+  };
+
+  // The most bytes an instruction header can take up, not counting the
+  // contents of strings and blobs. This is how many bytes of a header that is
+  // split between chunks we may have to hold back.
+  static const size_t kMaxHeaderSize = 32;
+
+  // The outcome of trying to decode an instruction header.
+  enum HeaderStatus {
+    hsDecoded,
+    hsIncomplete,
+    hsInvalid
+  };
+
+  // Decodes the header of the instruction at the start of the given data.
+  HeaderStatus decode_header(const uint8_t *data, size_t size,
+      pton_instr_t *instr_out);
+
+  // Processes an instruction whose header has been decoded, given the part of
+  // the contents, if any, that is available. Returns the number of bytes of
+  // contents consumed.
+  size_t process(pton_instr_t *instr, const uint8_t *contents,
+      size_t available);
+
+  // Processes a string, blob, or packed array instruction.
+  size_t process_contents(pton_instr_t *instr, const uint8_t *contents,
+      size_t available);
+
+  // Delivers the value of the given string, blob, or packed array instruction
+  // whose contents are all available. Strings and blobs may only borrow the
+  // contents if they come straight from the input.
+  void deliver_contents(pton_instr_t *instr, const uint8_t *contents,
+      bool may_borrow);
+
+  // Delivers the array of the given packed array instruction whose contents
+  // are all available.
+  void deliver_packed_array(pton_instr_t *instr);
+
+  // Collects as much of the contents of the current partial instruction as
+  // available, returning the number of bytes consumed.
+  size_t continue_contents(const uint8_t *data, size_t available);
+
+  // Skips as much of the current index table as available, returning the
+  // number of bytes consumed. When the whole table has been skipped the
+  // indexed array or map begins.
+  size_t continue_index(size_t available);
+
+  // Pushes a new frame for the given container.
+  void begin_array(uint32_t length);
+  void begin_map(uint32_t size);
+  void begin_seed(uint32_t headerc, uint32_t fieldc);
+  void begin_columns(uint32_t rows, uint32_t headerc, uint32_t keyc);
+
+  // Called when the seed on top of the stack has had all its headers read.
+  void end_seed_headers(Frame *frame);
+
+  // Pops the seed on top of the stack and returns the value it became.
+  Variant end_seed();
+
+  // Called when the columns on top of the stack have had all their headers
+  // read.
+  void end_columns_headers(Frame *frame);
+
+  // Creates the row with the given index of the given columns, storing the
+  // row and its instance.
+  void create_row(Frame *frame, Variant *row_out, Variant *instance_out);
+
+  // Returns the next row of the given columns, creating it unless it was
+  // created early.
+  Variant next_row(Frame *frame);
+
+  // Returns the seed with the given index or null if it isn't known yet.
+  Variant get_seed(uint64_t index);
+
+  // Pops the columns on top of the stack and returns the array of rows they
+  // became.
+  Variant end_columns();
+
+  // Stores a value that has been read either as the element of the innermost
+  // container or, if there is none, as the result. Completing a container may
+  // complete its parent and so on.
+  void deliver(Variant value);
+
+  // Marks reading as failed.
+  void fail() { status_ = IncrementalBinaryReader::FAILED; }
+
+  BinaryReader *reader_;
+  Status status_;
+  Variant result_;
+  std::vector<Frame> stack_;
+
+  // The seeds read so far, in the order they were encountered, such that
+  // references can be resolved, and how many indices they've been given.
+  std::vector<SeedRun> seeds_;
+  uint64_t seed_count_;
+
+  // The start of an instruction that was split between chunks.
+  std::vector<uint8_t> pending_;
+
+  // When the contents of a string, blob, or packed array are split between
+  // chunks, the instruction, the contents seen so far, and how many bytes are
+  // left. The contents are collected as they arrive rather than allocated up
+  // front since the length comes from the input and may be anything.
+  pton_instr_t partial_;
+  std::vector<uint8_t> partial_contents_;
+  uint32_t partial_remaining_;
+
+  // The table of an indexed array or map is only useful for random access so
+  // it is skipped. This is the instruction whose table is being skipped and
+  // how many bytes of it are left.
+  pton_instr_t indexed_;
+  uint64_t index_remaining_;
+};
+
+BinaryReaderImpl::BinaryReaderImpl(BinaryReader *reader)
+  : reader_(reader)
+  , status_(IncrementalBinaryReader::NEED_MORE)
+  , seed_count_(0)
+  , partial_remaining_(0)
+  , index_remaining_(0) { }
+
+void BinaryReaderImpl::reset() {
+  status_ = IncrementalBinaryReader::NEED_MORE;
+  result_ = Variant::null();
+  stack_.clear();
+  seeds_.clear();
+  seed_count_ = 0;
+  pending_.clear();
+  std::vector<uint8_t>().swap(partial_contents_);
+  partial_remaining_ = 0;
+  index_remaining_ = 0;
+}
+
+BinaryReaderImpl::Status BinaryReaderImpl::feed(const uint8_t *data,
+    size_t size, size_t *consumed_out) {
+  size_t cursor = 0;
+  while (status_ == IncrementalBinaryReader::NEED_MORE) {
+    if (partial_remaining_ > 0) {
+      cursor += continue_contents(data + cursor, size - cursor);
+      if (partial_remaining_ > 0)
+        break;
+      continue;
+    }
+    if (index_remaining_ > 0) {
+      cursor += continue_index(size - cursor);
+      if (index_remaining_ > 0)
+        break;
+      continue;
+    }
+    if (cursor == size)
+      break;
+    pton_instr_t instr;
+    if (pending_.empty()) {
+      HeaderStatus header = decode_header(data + cursor, size - cursor, &instr);
+      if (header == hsInvalid) {
+        fail();
+      } else if (header == hsIncomplete) {
+        pending_.insert(pending_.end(), data + cursor, data + size);
+        cursor = size;
+      } else {
+        cursor += instr.size;
+        cursor += process(&instr, data + cursor, size - cursor);
+      }
+    } else {
+      // Top up the pending bytes with just enough that any header will fit,
+      // then figure out how many of them the header actually used.
+      size_t old_size = pending_.size();
+      size_t added = kMaxHeaderSize - old_size;
+      if (added > size - cursor)
+        added = size - cursor;
+      pending_.insert(pending_.end(), data + cursor, data + cursor + added);
+      HeaderStatus header = decode_header(&pending_[0], pending_.size(), &instr);
+      if (header == hsInvalid) {
+        fail();
+      } else if (header == hsIncomplete) {
+        cursor += added;
+      } else {
+        pending_.clear();
+        cursor += instr.size - old_size;
+        cursor += process(&instr, data + cursor, size - cursor);
+      }
+    }
+  }
+  if (consumed_out != NULL)
+    *consumed_out = cursor;
+  return status_;
+}
+
+BinaryReaderImpl::HeaderStatus BinaryReaderImpl::decode_header(
+    const uint8_t *data, size_t size, pton_instr_t *instr_out) {
+  InstrDecoder decoder(data, size, true);
+  if (decoder.decode(instr_out))
+    return hsDecoded;
+  // Only wait for more input if the header is valid as far as it goes.
+  return decoder.is_truncated() ? hsIncomplete : hsInvalid;
+}
+
+size_t BinaryReaderImpl::process(pton_instr_t *instr, const uint8_t *contents,
+    size_t available) {
+  switch (instr->opcode) {
     case PTON_OPCODE_INT64:
-      return succeed(Variant::integer(instr.payload.int64_value), result_out);
+      deliver(Variant::integer(instr->payload.int64_value));
+      return 0;
+    case PTON_OPCODE_FLOAT64:
+      deliver(Variant::float64(instr->payload.float64_value));
+      return 0;
     case PTON_OPCODE_DEFAULT_STRING:
-      return decode_default_string(&instr, result_out);
     case PTON_OPCODE_STRING_WITH_ENCODING:
-      return decode_string_with_encoding(&instr, result_out);
     case PTON_OPCODE_BLOB:
-      return decode_blob(&instr, result_out);
+    case PTON_OPCODE_INT64_ARRAY:
+    case PTON_OPCODE_FLOAT64_ARRAY:
+      return process_contents(instr, contents, available);
     case PTON_OPCODE_BEGIN_ARRAY:
-      return decode_array(instr.payload.array_length, result_out);
+      begin_array(instr->payload.array_length);
+      return 0;
     case PTON_OPCODE_BEGIN_MAP:
-      return decode_map(instr.payload.map_size, result_out);
+      begin_map(instr->payload.map_size);
+      return 0;
     case PTON_OPCODE_BEGIN_SEED:
-      return decode_seed(instr.payload.seed_data.headerc,
-          instr.payload.seed_data.fieldc, result_out);
+      begin_seed(instr->payload.seed_data.headerc,
+          instr->payload.seed_data.fieldc);
+      return 0;
+    case PTON_OPCODE_BEGIN_COLUMNS:
+      begin_columns(instr->payload.columns_data.rows,
+          instr->payload.columns_data.headerc,
+          instr->payload.columns_data.keyc);
+      return 0;
+    case PTON_OPCODE_BEGIN_INDEXED_ARRAY:
+    case PTON_OPCODE_BEGIN_INDEXED_MAP:
+      indexed_ = *instr;
+      index_remaining_ = (static_cast<uint64_t>(instr->payload.indexed_data.count) + 1)
+          * instr->payload.indexed_data.entry_size;
+      return continue_index(available);
     case PTON_OPCODE_NULL:
-      return succeed(Variant::null(), result_out);
+      deliver(Variant::null());
+      return 0;
     case PTON_OPCODE_BOOL:
-      return succeed(Variant::boolean(instr.payload.bool_value), result_out);
+      deliver(Variant::boolean(instr->payload.bool_value));
+      return 0;
     case PTON_OPCODE_ID64:
-      return succeed(Variant::id(instr.payload.id64.size, instr.payload.id64.value),
-          result_out);
-    case PTON_OPCODE_REFERENCE:
-      return succeed(Variant::integer(instr.payload.reference_offset), result_out);
+      deliver(Variant::id(instr->payload.id64.size, instr->payload.id64.value));
+      return 0;
+    case PTON_OPCODE_REFERENCE: {
+      uint64_t offset = instr->payload.reference_offset;
+      if (offset >= seed_count_) {
+        fail();
+      } else {
+        deliver(get_seed(seed_count_ - offset - 1));
+      }
+      return 0;
+    }
+    case PTON_OPCODE_TABLE_STRING: {
+      StringTable *table = reader_->string_table_;
+      uint32_t index = instr->payload.table_string_index;
+      if (table == NULL || index >= table->size()) {
+        fail();
+      } else {
+        deliver(table->get_copy(index, reader_->factory_));
+      }
+      return 0;
+    }
     default:
-      return false;
+      fail();
+      return 0;
   }
 }
 
-bool BinaryReaderImpl::decode_default_string(pton_instr_t *instr, Variant *result_out) {
-  const uint8_t *chars = instr->payload.default_string_data.contents;
-  uint32_t size = instr->payload.default_string_data.length;
-  String result = reader_->factory_->new_string(size);
-  memcpy(result.mutable_chars(), chars, size);
-  result.ensure_frozen();
-  return succeed(result, result_out);
+size_t BinaryReaderImpl::process_contents(pton_instr_t *instr,
+    const uint8_t *contents, size_t available) {
+  uint64_t size = 0;
+  switch (instr->opcode) {
+    case PTON_OPCODE_DEFAULT_STRING:
+      size = instr->payload.default_string_data.length;
+      break;
+    case PTON_OPCODE_STRING_WITH_ENCODING:
+      size = instr->payload.string_with_encoding_data.length;
+      break;
+    case PTON_OPCODE_BLOB:
+      size = instr->payload.blob_data.length;
+      break;
+    case PTON_OPCODE_INT64_ARRAY:
+      size = instr->payload.int64_array_data.size;
+      break;
+    default:
+      size = static_cast<uint64_t>(instr->payload.float64_array_data.count)
+          * kFloat64Size;
+      break;
+  }
+  if (available >= size) {
+    // The common case: the contents are all there so we can create the value
+    // directly, or not copy at all if we're allowed to borrow.
+    deliver_contents(instr, contents, true);
+    return static_cast<size_t>(size);
+  }
+  if (size > 0xFFFFFFFF) {
+    // Too big to collect.
+    fail();
+    return 0;
+  }
+  // The contents are split between chunks so we collect them as they arrive
+  // and create the value once they're all there.
+  partial_ = *instr;
+  partial_contents_.clear();
+  partial_remaining_ = static_cast<uint32_t>(size);
+  return continue_contents(contents, available);
 }
 
-bool BinaryReaderImpl::decode_blob(pton_instr_t *instr, Variant *result_out) {
-  const uint8_t *data = instr->payload.blob_data.contents;
-  uint32_t size = instr->payload.blob_data.length;
-  Blob result = reader_->factory_->new_blob(data, size);
-  return succeed(result, result_out);
+void BinaryReaderImpl::deliver_contents(pton_instr_t *instr,
+    const uint8_t *contents, bool may_borrow) {
+  Factory *factory = reader_->factory_;
+  const char *chars = reinterpret_cast<const char*>(contents);
+  switch (instr->opcode) {
+    case PTON_OPCODE_DEFAULT_STRING: {
+      uint32_t length = instr->payload.default_string_data.length;
+      deliver((may_borrow && reader_->borrow_strings_)
+          ? Variant::string(chars, length)
+          : factory->new_interned_string(chars, length));
+      break;
+    }
+    case PTON_OPCODE_STRING_WITH_ENCODING: {
+      uint32_t length = instr->payload.string_with_encoding_data.length;
+      String result = factory->new_string(length,
+          instr->payload.string_with_encoding_data.encoding);
+      if (length > 0)
+        memcpy(result.mutable_chars(), chars, length);
+      result.ensure_frozen();
+      deliver(result);
+      break;
+    }
+    case PTON_OPCODE_BLOB: {
+      uint32_t length = instr->payload.blob_data.length;
+      deliver((may_borrow && reader_->borrow_blobs_)
+          ? Variant::blob(contents, length)
+          : factory->new_blob(contents, length));
+      break;
+    }
+    case PTON_OPCODE_INT64_ARRAY:
+      // The header may have been decoded from the pending bytes so the
+      // contents pointer has to be set to where they actually are.
+      instr->payload.int64_array_data.contents = contents;
+      deliver_packed_array(instr);
+      break;
+    default:
+      instr->payload.float64_array_data.contents = contents;
+      deliver_packed_array(instr);
+      break;
+  }
 }
 
-bool BinaryReaderImpl::decode_string_with_encoding(pton_instr_t *instr, Variant *result_out) {
-  pton_charset_t encoding = instr->payload.string_with_encoding_data.encoding;
-  const uint8_t *chars = instr->payload.string_with_encoding_data.contents;
-  uint32_t size = instr->payload.string_with_encoding_data.length;
-  String result = reader_->factory_->new_string(size, encoding);
-  memcpy(result.mutable_chars(), chars, size);
-  result.ensure_frozen();
-  return succeed(result, result_out);
+size_t BinaryReaderImpl::continue_contents(const uint8_t *data,
+    size_t available) {
+  size_t count = partial_remaining_;
+  if (count > available)
+    count = available;
+  partial_contents_.insert(partial_contents_.end(), data, data + count);
+  partial_remaining_ -= static_cast<uint32_t>(count);
+  if (partial_remaining_ == 0) {
+    deliver_contents(&partial_, &partial_contents_[0], false);
+    // Release the memory, the contents may have been big.
+    std::vector<uint8_t>().swap(partial_contents_);
+  }
+  return count;
+}
+
+void BinaryReaderImpl::deliver_packed_array(pton_instr_t *instr) {
+  Variant value = (instr->opcode == PTON_OPCODE_INT64_ARRAY)
+      ? unpack_int64_array(reader_->factory_, instr)
+      : unpack_float64_array(reader_->factory_, instr);
+  if (value.is_null()) {
+    fail();
+  } else {
+    deliver(value);
+  }
+}
+
+size_t BinaryReaderImpl::continue_index(size_t available) {
+  size_t count = (index_remaining_ < available)
+      ? static_cast<size_t>(index_remaining_)
+      : available;
+  index_remaining_ -= count;
+  if (index_remaining_ == 0) {
+    uint32_t size = indexed_.payload.indexed_data.count;
+    if (indexed_.opcode == PTON_OPCODE_BEGIN_INDEXED_ARRAY) {
+      begin_array(size);
+    } else {
+      begin_map(size);
+    }
+  }
+  return count;
 }
 
-bool BinaryReaderImpl::decode_array(uint32_t length, Variant *result_out) {
+void BinaryReaderImpl::begin_array(uint32_t length) {
   Array result = reader_->factory_->new_array(length);
-  for (size_t i = 0; i < length; i++) {
-    Variant elm;
-    if (!decode(&elm))
-      return false;
-    result.add(elm);
+  if (length == 0) {
+    result.ensure_frozen();
+    deliver(result);
+    return;
   }
-  result.ensure_frozen();
-  return succeed(result, result_out);
+  Frame frame;
+  frame.opcode = PTON_OPCODE_BEGIN_ARRAY;
+  frame.value = result;
+  frame.type = NULL;
+  frame.seed_run = 0;
+  frame.headers_read = 0;
+  frame.headers_remaining = 0;
+  frame.remaining = length;
+  frame.has_key = false;
+  stack_.push_back(frame);
 }
 
-bool BinaryReaderImpl::decode_map(uint32_t size, Variant *result_out) {
+void BinaryReaderImpl::begin_map(uint32_t size) {
   Map result = reader_->factory_->new_map();
-  for (size_t i = 0; i < size; i++) {
-    Variant key;
-    if (!decode(&key))
-      return false;
-    Variant value;
-    if (!decode(&value))
-      return false;
-    result.set(key, value);
+  if (size == 0) {
+    result.ensure_frozen();
+    deliver(result);
+    return;
   }
-  result.ensure_frozen();
-  return succeed(result, result_out);
+  Frame frame;
+  frame.opcode = PTON_OPCODE_BEGIN_MAP;
+  frame.value = result;
+  frame.type = NULL;
+  frame.seed_run = 0;
+  frame.headers_read = 0;
+  frame.headers_remaining = 0;
+  frame.remaining = size;
+  frame.has_key = false;
+  stack_.push_back(frame);
 }
 
-bool BinaryReaderImpl::decode_seed(uint32_t headerc, uint32_t size, Variant *result_out) {
-  Seed seed = reader_->factory_->new_seed();
-  AbstractTypeRegistry *registry = reader_->type_registry_;
-  AbstractSeedType *type = NULL;
-  for (size_t i = 0; i < headerc; i++) {
-    // Scan through and read the headers, resolving them to types as we go.
-    Variant header;
-    if (!decode(&header))
-      return false;
-    if (i == 0)
-      // We set the header to the first, most specific, one.
-      seed.set_header(header);
-    if (type == NULL && registry != NULL) {
-      // If there is a registry and we still haven't recognized a type we try to
-      // resolve the current header to a type.
-      type = registry->resolve_type(header);
-    }
-  }
-  // Note that when building the instance we're not giving the type's own header
-  // necessarily, the header we're giving may be more specific.
-  Variant result = (type == NULL)
-    ? seed
-    : type->get_initial_instance(seed.header(), reader_->factory_);
-  for (size_t i = 0; i < size; i++) {
-    Variant key;
-    if (!decode(&key))
-      return false;
-    Variant value;
-    if (!decode(&value))
-      return false;
-    seed.set_field(key, value);
-  }
+void BinaryReaderImpl::begin_seed(uint32_t headerc, uint32_t fieldc) {
+  Frame frame;
+  frame.opcode = PTON_OPCODE_BEGIN_SEED;
+  frame.value = reader_->factory_->new_seed();
+  frame.type = NULL;
+  // The seed gets its index before the headers are read but can only be
+  // referenced once we know what it becomes, until then references resolve to
+  // null.
+  frame.seed_run = seeds_.size();
+  SeedRun run = {seed_count_++, Variant::null(), false, false, 0};
+  seeds_.push_back(run);
+  frame.headers_read = 0;
+  frame.headers_remaining = headerc;
+  frame.remaining = fieldc;
+  frame.has_key = false;
+  stack_.push_back(frame);
+  if (headerc == 0)
+    end_seed_headers(&stack_.back());
+}
+
+void BinaryReaderImpl::end_seed_headers(Frame *frame) {
+  // Note that when building the instance we're not giving the type's own
+  // header necessarily, the header we're giving may be more specific.
+  frame->instance = (frame->type == NULL)
+      ? frame->value
+      : frame->type->get_initial_instance(Seed(frame->value).header(),
+          reader_->factory_);
+  seeds_[frame->seed_run].value = frame->instance;
+  if (frame->remaining == 0)
+    // There are no fields so the seed is already done.
+    deliver(end_seed());
+}
+
+Variant BinaryReaderImpl::end_seed() {
+  Frame frame = stack_.back();
+  stack_.pop_back();
+  Seed seed = frame.value;
   seed.ensure_frozen();
-  if (type != NULL)
-    result = type->get_complete_instance(result, seed, reader_->factory_);
-  return succeed(result, result_out);
+  return (frame.type == NULL)
+      ? frame.instance
+      : frame.type->get_complete_instance(frame.instance, seed,
+          reader_->factory_);
 }
 
-bool BinaryReaderImpl::succeed(Variant value, Variant *out) {
-  *out = value;
-  return true;
+void BinaryReaderImpl::begin_columns(uint32_t rows, uint32_t headerc,
+    uint32_t keyc) {
+  Factory *factory = reader_->factory_;
+  Frame frame;
+  frame.opcode = PTON_OPCODE_BEGIN_COLUMNS;
+  // Nothing is allocated based on the number of rows or keys since they're
+  // just what the input claims, the arrays grow as the rows and keys are read.
+  frame.value = factory->new_array();
+  frame.type = NULL;
+  frame.seed_run = seeds_.size();
+  if (headerc > 0) {
+    // Like a seed each row gets its index before anything within it is read.
+    frame.instance = factory->new_array();
+    SeedRun run = {seed_count_, frame.instance, true, true, stack_.size()};
+    seeds_.push_back(run);
+    seed_count_ += rows;
+  }
+  frame.headers_read = 0;
+  frame.headers_remaining = headerc;
+  frame.remaining = 0;
+  frame.has_key = false;
+  frame.keys = factory->new_array();
+  frame.keyc = keyc;
+  frame.rows = rows;
+  frame.row = 0;
+  frame.column = 0;
+  stack_.push_back(frame);
+  if (headerc == 0)
+    end_columns_headers(&stack_.back());
+}
+
+void BinaryReaderImpl::end_columns_headers(Frame *frame) {
+  if (frame->keyc == 0)
+    // There are no keys so the rows are already done.
+    deliver(end_columns());
+}
+
+void BinaryReaderImpl::create_row(Frame *frame, Variant *row_out,
+    Variant *instance_out) {
+  Factory *factory = reader_->factory_;
+  if (frame->headers_read == 0) {
+    *row_out = factory->new_map();
+    *instance_out = *row_out;
+    return;
+  }
+  Seed seed = factory->new_seed();
+  seed.set_header(frame->key);
+  *row_out = seed;
+  *instance_out = (frame->type == NULL)
+      ? Variant(seed)
+      : frame->type->get_initial_instance(frame->key, factory);
+}
+
+Variant BinaryReaderImpl::next_row(Frame *frame) {
+  Variant row;
+  Variant instance;
+  Variant early = frame->early_rows.is_null()
+      ? Variant::null()
+      : Map(frame->early_rows)[Variant::integer(frame->row)];
+  if (early.is_null()) {
+    create_row(frame, &row, &instance);
+  } else {
+    row = early.array_get(0);
+    instance = early.array_get(1);
+  }
+  Array(frame->value).add(row);
+  if (frame->headers_read > 0)
+    Array(frame->instance).add(instance);
+  return row;
+}
+
+Variant BinaryReaderImpl::get_seed(uint64_t index) {
+  // Find the last run that starts at or before the index.
+  size_t low = 0;
+  size_t high = seeds_.size();
+  while (high - low > 1) {
+    size_t mid = low + (high - low) / 2;
+    if (seeds_[mid].first <= index) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  SeedRun *run = &seeds_[low];
+  if (!run->is_columns)
+    return run->value;
+  Array instances = run->value;
+  uint64_t row = index - run->first;
+  if (row < instances.length())
+    return instances[static_cast<uint32_t>(row)];
+  if (!run->is_open)
+    return Variant::null();
+  Frame *frame = &stack_[run->depth];
+  if (frame->headers_remaining > 0)
+    // Like seeds, rows can't be referenced until we know what they become.
+    return Variant::null();
+  // The row is referenced before it's been reached so we create it now. Each
+  // reference creates at most one row so this is bounded by the input too.
+  Factory *factory = reader_->factory_;
+  if (frame->early_rows.is_null())
+    frame->early_rows = factory->new_map();
+  Map early_rows = frame->early_rows;
+  Variant key = Variant::integer(static_cast<int64_t>(row));
+  Variant early = early_rows[key];
+  if (early.is_null()) {
+    Variant row_value;
+    Variant instance;
+    create_row(frame, &row_value, &instance);
+    Array pair = factory->new_array(2);
+    pair.add(row_value);
+    pair.add(instance);
+    early_rows.set(key, pair);
+    early = pair;
+  }
+  return early.array_get(1);
+}
+
+Variant BinaryReaderImpl::end_columns() {
+  Frame frame = stack_.back();
+  stack_.pop_back();
+  Array rows = frame.value;
+  if (frame.headers_read == 0) {
+    for (uint32_t i = 0; i < frame.rows; i++)
+      rows[i].ensure_frozen();
+    rows.ensure_frozen();
+    return rows;
+  }
+  seeds_[frame.seed_run].is_open = false;
+  Factory *factory = reader_->factory_;
+  Array instances = frame.instance;
+  Array result = factory->new_array(frame.rows);
+  for (uint32_t i = 0; i < frame.rows; i++) {
+    Seed seed = rows[i];
+    seed.ensure_frozen();
+    result.add((frame.type == NULL)
+        ? instances[i]
+        : frame.type->get_complete_instance(instances[i], seed, factory));
+  }
+  result.ensure_frozen();
+  return result;
+}
+
+void BinaryReaderImpl::deliver(Variant value) {
+  while (true) {
+    if (stack_.empty()) {
+      result_ = value;
+      status_ = IncrementalBinaryReader::DONE;
+      return;
+    }
+    Frame *frame = &stack_.back();
+    switch (frame->opcode) {
+      case PTON_OPCODE_BEGIN_ARRAY: {
+        Array array = frame->value;
+        array.add(value);
+        if (--frame->remaining > 0)
+          return;
+        array.ensure_frozen();
+        value = array;
+        break;
+      }
+      case PTON_OPCODE_BEGIN_MAP: {
+        if (!frame->has_key) {
+          frame->key = value;
+          frame->has_key = true;
+          return;
+        }
+        Map map = frame->value;
+        map.set(frame->key, value);
+        frame->has_key = false;
+        if (--frame->remaining > 0)
+          return;
+        map.ensure_frozen();
+        value = map;
+        break;
+      }
+      case PTON_OPCODE_BEGIN_SEED: {
+        Seed seed = frame->value;
+        if (frame->headers_remaining > 0) {
+          if (frame->headers_read++ == 0)
+            // We set the header to the first, most specific, one.
+            seed.set_header(value);
+          AbstractTypeRegistry *registry = reader_->type_registry_;
+          if (frame->type == NULL && registry != NULL)
+            // If there is a registry and we still haven't recognized a type we
+            // try to resolve the current header to a type.
+            frame->type = registry->resolve_type(value);
+          if (--frame->headers_remaining == 0)
+            end_seed_headers(frame);
+          return;
+        }
+        if (!frame->has_key) {
+          frame->key = value;
+          frame->has_key = true;
+          return;
+        }
+        seed.set_field(frame->key, value);
+        frame->has_key = false;
+        if (--frame->remaining > 0)
+          return;
+        value = end_seed();
+        continue;
+      }
+      case PTON_OPCODE_BEGIN_COLUMNS: {
+        if (frame->headers_remaining > 0) {
+          if (frame->headers_read++ == 0)
+            frame->key = value;
+          AbstractTypeRegistry *registry = reader_->type_registry_;
+          if (frame->type == NULL && registry != NULL)
+            frame->type = registry->resolve_type(value);
+          if (--frame->headers_remaining == 0)
+            end_columns_headers(frame);
+          return;
+        }
+        Array keys = frame->keys;
+        if (keys.length() < frame->keyc) {
+          keys.add(value);
+          if (keys.length() < frame->keyc || frame->rows > 0)
+            return;
+        } else {
+          Variant row = (frame->column == 0)
+              ? next_row(frame)
+              : Array(frame->value)[frame->row];
+          Variant key = keys[frame->column];
+          if (row.is_seed()) {
+            Seed(row).set_field(key, value);
+          } else {
+            Map(row).set(key, value);
+          }
+          if (++frame->row < frame->rows)
+            return;
+          frame->row = 0;
+          if (++frame->column < frame->keyc)
+            return;
+        }
+        value = end_columns();
+        continue;
+      }
+      default:
+        fail();
+        return;
+    }
+    stack_.pop_back();
+  }
 }
 
 BinaryReader::BinaryReader(Factory *factory)
   : factory_(factory)
-  , type_registry_(NULL) { }
+  , type_registry_(NULL)
+  , borrow_strings_(false)
+  , borrow_blobs_(false)
+  , string_table_(NULL) { }
 
 Variant BinaryReader::parse(const void *data, size_t size) {
-  BinaryReaderImpl decoder(data, size, this);
-  Variant result;
-  decoder.decode(&result);
-  return result;
+  BinaryReaderImpl decoder(this);
+  decoder.feed(static_cast<const uint8_t*>(data), size, NULL);
+  return decoder.result();
+}
+
+IncrementalBinaryReader::IncrementalBinaryReader(BinaryReader *config)
+  : impl_(new BinaryReaderImpl(config)) { }
+
+IncrementalBinaryReader::~IncrementalBinaryReader() {
+  delete impl_;
+}
+
+IncrementalBinaryReader::Status IncrementalBinaryReader::feed(const void *data,
+    size_t size, size_t *consumed_out) {
+  return impl_->feed(static_cast<const uint8_t*>(data), size, consumed_out);
+}
+
+Variant IncrementalBinaryReader::result() {
+  return impl_->result();
+}
+
+void IncrementalBinaryReader::reset() {
+  impl_->reset();
+}
+
+// Returns the number of values that follow the given instruction as part of
+// the same value: elements for arrays, keys and values for maps, headers, keys,
+// and values for seeds.
+static uint64_t get_nested_value_count(pton_instr_t *instr) {
+  switch (instr->opcode) {
+    case PTON_OPCODE_BEGIN_ARRAY:
+      return instr->payload.array_length;
+    case PTON_OPCODE_BEGIN_INDEXED_ARRAY:
+      return instr->payload.indexed_data.count;
+    case PTON_OPCODE_BEGIN_MAP:
+      return static_cast<uint64_t>(instr->payload.map_size) * 2;
+    case PTON_OPCODE_BEGIN_INDEXED_MAP:
+      return static_cast<uint64_t>(instr->payload.indexed_data.count) * 2;
+    case PTON_OPCODE_BEGIN_SEED:
+      return static_cast<uint64_t>(instr->payload.seed_data.headerc)
+          + static_cast<uint64_t>(instr->payload.seed_data.fieldc) * 2;
+    case PTON_OPCODE_BEGIN_COLUMNS:
+      return static_cast<uint64_t>(instr->payload.columns_data.headerc)
+          + instr->payload.columns_data.keyc
+          + static_cast<uint64_t>(instr->payload.columns_data.rows)
+              * instr->payload.columns_data.keyc;
+    default:
+      return 0;
+  }
+}
+
+static bool is_indexed(pton_instr_t *instr) {
+  return instr->opcode == PTON_OPCODE_BEGIN_INDEXED_ARRAY
+      || instr->opcode == PTON_OPCODE_BEGIN_INDEXED_MAP;
+}
+
+// Skips over the value that starts at the given offset, storing the offset
+// just past it. Returns false if the value is invalid. Indexed arrays and maps
+// are skipped using their tables without looking at their contents.
+static bool skip_value(const uint8_t *data, size_t size, size_t *offset) {
+  size_t cursor = *offset;
+  uint64_t remaining_instrs = 1;
+  pton_instr_t instr;
+  while (remaining_instrs > 0) {
+    if (!pton_decode_next_instruction(data + cursor, size - cursor, &instr))
+      return false;
+    cursor += instr.size;
+    if (is_indexed(&instr)) {
+      uint64_t data_size = instr.payload.indexed_data.data_size;
+      if (data_size > size - cursor)
+        return false;
+      cursor += static_cast<size_t>(data_size);
+      remaining_instrs--;
+    } else {
+      remaining_instrs += get_nested_value_count(&instr) - 1;
+    }
+  }
+  *offset = cursor;
+  return true;
 }
 
 bool BinaryReader::validate(const void *raw_data, size_t size) {
   const uint8_t *data = static_cast<const uint8_t*>(raw_data);
+  // Unlike when skipping we look inside indexed arrays and maps and check
+  // that their tables match their contents, so we have to keep track of
+  // where we are in each of them.
+  struct Frame {
+    pton_instr_t instr;
+    uint64_t remaining;
+    uint64_t values_seen;
+    size_t data_start;
+  };
+  std::vector<Frame> frames;
   size_t cursor = 0;
-  size_t remaining_instrs = 1;
   pton_instr_t instr;
-  while (cursor < size && remaining_instrs > 0) {
+  do {
+    if (!frames.empty() && is_indexed(&frames.back().instr)) {
+      Frame *top = &frames.back();
+      uint32_t values_per_entry =
+          (top->instr.opcode == PTON_OPCODE_BEGIN_INDEXED_MAP) ? 2 : 1;
+      if ((top->values_seen % values_per_entry) == 0) {
+        uint32_t index = static_cast<uint32_t>(top->values_seen / values_per_entry);
+        if (pton_instr_index_entry(&top->instr, index) != cursor - top->data_start)
+          return false;
+      }
+    }
     if (!pton_decode_next_instruction(data + cursor, size - cursor, &instr))
       return false;
     cursor += instr.size;
-    remaining_instrs--;
-    switch (instr.opcode) {
-      case PTON_OPCODE_BOOL:
-      case PTON_OPCODE_DEFAULT_STRING:
-      case PTON_OPCODE_ID64:
-      case PTON_OPCODE_INT64:
-      case PTON_OPCODE_NULL:
-      case PTON_OPCODE_REFERENCE:
-      case PTON_OPCODE_STRING_WITH_ENCODING:
-      case PTON_OPCODE_BLOB:
-        break;
-      case PTON_OPCODE_BEGIN_ARRAY:
-        remaining_instrs += instr.payload.array_length;
-        break;
-      case PTON_OPCODE_BEGIN_MAP:
-        remaining_instrs += instr.payload.map_size * 2;
-        break;
-      case PTON_OPCODE_BEGIN_SEED:
-        remaining_instrs += instr.payload.seed_data.headerc
-          + instr.payload.seed_data.fieldc * 2;
+    uint64_t nested_count = get_nested_value_count(&instr);
+    if (nested_count > 0) {
+      Frame frame = {instr, nested_count, 0, cursor};
+      frames.push_back(frame);
+      continue;
+    }
+    if (is_indexed(&instr) && instr.payload.indexed_data.data_size != 0)
+      return false;
+    if (instr.opcode == PTON_OPCODE_INT64_ARRAY
+        && !pton_instr_unpack_int64_array(&instr, NULL))
+      return false;
+    // A value is done which may complete the containers around it.
+    while (!frames.empty()) {
+      Frame *top = &frames.back();
+      top->values_seen++;
+      if (--top->remaining > 0)
         break;
+      if (is_indexed(&top->instr)
+          && top->instr.payload.indexed_data.data_size != cursor - top->data_start)
+        return false;
+      frames.pop_back();
     }
-  }
-  return (cursor == size) && (remaining_instrs == 0);
+  } while (!frames.empty());
+  return cursor == size;
 }
 
 } // namespace plankton
@@ -843,12 +2404,142 @@ bool pton_decode_next_instruction(const uint8_t *code, size_t size, pton_instr_t
   return in.decode(instr_out);
 }
 
+bool pton_instr_unpack_int64_array(const pton_instr_t *instr, int64_t *dest) {
+  uint32_t count = instr->payload.int64_array_data.count;
+  uint8_t layout = instr->payload.int64_array_data.layout;
+  const uint8_t *contents = instr->payload.int64_array_data.contents;
+  size_t size = instr->payload.int64_array_data.size;
+  if ((layout >> 4) == BinaryImplUtils::iaFixed) {
+    // The decoder has already checked that the size matches.
+    size_t width = static_cast<size_t>(1) << (layout & 0xF);
+    size_t shift = 64 - 8 * width;
+    if (dest == NULL)
+      return true;
+    for (uint32_t i = 0; i < count; i++) {
+      uint64_t raw = 0;
+      for (size_t j = 0; j < width; j++)
+        raw |= static_cast<uint64_t>(contents[i * width + j]) << (8 * j);
+      // Shift the top byte up to the top and back to sign extend.
+      dest[i] = static_cast<int64_t>(raw << shift) >> shift;
+    }
+    return true;
+  }
+  size_t cursor = 0;
+  uint64_t value = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t zigzag = 0;
+    size_t used = BinaryImplUtils::decode_varint(contents + cursor,
+        size - cursor, &zigzag);
+    if (used == 0)
+      return false;
+    cursor += used;
+    value += (zigzag >> 1) ^ (0 - (zigzag & 1));
+    if (dest != NULL)
+      dest[i] = static_cast<int64_t>(value);
+  }
+  return cursor == size;
+}
+
+void pton_instr_unpack_float64_array(const pton_instr_t *instr, double *dest) {
+  uint32_t count = instr->payload.float64_array_data.count;
+  const uint8_t *contents = instr->payload.float64_array_data.contents;
+  for (uint32_t i = 0; i < count; i++)
+    dest[i] = BinaryImplUtils::decode_float64(
+        contents + static_cast<size_t>(i) * BinaryImplUtils::kFloat64Size);
+}
+
+uint64_t pton_instr_index_entry(const pton_instr_t *instr, uint32_t index) {
+  uint32_t entry_size = instr->payload.indexed_data.entry_size;
+  const uint8_t *entry = instr->payload.indexed_data.table
+      + static_cast<size_t>(index) * entry_size;
+  uint64_t result = 0;
+  for (uint32_t i = 0; i < entry_size; i++)
+    result |= static_cast<uint64_t>(entry[i]) << (8 * i);
+  return result;
+}
+
 bool pton_validate(const void *code, size_t size) {
   return BinaryReader::validate(code, size);
 }
 
+void pton_cursor_init(pton_cursor_t *cursor, const void *code, size_t size) {
+  cursor->code = static_cast<const uint8_t*>(code);
+  cursor->size = size;
+  cursor->offset = 0;
+  cursor->started = false;
+  cursor->failed = false;
+  cursor->depth = 0;
+}
+
+pton_cursor_event_t pton_cursor_next(pton_cursor_t *cursor,
+    pton_instr_t *instr_out) {
+  if (cursor->failed)
+    return PTON_CURSOR_ERROR;
+  if (cursor->depth > 0) {
+    if (cursor->remaining[cursor->depth - 1] == 0) {
+      cursor->depth--;
+      return PTON_CURSOR_END;
+    }
+  } else if (cursor->started) {
+    return PTON_CURSOR_DONE;
+  }
+  if (!pton_decode_next_instruction(cursor->code + cursor->offset,
+          cursor->size - cursor->offset, instr_out)) {
+    cursor->failed = true;
+    return PTON_CURSOR_ERROR;
+  }
+  cursor->offset += instr_out->size;
+  cursor->started = true;
+  if (cursor->depth > 0)
+    cursor->remaining[cursor->depth - 1]--;
+  switch (instr_out->opcode) {
+    case PTON_OPCODE_BEGIN_ARRAY:
+    case PTON_OPCODE_BEGIN_MAP:
+    case PTON_OPCODE_BEGIN_SEED:
+    case PTON_OPCODE_BEGIN_INDEXED_ARRAY:
+    case PTON_OPCODE_BEGIN_INDEXED_MAP:
+    case PTON_OPCODE_BEGIN_COLUMNS:
+      if (cursor->depth == PTON_CURSOR_MAX_DEPTH) {
+        cursor->failed = true;
+        return PTON_CURSOR_ERROR;
+      }
+      cursor->remaining[cursor->depth++] = get_nested_value_count(instr_out);
+      return PTON_CURSOR_BEGIN;
+    default:
+      return PTON_CURSOR_ATOM;
+  }
+}
+
+bool pton_cursor_skip_value(pton_cursor_t *cursor) {
+  if (cursor->failed)
+    return false;
+  if (cursor->depth > 0) {
+    if (cursor->remaining[cursor->depth - 1] == 0)
+      return false;
+  } else if (cursor->started) {
+    return false;
+  }
+  if (!skip_value(cursor->code, cursor->size, &cursor->offset)) {
+    cursor->failed = true;
+    return false;
+  }
+  cursor->started = true;
+  if (cursor->depth > 0)
+    cursor->remaining[cursor->depth - 1]--;
+  return true;
+}
+
+size_t pton_cursor_offset(pton_cursor_t *cursor) {
+  return cursor->offset;
+}
+
 void pton_binary_writer_write(pton_assembler_t *assm, pton_variant_t value) {
   Assembler inner(assm);
   VariantWriter writer(&inner);
   writer.encode(value);
 }
+
+size_t pton_binary_size(pton_variant_t value) {
+  BinaryWriter writer;
+  return writer.measure(value);
+}
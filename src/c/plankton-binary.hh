@@ -27,10 +27,168 @@ public:
     boReference = 8,
     boStringWithEncoding = 10,
     boId = 11,
-    boBlob = 12
+    boBlob = 12,
+    boIndexedArray = 14,
+    boIndexedMap = 15,
+    boInt64Array = 16,
+    boFloat64 = 17,
+    boFloat64Array = 18,
+    boColumns = 19,
+    boTableString = 20
   };
+
+  // How the values of a packed int64 array are stored. The kind is stored in
+  // the top four bits of the layout byte that follows the count.
+  enum int64_array_kind_t {
+    // Fixed-width little-endian two's complement, the bottom four bits of the
+    // layout byte hold the base-2 logarithm of the width in bytes.
+    iaFixed = 0,
+    // The difference from the previous value, the first from 0, as a zigzag
+    // encoded varint.
+    iaDeltas = 1
+  };
+
+  // The version of the layout of indexed arrays and maps. It is stored in the
+  // top four bits of the layout byte that follows their size, the bottom four
+  // hold the base-2 logarithm of the size of the offset table entries.
+  static const uint8_t kIndexLayoutVersion = 0;
+
+  // The largest number of bytes a varint can take up.
+  static const size_t kMaxVarintSize = 10;
+
+  // The largest number of bytes a varint holding a 32-bit value can take up.
+  static const size_t kMaxUint32VarintSize = 5;
+
+  // Writes the given value as a varint into the given destination which must
+  // have room for kMaxVarintSize bytes. Returns the number of bytes written.
+  static inline size_t encode_varint(uint64_t value, uint8_t *dest);
+
+  // Decodes a varint from the start of the given data. Returns the number of
+  // bytes read, or 0 if the data ends before the varint does or it is longer
+  // than kMaxVarintSize.
+  static inline size_t decode_varint(const uint8_t *data, size_t size,
+      uint64_t *result_out);
+
+  // Returns the number of bytes the given value takes up as a varint.
+  static inline size_t varint_size(uint64_t value);
+
+  // The number of bytes a float64 takes up, both on its own and as an element
+  // of a packed float64 array.
+  static const size_t kFloat64Size = 8;
+
+  // Writes the given value into the given destination as kFloat64Size bytes
+  // holding the little-endian IEEE 754 binary64 representation.
+  static inline void encode_float64(double value, uint8_t *dest);
+
+  // Reads a value written by encode_float64.
+  static inline double decode_float64(const uint8_t *data);
+
+  // Returns a new frozen int64 array holding the values of the given packed
+  // int64 array instruction, or null if they are invalid.
+  static Variant unpack_int64_array(Factory *factory, const pton_instr_t *instr);
+
+  // Returns a new frozen float64 array holding the values of the given packed
+  // float64 array instruction.
+  static Variant unpack_float64_array(Factory *factory, const pton_instr_t *instr);
 };
 
+// The wire encoding of unsigned integers is similar to protobuf varints with
+// a slight twist. You might call them biased varints. Basically it's a sequence
+// of bytes where the bottom 7 bits give 7 bits of the value and the top bit
+// indicates whether there are more bytes coming. The order is backwards: the
+// first byte holds the least significant 7 bits, etc.
+//
+// The problem with using this format directly is that it allows leading zeros,
+// so these:
+//
+//   0x00
+//   0x80 0x00
+//   0x80 0x80 0x80 0x00
+//
+// are all valid representations of the same value, 0. This means that you
+// either have to declare some encodings invalid or live with having multiple
+// valid representations of the same number. It also means that you can make
+// fewer assumptions about the value represented based on the length of the
+// encoding. It would be really nice if each number had a unique representation
+// and to accomplish this, instead of concatenating the payloads directly we add
+// an implicit 1 to the payload of each byte, except the first one. This means
+// that the examples from before now correspond to different values,
+//
+//   0x00 -> 0
+//   0x80 0x00 -> 128 (= 2^7)
+//   0x80 0x80 0x00 -> 16512 (= 2^7 + 2^14)
+//   0x80 0x80 0x80 0x00 -> 2113664 (= 2^7 + 2^14 + 2^21)
+//
+// This is also slightly more space efficient -- without the bias two bytes will
+// hold up to 16383, with the bias it's 16511, but that's in the order of less
+// than 1% so it hardly matters.
+//
+// These kernels are used for every integer, length, and count so they're kept
+// small enough to inline: encoding writes into a fixed-size block so the caller
+// only checks capacity once, and decoding checks bounds once up front rather
+// than for each byte.
+
+size_t BinaryImplUtils::encode_varint(uint64_t value, uint8_t *dest) {
+  size_t count = 0;
+  while (value >= 0x80) {
+    dest[count++] = static_cast<uint8_t>((value & 0x7F) | 0x80);
+    value = (value >> 7) - 1;
+  }
+  dest[count++] = static_cast<uint8_t>(value);
+  return count;
+}
+
+size_t BinaryImplUtils::varint_size(uint64_t value) {
+  size_t count = 1;
+  while (value >= 0x80) {
+    value = (value >> 7) - 1;
+    count++;
+  }
+  return count;
+}
+
+size_t BinaryImplUtils::decode_varint(const uint8_t *data, size_t size,
+    uint64_t *result_out) {
+  if (size == 0)
+    return 0;
+  uint64_t first = data[0];
+  if (first < 0x80) {
+    // Most varints are small so it pays to treat single bytes specially.
+    *result_out = first;
+    return 1;
+  }
+  size_t limit = (size < kMaxVarintSize) ? size : kMaxVarintSize;
+  uint64_t result = first & 0x7F;
+  for (size_t i = 1; i < limit; i++) {
+    uint64_t next = data[i];
+    result += ((next & 0x7F) + 1) << (7 * i);
+    if (next < 0x80) {
+      *result_out = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Floats are stored as their raw bits, assembled byte by byte so the result
+// doesn't depend on the host's byte order.
+
+void BinaryImplUtils::encode_float64(double value, uint8_t *dest) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  for (size_t i = 0; i < kFloat64Size; i++)
+    dest[i] = static_cast<uint8_t>(bits >> (8 * i));
+}
+
+double BinaryImplUtils::decode_float64(const uint8_t *data) {
+  uint64_t bits = 0;
+  for (size_t i = 0; i < kFloat64Size; i++)
+    bits |= static_cast<uint64_t>(data[i]) << (8 * i);
+  double result;
+  memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
 } // plankton
 
 #endif // _PLANKTON_BINARY
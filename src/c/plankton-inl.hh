@@ -17,6 +17,10 @@ Variant Variant::integer(int64_t value) {
   return Variant(value);
 }
 
+Variant Variant::float64(double value) {
+  return Variant(pton_float64(value));
+}
+
 Variant::Variant(const char *string) : value_(pton_c_str(string)) { }
 
 Variant::Variant(const char *string, uint32_t length)
@@ -30,6 +34,10 @@ int64_t Variant::integer_value(int64_t if_not_int) const {
   return pton_int64_value_with_default(value_, if_not_int);
 }
 
+double Variant::float64_value(double if_not_float) const {
+  return pton_float64_value_with_default(value_, if_not_float);
+}
+
 bool Variant::bool_value(bool if_not_bool) const {
   return pton_bool_value_with_default(value_, if_not_bool);
 }
@@ -43,6 +51,11 @@ bool Variant::is_integer() const {
   return pton_is_integer(value_);
 }
 
+// Is this value a float?
+bool Variant::is_float() const {
+  return pton_is_float(value_);
+}
+
 // Is this value a map?
 bool Variant::is_map() const {
   return pton_is_map(value_);
@@ -73,8 +86,20 @@ bool Variant::is_native() const {
   return type() == PTON_NATIVE;
 }
 
+void *ArenaData::alloc_raw(size_t bytes) {
+  size_t aligned = (bytes + (kAlignment - 1)) & ~(kAlignment - 1);
+  // A fresh arena has no page so even empty allocations have to get one,
+  // otherwise they'd return NULL.
+  if (aligned > static_cast<size_t>(limit_ - cursor_) || cursor_ == NULL)
+    return alloc_raw_slow(aligned);
+  uint8_t *result = cursor_;
+  cursor_ += aligned;
+  return result;
+}
+
 Arena::Arena()
-  : tclib::refcount_reference_t<ArenaData>(NULL) { }
+  : tclib::refcount_reference_t<ArenaData>(NULL)
+  , intern_strings_(false) { }
 
 template <typename T>
 T *Arena::alloc_values(uint32_t elms) {
@@ -86,6 +111,22 @@ T *Arena::alloc_value() {
   return static_cast<T*>(alloc_raw(sizeof(T)));
 }
 
+template <typename T>
+T *Arena::alloc_growable_values(uint32_t elms) {
+  return static_cast<T*>(data()->alloc_chunk(sizeof(T) * elms));
+}
+
+template <typename T>
+T *Arena::grow_values(T *values, uint32_t old_elms, uint32_t new_elms) {
+  return static_cast<T*>(data()->grow_chunk(values, sizeof(T) * old_elms,
+      sizeof(T) * new_elms));
+}
+
+template <typename T>
+void Arena::free_values(T *values, uint32_t elms) {
+  data()->free_chunk(values, sizeof(T) * elms);
+}
+
 } // namespace plankton
 
 #endif // _PLANKTON
@@ -11,6 +11,8 @@ BEGIN_C_INCLUDES
 #include "utils/check.h"
 END_C_INCLUDES
 
+#include <math.h>
+
 namespace plankton {
 
 TextWriter::TextWriter(TextSyntax syntax)
@@ -70,6 +72,9 @@ protected:
 
   Buffer<char> chars_;
 
+  // Returns true iff the seed with the given identity is being written.
+  bool is_open_seed(const void *identity);
+
 private:
   // Writes the given null-terminated string directly to the buffer.
   void write_raw_string(const char *chars);
@@ -80,6 +85,10 @@ private:
   // Writes the given integer in decimal.
   void write_integer(int64_t value);
 
+  // Writes the given float in the shortest decimal form that reads back as
+  // the same value.
+  void write_float64(double value);
+
   // Writes the given string, properly ascii encoded.
   void write_string(const char *chars, size_t length);
 
@@ -115,6 +124,9 @@ private:
   static const char kBase64Padding;
 
   Arena scratch_;
+
+  // The seeds that are currently being written, outermost first.
+  std::vector<const void*> open_seeds_;
 };
 
 class SourceTextWriterImpl : public TextWriterImpl {
@@ -139,8 +151,10 @@ private:
   // short length limit is treated as infinity so if we ever reach a value
   // greater we bail out immediately. This is to keep the calculation constant
   // and avoid the potential complexity blowup if we compute the full size
-  // of subtrees for every variant.
-  static size_t get_short_length(Variant variant, size_t offset);
+  // of subtrees for every variant. A seed that occurs within itself is
+  // written as a placeholder, which is_nested tells apart from the outermost
+  // value that is already being written when its length is asked for.
+  size_t get_short_length(Variant variant, size_t offset, bool is_nested = true);
 
   // Will writing the given value cause the line to get too long so we have to
   // use the long multiline format?
@@ -183,6 +197,9 @@ void TextWriterImpl::write(Variant value, size_t depth) {
     case PTON_INTEGER:
       write_integer(value.integer_value());
       break;
+    case PTON_FLOAT:
+      write_float64(value.float64_value());
+      break;
     case PTON_STRING:
       write_string(value.string_chars(), value.string_length());
       break;
@@ -198,9 +215,19 @@ void TextWriterImpl::write(Variant value, size_t depth) {
     case PTON_MAP:
       write_map(value, depth);
       break;
-    case PTON_SEED:
+    case PTON_SEED: {
+      const void *identity = value.to_c().payload_.as_arena_seed_;
+      if (is_open_seed(identity)) {
+        // The text format has no references so a seed that contains itself
+        // can't be written.
+        write_raw_string("?");
+        break;
+      }
+      open_seeds_.push_back(identity);
       write_seed(value, depth);
+      open_seeds_.pop_back();
       break;
+    }
     case PTON_NATIVE:
       write_native(value, depth);
       break;
@@ -210,9 +237,19 @@ void TextWriterImpl::write(Variant value, size_t depth) {
   }
 }
 
-size_t SourceTextWriterImpl::get_short_length(Variant value, size_t offset) {
+bool TextWriterImpl::is_open_seed(const void *identity) {
+  for (size_t i = 0; i < open_seeds_.size(); i++) {
+    if (open_seeds_[i] == identity)
+      return true;
+  }
+  return false;
+}
+
+size_t SourceTextWriterImpl::get_short_length(Variant value, size_t offset,
+    bool is_nested) {
   switch (value.type()) {
     case PTON_INTEGER:
+    case PTON_FLOAT:
       return offset + 5;
     case PTON_BOOL:
     case PTON_NULL:
@@ -238,6 +275,9 @@ size_t SourceTextWriterImpl::get_short_length(Variant value, size_t offset) {
       return current;
     }
     case PTON_SEED: {
+      if (is_nested && is_open_seed(value.to_c().payload_.as_arena_seed_))
+        // The seed contains itself so it'll be written as a placeholder.
+        return offset + 1;
       Seed seed = value;
       size_t current = get_short_length(seed.header(), offset + 2);
       for (Seed::Iterator i = seed.fields_begin();
@@ -297,6 +337,28 @@ void TextWriterImpl::write_integer(int64_t value) {
   write_raw_string(chars);
 }
 
+void TextWriterImpl::write_float64(double value) {
+  if (isnan(value)) {
+    write_raw_string("%nan");
+    return;
+  } else if (isinf(value)) {
+    write_raw_string(value < 0 ? "%-inf" : "%inf");
+    return;
+  }
+  // 17 significant digits are always enough to get the same value back but
+  // usually fewer will do and they read better.
+  char chars[64];
+  for (int precision = 15; precision <= 17; precision++) {
+    sprintf(chars, "%.*g", precision, value);
+    if (strtod(chars, NULL) == value)
+      break;
+  }
+  // Make sure it doesn't read back as an integer.
+  if (strpbrk(chars, ".e") == NULL)
+    strcat(chars, ".0");
+  write_raw_string(chars);
+}
+
 bool TextWriterImpl::is_unquoted_string_start(char c) {
   return ('a' <= c && c <= 'z')
       || ('A' <= c && c <= 'Z');
@@ -413,7 +475,7 @@ void TextWriterImpl::write_blob(const void *data, size_t size) {
 }
 
 bool SourceTextWriterImpl::write_long(Variant value) {
-  return get_short_length(value, indent_) >= kShortLengthLimit;
+  return get_short_length(value, indent_, false) >= kShortLengthLimit;
 }
 
 void SourceTextWriterImpl::write_array(Array array, size_t depth) {
@@ -655,8 +717,12 @@ protected:
   // Decodes a non-toplevel expression.
   bool decode(Variant *out);
 
-  // Parses the next integer.
-  bool decode_integer(Variant *out);
+  // Parses the next integer or float.
+  bool decode_number(Variant *out);
+
+  // If the input at the cursor is the given word, skips past it and returns
+  // true, otherwise returns false without consuming anything.
+  bool advance_past(const char *word);
 
   // Parses the next unquoted string.
   bool decode_unquoted_string(Variant *out);
@@ -827,8 +893,22 @@ bool TextReaderImpl::decode(Variant *out) {
           advance_and_skip();
           return succeed(Variant::yes(), out);
         case 'n':
+          if (advance_past("nan")) {
+            skip_whitespace();
+            return succeed(Variant::float64(NAN), out);
+          }
           advance_and_skip();
           return succeed(Variant::null(), out);
+        case 'i':
+          if (!advance_past("inf"))
+            return fail(out);
+          skip_whitespace();
+          return succeed(Variant::float64(HUGE_VAL), out);
+        case '-':
+          if (!advance_past("-inf"))
+            return fail(out);
+          skip_whitespace();
+          return succeed(Variant::float64(-HUGE_VAL), out);
         case '[':
           return decode_blob(out);
         default:
@@ -844,11 +924,11 @@ bool TextReaderImpl::decode(Variant *out) {
     case '"':
       return decode_quoted_string(out);
     case '-':
-      return (next() == '-' ? fail(out) : decode_integer(out));
+      return (next() == '-' ? fail(out) : decode_number(out));
     default:
       char c = current();
       if (is_digit(c)) {
-        return decode_integer(out);
+        return decode_number(out);
       } else if (is_unquoted_string_start(c)) {
         return decode_unquoted_string(out);
       } else {
@@ -857,7 +937,8 @@ bool TextReaderImpl::decode(Variant *out) {
   }
 }
 
-bool TextReaderImpl::decode_integer(Variant *out) {
+bool TextReaderImpl::decode_number(Variant *out) {
+  size_t start = cursor_;
   bool is_negative = false;
   if (current() == '-') {
     is_negative = true;
@@ -868,12 +949,53 @@ bool TextReaderImpl::decode_integer(Variant *out) {
     result = (10 * result) + (current() - '0');
     advance();
   }
+  // A fraction or an exponent makes it a float. They only count if they're
+  // followed by digits.
+  bool is_float = false;
+  if (current() == '.' && is_digit(next())) {
+    is_float = true;
+    advance();
+    while (is_digit(current()))
+      advance();
+  }
+  if (current() == 'e' || current() == 'E') {
+    size_t exponent_start = cursor_;
+    advance();
+    if (current() == '+' || current() == '-')
+      advance();
+    if (is_digit(current())) {
+      is_float = true;
+      while (is_digit(current()))
+        advance();
+    } else {
+      cursor_ = exponent_start;
+    }
+  }
+  if (is_float) {
+    // The input isn't null terminated so strtod needs a copy.
+    size_t length = cursor_ - start;
+    char chars[64];
+    if (length >= sizeof(chars))
+      return fail(out);
+    memcpy(chars, chars_ + start, length);
+    chars[length] = '\0';
+    skip_whitespace();
+    return succeed(Variant::float64(strtod(chars, NULL)), out);
+  }
   skip_whitespace();
   if (is_negative)
     result = -result;
   return succeed(Variant::integer(result), out);
 }
 
+bool TextReaderImpl::advance_past(const char *word) {
+  size_t length = strlen(word);
+  if (length > length_ - cursor_ || strncmp(chars_ + cursor_, word, length) != 0)
+    return false;
+  cursor_ += length;
+  return true;
+}
+
 bool TextWriterImpl::encode_short_escape(char c, char *out) {
   switch (c) {
     case '\a': *out = 'a'; break;
@@ -936,8 +1058,8 @@ bool TextReaderImpl::decode_unquoted_string(Variant *out) {
     buf.add(next);
   }
   skip_whitespace();
-  return succeed(factory()->new_string(*buf, static_cast<uint32_t>(buf.length())),
-      out);
+  return succeed(factory()->new_interned_string(*buf,
+      static_cast<uint32_t>(buf.length())), out);
 }
 
 bool TextReaderImpl::decode_character(char *out) {
@@ -980,8 +1102,8 @@ bool TextReaderImpl::decode_quoted_string(Variant *out) {
   } else {
     advance_and_skip();
   }
-  return succeed(factory()->new_string(*buf, static_cast<uint32_t>(buf.length())),
-      out);
+  return succeed(factory()->new_interned_string(*buf,
+      static_cast<uint32_t>(buf.length())), out);
 }
 
 bool SourceTextReaderImpl::decode_array(Variant *out) {
@@ -9,6 +9,7 @@
 #include "plankton-inl.hh"
 #include "socket.hh"
 #include "utils/alloc.hh"
+#include "utils/log.hh"
 
 using namespace plankton;
 
@@ -52,6 +53,7 @@ private:
   friend class plankton::Variant;
   friend class plankton::Arena;
   friend class ArraySink;
+  friend struct pton_lazy_value_t;
   static const uint32_t kDefaultInitCapacity = 8;
   Arena *origin_;
   uint32_t length_;
@@ -59,6 +61,42 @@ private:
   Variant *elms_;
 };
 
+// An arena-allocated array of integers stored packed. Behaves like an array
+// except that it can only hold integers.
+struct pton_arena_int64_array_t : public pton_arena_value_t {
+public:
+  pton_arena_int64_array_t(Arena *origin, uint32_t init_capacity);
+
+  bool add(int64_t value);
+
+private:
+  friend class plankton::Variant;
+  friend class plankton::BinaryImplUtils;
+  static const uint32_t kDefaultInitCapacity = 8;
+  Arena *origin_;
+  uint32_t length_;
+  uint32_t capacity_;
+  int64_t *elms_;
+};
+
+// An arena-allocated array of floats stored packed. Behaves like an array
+// except that it can only hold floats.
+struct pton_arena_float64_array_t : public pton_arena_value_t {
+public:
+  pton_arena_float64_array_t(Arena *origin, uint32_t init_capacity);
+
+  bool add(double value);
+
+private:
+  friend class plankton::Variant;
+  friend class plankton::BinaryImplUtils;
+  static const uint32_t kDefaultInitCapacity = 8;
+  Arena *origin_;
+  uint32_t length_;
+  uint32_t capacity_;
+  double *elms_;
+};
+
 // An arena-allocated native object handle.
 struct pton_arena_native_t : public pton_arena_value_t {
 public:
@@ -97,10 +135,44 @@ private:
   friend class MapKeySink;
   friend class MapValueSink;
 
+  // Maps smaller than this are searched linearly, larger ones get a hash
+  // index once they grow this big.
+  static const uint32_t kIndexThreshold = 8;
+
+  // Returns the index of the first entry whose key equals the given one, or
+  // -1 if there is none.
+  int64_t find(Variant key) const;
+
+  // Adds the entry at the given index to the hash index. If another entry has
+  // the same key the one that comes first is the one lookups find.
+  void index_entry(uint32_t index);
+
+  // Removes the entry at the given index, which is currently under the given
+  // key, from the hash index. If a later entry has the same key it takes the
+  // removed entry's place.
+  void unindex_entry(uint32_t index, Variant key);
+
+  // (Re)builds the hash index from scratch such that it can hold at least the
+  // given number of entries.
+  void build_index(uint32_t min_capacity);
+
+  // Replaces the key of the entry at the given index, keeping the hash index
+  // in sync.
+  void set_key(uint32_t index, Variant key);
+
   Arena *origin_;
   uint32_t size_;
   uint32_t capacity_;
   entry_t *elms_;
+
+  // Open addressing hash index into the entries, built when the map reaches
+  // kIndexThreshold entries. Each slot holds an entry index plus one, zero
+  // meaning the slot is empty. Like the entries the index is allocated in the
+  // arena so it goes away with the map. Lookups never modify it so frozen maps
+  // can be searched concurrently. It is always either NULL or in sync with the
+  // entries.
+  uint32_t *index_;
+  uint32_t index_capacity_;
 };
 
 struct pton_arena_seed_t : public pton_arena_value_t {
@@ -111,6 +183,7 @@ public:
 
 private:
   friend class plankton::Variant;
+  friend struct pton_lazy_value_t;
   Variant header_;
   Map fields_;
 };
@@ -146,6 +219,152 @@ private:
   uint32_t size_;
 };
 
+// Binary plankton input that is being viewed lazily. Shared between all the
+// lazy values that view the same input.
+class LazyInput {
+public:
+  LazyInput(const uint8_t *code, size_t size, Factory *factory,
+      bool borrow_strings, bool borrow_blobs, StringTable *string_table);
+
+  // Decodes the value that starts at the given offset, storing the offset just
+  // past it. Arrays, maps, and seeds become lazy values. Returns false if the
+  // input is invalid.
+  bool decode(size_t offset, Variant *result_out, size_t *end_out);
+
+  Factory *factory() { return factory_; }
+
+private:
+  // Controls how seeds are hashed: by the address of their encoding.
+  struct CodeHasher {
+  public:
+    size_t operator()(const uint8_t *key) const {
+      uintptr_t value = reinterpret_cast<uintptr_t>(key);
+      return static_cast<size_t>(value ^ (value >> 4) ^ (value >> 16));
+    }
+    // MSVC hash map stuff.
+    static const size_t bucket_size = 4;
+    bool operator()(const uint8_t *a, const uint8_t *b) { return a < b; }
+  };
+
+  typedef platform_hash_map<const uint8_t*, Variant, CodeHasher> SeedMap;
+
+  // Returns the lazy seed whose encoding starts at the given offset, creating
+  // it if necessary. A seed must always be viewed through the same value
+  // otherwise references wouldn't preserve identity.
+  bool get_seed(size_t offset, pton_instr_t *instr, Variant *result_out);
+
+  // Returns the array of rows encoded by column at the given offset, creating
+  // it if necessary. The rows are decoded all at once, since each is spread
+  // over all the columns, but the values in them are viewed lazily. Like
+  // seeds the same array is returned every time.
+  bool get_columns(size_t offset, pton_instr_t *instr, Variant *result_out);
+
+  // Resolves a reference instruction at the given offset.
+  bool resolve_reference(size_t offset, uint64_t distance,
+      Variant *result_out);
+
+  const uint8_t *code_;
+  size_t size_;
+  Factory *factory_;
+  bool borrow_strings_;
+  bool borrow_blobs_;
+  StringTable *string_table_;
+
+  SeedMap seeds_;
+
+  // Where a seed that can be referenced is encoded: the offset of either a
+  // seed or columns of seeds, and for columns which of the rows it is.
+  struct SeedLocation {
+    size_t offset;
+    uint32_t row;
+  };
+
+  // The seeds that begin before scanned_to_, in order. This is what
+  // references are resolved against and is only built if there are
+  // references.
+  std::vector<SeedLocation> seed_offsets_;
+  size_t scanned_to_;
+};
+
+// A read-only array, map, or seed that is backed by its binary encoding and
+// decodes its contents when they're first accessed. Values are decoded in
+// order and stored in an ordinary arena value, the backing, so a lookup only
+// decodes as far as it needs to and never decodes anything twice. Reading
+// updates the backing and the decoding state without locking so a lazy value
+// is not thread safe and isn't considered frozen, though it can't be modified.
+struct pton_lazy_value_t : public pton_arena_value_t {
+public:
+  // Creates a lazy value that decodes the given number of units, starting at
+  // the given offset, into the given backing value. For arrays a unit is an
+  // element, for maps it's a mapping, and for seeds the first unit is the given
+  // number of headers and the rest are fields.
+  pton_lazy_value_t(LazyInput *input, size_t offset, uint32_t unit_count,
+      uint32_t headerc, Variant backing);
+
+  // Decodes the next unit into the backing. If it's a mapping or a field the
+  // key and value are stored in the output parameters. Returns false if there
+  // are no more units or the input is invalid.
+  bool decode_next(Variant *key_out, Variant *value_out);
+
+  // Decodes units until at least the given number have been decoded.
+  void decode_until(uint32_t count);
+
+  // Decodes everything.
+  void decode_all() { decode_until(unit_count_); }
+
+  // Makes this array decode its elements individually, when they're asked
+  // for, using the offset index of the given indexed array instruction. The
+  // elements start at the offset this value was created with.
+  void set_index(const pton_instr_t *instr);
+
+  // Returns the element of this array at the given index.
+  Variant get(uint32_t index);
+
+  // Looks up the given key in a map or a seed's fields, decoding only as far
+  // as is necessary to find it. If it is found the value is stored in the
+  // output parameter, if there is one, and true is returned.
+  bool find(Variant key, Variant *value_out);
+
+  uint32_t unit_count() { return unit_count_; }
+
+  Variant backing() { return backing_; }
+
+  // Returns the map that holds the mappings decoded so far.
+  pton_arena_map_t *backing_map();
+
+private:
+  // Does the work of decode_next. On failure the offset may be left in the
+  // middle of a unit.
+  bool decode_unit(Variant *key_out, Variant *value_out);
+
+  LazyInput *input_;
+  size_t next_offset_;
+  uint32_t decoded_count_;
+  uint32_t unit_count_;
+  uint32_t headerc_;
+  Variant backing_;
+
+  // If this is an indexed array these hold the index, where the elements
+  // start, and which elements have been decoded. Otherwise present_ is NULL.
+  pton_instr_t index_;
+  size_t data_offset_;
+  bool *present_;
+};
+
+// Returns the arena map that holds the entries of the given map, decoding it
+// fully first if it's lazy. Returns NULL if the value is not a map.
+static pton_arena_map_t *get_map_data(pton_variant_t variant) {
+  switch (variant.header_.repr_tag_) {
+    case header_t::PTON_REPR_ARNA_MAP:
+      return variant.payload_.as_arena_map_;
+    case header_t::PTON_REPR_LAZY_MAP:
+      variant.payload_.as_lazy_value_->decode_all();
+      return variant.payload_.as_lazy_value_->backing_map();
+    default:
+      return NULL;
+  }
+}
+
 struct pton_sink_t {
 public:
   explicit pton_sink_t(Factory *origin);
@@ -173,6 +392,16 @@ void pton_dispose_arena(pton_arena_t *arena) {
   delete arena;
 }
 
+ArenaData::ArenaData()
+  : next_page_(0)
+  , cursor_(NULL)
+  , limit_(NULL)
+  , next_page_size_(kMinPageSize)
+  , adopter_count_(0) {
+  for (size_t i = 0; i < kChunkSizeClassCount; i++)
+    free_chunks_[i] = NULL;
+}
+
 ArenaData::~ArenaData() {
   // Invoke the scheduled cleanups.
   for (size_t i = 0; i < cleanups_.size(); i++) {
@@ -183,12 +412,10 @@ ArenaData::~ArenaData() {
   for (size_t i = 0; i < adopted_.size(); i++)
     adopted_[i]->unmark_adopted();
   // Free memory.
-  for (size_t i = 0; i < blocks_.size(); i++) {
-    blob_t *blob = &blocks_[i];
-    // For good measure, zap the memory before freeing it.
-    blob_fill(*blob, 0xCD);
-    allocator_default_free(*blob);
-  }
+  for (size_t i = 0; i < pages_.size(); i++)
+    free_block(pages_[i]);
+  for (size_t i = 0; i < large_blocks_.size(); i++)
+    free_block(large_blocks_[i]);
 }
 
 void ArenaData::adopt_ownership(VariantOwner *owner) {
@@ -201,10 +428,12 @@ void ArenaData::register_cleanup(tclib::callback_t<void(void)> callback) {
 }
 
 void ArenaData::mark_adopted() {
+  adopter_count_++;
   ref();
 }
 
 void ArenaData::unmark_adopted() {
+  adopter_count_--;
   deref();
 }
 
@@ -212,11 +441,140 @@ VariantOwner *ArenaData::resolve_adopted() {
   return this;
 }
 
-void *ArenaData::alloc_raw(size_t bytes) {
-  blob_t block = allocator_default_malloc(bytes);
-  uint8_t *memory = static_cast<uint8_t*>(block.start);
-  blocks_.push_back(block);
-  return memory;
+void *ArenaData::alloc_raw_slow(size_t bytes) {
+  if (bytes > kMaxPagedAllocSize) {
+    // Large allocations get their own block. This leaves the current page
+    // alone so what remains of it can still be used for later allocations.
+    blob_t block = alloc_block(bytes);
+    large_blocks_.push_back(block);
+    return block.start;
+  }
+  // If the arena has been rewound there may be pages left over from before
+  // that can be reused.
+  while (next_page_ < pages_.size()) {
+    blob_t page = pages_[next_page_++];
+    if (page.size >= bytes) {
+      cursor_ = static_cast<uint8_t*>(page.start) + bytes;
+      limit_ = static_cast<uint8_t*>(page.start) + page.size;
+      return page.start;
+    }
+  }
+  size_t page_size = next_page_size_;
+  if (next_page_size_ < kMaxPageSize)
+    next_page_size_ *= 2;
+  if (page_size < bytes)
+    // While the arena is young the pages may be smaller than the largest paged
+    // allocation.
+    page_size = bytes;
+  blob_t page = alloc_block(page_size);
+  pages_.push_back(page);
+  next_page_ = pages_.size();
+  cursor_ = static_cast<uint8_t*>(page.start) + bytes;
+  limit_ = static_cast<uint8_t*>(page.start) + page.size;
+  return page.start;
+}
+
+size_t ArenaData::chunk_size_class(size_t bytes) {
+  size_t result = 0;
+  while ((static_cast<size_t>(1) << result) < bytes)
+    result++;
+  return result;
+}
+
+void *ArenaData::alloc_chunk(size_t bytes) {
+  size_t size_class = chunk_size_class(bytes);
+  if (size_class < kChunkSizeClassCount) {
+    void *head = free_chunks_[size_class];
+    if (head != NULL) {
+      free_chunks_[size_class] = *static_cast<void**>(head);
+      return head;
+    }
+  }
+  return alloc_raw(bytes);
+}
+
+void *ArenaData::grow_chunk(void *chunk, size_t old_bytes, size_t new_bytes) {
+  uint8_t *start = static_cast<uint8_t*>(chunk);
+  size_t old_aligned = (old_bytes + (kAlignment - 1)) & ~(kAlignment - 1);
+  size_t new_aligned = (new_bytes + (kAlignment - 1)) & ~(kAlignment - 1);
+  if (start + old_aligned == cursor_
+      && new_aligned <= static_cast<size_t>(limit_ - start)) {
+    // The chunk is the last thing in the current page and there's room to
+    // extend it so we can just move the cursor.
+    cursor_ = start + new_aligned;
+    return chunk;
+  }
+  void *result = alloc_chunk(new_bytes);
+  memcpy(result, chunk, old_bytes);
+  free_chunk(chunk, old_bytes);
+  return result;
+}
+
+void ArenaData::free_chunk(void *chunk, size_t bytes) {
+  uint8_t *start = static_cast<uint8_t*>(chunk);
+  size_t aligned = (bytes + (kAlignment - 1)) & ~(kAlignment - 1);
+  if (start + aligned == cursor_) {
+    // The chunk is the last thing in the current page so we can give the
+    // memory straight back.
+    cursor_ = start;
+    return;
+  }
+  // The chunk goes in the largest class it can hold, which is the one below
+  // the smallest that can hold it unless the size is an exact power of 2.
+  size_t size_class = chunk_size_class(bytes);
+  if ((static_cast<size_t>(1) << size_class) > bytes)
+    size_class--;
+  if (size_class >= kChunkSizeClassCount
+      || (static_cast<size_t>(1) << size_class) < sizeof(void*))
+    return;
+  *static_cast<void**>(chunk) = free_chunks_[size_class];
+  free_chunks_[size_class] = chunk;
+}
+
+blob_t ArenaData::alloc_block(size_t bytes) {
+  return allocator_default_malloc(bytes);
+}
+
+void ArenaData::free_block(blob_t block) {
+  // For good measure, zap the memory before freeing it.
+  blob_fill(block, 0xCD);
+  allocator_default_free(block);
+}
+
+ArenaData::Mark ArenaData::mark() {
+  Mark result;
+  result.next_page = next_page_;
+  result.cursor = cursor_;
+  result.limit = limit_;
+  result.large_block_count = large_blocks_.size();
+  result.adopted_count = adopted_.size();
+  result.cleanup_count = cleanups_.size();
+  result.interned_count = interned_.size();
+  return result;
+}
+
+void ArenaData::rewind(const Mark &mark) {
+  for (size_t i = mark.cleanup_count; i < cleanups_.size(); i++) {
+    tclib::callback_t<void(void)> &cleanup = cleanups_[i];
+    cleanup();
+  }
+  cleanups_.resize(mark.cleanup_count);
+  for (size_t i = mark.interned_count; i < interned_.size(); i++)
+    interned_indices_.erase(interned_[i]);
+  interned_.resize(mark.interned_count);
+  for (size_t i = mark.adopted_count; i < adopted_.size(); i++)
+    adopted_[i]->unmark_adopted();
+  adopted_.resize(mark.adopted_count);
+  for (size_t i = mark.large_block_count; i < large_blocks_.size(); i++)
+    free_block(large_blocks_[i]);
+  large_blocks_.resize(mark.large_block_count);
+  next_page_ = mark.next_page;
+  cursor_ = mark.cursor;
+  limit_ = mark.limit;
+  // Released chunks may live in memory that has just been released so we
+  // forget about all of them.
+  for (size_t i = 0; i < kChunkSizeClassCount; i++)
+    free_chunks_[i] = NULL;
 }
 
 void Arena::adopt_ownership(VariantOwner *owner) {
@@ -231,6 +589,33 @@ void Arena::register_cleanup(tclib::callback_t<void(void)> callback) {
   data()->register_cleanup(callback);
 }
 
+Arena::Mark Arena::mark() {
+  return data()->mark();
+}
+
+bool Arena::rewind(Mark mark) {
+  ArenaData *shared = data();
+  if (shared->is_adopted())
+    return false;
+  shared->rewind(mark);
+  return true;
+}
+
+void Arena::reset() {
+  ArenaData *shared = refcount_shared();
+  if (shared == NULL)
+    return;
+  if (shared->is_adopted()) {
+    // Someone else depends on the current values so we leave them the data and
+    // start over with new data next time we need some.
+    tclib::refcount_reference_t<ArenaData>::operator=(
+        tclib::refcount_reference_t<ArenaData>());
+  } else {
+    Mark empty = {0, NULL, NULL, 0, 0, 0, 0};
+    shared->rewind(empty);
+  }
+}
+
 void Arena::mark_adopted() {
   // ignore.
 }
@@ -288,6 +673,28 @@ pton_variant_t pton_new_array_with_capacity(pton_arena_t *arena, uint32_t init_c
   return Arena::from_c(arena)->new_array(init_capacity).to_c();
 }
 
+Array Arena::new_int64_array(uint32_t init_capacity) {
+  pton_arena_int64_array_t *data = alloc_value<pton_arena_int64_array_t>();
+  Variant result(header_t::PTON_REPR_ARNA_INT64_ARRAY,
+      new (data) pton_arena_int64_array_t(this, init_capacity));
+  return result;
+}
+
+pton_variant_t pton_new_int64_array(pton_arena_t *arena, uint32_t init_capacity) {
+  return Arena::from_c(arena)->new_int64_array(init_capacity).to_c();
+}
+
+Array Arena::new_float64_array(uint32_t init_capacity) {
+  pton_arena_float64_array_t *data = alloc_value<pton_arena_float64_array_t>();
+  Variant result(header_t::PTON_REPR_ARNA_FLOAT64_ARRAY,
+      new (data) pton_arena_float64_array_t(this, init_capacity));
+  return result;
+}
+
+pton_variant_t pton_new_float64_array(pton_arena_t *arena, uint32_t init_capacity) {
+  return Arena::from_c(arena)->new_float64_array(init_capacity).to_c();
+}
+
 Map Arena::new_map() {
   pton_arena_map_t *data = alloc_value<pton_arena_map_t>();
   Variant result(header_t::PTON_REPR_ARNA_MAP, new (data) pton_arena_map_t(this));
@@ -324,15 +731,50 @@ String Arena::new_string(const char *str, uint32_t length) {
 
 String Arena::new_string(const void *str, uint32_t length,
     pton_charset_t encoding) {
+  if (encoding == Variant::default_string_encoding()) {
+    // Frozen strings with the default encoding don't need any of the state in
+    // an arena string so we make them external strings whose characters just
+    // happen to be owned by this arena. That way they cost a single small
+    // allocation. Storing short strings inside the variant itself would save
+    // that too but the string accessors take variants by value so they'd
+    // return pointers into a copy that's gone by the time they return.
+    char *own_str = alloc_values<char>(length + 1);
+    if (length > 0)
+      memcpy(own_str, str, length);
+    own_str[length] = '\0';
+    return String(Variant(pton_string(own_str, length)));
+  }
   pton_arena_string_t *data = alloc_value<pton_arena_string_t>();
   char *own_str = alloc_values<char>(length + 1);
-  memcpy(own_str, str, length);
+  if (length > 0)
+    memcpy(own_str, str, length);
   own_str[length] = '\0';
   Variant result(header_t::PTON_REPR_ARNA_STRING, new (data) pton_arena_string_t(
       own_str, length, encoding, true));
   return String(result);
 }
 
+String ArenaData::intern_string(Factory *owner, const char *str,
+    uint32_t length) {
+  // The lookup key is an external string so nothing is allocated unless the
+  // string is new.
+  Variant key(pton_string(str, length));
+  platform_hash_map<Variant, size_t, Variant::Hasher>::iterator i =
+      interned_indices_.find(key);
+  if (i != interned_indices_.end())
+    return interned_[i->second];
+  String result = owner->new_string(str, length);
+  interned_indices_[result] = interned_.size();
+  interned_.push_back(result);
+  return result;
+}
+
+String Arena::new_interned_string(const char *str, uint32_t length) {
+  if (!intern_strings_ || length > kMaxInternedLength)
+    return new_string(str, length);
+  return data()->intern_string(this, str, length);
+}
+
 pton_variant_t pton_new_string(pton_arena_t *arena, const char *str, uint32_t length) {
   return Arena::from_c(arena)->new_string(str, length).to_c();
 }
@@ -425,6 +867,12 @@ pton_type_t Variant::type() const {
   return pton_type(value_);
 }
 
+// Floats are equal if they compare equal or are both NaN; otherwise NaN
+// couldn't be used as a map key.
+static bool floats_equal(double a, double b) {
+  return (a == b) || ((a != a) && (b != b));
+}
+
 bool pton_variants_equal(pton_variant_t a, pton_variant_t b) {
   pton_check_binary_version(a);
   pton_check_binary_version(b);
@@ -435,18 +883,23 @@ bool pton_variants_equal(pton_variant_t a, pton_variant_t b) {
   switch (a_type) {
     case PTON_INTEGER:
       return pton_int64_value(a) == pton_int64_value(b);
+    case PTON_FLOAT:
+      return floats_equal(pton_float64_value(a), pton_float64_value(b));
     case PTON_STRING: {
       uint32_t length = pton_string_length(a);
       if (pton_string_length(b) != length)
         return false;
-      return strncmp(pton_string_chars(a), pton_string_chars(b), length) == 0;
+      const char *a_chars = pton_string_chars(a);
+      const char *b_chars = pton_string_chars(b);
+      // Interned strings with the same contents share their characters so
+      // they're recognized without looking at the contents.
+      return (a_chars == b_chars) || (memcmp(a_chars, b_chars, length) == 0);
     }
     case PTON_BLOB: {
       uint32_t size = pton_blob_size(a);
       if (pton_blob_size(b) != size)
         return false;
-      return strncmp(static_cast<const char*>(pton_blob_data(a)),
-          static_cast<const char*>(pton_blob_data(b)), size) == 0;
+      return memcmp(pton_blob_data(a), pton_blob_data(b), size) == 0;
     }
     case PTON_ARRAY:
       return a.payload_.as_arena_array_ == b.payload_.as_arena_array_;
@@ -468,10 +921,190 @@ bool Variant::operator==(const Variant &that) const {
   return pton_variants_equal(value_, that.value_);
 }
 
+// Mixes the bits of the given value such that each output bit depends on all
+// the input bits.
+static uint64_t hash_mix(uint64_t value) {
+  value ^= value >> 32;
+  value *= 0xD6E8FEB86659FD93ULL;
+  value ^= value >> 32;
+  value *= 0xD6E8FEB86659FD93ULL;
+  value ^= value >> 32;
+  return value;
+}
+
+// Hashes a block of memory, 8 bytes at a time.
+static uint64_t hash_bytes(const void *data, size_t size, uint64_t seed) {
+  const uint8_t *bytes = static_cast<const uint8_t*>(data);
+  uint64_t result = seed ^ (size * 0x9E3779B97F4A7C15ULL);
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    result = (result ^ word) * 0x9E3779B97F4A7C15ULL;
+    result ^= result >> 29;
+    bytes += 8;
+    size -= 8;
+  }
+  uint64_t tail = 0;
+  if (size > 0)
+    memcpy(&tail, bytes, size);
+  return hash_mix(result ^ tail);
+}
+
+// Arrays and maps nested deeper than this are hashed by type only when hashing
+// structurally. This keeps deep structures from taking too long to hash.
+static const size_t kMaxHashDepth = 8;
+
+// Returns true if the contents of the given array or map can't change, that
+// is, if it is frozen or lazy.
+static bool has_fixed_contents(pton_variant_t variant) {
+  switch (variant.header_.repr_tag_) {
+    case header_t::PTON_REPR_LAZY_ARRAY:
+    case header_t::PTON_REPR_LAZY_MAP:
+      return true;
+    default:
+      return pton_is_frozen(variant);
+  }
+}
+
+// Hashes the given value. If structural, arrays and maps whose contents can't
+// change are hashed by their contents up to the given depth, otherwise by
+// identity.
+static uint64_t variant_hash(pton_variant_t variant, uint64_t seed,
+    bool is_structural, size_t depth) {
+  pton_type_t type = pton_type(variant);
+  uint64_t result = hash_mix(seed ^ type);
+  switch (type) {
+    case PTON_INTEGER:
+      return hash_mix(result ^ static_cast<uint64_t>(pton_int64_value(variant)));
+    case PTON_FLOAT: {
+      // Values that are equal must hash the same so 0.0 and -0.0 are hashed
+      // alike, as are all NaNs.
+      double value = pton_float64_value(variant);
+      uint64_t bits = 0;
+      if (value != value) {
+        bits = ~static_cast<uint64_t>(0);
+      } else if (value != 0) {
+        memcpy(&bits, &value, sizeof(bits));
+      }
+      return hash_mix(result ^ bits);
+    }
+    case PTON_STRING:
+      return hash_bytes(pton_string_chars(variant),
+          pton_string_length(variant), result);
+    case PTON_BLOB:
+      return hash_bytes(pton_blob_data(variant), pton_blob_size(variant),
+          result);
+    case PTON_BOOL:
+      return hash_mix(result ^ variant.header_.repr_tag_);
+    case PTON_ID:
+      return hash_mix(result ^ variant.payload_.as_inline_id_
+          ^ (static_cast<uint64_t>(variant.header_.length_) << 56));
+    case PTON_ARRAY: {
+      if (!is_structural || !has_fixed_contents(variant))
+        break;
+      if (depth >= kMaxHashDepth)
+        return result;
+      uint32_t length = pton_array_length(variant);
+      for (uint32_t i = 0; i < length; i++)
+        result = variant_hash(pton_array_get(variant, i), result, true,
+            depth + 1);
+      return hash_mix(result ^ length);
+    }
+    case PTON_MAP: {
+      if (!is_structural || !has_fixed_contents(variant))
+        break;
+      if (depth >= kMaxHashDepth)
+        return result;
+      pton_arena_map_t *data = get_map_data(variant);
+      for (uint32_t i = 0; i < data->size(); i++) {
+        pton_arena_map_t::entry_t *entry = &data->elms()[i];
+        result = variant_hash(entry->key.to_c(), result, true, depth + 1);
+        result = variant_hash(entry->value.to_c(), result, true, depth + 1);
+      }
+      return hash_mix(result ^ data->size());
+    }
+    case PTON_NULL:
+      return result;
+    default:
+      break;
+  }
+  // Everything else, including arrays and maps, is identical only to itself
+  // so we hash the address. That way the hash doesn't change when the value
+  // is modified or frozen.
+  return hash_mix(result
+      ^ reinterpret_cast<uintptr_t>(variant.payload_.as_arena_value_));
+}
+
+uint64_t pton_variant_hash(pton_variant_t variant, uint64_t seed) {
+  pton_check_binary_version(variant);
+  return variant_hash(variant, seed, false, 0);
+}
+
+uint64_t pton_variant_structural_hash(pton_variant_t variant, uint64_t seed) {
+  pton_check_binary_version(variant);
+  return variant_hash(variant, seed, true, 0);
+}
+
+uint64_t Variant::hash(uint64_t seed) const {
+  return pton_variant_hash(value_, seed);
+}
+
+uint64_t Variant::structural_hash(uint64_t seed) const {
+  return pton_variant_structural_hash(value_, seed);
+}
+
+bool Variant::Hasher::operator()(const Variant &a, const Variant &b) const {
+  // Any order will do as long as values are equivalent exactly when they're
+  // identical.
+  uint64_t a_hash = a.hash();
+  uint64_t b_hash = b.hash();
+  if (a_hash != b_hash)
+    return a_hash < b_hash;
+  pton_type_t type = a.type();
+  if (type != b.type())
+    return type < b.type();
+  switch (type) {
+    case PTON_INTEGER:
+      return a.integer_value() < b.integer_value();
+    case PTON_FLOAT: {
+      // NaNs are equivalent to each other and come before everything else.
+      double a_value = a.float64_value();
+      double b_value = b.float64_value();
+      if (a_value != a_value)
+        return b_value == b_value;
+      return a_value < b_value;
+    }
+    case PTON_STRING:
+    case PTON_BLOB: {
+      const void *a_data = (type == PTON_STRING)
+          ? static_cast<const void*>(a.string_chars())
+          : a.blob_data();
+      const void *b_data = (type == PTON_STRING)
+          ? static_cast<const void*>(b.string_chars())
+          : b.blob_data();
+      uint32_t a_size = (type == PTON_STRING) ? a.string_length() : a.blob_size();
+      uint32_t b_size = (type == PTON_STRING) ? b.string_length() : b.blob_size();
+      if (a_size != b_size)
+        return a_size < b_size;
+      return memcmp(a_data, b_data, a_size) < 0;
+    }
+    default: {
+      pton_variant_t a_value = a.value_;
+      pton_variant_t b_value = b.value_;
+      if (a_value.header_.repr_tag_ != b_value.header_.repr_tag_)
+        return a_value.header_.repr_tag_ < b_value.header_.repr_tag_;
+      if (a_value.header_.length_ != b_value.header_.length_)
+        return a_value.header_.length_ < b_value.header_.length_;
+      return a_value.payload_.as_inline_id_ < b_value.payload_.as_inline_id_;
+    }
+  }
+}
+
 bool pton_is_frozen(pton_variant_t variant) {
   pton_check_binary_version(variant);
   switch (variant.header_.repr_tag_) {
     case header_t::PTON_REPR_INT64:
+    case header_t::PTON_REPR_FLOAT64:
     case header_t::PTON_REPR_NULL:
     case header_t::PTON_REPR_TRUE:
     case header_t::PTON_REPR_FALSE:
@@ -480,11 +1113,18 @@ bool pton_is_frozen(pton_variant_t variant) {
     case header_t::PTON_REPR_INLN_ID:
       return true;
     case header_t::PTON_REPR_ARNA_ARRAY:
+    case header_t::PTON_REPR_ARNA_INT64_ARRAY:
+    case header_t::PTON_REPR_ARNA_FLOAT64_ARRAY:
     case header_t::PTON_REPR_ARNA_MAP:
     case header_t::PTON_REPR_ARNA_STRING:
     case header_t::PTON_REPR_ARNA_BLOB:
     case header_t::PTON_REPR_ARNA_SEED:
       return variant.payload_.as_arena_value_->is_frozen();
+    case header_t::PTON_REPR_LAZY_ARRAY:
+    case header_t::PTON_REPR_LAZY_MAP:
+    case header_t::PTON_REPR_LAZY_SEED:
+      // Lazy values can't be modified but reading them decodes into their
+      // backing so they can't be read concurrently like frozen values can.
     default:
       return false;
   }
@@ -498,6 +1138,8 @@ void pton_ensure_frozen(pton_variant_t variant) {
   pton_check_binary_version(variant);
   switch (variant.header_.repr_tag_) {
     case header_t::PTON_REPR_ARNA_ARRAY:
+    case header_t::PTON_REPR_ARNA_INT64_ARRAY:
+    case header_t::PTON_REPR_ARNA_FLOAT64_ARRAY:
     case header_t::PTON_REPR_ARNA_MAP:
     case header_t::PTON_REPR_ARNA_STRING:
     case header_t::PTON_REPR_ARNA_BLOB:
@@ -528,14 +1170,23 @@ bool pton_array_add(pton_variant_t array, pton_variant_t value) {
 bool Variant::array_add(Variant value) {
   pton_check_binary_version(value_);
   pton_check_binary_version(value.value_);
-  if (!is_array())
-    return false;
-  return value_.payload_.as_arena_array_->add(value);
+  switch (repr_tag()) {
+    case header_t::PTON_REPR_ARNA_ARRAY:
+      return value_.payload_.as_arena_array_->add(value);
+    case header_t::PTON_REPR_ARNA_INT64_ARRAY:
+      return value.is_integer()
+          && value_.payload_.as_arena_int64_array_->add(value.integer_value());
+    case header_t::PTON_REPR_ARNA_FLOAT64_ARRAY:
+      return value.is_float()
+          && value_.payload_.as_arena_float64_array_->add(value.float64_value());
+    default:
+      return false;
+  }
 }
 
 pton_sink_t *pton_array_add_sink(pton_variant_t array) {
   pton_check_binary_version(array);
-  if (!pton_is_array(array))
+  if (array.header_.repr_tag_ != header_t::PTON_REPR_ARNA_ARRAY)
     return NULL;
   return array.payload_.as_arena_array_->add_sink();
 }
@@ -554,7 +1205,18 @@ uint32_t pton_array_length(pton_variant_t variant) {
 
 uint32_t Variant::array_length() const {
   pton_check_binary_version(value_);
-  return is_array() ? value_.payload_.as_arena_array_->length_ : 0;
+  switch (repr_tag()) {
+    case header_t::PTON_REPR_ARNA_ARRAY:
+      return value_.payload_.as_arena_array_->length_;
+    case header_t::PTON_REPR_ARNA_INT64_ARRAY:
+      return value_.payload_.as_arena_int64_array_->length_;
+    case header_t::PTON_REPR_ARNA_FLOAT64_ARRAY:
+      return value_.payload_.as_arena_float64_array_->length_;
+    case header_t::PTON_REPR_LAZY_ARRAY:
+      return value_.payload_.as_lazy_value_->unit_count();
+    default:
+      return 0;
+  }
 }
 
 pton_variant_t pton_array_get(pton_variant_t variant, uint32_t index) {
@@ -563,10 +1225,125 @@ pton_variant_t pton_array_get(pton_variant_t variant, uint32_t index) {
 
 Variant Variant::array_get(uint32_t index) const {
   pton_check_binary_version(value_);
-  if (!is_array())
-    return null();
-  pton_arena_array_t *data = value_.payload_.as_arena_array_;
-  return (index < data->length_) ? data->elms_[index] : null();
+  switch (repr_tag()) {
+    case header_t::PTON_REPR_ARNA_ARRAY: {
+      pton_arena_array_t *data = value_.payload_.as_arena_array_;
+      return (index < data->length_) ? data->elms_[index] : null();
+    }
+    case header_t::PTON_REPR_ARNA_INT64_ARRAY: {
+      pton_arena_int64_array_t *data = value_.payload_.as_arena_int64_array_;
+      return (index < data->length_) ? integer(data->elms_[index]) : null();
+    }
+    case header_t::PTON_REPR_ARNA_FLOAT64_ARRAY: {
+      pton_arena_float64_array_t *data = value_.payload_.as_arena_float64_array_;
+      return (index < data->length_) ? float64(data->elms_[index]) : null();
+    }
+    case header_t::PTON_REPR_LAZY_ARRAY:
+      return value_.payload_.as_lazy_value_->get(index);
+    default:
+      return null();
+  }
+}
+
+bool pton_array_int64_span(pton_variant_t variant, const int64_t **elms_out,
+    uint32_t *length_out) {
+  return Variant(variant).array_int64_span(elms_out, length_out);
+}
+
+bool Variant::array_int64_span(const int64_t **elms_out,
+    uint32_t *length_out) const {
+  pton_check_binary_version(value_);
+  if (repr_tag() != header_t::PTON_REPR_ARNA_INT64_ARRAY)
+    return false;
+  pton_arena_int64_array_t *data = value_.payload_.as_arena_int64_array_;
+  *elms_out = data->elms_;
+  *length_out = data->length_;
+  return true;
+}
+
+pton_arena_int64_array_t::pton_arena_int64_array_t(Arena *origin,
+    uint32_t init_capacity)
+  : origin_(origin)
+  , length_(0)
+  , capacity_(0)
+  , elms_(NULL) {
+  if (init_capacity < kDefaultInitCapacity)
+    init_capacity = kDefaultInitCapacity;
+  capacity_ = init_capacity;
+  elms_ = origin->alloc_growable_values<int64_t>(capacity_);
+}
+
+bool pton_arena_int64_array_t::add(int64_t value) {
+  if (is_frozen())
+    return false;
+  if (length_ == capacity_) {
+    elms_ = origin_->grow_values<int64_t>(elms_, capacity_, 2 * capacity_);
+    capacity_ *= 2;
+  }
+  elms_[length_++] = value;
+  return true;
+}
+
+bool pton_array_float64_span(pton_variant_t variant, const double **elms_out,
+    uint32_t *length_out) {
+  return Variant(variant).array_float64_span(elms_out, length_out);
+}
+
+bool Variant::array_float64_span(const double **elms_out,
+    uint32_t *length_out) const {
+  pton_check_binary_version(value_);
+  if (repr_tag() != header_t::PTON_REPR_ARNA_FLOAT64_ARRAY)
+    return false;
+  pton_arena_float64_array_t *data = value_.payload_.as_arena_float64_array_;
+  *elms_out = data->elms_;
+  *length_out = data->length_;
+  return true;
+}
+
+pton_arena_float64_array_t::pton_arena_float64_array_t(Arena *origin,
+    uint32_t init_capacity)
+  : origin_(origin)
+  , length_(0)
+  , capacity_(0)
+  , elms_(NULL) {
+  if (init_capacity < kDefaultInitCapacity)
+    init_capacity = kDefaultInitCapacity;
+  capacity_ = init_capacity;
+  elms_ = origin->alloc_growable_values<double>(capacity_);
+}
+
+bool pton_arena_float64_array_t::add(double value) {
+  if (is_frozen())
+    return false;
+  if (length_ == capacity_) {
+    elms_ = origin_->grow_values<double>(elms_, capacity_, 2 * capacity_);
+    capacity_ *= 2;
+  }
+  elms_[length_++] = value;
+  return true;
+}
+
+Variant BinaryImplUtils::unpack_int64_array(Factory *factory,
+    const pton_instr_t *instr) {
+  uint32_t count = instr->payload.int64_array_data.count;
+  Array result = factory->new_int64_array(count);
+  pton_arena_int64_array_t *data = result.to_c().payload_.as_arena_int64_array_;
+  if (!pton_instr_unpack_int64_array(instr, data->elms_))
+    return Variant::null();
+  data->length_ = count;
+  result.ensure_frozen();
+  return result;
+}
+
+Variant BinaryImplUtils::unpack_float64_array(Factory *factory,
+    const pton_instr_t *instr) {
+  uint32_t count = instr->payload.float64_array_data.count;
+  Array result = factory->new_float64_array(count);
+  pton_arena_float64_array_t *data = result.to_c().payload_.as_arena_float64_array_;
+  pton_instr_unpack_float64_array(instr, data->elms_);
+  data->length_ = count;
+  result.ensure_frozen();
+  return result;
 }
 
 pton_arena_array_t::pton_arena_array_t(Arena *origin, uint32_t init_capacity)
@@ -577,17 +1354,15 @@ pton_arena_array_t::pton_arena_array_t(Arena *origin, uint32_t init_capacity)
   if (init_capacity < kDefaultInitCapacity)
     init_capacity = kDefaultInitCapacity;
   capacity_ = init_capacity;
-  elms_ = origin->alloc_values<Variant>(capacity_);
+  elms_ = origin->alloc_growable_values<Variant>(capacity_);
 }
 
 bool pton_arena_array_t::add(Variant value) {
   if (is_frozen())
     return false;
   if (length_ == capacity_) {
+    elms_ = origin_->grow_values<Variant>(elms_, capacity_, 2 * capacity_);
     capacity_ *= 2;
-    Variant *new_elms = origin_->alloc_values<Variant>(capacity_);
-    memcpy(new_elms, elms_, sizeof(Variant) * length_);
-    elms_ = new_elms;
   }
   elms_[length_++] = value;
   return true;
@@ -633,7 +1408,14 @@ pton_arena_native_t::pton_arena_native_t(AbstractSeedType *type, void *object)
 
 uint32_t pton_map_size(pton_variant_t variant) {
   pton_check_binary_version(variant);
-  return pton_is_map(variant) ? variant.payload_.as_arena_map_->size() : 0;
+  switch (variant.header_.repr_tag_) {
+    case header_t::PTON_REPR_ARNA_MAP:
+      return variant.payload_.as_arena_map_->size();
+    case header_t::PTON_REPR_LAZY_MAP:
+      return variant.payload_.as_lazy_value_->unit_count();
+    default:
+      return 0;
+  }
 }
 
 AbstractSeedType *Variant::native_type() const {
@@ -668,7 +1450,8 @@ bool pton_map_set(pton_variant_t map, pton_variant_t key, pton_variant_t value)
   pton_check_binary_version(map);
   pton_check_binary_version(key);
   pton_check_binary_version(value);
-  return pton_is_map(map) && map.payload_.as_arena_map_->set(key, value);
+  return (map.header_.repr_tag_ == header_t::PTON_REPR_ARNA_MAP)
+      && map.payload_.as_arena_map_->set(key, value);
 }
 
 bool Variant::map_set(Variant key, Variant value) {
@@ -679,9 +1462,17 @@ pton_variant_t pton_map_get_with_default(pton_variant_t variant,
     pton_variant_t key, pton_variant_t defawlt) {
   pton_check_binary_version(variant);
   pton_check_binary_version(key);
-  return pton_is_map(variant)
-      ? variant.payload_.as_arena_map_->get(key, defawlt).to_c()
-      : defawlt;
+  switch (variant.header_.repr_tag_) {
+    case header_t::PTON_REPR_ARNA_MAP:
+      return variant.payload_.as_arena_map_->get(key, defawlt).to_c();
+    case header_t::PTON_REPR_LAZY_MAP: {
+      Variant result = defawlt;
+      variant.payload_.as_lazy_value_->find(key, &result);
+      return result.to_c();
+    }
+    default:
+      return defawlt;
+  }
 }
 
 pton_variant_t pton_map_get(pton_variant_t variant, pton_variant_t key) {
@@ -691,13 +1482,21 @@ pton_variant_t pton_map_get(pton_variant_t variant, pton_variant_t key) {
 bool pton_map_has(pton_variant_t variant, pton_variant_t key) {
   pton_check_binary_version(variant);
   pton_check_binary_version(key);
-  return pton_is_map(variant) && variant.payload_.as_arena_map_->has(key);
+  switch (variant.header_.repr_tag_) {
+    case header_t::PTON_REPR_ARNA_MAP:
+      return variant.payload_.as_arena_map_->has(key);
+    case header_t::PTON_REPR_LAZY_MAP:
+      return variant.payload_.as_lazy_value_->find(key, NULL);
+    default:
+      return false;
+  }
 }
 
 bool pton_map_set_sinks(pton_variant_t map, pton_sink_t **key_out,
     pton_sink_t **value_out) {
   pton_check_binary_version(map);
-  return pton_is_map(map) && map.payload_.as_arena_map_->set(key_out, value_out);
+  return (map.header_.repr_tag_ == header_t::PTON_REPR_ARNA_MAP)
+      && map.payload_.as_arena_map_->set(key_out, value_out);
 }
 
 bool Variant::map_set(Sink *key_out, Sink *value_out) {
@@ -716,7 +1515,7 @@ Variant Variant::map_get(Variant key, Variant defawlt) const {
   return pton_map_get_with_default(value_, key.value_, defawlt.value_);
 }
 
-Variant Variant::map_has(Variant key) const {
+bool Variant::map_has(Variant key) const {
   return pton_map_has(value_, key.value_);
 }
 
@@ -740,7 +1539,15 @@ uint32_t pton_id_size(pton_variant_t variant) {
 
 Variant Variant::seed_header() const {
   pton_check_binary_version(value_);
-  return is_seed() ? value_.payload_.as_arena_seed_->header_ : null();
+  switch (repr_tag()) {
+    case header_t::PTON_REPR_ARNA_SEED:
+      return value_.payload_.as_arena_seed_->header_;
+    case header_t::PTON_REPR_LAZY_SEED:
+      value_.payload_.as_lazy_value_->decode_until(1);
+      return value_.payload_.as_lazy_value_->backing().seed_header();
+    default:
+      return null();
+  }
 }
 
 pton_variant_t pton_seed_get_header(pton_variant_t value) {
@@ -750,7 +1557,7 @@ pton_variant_t pton_seed_get_header(pton_variant_t value) {
 bool Variant::seed_set_header(Variant value) {
   pton_check_binary_version(value_);
   pton_check_binary_version(value.value_);
-  if (is_seed() && !is_frozen()) {
+  if (repr_tag() == header_t::PTON_REPR_ARNA_SEED && !is_frozen()) {
     value_.payload_.as_arena_seed_->header_ = value;
     return true;
   } else {
@@ -766,7 +1573,7 @@ bool Variant::seed_set_field(Variant key, Variant value) {
   pton_check_binary_version(value_);
   pton_check_binary_version(key.value_);
   pton_check_binary_version(value.value_);
-  return is_seed()
+  return (repr_tag() == header_t::PTON_REPR_ARNA_SEED)
       ? value_.payload_.as_arena_seed_->fields_.set(key, value)
       : false;
 }
@@ -774,30 +1581,56 @@ bool Variant::seed_set_field(Variant key, Variant value) {
 Variant Variant::seed_get_field(Variant key) {
   pton_check_binary_version(value_);
   pton_check_binary_version(key.value_);
-  return is_seed()
-      ? value_.payload_.as_arena_seed_->fields_[key]
-      : null();
+  switch (repr_tag()) {
+    case header_t::PTON_REPR_ARNA_SEED:
+      return value_.payload_.as_arena_seed_->fields_[key];
+    case header_t::PTON_REPR_LAZY_SEED: {
+      Variant result;
+      value_.payload_.as_lazy_value_->find(key, &result);
+      return result;
+    }
+    default:
+      return null();
+  }
 }
 
 uint32_t Variant::seed_field_count() {
   pton_check_binary_version(value_);
-  return is_seed()
-      ? value_.payload_.as_arena_seed_->fields_.size()
-      : 0;
-}
-
+  switch (repr_tag()) {
+    case header_t::PTON_REPR_ARNA_SEED:
+      return value_.payload_.as_arena_seed_->fields_.size();
+    case header_t::PTON_REPR_LAZY_SEED:
+      // The first unit is the headers.
+      return value_.payload_.as_lazy_value_->unit_count() - 1;
+    default:
+      return 0;
+  }
+}
+
 Map_Iterator Variant::seed_fields_begin() {
   pton_check_binary_version(value_);
-  return is_seed()
-      ? value_.payload_.as_arena_seed_->fields_.begin()
-      : Map_Iterator();
+  switch (repr_tag()) {
+    case header_t::PTON_REPR_ARNA_SEED:
+      return value_.payload_.as_arena_seed_->fields_.begin();
+    case header_t::PTON_REPR_LAZY_SEED:
+      value_.payload_.as_lazy_value_->decode_all();
+      return value_.payload_.as_lazy_value_->backing().seed_fields_begin();
+    default:
+      return Map_Iterator();
+  }
 }
 
 Map_Iterator Variant::seed_fields_end() {
   pton_check_binary_version(value_);
-  return is_seed()
-      ? value_.payload_.as_arena_seed_->fields_.end()
-      : Map_Iterator();
+  switch (repr_tag()) {
+    case header_t::PTON_REPR_ARNA_SEED:
+      return value_.payload_.as_arena_seed_->fields_.end();
+    case header_t::PTON_REPR_LAZY_SEED:
+      value_.payload_.as_lazy_value_->decode_all();
+      return value_.payload_.as_lazy_value_->backing().seed_fields_end();
+    default:
+      return Map_Iterator();
+  }
 }
 
 uint32_t Variant::id_size() const {
@@ -811,13 +1644,14 @@ Map_Iterator Variant::map_begin() const {
 void pton_map_iter_init(pton_map_iter_t *iter, pton_variant_t variant) {
   pton_check_binary_version(variant);
   iter->cursor = 0;
-  iter->data = pton_is_map(variant) ? variant.payload_.as_arena_map_ : NULL;
+  iter->data = get_map_data(variant);
 }
 
 Map_Iterator Variant::map_end() const {
-  return is_map()
-      ? Map_Iterator(payload()->as_arena_map_, payload()->as_arena_map_->size())
-      : Map_Iterator(NULL, 0);
+  pton_arena_map_t *data = get_map_data(value_);
+  return (data == NULL)
+      ? Map_Iterator(NULL, 0)
+      : Map_Iterator(data, data->size());
 }
 
 Map_Iterator::Map_Iterator(pton_arena_map_t *data, uint32_t cursor)
@@ -870,20 +1704,123 @@ pton_arena_map_t::pton_arena_map_t(Arena *origin)
   : origin_(origin)
   , size_(0)
   , capacity_(0)
-  , elms_(NULL) { }
+  , elms_(NULL)
+  , index_(NULL)
+  , index_capacity_(0) { }
+
+int64_t pton_arena_map_t::find(Variant key) const {
+  if (index_ == NULL) {
+    // The map is small so searching it linearly is cheap.
+    for (uint32_t i = 0; i < size_; i++) {
+      if (elms_[i].key == key)
+        return i;
+    }
+    return -1;
+  }
+  uint32_t mask = index_capacity_ - 1;
+  for (uint64_t slot = key.hash() & mask;; slot = (slot + 1) & mask) {
+    uint32_t entry = index_[slot];
+    if (entry == 0)
+      return -1;
+    if (elms_[entry - 1].key == key)
+      return entry - 1;
+  }
+}
+
+void pton_arena_map_t::index_entry(uint32_t index) {
+  uint32_t mask = index_capacity_ - 1;
+  Variant key = elms_[index].key;
+  for (uint64_t slot = key.hash() & mask;; slot = (slot + 1) & mask) {
+    uint32_t entry = index_[slot];
+    if (entry == 0) {
+      index_[slot] = index + 1;
+      return;
+    }
+    if (elms_[entry - 1].key == key) {
+      if (entry - 1 > index)
+        index_[slot] = index + 1;
+      return;
+    }
+  }
+}
+
+void pton_arena_map_t::unindex_entry(uint32_t index, Variant key) {
+  uint32_t mask = index_capacity_ - 1;
+  uint64_t hole = key.hash() & mask;
+  while (index_[hole] != index + 1) {
+    if (index_[hole] == 0)
+      // Another entry with the same key comes first so this one wasn't in
+      // the index.
+      return;
+    hole = (hole + 1) & mask;
+  }
+  // Shift the rest of the probe sequence back so it doesn't have a gap in it
+  // that would cut lookups short.
+  for (uint64_t slot = (hole + 1) & mask; index_[slot] != 0;
+       slot = (slot + 1) & mask) {
+    uint64_t home = elms_[index_[slot] - 1].key.hash() & mask;
+    bool can_move = (hole <= slot)
+        ? (home <= hole || home > slot)
+        : (home <= hole && home > slot);
+    if (can_move) {
+      index_[hole] = index_[slot];
+      hole = slot;
+    }
+  }
+  index_[hole] = 0;
+  for (uint32_t i = index + 1; i < size_; i++) {
+    if (elms_[i].key == key) {
+      index_entry(i);
+      return;
+    }
+  }
+}
+
+void pton_arena_map_t::build_index(uint32_t min_capacity) {
+  // Keep the index at most half full so probe sequences stay short.
+  uint32_t capacity = 16;
+  while (capacity < 2 * min_capacity)
+    capacity *= 2;
+  if (index_ != NULL)
+    origin_->free_values<uint32_t>(index_, index_capacity_);
+  index_ = origin_->alloc_growable_values<uint32_t>(capacity);
+  index_capacity_ = capacity;
+  memset(index_, 0, capacity * sizeof(uint32_t));
+  for (uint32_t i = 0; i < size_; i++)
+    index_entry(i);
+}
+
+void pton_arena_map_t::set_key(uint32_t index, Variant key) {
+  Variant old_key = elms_[index].key;
+  if (index_ != NULL)
+    unindex_entry(index, old_key);
+  elms_[index].key = key;
+  if (index_ != NULL)
+    index_entry(index);
+}
 
 bool pton_arena_map_t::set(Variant key, Variant value) {
   if (is_frozen())
     return false;
   if (size_ == capacity_) {
-    capacity_ = (capacity_ < 4 ? 4 : (2 * capacity_));
-    entry_t *new_elms = origin_->alloc_values<entry_t>(capacity_);
-    memcpy(new_elms, elms_, sizeof(entry_t) * size_);
-    elms_ = new_elms;
+    if (elms_ == NULL) {
+      capacity_ = 4;
+      elms_ = origin_->alloc_growable_values<entry_t>(capacity_);
+    } else {
+      elms_ = origin_->grow_values<entry_t>(elms_, capacity_, 2 * capacity_);
+      capacity_ *= 2;
+    }
   }
-  entry_t *entry = &elms_[size_++];
+  uint32_t index = size_++;
+  entry_t *entry = &elms_[index];
   entry->key = key;
   entry->value = value;
+  if (2 * size_ > index_capacity_) {
+    if (size_ >= kIndexThreshold)
+      build_index(size_);
+  } else {
+    index_entry(index);
+  }
   return true;
 }
 
@@ -913,7 +1850,7 @@ public:
 bool MapKeySink::set_destination(Variant value) {
   if (map_->is_frozen())
     return false;
-  map_->elms_[index_].key = value;
+  map_->set_key(static_cast<uint32_t>(index_), value);
   return true;
 }
 
@@ -944,25 +1881,408 @@ bool pton_arena_map_t::set(pton_sink_t **key_out, pton_sink_t **value_out) {
 }
 
 Variant pton_arena_map_t::get(Variant key, Variant defawlt) const {
-  for (size_t i = 0; i < size_; i++) {
-    entry_t *entry = &elms_[i];
-    if (entry->key == key)
-      return entry->value;
-  }
-  return defawlt;
+  int64_t index = find(key);
+  return (index < 0) ? defawlt : elms_[index].value;
 }
 
 bool pton_arena_map_t::has(Variant key) const {
-  for (size_t i = 0; i < size_; i++) {
-    entry_t *entry = &elms_[i];
-    if (entry->key == key)
+  return find(key) >= 0;
+}
+
+pton_arena_seed_t::pton_arena_seed_t(Arena *origin) {
+  fields_ = origin->new_map();
+}
+
+LazyInput::LazyInput(const uint8_t *code, size_t size, Factory *factory,
+    bool borrow_strings, bool borrow_blobs, StringTable *string_table)
+  : code_(code)
+  , size_(size)
+  , factory_(factory)
+  , borrow_strings_(borrow_strings)
+  , borrow_blobs_(borrow_blobs)
+  , string_table_(string_table)
+  , scanned_to_(0) { }
+
+// Returns the offset just past the value that starts at the given offset, or
+// 0 if it is invalid.
+static size_t skip_encoded_value(const uint8_t *code, size_t size,
+    size_t offset) {
+  pton_cursor_t cursor;
+  pton_cursor_init(&cursor, code + offset, size - offset);
+  return pton_cursor_skip_value(&cursor)
+      ? offset + pton_cursor_offset(&cursor)
+      : 0;
+}
+
+// Returns a variant with the given lazy representation.
+static Variant new_lazy_variant(header_t::pton_variant_repr_tag_t tag,
+    pton_lazy_value_t *data) {
+  pton_variant_t result = VARIANT_INIT(tag, 0);
+  result.payload_.as_lazy_value_ = data;
+  return result;
+}
+
+bool LazyInput::decode(size_t offset, Variant *result_out, size_t *end_out) {
+  pton_instr_t instr;
+  if (!pton_decode_next_instruction(code_ + offset, size_ - offset, &instr))
+    return false;
+  *end_out = offset + instr.size;
+  switch (instr.opcode) {
+    case PTON_OPCODE_INT64:
+      *result_out = Variant::integer(instr.payload.int64_value);
+      return true;
+    case PTON_OPCODE_FLOAT64:
+      *result_out = Variant::float64(instr.payload.float64_value);
+      return true;
+    case PTON_OPCODE_ID64:
+      *result_out = Variant::id(instr.payload.id64.size,
+          instr.payload.id64.value);
+      return true;
+    case PTON_OPCODE_NULL:
+      *result_out = Variant::null();
+      return true;
+    case PTON_OPCODE_BOOL:
+      *result_out = Variant::boolean(instr.payload.bool_value);
+      return true;
+    case PTON_OPCODE_DEFAULT_STRING: {
+      const char *chars = reinterpret_cast<const char*>(
+          instr.payload.default_string_data.contents);
+      uint32_t length = instr.payload.default_string_data.length;
+      *result_out = borrow_strings_
+          ? Variant::string(chars, length)
+          : factory_->new_interned_string(chars, length);
+      return true;
+    }
+    case PTON_OPCODE_STRING_WITH_ENCODING: {
+      uint32_t length = instr.payload.string_with_encoding_data.length;
+      String result = factory_->new_string(length,
+          instr.payload.string_with_encoding_data.encoding);
+      memcpy(result.mutable_chars(),
+          instr.payload.string_with_encoding_data.contents, length);
+      result.ensure_frozen();
+      *result_out = result;
+      return true;
+    }
+    case PTON_OPCODE_BLOB: {
+      const uint8_t *data = instr.payload.blob_data.contents;
+      uint32_t size = instr.payload.blob_data.length;
+      *result_out = borrow_blobs_
+          ? Variant::blob(data, size)
+          : factory_->new_blob(data, size);
+      return true;
+    }
+    case PTON_OPCODE_REFERENCE:
+      return resolve_reference(offset, instr.payload.reference_offset,
+          result_out);
+    case PTON_OPCODE_TABLE_STRING: {
+      uint32_t index = instr.payload.table_string_index;
+      if (string_table_ == NULL || index >= string_table_->size())
+        return false;
+      *result_out = string_table_->get_copy(index, factory_);
       return true;
+    }
+    case PTON_OPCODE_INT64_ARRAY:
+      // Packed arrays are cheap enough to unpack that there's no point in
+      // doing it lazily.
+      *result_out = BinaryImplUtils::unpack_int64_array(factory_, &instr);
+      return !result_out->is_null();
+    case PTON_OPCODE_FLOAT64_ARRAY:
+      *result_out = BinaryImplUtils::unpack_float64_array(factory_, &instr);
+      return true;
+    case PTON_OPCODE_BEGIN_ARRAY:
+    case PTON_OPCODE_BEGIN_MAP:
+    case PTON_OPCODE_BEGIN_SEED:
+    case PTON_OPCODE_BEGIN_INDEXED_ARRAY:
+    case PTON_OPCODE_BEGIN_INDEXED_MAP:
+    case PTON_OPCODE_BEGIN_COLUMNS:
+      break;
+  }
+  // Arrays, maps, and seeds are skipped rather than decoded. The skipping
+  // happens here rather than when the next value is needed since lazy values
+  // only ever need the end of a value to find the next one.
+  *end_out = skip_encoded_value(code_, size_, offset);
+  if (*end_out == 0)
+    return false;
+  if (instr.opcode == PTON_OPCODE_BEGIN_SEED)
+    return get_seed(offset, &instr, result_out);
+  if (instr.opcode == PTON_OPCODE_BEGIN_COLUMNS)
+    return get_columns(offset, &instr, result_out);
+  if (instr.opcode == PTON_OPCODE_BEGIN_ARRAY) {
+    uint32_t length = instr.payload.array_length;
+    pton_lazy_value_t *data = new (factory_) pton_lazy_value_t(this,
+        offset + instr.size, length, 0, factory_->new_array(length));
+    *result_out = new_lazy_variant(header_t::PTON_REPR_LAZY_ARRAY, data);
+  } else if (instr.opcode == PTON_OPCODE_BEGIN_INDEXED_ARRAY) {
+    uint32_t length = instr.payload.indexed_data.count;
+    Array backing = factory_->new_array(length);
+    for (uint32_t i = 0; i < length; i++)
+      backing.add(Variant::null());
+    pton_lazy_value_t *data = new (factory_) pton_lazy_value_t(this,
+        offset + instr.size, length, 0, backing);
+    data->set_index(&instr);
+    *result_out = new_lazy_variant(header_t::PTON_REPR_LAZY_ARRAY, data);
+  } else if (instr.opcode == PTON_OPCODE_BEGIN_INDEXED_MAP) {
+    // Lookups still have to compare keys in order so an indexed map is viewed
+    // the same way as a plain one; the index only makes skipping it cheap.
+    pton_lazy_value_t *data = new (factory_) pton_lazy_value_t(this,
+        offset + instr.size, instr.payload.indexed_data.count, 0,
+        factory_->new_map());
+    *result_out = new_lazy_variant(header_t::PTON_REPR_LAZY_MAP, data);
+  } else {
+    pton_lazy_value_t *data = new (factory_) pton_lazy_value_t(this,
+        offset + instr.size, instr.payload.map_size, 0, factory_->new_map());
+    *result_out = new_lazy_variant(header_t::PTON_REPR_LAZY_MAP, data);
+  }
+  return true;
+}
+
+bool LazyInput::get_seed(size_t offset, pton_instr_t *instr,
+    Variant *result_out) {
+  SeedMap::iterator existing = seeds_.find(code_ + offset);
+  if (existing != seeds_.end()) {
+    *result_out = existing->second;
+    return true;
+  }
+  pton_lazy_value_t *data = new (factory_) pton_lazy_value_t(this,
+      offset + instr->size, instr->payload.seed_data.fieldc + 1,
+      instr->payload.seed_data.headerc, factory_->new_seed());
+  Variant result = new_lazy_variant(header_t::PTON_REPR_LAZY_SEED, data);
+  seeds_[code_ + offset] = result;
+  *result_out = result;
+  return true;
+}
+
+bool LazyInput::get_columns(size_t offset, pton_instr_t *instr,
+    Variant *result_out) {
+  SeedMap::iterator existing = seeds_.find(code_ + offset);
+  if (existing != seeds_.end()) {
+    *result_out = existing->second;
+    return true;
+  }
+  uint32_t rows = instr->payload.columns_data.rows;
+  uint32_t headerc = instr->payload.columns_data.headerc;
+  uint32_t keyc = instr->payload.columns_data.keyc;
+  // Every value takes up at least one byte so if the rest of the input can't
+  // hold a value for each key of each row it's invalid, and there's no reason
+  // to create the rows it claims.
+  size_t cursor = offset + instr->size;
+  if (static_cast<uint64_t>(rows) * keyc > size_ - cursor)
+    return false;
+  Array result = factory_->new_array(rows);
+  for (uint32_t i = 0; i < rows; i++)
+    result.add((headerc == 0) ? Variant(factory_->new_map()) : factory_->new_seed());
+  // The rows are registered before anything within them is decoded such that
+  // references back to them resolve.
+  seeds_[code_ + offset] = result;
+  for (uint32_t i = 0; i < headerc; i++) {
+    Variant header;
+    if (!decode(cursor, &header, &cursor))
+      return false;
+    if (i > 0)
+      continue;
+    // We set the header to the first, most specific, one.
+    for (uint32_t j = 0; j < rows; j++)
+      result[j].seed_set_header(header);
+  }
+  std::vector<Variant> keys;
+  for (uint32_t i = 0; i < keyc; i++) {
+    Variant key;
+    if (!decode(cursor, &key, &cursor))
+      return false;
+    keys.push_back(key);
+  }
+  for (uint32_t i = 0; i < keyc; i++) {
+    for (uint32_t j = 0; j < rows; j++) {
+      Variant value;
+      if (!decode(cursor, &value, &cursor))
+        return false;
+      if (headerc == 0) {
+        result[j].map_set(keys[i], value);
+      } else {
+        result[j].seed_set_field(keys[i], value);
+      }
+    }
+  }
+  for (uint32_t i = 0; i < rows; i++)
+    result[i].ensure_frozen();
+  result.ensure_frozen();
+  *result_out = result;
+  return true;
+}
+
+bool LazyInput::resolve_reference(size_t offset, uint64_t distance,
+    Variant *result_out) {
+  // The seeds are numbered in the order they occur in the input so the seeds
+  // that can be referenced from here are the ones that begin before this
+  // offset. We scan for them once and remember where they are.
+  pton_instr_t instr;
+  while (scanned_to_ < offset) {
+    if (!pton_decode_next_instruction(code_ + scanned_to_, size_ - scanned_to_,
+            &instr))
+      return false;
+    if (instr.opcode == PTON_OPCODE_BEGIN_SEED) {
+      SeedLocation location = {scanned_to_, 0};
+      seed_offsets_.push_back(location);
+    } else if (instr.opcode == PTON_OPCODE_BEGIN_COLUMNS
+        && instr.payload.columns_data.headerc > 0) {
+      // Each row is a seed. Every row has at least one value in the input so
+      // there can't be more rows than there is input left.
+      uint32_t rows = instr.payload.columns_data.rows;
+      if (rows > size_ - scanned_to_)
+        return false;
+      for (uint32_t i = 0; i < rows; i++) {
+        SeedLocation location = {scanned_to_, i};
+        seed_offsets_.push_back(location);
+      }
+    }
+    scanned_to_ += instr.size;
+  }
+  size_t count = 0;
+  while (count < seed_offsets_.size() && seed_offsets_[count].offset < offset)
+    count++;
+  if (distance >= count)
+    return false;
+  SeedLocation target = seed_offsets_[count - distance - 1];
+  if (!pton_decode_next_instruction(code_ + target.offset,
+          size_ - target.offset, &instr))
+    return false;
+  if (instr.opcode != PTON_OPCODE_BEGIN_COLUMNS)
+    return get_seed(target.offset, &instr, result_out);
+  Variant rows;
+  if (!get_columns(target.offset, &instr, &rows))
+    return false;
+  *result_out = rows.array_get(target.row);
+  return true;
+}
+
+pton_lazy_value_t::pton_lazy_value_t(LazyInput *input, size_t offset,
+    uint32_t unit_count, uint32_t headerc, Variant backing)
+  : input_(input)
+  , next_offset_(offset)
+  , decoded_count_(0)
+  , unit_count_(unit_count)
+  , headerc_(headerc)
+  , backing_(backing)
+  , data_offset_(offset)
+  , present_(NULL) { }
+
+void pton_lazy_value_t::set_index(const pton_instr_t *instr) {
+  index_ = *instr;
+  present_ = static_cast<bool*>(input_->factory()->alloc_raw(
+      sizeof(bool) * unit_count_));
+  for (uint32_t i = 0; i < unit_count_; i++)
+    present_[i] = false;
+}
+
+Variant pton_lazy_value_t::get(uint32_t index) {
+  if (present_ == NULL) {
+    decode_until(index + 1);
+    return backing_.array_get(index);
+  }
+  if (index >= unit_count_)
+    return Variant::null();
+  pton_arena_array_t *data = backing_.to_c().payload_.as_arena_array_;
+  if (!present_[index]) {
+    // The elements are decoded independently so a corrupt one just reads as
+    // null, it doesn't affect the others.
+    uint64_t start = pton_instr_index_entry(&index_, index);
+    Variant value;
+    size_t end = 0;
+    if (start < index_.payload.indexed_data.data_size
+        && input_->decode(data_offset_ + start, &value, &end))
+      data->elms_[index] = value;
+    present_[index] = true;
+  }
+  return data->elms_[index];
+}
+
+bool pton_lazy_value_t::decode_next(Variant *key_out, Variant *value_out) {
+  if (decoded_count_ == unit_count_)
+    return false;
+  if (!decode_unit(key_out, value_out)) {
+    // Treat invalid input as if the value ended there.
+    unit_count_ = decoded_count_;
+    return false;
+  }
+  decoded_count_++;
+  return true;
+}
+
+bool pton_lazy_value_t::decode_unit(Variant *key_out, Variant *value_out) {
+  if (present_ != NULL) {
+    *value_out = get(decoded_count_);
+  } else if (backing_.is_array()) {
+    Variant value;
+    if (!input_->decode(next_offset_, &value, &next_offset_))
+      return false;
+    backing_.array_add(value);
+    *value_out = value;
+  } else if (backing_.is_seed() && decoded_count_ == 0) {
+    for (uint32_t i = 0; i < headerc_; i++) {
+      Variant header;
+      if (!input_->decode(next_offset_, &header, &next_offset_))
+        return false;
+      if (i == 0)
+        // We set the header to the first, most specific, one.
+        backing_.seed_set_header(header);
+    }
+    *value_out = backing_.seed_header();
+  } else {
+    Variant key;
+    if (!input_->decode(next_offset_, &key, &next_offset_))
+      return false;
+    Variant value;
+    if (!input_->decode(next_offset_, &value, &next_offset_))
+      return false;
+    backing_map()->set(key, value);
+    *key_out = key;
+    *value_out = value;
+  }
+  return true;
+}
+
+void pton_lazy_value_t::decode_until(uint32_t count) {
+  Variant key;
+  Variant value;
+  while (decoded_count_ < count && decode_next(&key, &value))
+    ;
+}
+
+pton_arena_map_t *pton_lazy_value_t::backing_map() {
+  return backing_.is_seed()
+      ? backing_.to_c().payload_.as_arena_seed_->fields_.to_c().payload_.as_arena_map_
+      : backing_.to_c().payload_.as_arena_map_;
+}
+
+bool pton_lazy_value_t::find(Variant key, Variant *value_out) {
+  if (backing_.is_seed())
+    // Make sure we're past the headers.
+    decode_until(1);
+  pton_arena_map_t *map = backing_map();
+  if (map->has(key)) {
+    if (value_out != NULL)
+      *value_out = map->get(key);
+    return true;
+  }
+  Variant next_key;
+  Variant next_value;
+  while (decode_next(&next_key, &next_value)) {
+    if (next_key == key) {
+      if (value_out != NULL)
+        *value_out = next_value;
+      return true;
+    }
   }
   return false;
 }
 
-pton_arena_seed_t::pton_arena_seed_t(Arena *origin) {
-  fields_ = origin->new_map();
+Variant BinaryReader::parse_lazy(const void *data, size_t size) {
+  LazyInput *input = factory_->register_destructor(new (factory_) LazyInput(
+      static_cast<const uint8_t*>(data), size, factory_, borrow_strings_,
+      borrow_blobs_, string_table_));
+  Variant result;
+  size_t end = 0;
+  return input->decode(0, &result, &end) ? result : Variant::null();
 }
 
 uint32_t pton_string_length(pton_variant_t variant) {
@@ -1164,6 +2484,11 @@ bool pton_is_integer(pton_variant_t variant) {
   return variant.header_.repr_tag_ == header_t::PTON_REPR_INT64;
 }
 
+bool pton_is_float(pton_variant_t variant) {
+  pton_check_binary_version(variant);
+  return variant.header_.repr_tag_ == header_t::PTON_REPR_FLOAT64;
+}
+
 bool pton_is_null(pton_variant_t variant) {
   pton_check_binary_version(variant);
   return variant.header_.repr_tag_ == header_t::PTON_REPR_NULL;
@@ -1171,12 +2496,12 @@ bool pton_is_null(pton_variant_t variant) {
 
 bool pton_is_array(pton_variant_t variant) {
   pton_check_binary_version(variant);
-  return variant.header_.repr_tag_ == header_t::PTON_REPR_ARNA_ARRAY;
+  return pton_type(variant) == PTON_ARRAY;
 }
 
 bool pton_is_map(pton_variant_t variant) {
   pton_check_binary_version(variant);
-  return variant.header_.repr_tag_ == header_t::PTON_REPR_ARNA_MAP;
+  return pton_type(variant) == PTON_MAP;
 }
 
 bool pton_is_id(pton_variant_t variant) {
@@ -1208,6 +2533,16 @@ int64_t pton_int64_value_with_default(pton_variant_t variant, int64_t if_not_int
   return pton_is_integer(variant) ? variant.payload_.as_int64_ : if_not_int;
 }
 
+double pton_float64_value(pton_variant_t variant) {
+  return pton_float64_value_with_default(variant, 0);
+}
+
+double pton_float64_value_with_default(pton_variant_t variant,
+    double if_not_float) {
+  pton_check_binary_version(variant);
+  return pton_is_float(variant) ? variant.payload_.as_float64_ : if_not_float;
+}
+
 
 pton_variant_t pton_null() {
   pton_variant_t result = VARIANT_INIT(header_t::PTON_REPR_NULL, 0);
@@ -1237,6 +2572,12 @@ pton_variant_t pton_integer(int64_t value) {
   return result;
 }
 
+pton_variant_t pton_float64(double value) {
+  pton_variant_t result = VARIANT_INIT(header_t::PTON_REPR_FLOAT64, 0);
+  result.payload_.as_float64_ = value;
+  return result;
+}
+
 pton_variant_t pton_string(const char *chars, uint32_t length) {
   pton_variant_t result = VARIANT_INIT(header_t::PTON_REPR_EXTN_STRING,
       length);
@@ -1276,17 +2617,58 @@ pton_variant_t pton_id(uint32_t size, uint64_t value) {
 OutputSocket::OutputSocket(tclib::OutStream *dest)
   : dest_(dest)
   , cursor_(0)
+  , flush_policy_(FLUSH_PER_MESSAGE)
+  , buffer_size_(kDefaultBufferSize)
   , default_encoding_(PTON_CHARSET_UTF_8)
-  , has_been_inited_(false) { }
+  , has_been_inited_(false)
+  , use_string_table_(false)
+  , framing_version_(FRAMING_V1) { }
+
+OutputSocket::~OutputSocket() {
+  if (buffered_size() > 0)
+    flush();
+}
 
 static const byte_t kHeader[8] = {'p', 't', 0xF6, 'n', 0, 0, 0, 0};
 
+// The index within the header of the framing version. It is 0 for v1 which
+// predates there being versions.
+static const size_t kHeaderVersionIndex = 4;
+
+// The size of the fixed part of v2 frame headers, after that comes the size
+// of the value.
+static const size_t kFrameHeaderSize = 8;
+
+// Stores the low 'count' bytes of the given value, least significant first.
+static void encode_little_endian(uint64_t value, size_t count, byte_t *dest) {
+  for (size_t i = 0; i < count; i++)
+    dest[i] = static_cast<byte_t>(value >> (8 * i));
+}
+
+// Reads a 'count' byte little endian value.
+static uint64_t decode_little_endian(const byte_t *src, size_t count) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < count; i++)
+    result |= static_cast<uint64_t>(src[i]) << (8 * i);
+  return result;
+}
+
 fat_bool_t OutputSocket::init() {
-  write_blob(const_cast<byte_t*>(kHeader), 8);
-  write_byte(kSetDefaultStringEncoding);
-  write_uint64(default_encoding_);
-  write_padding();
-  dest_->flush();
+  byte_t header[8];
+  memcpy(header, kHeader, 8);
+  if (framing_version_ != FRAMING_V1)
+    header[kHeaderVersionIndex] = static_cast<byte_t>(framing_version_);
+  write_blob(header, 8);
+  if (framing_version_ == FRAMING_V2) {
+    write_frame(kSetDefaultStringEncoding, kRootStreamIndex,
+        Variant::integer(default_encoding_), false);
+  } else {
+    write_byte(kSetDefaultStringEncoding);
+    write_uint64(default_encoding_);
+    write_padding();
+  }
+  // The header is always sent straight away, whatever the flush policy.
+  flush();
   has_been_inited_ = true;
   return F_TRUE;
 }
@@ -1298,26 +2680,172 @@ bool OutputSocket::set_default_string_encoding(pton_charset_t value) {
   return true;
 }
 
+bool OutputSocket::set_use_string_table(bool value) {
+  if (has_been_inited_)
+    return false;
+  use_string_table_ = value;
+  return true;
+}
+
+bool OutputSocket::set_framing_version(FramingVersion value) {
+  if (has_been_inited_)
+    return false;
+  framing_version_ = value;
+  return true;
+}
+
 void OutputSocket::send_value(Variant value, Variant stream_id) {
-  write_byte(kSendValue);
-  write_value(stream_id);
-  write_value(value);
+  if (framing_version_ == FRAMING_V2) {
+    uint32_t stream_index = get_stream_index(stream_id);
+    write_frame(kSendValue, stream_index, value, use_string_table_);
+  } else {
+    write_byte(kSendValue);
+    // Streams are identified by the raw encoding of their id so ids must
+    // always be written in full.
+    write_value(stream_id, false);
+    write_value(value, use_string_table_);
+    write_padding();
+  }
+  if (use_string_table_)
+    add_table_strings();
+  end_instruction();
+}
+
+void OutputSocket::add_table_strings() {
+  std::vector<String> candidates;
+  string_table_.take_candidates(&candidates);
+  for (size_t i = 0; i < candidates.size(); i++) {
+    // The receiver adds the strings in the order they arrive so they get the
+    // same indices on both ends.
+    if (framing_version_ == FRAMING_V2) {
+      write_frame(kAddTableString, kRootStreamIndex, candidates[i], false);
+    } else {
+      write_byte(kAddTableString);
+      write_value(candidates[i], false);
+      write_padding();
+    }
+    string_table_.add(candidates[i]);
+  }
+}
+
+void OutputSocket::write_blob(const byte_t *data, size_t size) {
+  cursor_ += size;
+  buffer_.write(data, size);
+}
+
+size_t OutputSocket::min_direct_blob_size() {
+  switch (flush_policy_) {
+    case FLUSH_PER_MESSAGE:
+      return kMinDirectBlobSize;
+    case FLUSH_WHEN_FULL:
+      // A blob at least as large as the buffer fills it so it gets flushed
+      // along with the rest of the message.
+      return (buffer_size_ > kMinDirectBlobSize) ? buffer_size_ : kMinDirectBlobSize;
+    default:
+      return 0;
+  }
+}
+
+void OutputSocket::prepare_writer(BinaryWriter *writer, bool use_string_table) {
+  if (use_string_table)
+    writer->set_string_table(&string_table_);
+  size_t min_direct_size = min_direct_blob_size();
+  if (min_direct_size > 0)
+    writer->set_blob_gaps(min_direct_size, &gaps_);
+}
+
+void OutputSocket::write_value(Variant value, bool use_string_table) {
+  ArenaScope scope(&scratch_);
+  BinaryWriter writer(&scratch_);
+  prepare_writer(&writer, use_string_table);
+  // The value is encoded straight into the buffer, after the size which has
+  // to be known up front.
+  size_t size = writer.measure(value);
+  write_uint64(size);
+  write_measured_value(&writer, value, size);
+}
+
+void OutputSocket::write_frame(byte_t opcode, uint32_t stream_index,
+    Variant value, bool use_string_table) {
+  ArenaScope scope(&scratch_);
+  BinaryWriter writer(&scratch_);
+  prepare_writer(&writer, use_string_table);
+  uint64_t size = writer.measure(value);
+  byte_t header[kFrameHeaderSize + 8];
+  bool is_long = (size > 0xFFFFFFFF);
+  header[0] = opcode;
+  header[1] = is_long ? kFrameLongSize : 0;
+  header[2] = 0;
+  header[3] = 0;
+  encode_little_endian(stream_index, 4, header + 4);
+  size_t size_size = is_long ? 8 : 4;
+  encode_little_endian(size, size_size, header + kFrameHeaderSize);
+  write_blob(header, kFrameHeaderSize + size_size);
+  write_measured_value(&writer, value, static_cast<size_t>(size));
   write_padding();
-  flush();
 }
 
-void OutputSocket::write_blob(byte_t *data, size_t size) {
+void OutputSocket::write_measured_value(BinaryWriter *writer, Variant value,
+    size_t size) {
+  size_t first_gap = gaps_.size();
+  size_t start = buffer_.length();
+  size_t written = writer->write_measured(value, buffer_.reserve(size), size);
+  buffer_.extend(written);
   cursor_ += size;
-  tclib::WriteIop iop(dest_, data, size);
-  iop.execute();
+  for (size_t i = first_gap; i < gaps_.size(); i++)
+    gaps_[i].offset += start;
+}
+
+// Returns true if the given stream id is equivalent to another exactly when
+// their raw encodings are the same.
+static bool is_plain_stream_id(Variant stream_id) {
+  switch (stream_id.type()) {
+    case PTON_INTEGER:
+    case PTON_BOOL:
+    case PTON_ID:
+    case PTON_BLOB:
+      return true;
+    case PTON_FLOAT:
+      // 0.0 and -0.0 are equivalent, as are all NaNs, but they're encoded
+      // differently.
+      return false;
+    case PTON_STRING:
+      // String equivalence ignores the encoding, the raw encoding doesn't.
+      return String(stream_id).encoding() == Variant::default_string_encoding();
+    default:
+      return false;
+  }
 }
 
-void OutputSocket::write_value(Variant value) {
+uint32_t OutputSocket::get_stream_index(Variant stream_id) {
+  if (stream_id.is_null())
+    // The root stream is always bound.
+    return kRootStreamIndex;
+  // Like v1 the receiver identifies streams by the raw encoding of their id.
+  // For plain ids that's the same as looking the id itself up, arrays, maps
+  // and seeds are compared by identity so those are looked up by encoding.
+  VariantMap<uint32_t> *indices = &stream_indices_;
+  Variant key = stream_id;
   BinaryWriter writer;
-  writer.write(value);
-  size_t size = writer.size();
-  write_uint64(size);
-  write_blob(*writer, size);
+  if (!is_plain_stream_id(stream_id)) {
+    indices = &encoded_stream_indices_;
+    writer.write(stream_id);
+    key = Variant::blob(*writer, static_cast<uint32_t>(writer.size()));
+  }
+  uint32_t *existing = (*indices)[key];
+  if (existing != NULL)
+    return *existing;
+  uint32_t index = static_cast<uint32_t>(stream_indices_.size()
+      + encoded_stream_indices_.size()) + 1;
+  // The map doesn't own its keys so ids that aren't stored inline are copied.
+  if (key.is_string()) {
+    key = stream_ids_.new_string(key.string_chars(), key.string_length());
+  } else if (key.is_blob()) {
+    key = stream_ids_.new_blob(key.blob_data(), key.blob_size());
+  }
+  indices->set(key, index);
+  write_frame(kBindStream, index, stream_id, false);
+  return index;
 }
 
 void OutputSocket::write_byte(byte_t value) {
@@ -1325,32 +2853,60 @@ void OutputSocket::write_byte(byte_t value) {
 }
 
 void OutputSocket::write_uint64(uint64_t value) {
-  // This is redundant with pton_assembler_t::write_uint64 but trying to factor
-  // it out and share the code would probably be more trouble than it's worth.
-  uint64_t current = value;
-  while (current >= 0x80) {
-    write_byte(static_cast<byte_t>((current & 0x7F) | 0x80));
-    current = (current >> 7) - 1;
-  }
-  write_byte(static_cast<byte_t>(current));
+  uint8_t encoded[BinaryImplUtils::kMaxVarintSize];
+  write_blob(encoded, BinaryImplUtils::encode_varint(value, encoded));
 }
 
 void OutputSocket::write_padding() {
-  while ((cursor_ % 8) != 0)
-    write_byte(0);
+  size_t padding = (8 - (cursor_ % 8)) % 8;
+  cursor_ += padding;
+  buffer_.fill(0, padding);
+}
+
+void OutputSocket::end_instruction() {
+  if (flush_policy_ == FLUSH_PER_MESSAGE
+      || (flush_policy_ == FLUSH_WHEN_FULL && buffered_size() >= buffer_size_))
+    flush();
+}
+
+size_t OutputSocket::buffered_size() {
+  size_t result = buffer_.length();
+  for (size_t i = 0; i < gaps_.size(); i++)
+    result += gaps_[i].size;
+  return result;
 }
 
 void OutputSocket::flush() {
+  // The stream doesn't support writing several blocks at once so the buffer
+  // and the blobs that go between its parts are written one after the other.
+  size_t start = 0;
+  for (size_t i = 0; i < gaps_.size(); i++) {
+    BlobGap &gap = gaps_[i];
+    write_to_dest(*buffer_ + start, gap.offset - start);
+    write_to_dest(static_cast<const byte_t*>(gap.data), gap.size);
+    start = gap.offset;
+  }
+  write_to_dest(*buffer_ + start, buffer_.length() - start);
+  // Clearing keeps the memory so the buffer stops allocating once it has
+  // grown to the size of the largest messages.
+  buffer_.clear();
+  gaps_.clear();
   dest_->flush();
 }
 
+void OutputSocket::write_to_dest(const byte_t *data, size_t size) {
+  if (size == 0)
+    return;
+  tclib::WriteIop iop(dest_, data, size);
+  iop.execute();
+}
+
 StreamId::StreamId(byte_t *raw_key, size_t key_size, bool owns_key)
   : raw_key_(raw_key)
   , key_size_(key_size)
   , hash_code_(0)
   , owns_key_(owns_key) {
-  for (size_t i = 0; i < key_size_; i++)
-    hash_code_ = (hash_code_ << 3) ^ raw_key_[i] ^ (hash_code_ >> (WORD_SIZE - 3));
+  hash_code_ = static_cast<size_t>(hash_bytes(raw_key_, key_size_, 0));
 }
 
 bool StreamId::operator==(const StreamId &that) const {
@@ -1379,10 +2935,155 @@ void StreamId::dispose() {
   raw_key_ = NULL;
 }
 
+// Stored immediately before the data of each block from a message pool.
+struct MessagePool::BlockHeader {
+  MessagePool *pool;
+  size_t size_class;
+  size_t ref_count;
+  // The message data for the block, if it is used for one. Its shared copies
+  // are counted by the block's reference count.
+  MessageData message;
+};
+
+const size_t MessagePool::kBlockHeaderSize =
+    (sizeof(MessagePool::BlockHeader) + 7) & ~static_cast<size_t>(7);
+
+MessagePool::MessagePool()
+  : ref_count_(1) {
+  guard_.initialize();
+}
+
+MessagePool::~MessagePool() {
+  for (size_t i = 0; i < kSizeClassCount; i++) {
+    std::vector<BlockHeader*> &blocks = free_blocks_[i];
+    for (size_t j = 0; j < blocks.size(); j++)
+      delete[] reinterpret_cast<byte_t*>(blocks[j]);
+    blocks.clear();
+  }
+}
+
+MessagePool *MessagePool::create() {
+  return new MessagePool();
+}
+
+byte_t *MessagePool::allocate(size_t size) {
+  size_t size_class = 0;
+  while (size_class < kSizeClassCount && (kMinBlockSize << size_class) < size)
+    size_class++;
+  BlockHeader *header = NULL;
+  guard_.lock();
+  ref_count_++;
+  if (size_class < kSizeClassCount && !free_blocks_[size_class].empty()) {
+    header = free_blocks_[size_class].back();
+    free_blocks_[size_class].pop_back();
+  }
+  guard_.unlock();
+  if (header == NULL) {
+    // Blocks that are too large for any class get exactly the size asked for.
+    size_t capacity = (size_class < kSizeClassCount)
+        ? (kMinBlockSize << size_class)
+        : size;
+    header = reinterpret_cast<BlockHeader*>(
+        new byte_t[kBlockHeaderSize + capacity]);
+    header->pool = this;
+    header->size_class = size_class;
+  }
+  header->ref_count = 1;
+  return reinterpret_cast<byte_t*>(header) + kBlockHeaderSize;
+}
+
+void MessagePool::retain(byte_t *data) {
+  BlockHeader *header = reinterpret_cast<BlockHeader*>(data - kBlockHeaderSize);
+  MessagePool *pool = header->pool;
+  pool->guard_.lock();
+  header->ref_count++;
+  pool->guard_.unlock();
+}
+
+void MessagePool::release(byte_t *data) {
+  BlockHeader *header = reinterpret_cast<BlockHeader*>(data - kBlockHeaderSize);
+  MessagePool *pool = header->pool;
+  pool->guard_.lock();
+  if (--header->ref_count > 0) {
+    pool->guard_.unlock();
+    return;
+  }
+  size_t size_class = header->size_class;
+  if (size_class < kSizeClassCount
+      && pool->free_blocks_[size_class].size() < kMaxFreeBlocksPerClass) {
+    pool->free_blocks_[size_class].push_back(header);
+  } else {
+    delete[] reinterpret_cast<byte_t*>(header);
+  }
+  bool is_last = pool->unref();
+  pool->guard_.unlock();
+  if (is_last)
+    delete pool;
+}
+
+void MessagePool::dispose() {
+  guard_.lock();
+  bool is_last = unref();
+  guard_.unlock();
+  if (is_last)
+    delete this;
+}
+
+bool MessagePool::unref() {
+  return --ref_count_ == 0;
+}
+
+size_t MessagePool::free_block_count() {
+  guard_.lock();
+  size_t result = 0;
+  for (size_t i = 0; i < kSizeClassCount; i++)
+    result += free_blocks_[i].size();
+  guard_.unlock();
+  return result;
+}
+
+MessageData *MessageData::for_pooled(byte_t *data, size_t size) {
+  MessagePool::BlockHeader *header = reinterpret_cast<MessagePool::BlockHeader*>(
+      data - MessagePool::kBlockHeaderSize);
+  MessageData *result = new (&header->message) MessageData(data, size);
+  result->is_pooled_ = true;
+  return result;
+}
+
+MessageData::~MessageData() {
+  delete[] data_;
+  data_ = NULL;
+}
+
+MessageData *MessageData::share() {
+  if (is_pooled_) {
+    MessagePool::retain(data_);
+    return this;
+  }
+  byte_t *copy = new byte_t[size_];
+  memcpy(copy, data_, size_);
+  return new MessageData(copy, size_);
+}
+
+void MessageData::dispose() {
+  if (is_pooled_) {
+    MessagePool::release(data_);
+  } else {
+    delete this;
+  }
+}
+
 InputSocket::InputSocket(tclib::InStream *src)
   : src_(src)
   , has_been_inited_(false)
   , cursor_(0)
+  , read_ahead_size_(0)
+  , read_cursor_(0)
+  , read_limit_(0)
+  , src_at_eof_(false)
+  , empty_read_count_(0)
+  , pool_(MessagePool::create())
+  , framing_version_(FRAMING_V1)
   , default_type_registry_(NULL) {
   CHECK_FALSE("NULL socket source", src == NULL);
   stream_factory_ = tclib::new_callback(new_default_stream);
@@ -1397,6 +3098,9 @@ InputSocket::~InputSocket() {
     delete stream;
   }
   streams_.clear();
+  // Messages still held by the streams' clients keep the pool alive.
+  pool_->dispose();
+  pool_ = NULL;
 }
 
 bool InputSocket::set_stream_factory(InputStreamFactory factory) {
@@ -1412,7 +3116,14 @@ InputStream *InputSocket::new_default_stream(InputStreamConfig *config) {
 
 BufferInputStream::BufferInputStream(InputStreamConfig *config)
   : InputStream(config)
-  , type_registry_(config->default_type_registry()) { }
+  , type_registry_(config->default_type_registry())
+  , string_table_(config->string_table()) { }
+
+BufferInputStream::~BufferInputStream() {
+  for (size_t i = 0; i < pending_messages_.size(); i++)
+    pending_messages_[i]->dispose();
+  pending_messages_.clear();
+}
 
 void BufferInputStream::receive_block(MessageData *message) {
   pending_messages_.push_back(message);
@@ -1425,14 +3136,16 @@ Variant BufferInputStream::pull_message(Factory *factory) {
   pending_messages_.erase(pending_messages_.begin());
   BinaryReader reader(factory);
   reader.set_type_registry(type_registry_);
+  reader.set_string_table(string_table_);
   Variant result = reader.parse(message->data(), message->size());
-  delete message;
+  message->dispose();
   return result;
 }
 
 PushInputStream::PushInputStream(InputStreamConfig *config, MessageAction action)
   : InputStream(config)
-  , type_registry_(config->default_type_registry()) {
+  , type_registry_(config->default_type_registry())
+  , string_table_(config->string_table()) {
   if (!action.is_empty())
     actions_.push_back(action);
 }
@@ -1441,19 +3154,39 @@ InputStream *PushInputStream::new_instance(InputStreamConfig *config) {
   return new PushInputStream(config);
 }
 
+// Cleanup that disposes a message once the values parsed from it are no
+// longer in use.
+static void dispose_message(MessageData *message) {
+  message->dispose();
+}
+
 void PushInputStream::receive_block(MessageData *message) {
-  Arena arena;
-  BinaryReader reader(&arena);
+  Arena::Mark start = arena_.mark();
+  BinaryReader reader(&arena_);
   reader.set_type_registry(type_registry_);
+  reader.set_string_table(string_table_);
+  // Blobs point directly into the message so it has to live as long as the
+  // arena holds the values. Strings are still copied since users expect them
+  // to be null terminated.
+  reader.set_borrow_blobs(true);
   Variant value = reader.parse(message->data(), message->size());
-  delete message;
-  ParsedMessage parsed(&arena, value);
+  ParsedMessage parsed(&arena_, value);
   for (std::vector<MessageAction>::iterator i = actions_.begin();
        i != actions_.end();
        i++) {
     MessageAction &action = *i;
     action(&parsed);
   }
+  if (arena_.rewind(start)) {
+    // Nobody held on to the values so we can release the message now and
+    // reuse the memory for the next one.
+    message->dispose();
+  } else {
+    // The values have been adopted so the message has to stay alive until
+    // the adopter is done with them.
+    arena_.register_cleanup(tclib::new_callback(dispose_message, message));
+    arena_.reset();
+  }
 }
 
 void PushInputStream::add_action(MessageAction action) {
@@ -1468,18 +3201,31 @@ fat_bool_t InputSocket::init() {
   bool at_eof = false;
   read_blob(header, 8, &at_eof);
   for (size_t i = 0; i < 8; i++) {
-    if (header[i] != kHeader[i])
+    if (i != kHeaderVersionIndex && header[i] != kHeader[i])
+      return F_FALSE;
+  }
+  switch (header[kHeaderVersionIndex]) {
+    case 0:
+      framing_version_ = FRAMING_V1;
+      break;
+    case FRAMING_V2:
+      framing_version_ = FRAMING_V2;
+      break;
+    default:
       return F_FALSE;
   }
   StreamId id = root_id();
-  InputStreamConfig config(id, default_type_registry_);
+  InputStreamConfig config(id, default_type_registry_, &string_table_);
   InputStream *root_stream = stream_factory_(&config);
   streams_[id] = root_stream;
+  bound_streams_.push_back(root_stream);
   has_been_inited_ = true;
   return F_TRUE;
 }
 
 fat_bool_t InputSocket::process_next_instruction(ProcessInstrStatus *status_out) {
+  if (framing_version_ == FRAMING_V2)
+    return process_next_frame(status_out);
   bool at_eof = false;
   byte_t opcode = read_byte(&at_eof);
   switch (opcode) {
@@ -1489,19 +3235,31 @@ fat_bool_t InputSocket::process_next_instruction(ProcessInstrStatus *status_out)
       return F_BOOL(!at_eof);
     }
     case kSendValue: {
-      size_t stream_id_size = 0;
-      byte_t *stream_id_data = read_value(&stream_id_size, &at_eof);
-      StreamId id(stream_id_data, stream_id_size, true);
-      size_t value_size = 0;
-      byte_t *value_data = read_value(&value_size, &at_eof);
+      // The id is only used to look up the stream so it can live in scratch
+      // memory, which the value can't.
+      size_t stream_id_size = read_uint32(&at_eof);
+      byte_t *stream_id_data = read_to_scratch(stream_id_size, &at_eof);
+      InputStream *dest = get_stream(StreamId(stream_id_data, stream_id_size,
+          false));
+      size_t value_size = read_uint32(&at_eof);
+      byte_t *value_data = read_to_pool(value_size, &at_eof);
       read_padding(&at_eof);
-      InputStream *dest = get_stream(id);
       if (dest == NULL) {
-        delete value_data;
+        MessagePool::release(value_data);
       } else {
-        dest->receive_block(new MessageData(value_data, value_size));
+        dest->receive_block(MessageData::for_pooled(value_data, value_size));
+      }
+      return F_BOOL(!at_eof);
+    }
+    case kAddTableString: {
+      size_t size = read_uint32(&at_eof);
+      byte_t *data = read_to_scratch(size, &at_eof);
+      read_padding(&at_eof);
+      if (!add_table_string(data, size)) {
+        if (status_out != NULL)
+          *status_out = ProcessInstrStatus(true);
+        return F_FALSE;
       }
-      id.dispose();
       return F_BOOL(!at_eof);
     }
     default: {
@@ -1514,6 +3272,83 @@ fat_bool_t InputSocket::process_next_instruction(ProcessInstrStatus *status_out)
   }
 }
 
+fat_bool_t InputSocket::process_next_frame(ProcessInstrStatus *status_out) {
+  bool at_eof = false;
+  byte_t header[kFrameHeaderSize + 8];
+  read_blob(header, kFrameHeaderSize, &at_eof);
+  byte_t opcode = header[0];
+  byte_t flags = header[1];
+  uint32_t stream_index = static_cast<uint32_t>(decode_little_endian(header + 4, 4));
+  size_t size_size = (flags & kFrameLongSize) ? 8 : 4;
+  if (!at_eof)
+    read_blob(header + kFrameHeaderSize, size_size, &at_eof);
+  uint64_t size = decode_little_endian(header + kFrameHeaderSize, size_size);
+  if (at_eof) {
+    // When we reach the end between frames a 0 is returned which isn't an
+    // error, running out in the middle of a frame is.
+    if (opcode != 0 && status_out != NULL)
+      *status_out = ProcessInstrStatus(true);
+    return F_FALSE;
+  }
+  // Frames with long sizes are fine as long as they can be held in memory.
+  bool is_valid = (static_cast<uint64_t>(static_cast<size_t>(size)) == size);
+  if (is_valid) {
+    switch (opcode) {
+      case kSetDefaultStringEncoding:
+        read_to_scratch(static_cast<size_t>(size), &at_eof);
+        break;
+      case kSendValue: {
+        InputStream *dest = (stream_index < bound_streams_.size())
+            ? bound_streams_[stream_index]
+            : NULL;
+        byte_t *data = read_to_pool(static_cast<size_t>(size), &at_eof);
+        if (dest == NULL || at_eof) {
+          MessagePool::release(data);
+        } else {
+          dest->receive_block(MessageData::for_pooled(data,
+              static_cast<size_t>(size)));
+        }
+        break;
+      }
+      case kAddTableString: {
+        byte_t *data = read_to_scratch(static_cast<size_t>(size), &at_eof);
+        is_valid = add_table_string(data, static_cast<size_t>(size));
+        break;
+      }
+      case kBindStream: {
+        // Indices are handed out in order so the bindings can be kept in a
+        // vector.
+        byte_t *data = read_to_scratch(static_cast<size_t>(size), &at_eof);
+        is_valid = (stream_index == bound_streams_.size());
+        if (is_valid)
+          bound_streams_.push_back(get_stream(StreamId(data,
+              static_cast<size_t>(size), false)));
+        break;
+      }
+      default:
+        is_valid = false;
+        break;
+    }
+  }
+  if (!is_valid) {
+    if (status_out != NULL)
+      *status_out = ProcessInstrStatus(true);
+    return F_FALSE;
+  }
+  read_padding(&at_eof);
+  return F_BOOL(!at_eof);
+}
+
+bool InputSocket::add_table_string(byte_t *data, size_t size) {
+  Arena arena;
+  BinaryReader reader(&arena);
+  Variant value = reader.parse(data, size);
+  if (!value.is_string() || !string_table_.can_add(value))
+    return false;
+  string_table_.add(value);
+  return true;
+}
+
 fat_bool_t InputSocket::process_all_instructions() {
   CHECK_TRUE("input socket not inited", has_been_inited_);
   fat_bool_t last_result = F_TRUE;
@@ -1526,11 +3361,16 @@ fat_bool_t InputSocket::process_all_instructions() {
   return F_TRUE;
 }
 
-byte_t *InputSocket::read_value(size_t *size_out, bool *at_eof_out) {
-  uint32_t size = read_uint32(at_eof_out);
-  byte_t *data = new byte_t[size];
+byte_t *InputSocket::read_to_scratch(size_t size, bool *at_eof_out) {
+  if (scratch_.size() < size)
+    scratch_.resize(size);
+  read_blob(scratch_.data(), size, at_eof_out);
+  return scratch_.data();
+}
+
+byte_t *InputSocket::read_to_pool(size_t size, bool *at_eof_out) {
+  byte_t *data = pool_->allocate(size);
   read_blob(data, size, at_eof_out);
-  *size_out = size;
   return data;
 }
 
@@ -1547,31 +3387,117 @@ InputStream *InputSocket::get_stream(StreamId id) {
   return (i == streams_.end()) ? NULL : i->second;
 }
 
+size_t InputSocket::ensure_buffered(size_t size) {
+  if (buffered() >= size || src_at_eof_)
+    return buffered();
+  // Move what's left to the front to make room behind it.
+  size_t remaining = buffered();
+  if (read_cursor_ > 0) {
+    if (remaining > 0)
+      memmove(read_buffer_.data(), read_buffer_.data() + read_cursor_, remaining);
+    read_cursor_ = 0;
+    read_limit_ = remaining;
+  }
+  size_t capacity = (size > read_ahead_size_) ? size : read_ahead_size_;
+  if (read_buffer_.size() < capacity)
+    read_buffer_.resize(capacity);
+  while (buffered() < size && !src_at_eof_) {
+    // With read-ahead disabled only ask for what's missing, otherwise take as
+    // much as there's room for.
+    size_t wanted = (read_ahead_size_ == 0)
+        ? (size - buffered())
+        : (read_buffer_.size() - read_limit_);
+    read_limit_ += read_from_source(read_buffer_.data() + read_limit_, wanted);
+  }
+  return buffered();
+}
+
+size_t InputSocket::read_from_source(byte_t *dest, size_t size) {
+  tclib::ReadIop iop(src_, dest, size);
+  if (!iop.execute() || iop.at_eof()) {
+    src_at_eof_ = true;
+  } else if (iop.bytes_read() > 0) {
+    empty_read_count_ = 0;
+  } else if (++empty_read_count_ >= kMaxEmptyReads) {
+    // A read that returns nothing may just mean there's no data yet but a
+    // source that keeps doing that would have us retry forever.
+    WARN("Source returned nothing %i times in a row", kMaxEmptyReads);
+    src_at_eof_ = true;
+  }
+  return iop.bytes_read();
+}
+
 void InputSocket::read_blob(byte_t *dest, size_t size, bool *at_eof_out) {
   cursor_ += size;
-  tclib::ReadIop iop(src_, dest, size);
-  iop.execute();
-  if (iop.at_eof())
+  // Take what's already buffered first.
+  size_t from_buffer = (size < buffered()) ? size : buffered();
+  if (from_buffer > 0) {
+    memcpy(dest, read_buffer_.data() + read_cursor_, from_buffer);
+    read_cursor_ += from_buffer;
+  }
+  size_t missing = size - from_buffer;
+  if (missing == 0)
+    return;
+  size_t read = 0;
+  if (missing < read_ahead_size_) {
+    // Small reads go through the buffer so what comes after gets read along
+    // with them.
+    read = ensure_buffered(missing);
+    if (read > missing)
+      read = missing;
+    memcpy(dest + from_buffer, read_buffer_.data() + read_cursor_, read);
+    read_cursor_ += read;
+  } else {
+    // There's no point in copying large blocks through the buffer so they're
+    // read directly into place.
+    while (read < missing && !src_at_eof_)
+      read += read_from_source(dest + from_buffer + read, missing - read);
+  }
+  if (read < missing) {
+    memset(dest + from_buffer + read, 0, missing - read);
     *at_eof_out = true;
+  }
 }
 
 byte_t InputSocket::read_byte(bool *at_eof_out) {
-  byte_t value = 0;
-  read_blob(&value, 1, at_eof_out);
-  return value;
+  if (ensure_buffered(1) == 0) {
+    *at_eof_out = true;
+    return 0;
+  }
+  cursor_++;
+  return read_buffer_[read_cursor_++];
 }
 
 uint64_t InputSocket::read_uint64(bool *at_eof_out) {
-  uint8_t next = read_byte(at_eof_out);
-  uint64_t result = (next & 0x7F);
-  uint64_t offset = 7;
-  while (next >= 0x80) {
-    next = read_byte(at_eof_out);
-    uint64_t payload = ((next & 0x7F) + 1);
-    result = result + (payload << offset);
-    offset += 7;
+  // Decode from the buffer, only asking the source for more if what's there
+  // so far ends in the middle of the varint. Asking for a full varint's worth
+  // up front could block waiting for data that isn't coming.
+  size_t available = ensure_buffered(1);
+  while (true) {
+    uint64_t result = 0;
+    size_t length = BinaryImplUtils::decode_varint(
+        read_buffer_.data() + read_cursor_, available, &result);
+    if (length > 0) {
+      read_cursor_ += length;
+      cursor_ += length;
+      return result;
+    }
+    if (available >= BinaryImplUtils::kMaxVarintSize) {
+      WARN("Invalid varint in input");
+      read_cursor_ += available;
+      cursor_ += available;
+      return 0;
+    }
+    size_t next = ensure_buffered(available + 1);
+    if (next == available) {
+      // The input ended in the middle of the varint.
+      read_cursor_ += available;
+      cursor_ += available;
+      *at_eof_out = true;
+      return 0;
+    }
+    available = next;
   }
-  return result;
 }
 
 uint32_t InputSocket::read_uint32(bool *at_eof_out) {
@@ -1581,6 +3507,14 @@ uint32_t InputSocket::read_uint32(bool *at_eof_out) {
 }
 
 void InputSocket::read_padding(bool *at_eof_out) {
-  while ((cursor_ % 8) != 0)
-    read_byte(at_eof_out);
+  size_t size = (8 - (cursor_ % 8)) % 8;
+  if (size == 0)
+    return;
+  size_t available = ensure_buffered(size);
+  if (available < size) {
+    *at_eof_out = true;
+    size = available;
+  }
+  read_cursor_ += size;
+  cursor_ += size;
 }
@@ -10,6 +10,8 @@
 #include "utils/alloc.h"
 
 typedef struct pton_arena_array_t pton_arena_array_t;
+typedef struct pton_arena_int64_array_t pton_arena_int64_array_t;
+typedef struct pton_arena_float64_array_t pton_arena_float64_array_t;
 typedef struct pton_arena_blob_t pton_arena_blob_t;
 typedef struct pton_arena_map_t pton_arena_map_t;
 typedef struct pton_arena_native_t pton_arena_native_t;
@@ -17,6 +19,7 @@ typedef struct pton_arena_seed_t pton_arena_seed_t;
 typedef struct pton_arena_string_t pton_arena_string_t;
 typedef struct pton_arena_t pton_arena_t;
 typedef struct pton_arena_value_t pton_arena_value_t;
+typedef struct pton_lazy_value_t pton_lazy_value_t;
 typedef struct pton_assembler_t pton_assembler_t;
 typedef struct pton_sink_t pton_sink_t;
 typedef struct pton_command_line_t pton_command_line_t;
@@ -36,7 +39,8 @@ typedef enum pton_type_t {
   PTON_MAP = 0x07,
   PTON_ID = 0x08,
   PTON_SEED = 0x09,
-  PTON_NATIVE = 0x0A
+  PTON_NATIVE = 0x0A,
+  PTON_FLOAT = 0x0B
 } pton_type_t;
 
 // The charsets supported by plankton.
@@ -70,11 +74,17 @@ typedef struct {
         PTON_REPR_TRUE = 0x50,
         PTON_REPR_FALSE = 0x51,
         PTON_REPR_ARNA_ARRAY = 0x60,
+        PTON_REPR_ARNA_INT64_ARRAY = 0x61,
+        PTON_REPR_LAZY_ARRAY = 0x62,
+        PTON_REPR_ARNA_FLOAT64_ARRAY = 0x63,
         PTON_REPR_ARNA_MAP = 0x70,
+        PTON_REPR_LAZY_MAP = 0x72,
         PTON_REPR_INLN_ID = 0x80,
         PTON_REPR_ARNA_SEED = 0x90,
+        PTON_REPR_LAZY_SEED = 0x92,
         PTON_REPR_ARNA_NATIVE = 0xA0,
-        PTON_REPR_EXTN_NATIVE = 0xA1
+        PTON_REPR_EXTN_NATIVE = 0xA1,
+        PTON_REPR_FLOAT64 = 0xB0
     } repr_tag_ UNLESS_MSVC(: 8);
     // A tag used to identify the version of plankton that produced this value.
     // All variants returned from a binary plankton implementation will have the
@@ -95,14 +105,18 @@ typedef struct {
   // type of the variant.
   union pton_variant_payload_t {
     int64_t as_int64_;
+    double as_float64_;
     uint64_t as_inline_id_;
     pton_arena_value_t *as_arena_value_;
     pton_arena_array_t *as_arena_array_;
+    pton_arena_int64_array_t *as_arena_int64_array_;
+    pton_arena_float64_array_t *as_arena_float64_array_;
     pton_arena_map_t *as_arena_map_;
     pton_arena_native_t *as_arena_native_;
     pton_arena_seed_t *as_arena_seed_;
     pton_arena_string_t *as_arena_string_;
     pton_arena_blob_t *as_arena_blob_;
+    pton_lazy_value_t *as_lazy_value_;
     const void *as_external_blob_data_;
     const char *as_external_string_chars_;
     pton_native_info_t *as_external_native_;
@@ -131,6 +145,9 @@ pton_variant_t pton_bool(bool value);
 // Returns a variant representing an integer with the given value.
 pton_variant_t pton_integer(int64_t value);
 
+// Returns a variant representing a 64-bit floating-point number.
+pton_variant_t pton_float64(double value);
+
 // Returns a variant representing a 64-bit identity token.
 pton_variant_t pton_id64(uint64_t value);
 
@@ -160,6 +177,9 @@ pton_variant_t pton_blob(const void *data, uint32_t size);
 // Is the given value an integer?
 bool pton_is_integer(pton_variant_t variant);
 
+// Is the given value a floating-point number?
+bool pton_is_float(pton_variant_t variant);
+
 // Is the given value null?
 bool pton_is_null(pton_variant_t variant);
 
@@ -188,6 +208,15 @@ int64_t pton_int64_value(pton_variant_t variant);
 // given default value.
 int64_t pton_int64_value_with_default(pton_variant_t variant, int64_t if_not_int);
 
+// Returns the floating-point value of this variant if it is a float, otherwise
+// 0.
+double pton_float64_value(pton_variant_t variant);
+
+// Returns the floating-point value of this variant if it is a float, otherwise
+// the given default value.
+double pton_float64_value_with_default(pton_variant_t variant,
+    double if_not_float);
+
 // Returns the given value's type.
 pton_type_t pton_type(pton_variant_t variant);
 
@@ -227,6 +256,17 @@ pton_variant_t pton_array_get(pton_variant_t variant, uint32_t index);
 // as a sink so setting the sink will cause the array value to be set.
 pton_sink_t *pton_array_add_sink(pton_variant_t array);
 
+// If the given value is an array of integers stored packed, stores the start
+// of the integers and how many there are in the output parameters and returns
+// true. Otherwise returns false. The integers are valid until the array is
+// next modified.
+bool pton_array_int64_span(pton_variant_t variant, const int64_t **elms_out,
+    uint32_t *length_out);
+
+// Like pton_array_int64_span but for arrays of floats stored packed.
+bool pton_array_float64_span(pton_variant_t variant, const double **elms_out,
+    uint32_t *length_out);
+
 // Returns the number of mappings in this map, if this is a map, otherwise
 // 0.
 uint32_t pton_map_size(pton_variant_t variant);
@@ -310,6 +350,18 @@ void pton_dispose_arena(pton_arena_t *arena);
 // not necessarily considered identical.
 bool pton_variants_equal(pton_variant_t a, pton_variant_t b);
 
+// Returns a hash of the given value, mixed with the given seed. Values that are
+// identical according to pton_variants_equal have the same hash. Like equality
+// this means that arrays and maps are hashed by identity, not contents.
+uint64_t pton_variant_hash(pton_variant_t variant, uint64_t seed);
+
+// Returns a hash of the given value like pton_variant_hash except that frozen
+// arrays and maps, and lazily parsed ones, are hashed by their contents, so
+// such values with the same contents have the same hash. Mutable arrays and maps are still hashed by
+// identity. This is for keying caches on contents, it is not consistent with
+// pton_variants_equal.
+uint64_t pton_variant_structural_hash(pton_variant_t variant, uint64_t seed);
+
 // Creates and returns a new variant string. The string is fully owned by
 // the arena so the character array can be disposed after this call returns.
 // The length of the string is determined using strlen.
@@ -337,6 +389,14 @@ pton_variant_t pton_new_array(pton_arena_t *arena);
 // Creates and returns a new mutable array value.
 pton_variant_t pton_new_array_with_capacity(pton_arena_t *arena, uint32_t init_capacity);
 
+// Creates and returns a new mutable array that can only hold integers and
+// stores them packed rather than as variants.
+pton_variant_t pton_new_int64_array(pton_arena_t *arena, uint32_t init_capacity);
+
+// Creates and returns a new mutable array that can only hold floats and stores
+// them packed rather than as variants.
+pton_variant_t pton_new_float64_array(pton_arena_t *arena, uint32_t init_capacity);
+
 // Creates and returns a new mutable map value.
 pton_variant_t pton_new_map(pton_arena_t *arena);
 
@@ -377,6 +437,24 @@ bool pton_assembler_begin_array(pton_assembler_t *assm, uint32_t length);
 // followed immediately by the mappings, keys and values alternating.
 bool pton_assembler_begin_map(pton_assembler_t *assm, uint32_t size);
 
+// Works the same way as begin_array except that the array is written with a
+// table of the offsets of its elements such that readers can access any
+// element, or skip the whole array, without looking at the elements before it.
+// The assembler fills in the table when the last element has been written.
+bool pton_assembler_begin_indexed_array(pton_assembler_t *assm, uint32_t length);
+
+// Works the same way as begin_map except that the map is written with a table
+// of the offsets of its mappings, like begin_indexed_array.
+bool pton_assembler_begin_indexed_map(pton_assembler_t *assm, uint32_t size);
+
+// Writes the header of an array of rows that all have the same shape, stored
+// by column. If headerc is 0 the rows are maps, otherwise they are seeds that
+// all have the same headers. This must be followed by the headerc headers,
+// then the keyc keys, then for each key in turn the values of that key in each
+// of the rows. There must be at least one key unless there are no rows.
+bool pton_assembler_begin_columns(pton_assembler_t *assm, uint32_t rows,
+    uint32_t headerc, uint32_t keyc);
+
 // Writes a seed header.
 bool pton_assembler_begin_seed(pton_assembler_t *assm, uint32_t headerc, uint32_t fieldc);
 
@@ -389,6 +467,21 @@ bool pton_assembler_emit_null(pton_assembler_t *assm);
 // Writes an int64 with the given value.
 bool pton_assembler_emit_int64(pton_assembler_t *assm, int64_t value);
 
+// Writes an array of the given int64 values in packed form.
+bool pton_assembler_emit_int64_array(pton_assembler_t *assm,
+    const int64_t *values, uint32_t count);
+
+// Writes a 64-bit float with the given value.
+bool pton_assembler_emit_float64(pton_assembler_t *assm, double value);
+
+// Writes an array of the given 64-bit float values in packed form.
+bool pton_assembler_emit_float64_array(pton_assembler_t *assm,
+    const double *values, uint32_t count);
+
+// Writes a reference to the string with the given index in the string table
+// shared by the writer and reader of the code.
+bool pton_assembler_emit_table_string(pton_assembler_t *assm, uint32_t index);
+
 // Writes a blob with the given contents.
 bool pton_assembler_emit_blob(pton_assembler_t *assm, const void *data, uint32_t size);
 
@@ -430,7 +523,14 @@ typedef enum pton_instr_opcode_t {
   PTON_OPCODE_BOOL,
   PTON_OPCODE_BEGIN_SEED,
   PTON_OPCODE_REFERENCE,
-  PTON_OPCODE_BLOB
+  PTON_OPCODE_BLOB,
+  PTON_OPCODE_BEGIN_INDEXED_ARRAY,
+  PTON_OPCODE_BEGIN_INDEXED_MAP,
+  PTON_OPCODE_INT64_ARRAY,
+  PTON_OPCODE_FLOAT64,
+  PTON_OPCODE_FLOAT64_ARRAY,
+  PTON_OPCODE_BEGIN_COLUMNS,
+  PTON_OPCODE_TABLE_STRING
 } pton_instr_opcode_t;
 
 // Describes an individual binary plankton code instruction.
@@ -440,6 +540,7 @@ typedef struct {
   union pton_instr_payload_t {
     bool bool_value;
     int64_t int64_value;
+    double float64_value;
     uint32_t array_length;
     uint32_t map_size;
     struct {
@@ -464,6 +565,39 @@ typedef struct {
       uint64_t value;
     } id64;
     uint64_t reference_offset;
+    // An array or map followed by a table of the offsets of each element or
+    // mapping relative to the end of the table, followed by the total size of
+    // the elements or mappings.
+    struct {
+      uint32_t count;
+      uint32_t entry_size;
+      const uint8_t *table;
+      uint64_t data_size;
+    } indexed_data;
+    // A packed array of int64s. The layout says how the values are stored, use
+    // pton_instr_unpack_int64_array to get at them.
+    struct {
+      uint32_t count;
+      uint8_t layout;
+      uint32_t size;
+      const uint8_t *contents;
+    } int64_array_data;
+    // A packed array of 64-bit floats stored as 8 little-endian bytes each,
+    // use pton_instr_unpack_float64_array to get at them.
+    struct {
+      uint32_t count;
+      const uint8_t *contents;
+    } float64_array_data;
+    // An array of maps, or of seeds, that all have the same keys, stored by
+    // column. The headers and keys come first and then the columns, one value
+    // per row for each key.
+    struct {
+      uint32_t rows;
+      uint32_t headerc;
+      uint32_t keyc;
+    } columns_data;
+    // The index within the shared string table of a table string.
+    uint32_t table_string_index;
   } payload;
 } pton_instr_t;
 
@@ -473,9 +607,77 @@ typedef struct {
 bool pton_decode_next_instruction(const uint8_t *code, size_t size,
     pton_instr_t *instr_out);
 
+// Returns the offset, relative to the end of the instruction, of the element
+// or mapping with the given index within an indexed array or map instruction.
+// The offset at index count is the total size of the elements or mappings.
+uint64_t pton_instr_index_entry(const pton_instr_t *instr, uint32_t index);
+
+// Decodes the values of a packed int64 array instruction into the given array
+// which must have room for all of them. If dest is NULL the values are checked
+// but not stored. Returns false if the values are invalid.
+bool pton_instr_unpack_int64_array(const pton_instr_t *instr, int64_t *dest);
+
+// Decodes the values of a packed float64 array instruction into the given array
+// which must have room for all of them.
+void pton_instr_unpack_float64_array(const pton_instr_t *instr, double *dest);
+
 // Returns true if the given input is valid plankton.
 bool pton_validate(const void *code, size_t size);
 
+// The kinds of events produced when walking over binary plankton with a cursor.
+typedef enum pton_cursor_event_t {
+  // An atomic value: an integer, float, string, blob, null, bool, id,
+  // reference, table string, or packed int64 or float64 array.
+  PTON_CURSOR_ATOM,
+  // The start of an array, map, seed, or columns. The elements, mappings,
+  // headers and fields, or headers, keys and columns follow, then a matching
+  // end event.
+  PTON_CURSOR_BEGIN,
+  // The end of the innermost array, map, or seed that has begun.
+  PTON_CURSOR_END,
+  // The whole value has been read.
+  PTON_CURSOR_DONE,
+  // The input is invalid or nested too deeply.
+  PTON_CURSOR_ERROR
+} pton_cursor_event_t;
+
+// How deeply nested arrays, maps, and seeds can be for a cursor to walk them.
+#define PTON_CURSOR_MAX_DEPTH 64
+
+// Walks over a binary plankton value as a sequence of events without building
+// any variants or allocating any memory. The fields are private, the struct is
+// only exposed such that cursors can be stack allocated.
+typedef struct {
+  const uint8_t *code;
+  size_t size;
+  size_t offset;
+  // Set when the top-level value has been started.
+  bool started;
+  bool failed;
+  uint32_t depth;
+  // For each array, map, or seed that has begun, how many more values it
+  // contains.
+  uint64_t remaining[PTON_CURSOR_MAX_DEPTH];
+} pton_cursor_t;
+
+// Initializes a cursor to walk over the given code, which must remain valid as
+// long as the cursor and the instructions it produces are used.
+void pton_cursor_init(pton_cursor_t *cursor, const void *code, size_t size);
+
+// Advances the cursor to the next event. For atom and begin events the
+// instruction is stored in the given output parameter.
+pton_cursor_event_t pton_cursor_next(pton_cursor_t *cursor,
+    pton_instr_t *instr_out);
+
+// Skips over the next value, including the whole contents if it is an array,
+// map, or seed, without producing any events for it. Returns false if the
+// value is invalid or there is no next value because the innermost container
+// or the whole value has ended.
+bool pton_cursor_skip_value(pton_cursor_t *cursor);
+
+// Returns the offset within the code of the next instruction.
+size_t pton_cursor_offset(pton_cursor_t *cursor);
+
 // Creates and returns a new command-line reader. Dispose after use with
 // pton_dispose_command_line_reader();
 pton_command_line_reader_t *pton_new_command_line_reader();
@@ -519,4 +721,8 @@ char pton_syntax_error_offender(pton_syntax_error_t *that);
 // Serialize the given value onto the given assembler.
 void pton_binary_writer_write(pton_assembler_t *assm, pton_variant_t value);
 
+// Returns the exact number of bytes pton_binary_writer_write would write for
+// the given value.
+size_t pton_binary_size(pton_variant_t value);
+
 #endif // _PLANKTON_H
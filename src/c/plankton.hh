@@ -33,6 +33,22 @@ public:
   // followed immediately by the mappings, keys and values alternating.
   bool begin_map(uint32_t size) { return pton_assembler_begin_map(assm_, size); }
 
+  // Begins an array whose elements are preceded by an offset index. The index
+  // is filled in by the assembler once the last element has been written.
+  bool begin_indexed_array(uint32_t length) {
+    return pton_assembler_begin_indexed_array(assm_, length);
+  }
+
+  // Begins a map whose mappings are preceded by an offset index.
+  bool begin_indexed_map(uint32_t size) {
+    return pton_assembler_begin_indexed_map(assm_, size);
+  }
+
+  // Begins an array of same-shaped maps or seeds stored by column.
+  bool begin_columns(uint32_t rows, uint32_t headerc, uint32_t keyc) {
+    return pton_assembler_begin_columns(assm_, rows, headerc, keyc);
+  }
+
   // Writes a seed header for a seed with the given number of headers and
   // fields. This must be followed immediately by the headers and body of the seed.
   bool begin_seed(uint32_t headerc, uint32_t fieldc) { return pton_assembler_begin_seed(assm_, headerc, fieldc); }
@@ -46,6 +62,23 @@ public:
   // Writes an int64 with the given value.
   bool emit_int64(int64_t value) { return pton_assembler_emit_int64(assm_, value); }
 
+  // Writes an array of int64s in packed form.
+  bool emit_int64_array(const int64_t *values, uint32_t count) {
+    return pton_assembler_emit_int64_array(assm_, values, count);
+  }
+
+  // Writes a 64-bit float with the given value.
+  bool emit_float64(double value) { return pton_assembler_emit_float64(assm_, value); }
+
+  // Writes a reference to the string with the given index in the shared
+  // string table.
+  bool emit_table_string(uint32_t index) { return pton_assembler_emit_table_string(assm_, index); }
+
+  // Writes an array of 64-bit floats in packed form.
+  bool emit_float64_array(const double *values, uint32_t count) {
+    return pton_assembler_emit_float64_array(assm_, values, count);
+  }
+
   // Writes a string with the default encoding.
   bool emit_default_string(const char *chars, uint32_t length) {
     return pton_assembler_emit_default_string(assm_, chars, length);
@@ -64,26 +97,197 @@ public:
     return pton_assembler_emit_id64(assm_, size, value);
   }
 
+  // Writes a reference to the previously seen value at the given offset.
+  bool emit_reference(uint64_t offset) {
+    return pton_assembler_emit_reference(assm_, offset);
+  }
+
   // Flushes the given assembler, writing the output into the given parameters.
   // The caller assumes ownership of the returned array and is responsible for
   // freeing it. This doesn't free the assembler, it must still be disposed with
   // pton_dispose_assembler.
   blob_t peek_code() { return pton_assembler_peek_code(assm_); }
 
+  // Returns the code written by the assembler and gives up ownership of it
+  // without copying. The caller must dispose it with
+  // pton_assembler_dispose_code.
+  blob_t release_code() { return pton_assembler_release_code(assm_); }
+
 private:
   pton_assembler_t *own_assm_;
   pton_assembler_t *assm_;
 };
 
+// Walks over binary plankton as a sequence of events without building any
+// variants, for when only a few parts of a value are needed. The input must
+// remain valid as long as the cursor and the instructions it produces are used.
+class BinaryCursor {
+public:
+  BinaryCursor(const void *code, size_t size) { pton_cursor_init(&cursor_, code, size); }
+
+  // Advances to the next event, storing the instruction for atom and begin
+  // events in the given output parameter.
+  pton_cursor_event_t next(pton_instr_t *instr_out) { return pton_cursor_next(&cursor_, instr_out); }
+
+  // Skips over the whole of the next value. Returns false if there is no next
+  // value or it is invalid.
+  bool skip_value() { return pton_cursor_skip_value(&cursor_); }
+
+  // Returns the offset within the input of the next instruction.
+  size_t offset() { return pton_cursor_offset(&cursor_); }
+
+private:
+  pton_cursor_t cursor_;
+};
+
+// A table of strings shared by the writer and the reader of binary plankton,
+// for instance the two ends of a socket, such that strings in the table can be
+// written as their index rather than in full. Both ends must add the same
+// strings in the same order.
+class StringTable {
+public:
+  // The longest string that will be considered for adding to the table.
+  static const uint32_t kMaxLength = 64;
+
+  // The most strings that will be considered for adding to the table.
+  static const uint32_t kMaxSize = 1024;
+
+  // Adds a copy of the given string at the end of this table and returns its
+  // index. If the string is already in the table its existing index is
+  // returned instead.
+  uint32_t add(String value);
+
+  // If the given string is in this table stores its index in the out
+  // parameter and returns true, otherwise returns false.
+  bool find(String value, uint32_t *index_out);
+
+  // Returns the string with the given index. The string is owned by this
+  // table.
+  String get(uint32_t index) { return strings_[index]; }
+
+  // Returns a copy of the string with the given index owned by the given
+  // factory. Readers use this so the values they read don't depend on the
+  // table, which usually belongs to a socket that may go away first.
+  String get_copy(uint32_t index, Factory *factory);
+
+  // Returns true if the given string could be added to this table by a
+  // writer, that is, it is short enough and the table isn't full. Readers use
+  // this to reject tables the writing end couldn't have built.
+  bool can_add(String value);
+
+  // Returns the number of strings in this table.
+  uint32_t size() { return static_cast<uint32_t>(strings_.size()); }
+
+  // Records that the given string, which isn't in this table, has been
+  // written in full. Short strings that are written in full a second time
+  // become candidates for being added.
+  void note_written(String value);
+
+  // Moves the strings that have become candidates since the last call to the
+  // end of the given vector. They're not added automatically because the
+  // reading end must be told about them before they can be used.
+  void take_candidates(std::vector<String> *out);
+
+private:
+  // Returns a copy of the given string owned by this table.
+  String copy_string(String value);
+
+  Arena arena_;
+  std::vector<String> strings_;
+  VariantMap<uint32_t> indices_;
+
+  // How many times each string not in the table has been written, and which
+  // of them have become candidates.
+  VariantMap<uint32_t> write_counts_;
+  std::vector<String> candidates_;
+};
+
+// A blob that a BinaryWriter left out of the data it wrote such that it can be
+// written separately, see BinaryWriter::set_blob_gaps.
+struct BlobGap {
+  // Where in the written data the blob belongs.
+  size_t offset;
+  const void *data;
+  size_t size;
+};
+
 // Utility for serializing variant values to plankton.
 class BinaryWriter {
 public:
-  BinaryWriter();
+  // Creates a new writer. If a scratch arena is given it is used for any
+  // temporary values created while writing, for instance when encoding native
+  // objects, otherwise the writer uses its own. Temporary values live until
+  // the scratch arena is reset, or for the writer's own arena until the next
+  // value is measured.
+  BinaryWriter(Arena *scratch = NULL);
   ~BinaryWriter();
 
-  // Write the given value to this writer's internal buffer.
+  // Write the given value to this writer's internal buffer, replacing what was
+  // there before.
   void write(Variant value);
 
+  // Writes the given value directly into the given block of memory. Returns
+  // the size of the encoded value; if that is larger than the capacity of the
+  // block nothing is written and the caller can try again with a block of the
+  // returned size. Doesn't affect this writer's internal buffer.
+  size_t write(Variant value, void *dest, size_t capacity);
+
+  // Writes a value whose size has already been found using measure() into the
+  // given block, which must be at least that large. Returns the number of
+  // bytes written which is less than the size if blobs were left out. Native
+  // objects are written as they were encoded when measuring so the size is
+  // exact even if their encoders don't always give the same result.
+  size_t write_measured(Variant value, void *dest, size_t size);
+
+  // Returns the exact number of bytes writing the given value would produce
+  // with this writer's current settings. The replacements of any native
+  // objects are kept until the value is written.
+  size_t measure(Variant value);
+
+  // Gives up ownership of the internal buffer and returns it. The caller is
+  // responsible for disposing it with delete[]. After this the writer is
+  // empty.
+  uint8_t *release();
+
+  // Sets whether seeds and native objects that occur more than once within a
+  // value should be written only the first time and then referred to using
+  // back-references. This makes shared subgraphs smaller and allows cyclic
+  // graphs to be written. The format only allows seeds to be referenced so
+  // arrays and maps are always written in full. Without this, a seed that
+  // occurs within itself is still written as a reference the second time
+  // since that's the only way it can be written.
+  void set_emit_references(bool value) { emit_references_ = value; }
+
+  // Sets the number of elements from which arrays and maps are written with
+  // an offset index that allows readers to skip them or access individual
+  // elements without decoding everything before them. Zero, the default,
+  // means never write an index.
+  void set_index_threshold(uint32_t value) { index_threshold_ = value; }
+
+  // Sets the number of elements from which arrays of maps that all have the
+  // same keys in the same order, or of seeds that also have the same header,
+  // are written by column. The keys, and header, are then written only once
+  // instead of once for each element. Readers give back ordinary arrays of
+  // maps or seeds either way. Zero, the default, means never write columns.
+  void set_columns_threshold(uint32_t value) { columns_threshold_ = value; }
+
+  // Sets the table of strings that are written as their index rather than in
+  // full. Strings that could be in the table but aren't are noted with the
+  // table, see StringTable::note_written, when they're written.
+  void set_string_table(StringTable *value) { string_table_ = value; }
+
+  // Sets that blobs of at least the given size, except those within indexed
+  // arrays and maps, should be left out when writing into a given block,
+  // taking up no space, with where they belong added to the given vector.
+  // The caller is then responsible for writing them itself which saves
+  // copying them. Blobs within what native objects are encoded as are always
+  // written since they only live as long as the scratch arena. Writing into
+  // the internal buffer always writes everything.
+  void set_blob_gaps(size_t min_size, std::vector<BlobGap> *gaps) {
+    min_blob_gap_size_ = min_size;
+    blob_gaps_ = gaps;
+  }
+
   // Returns the start of the buffer.
   uint8_t *operator*() { return bytes_; }
 
@@ -91,9 +295,27 @@ public:
   size_t size() { return size_; }
 
 private:
-  friend class VariantWriter;
+  // Encodes the given value using the given assembler. When only measuring
+  // nothing is noted with the string table.
+  void encode(Variant value, pton_assembler_t *assm, bool is_measuring);
+
   uint8_t *bytes_;
   size_t size_;
+  Arena own_scratch_;
+  Arena *scratch_;
+
+  // The value last measured and the values its native objects were encoded
+  // as, in the order they were encountered. Writing the value uses these
+  // rather than encoding the natives again.
+  Variant measured_;
+  std::vector<Variant> replacements_;
+
+  bool emit_references_;
+  uint32_t index_threshold_;
+  uint32_t columns_threshold_;
+  StringTable *string_table_;
+  size_t min_blob_gap_size_;
+  std::vector<BlobGap> *blob_gaps_;
 };
 
 // The syntaxes text can be formatted as.
@@ -109,7 +331,8 @@ public:
   TextWriter(TextSyntax syntax = SOURCE_SYNTAX);
   ~TextWriter();
 
-  // Write the given variant to this asciigram.
+  // Write the given variant to this asciigram. The text format has no
+  // references so a seed that occurs within itself is written as ? there.
   void write(Variant value);
 
   // After encoding, returns the string containing the encoded representation.
@@ -127,6 +350,7 @@ private:
 };
 
 class AbstractTypeRegistry;
+class BinaryReaderImpl;
 
 // Utility for reading variant values from serialized data.
 class BinaryReader {
@@ -137,9 +361,43 @@ public:
   // Deserializes the given input and returns the result as a variant.
   Variant parse(const void *data, size_t size);
 
+  // Returns a read-only view of the given input whose arrays, maps, and seeds
+  // only decode their contents when they're first accessed, which is much
+  // cheaper than parse when only a small part of a large value is used. The
+  // input must stay alive as long as the result is used. The type registry is
+  // not used so seeds are returned as plain seeds.
+  //
+  // The view can't be modified but accessing it decodes and caches its
+  // contents without any synchronization so it doesn't report itself as
+  // frozen. A lazy view must only be used from one thread at a time; to share
+  // the value between threads parse it eagerly instead.
+  //
+  // Invalid input is only noticed when the part that contains it is decoded,
+  // and it isn't reported: an invalid element reads as null and a container
+  // whose contents turn out to be invalid appears to end there. Parse eagerly
+  // to find out whether the whole input is valid.
+  Variant parse_lazy(const void *data, size_t size);
+
   // Sets the type registry to use to resolve types during parsing.
   void set_type_registry(AbstractTypeRegistry *value) { type_registry_ = value; }
 
+  // Sets whether strings should point directly into the input rather than be
+  // copied into the factory. If they do, the input must stay alive as long as
+  // the parsed values are used, for instance by registering a cleanup with the
+  // factory that disposes it. Borrowed strings are not null terminated and
+  // strings with a non-default encoding are always copied.
+  void set_borrow_strings(bool value) { borrow_strings_ = value; }
+
+  // Sets whether blobs should point directly into the input rather than be
+  // copied. The same lifetime rules apply as for borrowed strings.
+  void set_borrow_blobs(bool value) { borrow_blobs_ = value; }
+
+  // Sets the table that strings written as table indices are looked up in.
+  // Those strings are copied into the reader's factory so the parsed values
+  // don't depend on the table. Without a table, input that refers to one is
+  // invalid.
+  void set_string_table(StringTable *value) { string_table_ = value; }
+
   // Returns true iff the given input is valid binary plankton.
   static bool validate(const void *data, size_t size);
 
@@ -147,6 +405,51 @@ private:
   friend class BinaryReaderImpl;
   Factory *factory_;
   AbstractTypeRegistry *type_registry_;
+  bool borrow_strings_;
+  bool borrow_blobs_;
+  StringTable *string_table_;
+};
+
+// A binary reader that is given its input in chunks, for instance as they
+// arrive over a connection, and decodes each chunk as far as it can. Only the
+// bytes of an instruction that is split between chunks are held back, so the
+// whole input never has to be in memory at once. The memory held for a split
+// string, blob, or packed array grows with the contents that have actually
+// arrived, not the length claimed by the input. Input is reported invalid as
+// soon as the bytes seen so far can't be the start of a valid value.
+class IncrementalBinaryReader {
+public:
+  // The state of reading a value.
+  enum Status {
+    // The input so far is valid but doesn't hold a whole value.
+    NEED_MORE,
+    // A whole value has been read.
+    DONE,
+    // The input is invalid.
+    FAILED
+  };
+
+  // Creates a new reader that uses the factory, type registry, and borrowing
+  // settings of the given reader. Borrowing only applies to strings and blobs
+  // that fit within a single chunk, and then that chunk must stay alive as long
+  // as the parsed values are used.
+  explicit IncrementalBinaryReader(BinaryReader *config);
+  ~IncrementalBinaryReader();
+
+  // Decodes the given chunk of input. If this completes the value DONE is
+  // returned and the value is available through result(). Any input after the
+  // end of the value is left alone; if consumed_out is non-NULL the number of
+  // bytes consumed from this chunk is stored there.
+  Status feed(const void *data, size_t size, size_t *consumed_out = NULL);
+
+  // Returns the value read, or null if reading isn't done.
+  Variant result();
+
+  // Clears the state of this reader such that it can read another value.
+  void reset();
+
+private:
+  BinaryReaderImpl *impl_;
 };
 
 // Represents a syntax error while parsing text input. If parsing fails an
@@ -36,10 +36,37 @@ void disass_instr(pton_instr_t *instr, string_buffer_t *buf) {
     case PTON_OPCODE_BEGIN_MAP:
       string_buffer_printf(buf, "begin_map:%i", instr->payload.map_size);
       break;
+    case PTON_OPCODE_BEGIN_INDEXED_ARRAY:
+      string_buffer_printf(buf, "begin_indexed_array:%i:%i",
+          instr->payload.indexed_data.count, instr->payload.indexed_data.entry_size);
+      break;
+    case PTON_OPCODE_BEGIN_INDEXED_MAP:
+      string_buffer_printf(buf, "begin_indexed_map:%i:%i",
+          instr->payload.indexed_data.count, instr->payload.indexed_data.entry_size);
+      break;
     case PTON_OPCODE_BEGIN_SEED:
       string_buffer_printf(buf, "begin_seed:%i:%i", instr->payload.seed_data.headerc,
           instr->payload.seed_data.fieldc);
       break;
+    case PTON_OPCODE_BEGIN_COLUMNS:
+      string_buffer_printf(buf, "begin_columns:%i:%i:%i",
+          instr->payload.columns_data.rows, instr->payload.columns_data.headerc,
+          instr->payload.columns_data.keyc);
+      break;
+    case PTON_OPCODE_INT64_ARRAY:
+      string_buffer_printf(buf, "int64_array:%i:%i",
+          instr->payload.int64_array_data.count, instr->payload.int64_array_data.layout);
+      break;
+    case PTON_OPCODE_FLOAT64: {
+      char chars[32];
+      snprintf(chars, sizeof(chars), "%.17g", instr->payload.float64_value);
+      string_buffer_printf(buf, "float64:%s", chars);
+      break;
+    }
+    case PTON_OPCODE_FLOAT64_ARRAY:
+      string_buffer_printf(buf, "float64_array:%i",
+          instr->payload.float64_array_data.count);
+      break;
     case PTON_OPCODE_NULL:
       string_buffer_printf(buf, "null");
       break;
@@ -49,6 +76,9 @@ void disass_instr(pton_instr_t *instr, string_buffer_t *buf) {
     case PTON_OPCODE_REFERENCE:
       string_buffer_printf(buf, "get_ref:%i", instr->payload.reference_offset);
       break;
+    case PTON_OPCODE_TABLE_STRING:
+      string_buffer_printf(buf, "table_string:%i", instr->payload.table_string_index);
+      break;
     default:
       string_buffer_printf(buf, "unknown (%i)", instr->opcode);
       break;
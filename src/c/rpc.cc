@@ -319,8 +319,7 @@ void MessageSocket::on_outgoing_response(uint64_t serial, OutgoingResponse respo
   if (observer() != NULL)
     observer()->notify_outgoing_response(response, serial);
   ResponseMessage message(response, serial);
-  Arena arena;
-  Native value = arena.new_native(&message);
+  NativeVariant value(&message);
   send_value(value);
 }
 
@@ -328,13 +327,12 @@ MessageSocket::PendingMessage::PendingMessage()
   : promise_(sync_promise_t<Variant, Variant>::pending()) { }
 
 IncomingResponse MessageSocket::send_request(OutgoingRequest *request) {
-  Arena arena;
   uint64_t serial = next_serial_++;
   RequestMessage message(request, serial);
   PendingMessage *pending = new (tclib::kDefaultAlloc) PendingMessage();
   pending->ref();
   pending_messages_[serial] = pending;
-  Native wrapped = arena.new_native(&message);
+  NativeVariant wrapped(&message);
   send_value(wrapped);
   return IncomingResponse(pending);
 }
@@ -420,6 +418,14 @@ void StreamServiceConnector::set_default_type_registry(TypeRegistry *value) {
   insock_.set_default_type_registry(value);
 }
 
+bool StreamServiceConnector::set_use_string_table(bool value) {
+  return outsock_.set_use_string_table(value);
+}
+
+void StreamServiceConnector::set_read_ahead_size(size_t value) {
+  insock_.set_read_ahead_size(value);
+}
+
 fat_bool_t StreamServiceConnector::init(MessageSocket::RequestCallback handler) {
   F_TRY(outsock_.init());
   insock_.set_stream_factory(PushInputStream::new_instance);
@@ -394,6 +394,18 @@ public:
 
   void set_default_type_registry(TypeRegistry *value);
 
+  // Sets whether to send strings through a string table. Requests and
+  // responses repeat the same headers, keys, and usually selectors so they're
+  // much smaller that way, but only enable it if the other end understands
+  // string tables. Must be called before init.
+  bool set_use_string_table(bool value);
+
+  // Sets how much data the input socket asks the input stream for at a time,
+  // see InputSocket::set_read_ahead_size. Only enable it if the input stream
+  // returns what's available rather than waiting until a read has been
+  // completely filled, like pipes and network sockets do.
+  void set_read_ahead_size(size_t value);
+
   // Keep running and processing messages as long as they come in on the input
   // stream.
   fat_bool_t process_all_messages() { return insock_.process_all_instructions(); }
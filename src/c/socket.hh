@@ -10,20 +10,55 @@
 #include "io/file.hh"
 #include "marshal.hh"
 #include "plankton.hh"
+#include "sync/mutex.hh"
 #include "utils/callback.hh"
 #include "utils/fatbool.hh"
+#include "utils-inl.hh"
 #include "variant.hh"
 
 namespace plankton {
 
 static const byte_t kSetDefaultStringEncoding = 1;
 static const byte_t kSendValue = 2;
+static const byte_t kAddTableString = 3;
+static const byte_t kBindStream = 4;
+
+// The format used for the instructions sent through a socket. The version is
+// announced in the socket header.
+enum FramingVersion {
+  // Each instruction is an opcode followed by varint sized values and values
+  // are sent along with the full id of the stream they're for.
+  FRAMING_V1 = 1,
+  // Each instruction is a frame with a fixed-size header that holds the
+  // opcode, flags, a stream index, and the size of the value that follows.
+  // Stream ids are bound to indices the first time they're used so after that
+  // finding the destination stream is a simple lookup.
+  FRAMING_V2 = 2
+};
+
+// Flag set in a v2 frame header if the size is 64 bits wide rather than 32.
+static const byte_t kFrameLongSize = 0x01;
+
+// The index of the root stream in v2 frames.
+static const uint32_t kRootStreamIndex = 0;
 
 class OutputSocket : public tclib::DefaultDestructable {
 public:
-  // Create a new output socket that writes to the given stream.
+  // When the data buffered by an output socket is written to the destination.
+  enum FlushPolicy {
+    // After each value has been sent. This is the default.
+    FLUSH_PER_MESSAGE,
+    // When at least the buffer size has been buffered.
+    FLUSH_WHEN_FULL,
+    // Only when flush is called.
+    FLUSH_MANUALLY
+  };
+
+  // Create a new output socket that writes to the given stream. The stream
+  // must outlive the socket since anything still buffered is flushed when the
+  // socket is destroyed.
   OutputSocket(tclib::OutStream *dest);
-  virtual ~OutputSocket() { }
+  virtual ~OutputSocket();
   virtual void default_destroy() { tclib::default_delete_concrete(this); }
 
   // Write the stream header.
@@ -33,15 +68,70 @@ public:
   // be done before init is called. The default encoding is utf-8.
   bool set_default_string_encoding(pton_charset_t value);
 
+  // Sets whether strings that are sent repeatedly should be added to a string
+  // table shared with the receiving end and from then on be sent as their
+  // index. This must be done before init is called. The receiver must
+  // understand string tables; the default is to not use one.
+  bool set_use_string_table(bool value);
+
+  // Sets the framing format to use. This must be done before init is called.
+  // The receiver must understand the version; the default is v1.
+  bool set_framing_version(FramingVersion value);
+
+  // Sets when buffered data is written to the destination. Data that hasn't
+  // been flushed by the time the socket is destroyed is flushed then.
+  void set_flush_policy(FlushPolicy value) { flush_policy_ = value; }
+
+  // Sets how much data is buffered before it is written when flushing when
+  // full.
+  void set_buffer_size(size_t value) { buffer_size_ = value; }
+
   // Sends the given value to the default stream.
   void send_value(Variant value, Variant stream_id = Variant::null());
 
+  // Writes everything buffered to the destination, as a single write, and
+  // flushes the destination.
+  void flush();
+
 private:
-  // Writes the given raw data to the destination.
-  void write_blob(byte_t *data, size_t size);
+  // The default buffer size.
+  static const size_t kDefaultBufferSize = 4096;
+
+  // The smallest blobs that are written directly from the value being sent
+  // rather than copied into the buffer.
+  static const size_t kMinDirectBlobSize = 1024;
+
+  // Returns the size from which blobs in the value being sent can be written
+  // directly, or 0 if they can't. The value is only guaranteed to be alive
+  // until send_value returns so that is only possible if it is sure to be
+  // flushed by then.
+  size_t min_direct_blob_size();
+
+  // Adds the given raw data to the buffer.
+  void write_blob(const byte_t *data, size_t size);
+
+  // Serializes and writes the given value preceded by its size as a varint,
+  // using the string table if requested.
+  void write_value(Variant value, bool use_string_table);
+
+  // Serializes and writes the given value as a v2 frame.
+  void write_frame(byte_t opcode, uint32_t stream_index, Variant value,
+      bool use_string_table);
 
-  // Serializes and writes the given value.
-  void write_value(Variant value);
+  // Sets up a writer for writing values into the buffer.
+  void prepare_writer(BinaryWriter *writer, bool use_string_table);
+
+  // Writes a value that has been measured using the given writer into the
+  // buffer.
+  void write_measured_value(BinaryWriter *writer, Variant value, size_t size);
+
+  // Returns the v2 index of the stream with the given id, binding it first
+  // if it hasn't been used before.
+  uint32_t get_stream_index(Variant stream_id);
+
+  // Adds the strings that have become worth adding to the string table and
+  // tells the receiving end about them.
+  void add_table_strings();
 
   // Writes a single byte to the destination.
   void write_byte(byte_t value);
@@ -52,22 +142,120 @@ private:
   // Writes 0s until the total number of bytes written is a multiple of 8.
   void write_padding();
 
-  void flush();
+  // Called when a whole instruction has been written, flushes if the policy
+  // says so.
+  void end_instruction();
+
+  // Returns the amount of data waiting to be flushed, including blobs that
+  // will be written directly.
+  size_t buffered_size();
+
+  // Passes the given data on to the destination.
+  void write_to_dest(const byte_t *data, size_t size);
 
   tclib::OutStream *dest_;
   size_t cursor_;
+  FlushPolicy flush_policy_;
+  size_t buffer_size_;
+
+  // Data written but not yet passed on to the destination.
+  Buffer<byte_t> buffer_;
+
+  // Blobs that belong in the buffer but are written directly from where they
+  // are when flushing.
+  std::vector<BlobGap> gaps_;
   pton_charset_t default_encoding_;
   bool has_been_inited_;
+  bool use_string_table_;
+  StringTable string_table_;
+  FramingVersion framing_version_;
+
+  // The v2 indices of the streams that have been bound. Plain ids are keyed
+  // by the id, others by a blob holding the raw encoding of the id. The keys
+  // that aren't stored inline live in the arena.
+  VariantMap<uint32_t> stream_indices_;
+  VariantMap<uint32_t> encoded_stream_indices_;
+  Arena stream_ids_;
+
+  // Scratch space used while encoding values, reused between values.
+  Arena scratch_;
+};
+
+// A pool of memory for message data that recycles blocks rather than
+// allocating and freeing one for every message. Blocks are reference counted
+// and come in power-of-two size classes; blocks larger than the largest class
+// aren't recycled. Blocks can outlive the socket that allocated them and be
+// released on any thread so the pool keeps itself alive until both its owner
+// and all its blocks are done with it.
+class MessagePool {
+public:
+  // Creates a new pool. The caller must call dispose when it's done with it.
+  static MessagePool *create();
+
+  // Returns a block of at least the given size with a single reference.
+  byte_t *allocate(size_t size);
+
+  // Adds a reference to the block that starts with the given data.
+  static void retain(byte_t *data);
+
+  // Removes a reference to the block that starts with the given data. When
+  // the last one is removed the block is recycled.
+  static void release(byte_t *data);
+
+  // Gives up the owner's claim to this pool. The pool is deleted when all its
+  // blocks have also been released.
+  void dispose();
+
+  // Returns the number of blocks waiting to be reused.
+  size_t free_block_count();
+
+private:
+  friend class MessageData;
+  struct BlockHeader;
+
+  MessagePool();
+  ~MessagePool();
+
+  // Drops a reference to this pool, the guard must be held. Returns true if
+  // that was the last one in which case the caller must delete the pool once
+  // it has released the guard.
+  bool unref();
+
+  // The size of the smallest size class.
+  static const size_t kMinBlockSize = 64;
+
+  // The number of size classes, the largest holds 64K.
+  static const size_t kSizeClassCount = 11;
+
+  // How many free blocks to keep of each size.
+  static const size_t kMaxFreeBlocksPerClass = 16;
+
+  // The size of the block headers, rounded up such that the data is 8-byte
+  // aligned.
+  static const size_t kBlockHeaderSize;
+
+  // Blocks may be released on any thread.
+  tclib::NativeMutex guard_;
+
+  // One for the owner plus one for each block that is in use.
+  size_t ref_count_;
+  std::vector<BlockHeader*> free_blocks_[kSizeClassCount];
 };
 
 // The raw binary data associated with a message sent on a stream.
 class MessageData {
 public:
+  // Creates message data that owns the given array and disposes it using
+  // delete[].
   MessageData(byte_t *data, size_t size)
     : data_(data)
-    , size_(size) { }
+    , size_(size)
+    , is_pooled_(false) { }
 
-  ~MessageData() { delete[] data_; }
+  // Returns message data for the given block allocated from a message pool,
+  // taking over the block's reference. The message data lives in the block's
+  // header so this doesn't allocate.
+  static MessageData *for_pooled(byte_t *data, size_t size);
 
   // Returns the raw message data.
   byte_t *data() { return data_; }
@@ -75,9 +263,20 @@ public:
   // Returns the size in bytes of the message data.
   size_t size() { return size_; }
 
+  // Returns a message data for the same data that stays valid after this one
+  // has been disposed. Pooled data is shared, otherwise it is copied.
+  MessageData *share();
+
+  // Gives up this message data. Pooled message data is released back to its
+  // pool once all the shared copies have been disposed.
+  void dispose();
+
 private:
+  ~MessageData();
+
   byte_t *data_;
   size_t size_;
+  bool is_pooled_;
 };
 
 // Utility class that wraps a binary stream id and adds the functionality you
@@ -123,14 +322,20 @@ private:
 // Data used when initializing new streams.
 class InputStreamConfig {
 public:
-  InputStreamConfig(StreamId id, TypeRegistry *default_type_registry)
+  InputStreamConfig(StreamId id, TypeRegistry *default_type_registry,
+      StringTable *string_table = NULL)
     : id_(id)
-    , default_type_registry_(default_type_registry) { }
+    , default_type_registry_(default_type_registry)
+    , string_table_(string_table) { }
   StreamId id() { return id_; }
   TypeRegistry *default_type_registry() { return default_type_registry_; }
+  // The socket's string table. Strings decoded from it are owned by the
+  // socket.
+  StringTable *string_table() { return string_table_; }
 private:
   StreamId id_;
   TypeRegistry *default_type_registry_;
+  StringTable *string_table_;
 };
 
 // An input stream is an abstract type that receives data received through a
@@ -142,7 +347,7 @@ public:
 
   // Called by the socket when a new value with this stream as its destination
   // has been received. Ownership of the message is passed to this stream so
-  // it is the stream's responsibility to destroy it once it's no longer needed.
+  // it is the stream's responsibility to dispose it once it's no longer needed.
   virtual void receive_block(MessageData *message) = 0;
 
 private:
@@ -157,6 +362,9 @@ class BufferInputStream : public InputStream {
 public:
   BufferInputStream(InputStreamConfig *config);
 
+  // Disposes any messages that haven't been pulled.
+  virtual ~BufferInputStream();
+
   // Buffer the next block.
   virtual void receive_block(MessageData *message);
 
@@ -173,6 +381,7 @@ public:
 private:
   std::vector<MessageData*> pending_messages_;
   TypeRegistry *type_registry_;
+  StringTable *string_table_;
 };
 
 // Data associated with a pre-parsed message received through a socket.
@@ -202,6 +411,8 @@ public:
   // Creates a new input stream that performs the given action on each message
   // it receives. The variant value passed to the action is valid during the
   // call only, the behavior of variants past the end of the call is undefined.
+  // Blobs in the value point directly into the received data rather than
+  // being copied.
   PushInputStream(InputStreamConfig *config, MessageAction action = tclib::empty_callback());
 
   // Static method for creating push input streams that conform to the type
@@ -224,6 +435,11 @@ public:
 private:
   std::vector<MessageAction> actions_;
   TypeRegistry *type_registry_;
+  StringTable *string_table_;
+
+  // The arena messages are parsed into. It is reset after each message so the
+  // memory gets reused.
+  Arena arena_;
 };
 
 class InputSocket : public tclib::DefaultDestructable {
@@ -260,6 +476,13 @@ public:
 
   void set_default_type_registry(TypeRegistry *value) { default_type_registry_ = value; }
 
+  // Sets how much data to ask the source for at a time. Instructions are then
+  // parsed out of memory rather than read from the source a byte at a time.
+  // This is only safe if the source returns what is available rather than
+  // blocking until a read has been completely filled, so it is 0 by default
+  // which makes the socket only read exactly what it needs.
+  void set_read_ahead_size(size_t value) { read_ahead_size_ = value; }
+
   // Read the stream header. Returns true iff the header is valid.
   fat_bool_t init();
 
@@ -279,8 +502,23 @@ public:
   InputStream *root_stream();
 
 private:
-  // Reads the requested number of bytes from the source, storing them in the
-  // given array.
+  // Ensures that at least the given number of bytes are buffered, reading from
+  // the source if necessary, and returns how many are. Fewer bytes are only
+  // available if the end of the source has been reached.
+  size_t ensure_buffered(size_t size);
+
+  // The number of reads in a row that may return nothing before the source is
+  // considered to have ended.
+  static const uint32_t kMaxEmptyReads = 64;
+
+  // Reads at most the given number of bytes from the source into the given
+  // array and returns how many were read. Records when the source is done.
+  size_t read_from_source(byte_t *dest, size_t size);
+
+  // Returns the number of bytes read from the source but not yet consumed.
+  size_t buffered() { return read_limit_ - read_cursor_; }
+
+  // Reads the requested number of bytes, storing them in the given array.
   void read_blob(byte_t *dest, size_t size, bool *at_eof_out);
 
   // Reads and returns a single byte from the source.
@@ -295,8 +533,19 @@ private:
   // Reads data until the number of bytes read in total is a multiple of 8.
   void read_padding(bool *at_eof_out);
 
-  // Reads the next block of data.
-  byte_t *read_value(size_t *size_out, bool *at_eof_out);
+  // Reads the given number of bytes into memory that is only valid until the
+  // next call.
+  byte_t *read_to_scratch(size_t size, bool *at_eof_out);
+
+  // Reads the given number of bytes into a block from the message pool.
+  byte_t *read_to_pool(size_t size, bool *at_eof_out);
+
+  // Reads and processes the next v2 frame.
+  fat_bool_t process_next_frame(ProcessInstrStatus *status_out);
+
+  // Parses a table string and adds it to the string table. Returns false if
+  // the data isn't a string.
+  bool add_table_string(byte_t *data, size_t size);
 
   // The default stream factory function.
   static InputStream *new_default_stream(InputStreamConfig *config);
@@ -313,9 +562,36 @@ private:
   tclib::InStream *src_;
   bool has_been_inited_;
   size_t cursor_;
+  size_t read_ahead_size_;
+
+  // Data read from the source, the part between the read cursor and limit has
+  // yet to be consumed.
+  std::vector<byte_t> read_buffer_;
+  size_t read_cursor_;
+  size_t read_limit_;
+  bool src_at_eof_;
+  uint32_t empty_read_count_;
+
+  // Memory for the values that are only used while processing an
+  // instruction, like stream ids.
+  std::vector<byte_t> scratch_;
+
+  // Memory for the values that are passed on to the streams.
+  MessagePool *pool_;
+
+  // The framing version announced in the header.
+  FramingVersion framing_version_;
+
+  // The streams bound to each v2 stream index, NULL where the stream doesn't
+  // exist.
+  std::vector<InputStream*> bound_streams_;
   InputStreamFactory stream_factory_;
   StreamMap streams_;
   TypeRegistry *default_type_registry_;
+
+  // Strings the sending end has added to the string table. Values parsed by
+  // the streams share these rather than each getting their own copy.
+  StringTable string_table_;
 };
 
 } // namespace plankton
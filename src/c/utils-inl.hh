@@ -15,8 +15,18 @@ template <typename T>
 class Buffer {
 public:
   Buffer();
+
+  // Creates a buffer that writes into the given storage which is owned by the
+  // caller. If more than 'capacity' elements are written the contents are
+  // moved to memory owned by the buffer.
+  Buffer(T *storage, size_t capacity);
+
   ~Buffer();
 
+  // Makes this buffer keep track of how many elements are written to it but
+  // not store them. Must be called before anything is written.
+  void set_measure_only() { measure_only_ = true; }
+
   // Add the given value at the end of this buffer, expanding if necessary.
   void add(const T &value);
 
@@ -28,6 +38,22 @@ public:
   // necessary.
   void fill(const T &value, size_t count);
 
+  // Inserts 'count' elements from the given array at the given index, moving
+  // the elements after it back.
+  void insert(size_t index, const T *data, size_t count);
+
+  // Ensures that there is room for 'count' more elements and returns where
+  // they would go. The length of the buffer is unchanged; elements stored
+  // directly in the room become part of the buffer when extend is called.
+  T *reserve(size_t count);
+
+  // Adds the next 'count' elements, which must have been stored in room
+  // returned by reserve, to the end of this buffer.
+  void extend(size_t count) { cursor_ += count; }
+
+  // Removes all elements from this buffer but keeps the memory for reuse.
+  void clear() { cursor_ = 0; }
+
   // Returns the start of this buffer. The buffer is only valid until the next
   // modification to the buffer.
   T *operator*() { return data_; }
@@ -38,62 +64,99 @@ public:
   // Returns the contents of this buffer and then removes any references to it
   // such that it will not be disposed when this buffer is destroyed. The
   // buffer can not be changed after this has been called (though length()
-  // remains valid).
+  // remains valid). If the buffer is still using storage given by the caller
+  // that storage is returned.
   T *release();
 
 private:
   // Ensures that this buffer will hold at least 'size' additional elements.
-  void ensure_capacity(size_t size);
+  // Returns false if the elements should not be stored.
+  bool ensure_capacity(size_t size);
 
   size_t capacity_;
   size_t cursor_;
   T *data_;
+  bool owns_data_;
+  bool measure_only_;
 };
 
 template <typename T>
 Buffer<T>::Buffer()
   : capacity_(0)
   , cursor_(0)
-  , data_(NULL) { }
+  , data_(NULL)
+  , owns_data_(true)
+  , measure_only_(false) { }
+
+template <typename T>
+Buffer<T>::Buffer(T *storage, size_t capacity)
+  : capacity_(capacity)
+  , cursor_(0)
+  , data_(storage)
+  , owns_data_(false)
+  , measure_only_(false) { }
 
 template <typename T>
 Buffer<T>::~Buffer() {
-  delete[] data_;
+  if (owns_data_)
+    delete[] data_;
   data_ = NULL;
 }
 
 template <typename T>
 void Buffer<T>::add(const T &value) {
-  ensure_capacity(1);
-  data_[cursor_++] = value;
+  if (ensure_capacity(1))
+    data_[cursor_] = value;
+  cursor_++;
 }
 
 template <typename T>
 void Buffer<T>::fill(const T &value, size_t count) {
-  ensure_capacity(count);
-  for (size_t i = 0; i < count; i++)
-    data_[cursor_++] = value;
+  if (ensure_capacity(count)) {
+    for (size_t i = 0; i < count; i++)
+      data_[cursor_ + i] = value;
+  }
+  cursor_ += count;
 }
 
 template <typename T>
 void Buffer<T>::write(const T *data, size_t count) {
-  ensure_capacity(count);
-  memcpy(data_ + cursor_, data, count * sizeof(T));
+  if (ensure_capacity(count))
+    memcpy(data_ + cursor_, data, count * sizeof(T));
   cursor_ += count;
 }
 
 template <typename T>
-void Buffer<T>::ensure_capacity(size_t size) {
+void Buffer<T>::insert(size_t index, const T *data, size_t count) {
+  if (ensure_capacity(count)) {
+    memmove(data_ + index + count, data_ + index, (cursor_ - index) * sizeof(T));
+    memcpy(data_ + index, data, count * sizeof(T));
+  }
+  cursor_ += count;
+}
+
+template <typename T>
+T *Buffer<T>::reserve(size_t count) {
+  return ensure_capacity(count) ? (data_ + cursor_) : NULL;
+}
+
+template <typename T>
+bool Buffer<T>::ensure_capacity(size_t size) {
+  if (measure_only_)
+    return false;
   size_t required = cursor_ + size;
-  if (required < capacity_)
-    return;
+  if (required <= capacity_)
+    return true;
   size_t new_capacity = (required < 128) ? 256 : (2 * required);
   T *new_data = new T[new_capacity];
   if (cursor_ > 0)
     memcpy(new_data, data_, sizeof(T) * cursor_);
-  delete[] data_;
+  if (owns_data_)
+    delete[] data_;
   data_ = new_data;
   capacity_ = new_capacity;
+  owns_data_ = true;
+  return true;
 }
 
 template <typename T>
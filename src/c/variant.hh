@@ -13,6 +13,7 @@ BEGIN_C_INCLUDES
 #include "utils/alloc.h"
 END_C_INCLUDES
 
+#include "c/stdhashmap.hh"
 #include "c/stdvector.hh"
 #include "utils/callback.hh"
 #include "utils/refcount.hh"
@@ -125,6 +126,10 @@ public:
   // unlike the constructor.
   static inline Variant integer(int64_t value);
 
+  // Static constructor for 64-bit floating-point variants. There is no
+  // implicit constructor because it would make integer literals ambiguous.
+  static inline Variant float64(double value);
+
   // Initializes a variant representing a string with the given contents, using
   // strlen to determine the string's length. This does not copy the string so
   // it has to stay alive for as long as the variant is used.
@@ -157,6 +162,10 @@ public:
   // 0.
   inline int64_t integer_value(int64_t if_not_int = 0) const;
 
+  // Returns the floating-point value of this variant if it is a float,
+  // otherwise 0.
+  inline double float64_value(double if_not_float = 0) const;
+
   // Returns the length of this string if it is a string, otherwise 0.
   uint32_t string_length() const;
 
@@ -193,6 +202,14 @@ public:
   // as a sink so setting the sink will cause the array value to be set.
   Sink array_add_sink();
 
+  // If this is a packed int64 array, stores the start of the integers and how
+  // many there are in the output parameters and returns true. Otherwise
+  // returns false.
+  bool array_int64_span(const int64_t **elms_out, uint32_t *length_out) const;
+
+  // Like array_int64_span but for packed float64 arrays.
+  bool array_float64_span(const double **elms_out, uint32_t *length_out) const;
+
   // Returns this native variant viewed under the given type, but only if this
   // is a native that has that type. If not, NULL is returned.
   template <typename T>
@@ -227,7 +244,7 @@ public:
 
   // Returns true if this is a map that contains a mapping for the given key,
   // otherwise false.
-  Variant map_has(Variant key) const;
+  bool map_has(Variant key) const;
 
   // Returns an iterator for iterating this map, if this is a map, otherwise an
   // empty iterator. The first call to advance will yield the first mapping, if
@@ -293,9 +310,31 @@ public:
   // not necessarily considered identical.
   bool operator==(const Variant &that) const;
 
+  // Returns a hash of this value. See pton_variant_hash for details.
+  uint64_t hash(uint64_t seed = 0) const;
+
+  // Returns a hash of this value where arrays and maps that can't change are
+  // hashed by their contents. See pton_variant_structural_hash for details.
+  uint64_t structural_hash(uint64_t seed = 0) const;
+
+  // Helper class that allows variants to be used as hash map keys.
+  class Hasher {
+  public:
+    size_t operator()(const Variant &value) const {
+      return static_cast<size_t>(value.hash());
+    }
+
+    // MSVC hash map stuff.
+    static const size_t bucket_size = 4;
+    bool operator()(const Variant &a, const Variant &b) const;
+  };
+
   // Returns true iff this value is locally immutable. Note that even if this
   // returns true it doesn't mean that nothing about this value can change -- it
-  // may contain references to other values that are mutable.
+  // may contain references to other values that are mutable. Frozen values
+  // can be read from several threads at once, so lazy values, see
+  // BinaryReader::parse_lazy, are not frozen even though they can't be
+  // modified since reading them updates their internal state.
   bool is_frozen() const;
 
   // Renders this value locally immutable. Values referenced from this one may
@@ -306,6 +345,9 @@ public:
   // Is this value an integer?
   inline bool is_integer() const;
 
+  // Is this value a float?
+  inline bool is_float() const;
+
   // Is this value a map?
   inline bool is_map() const;
 
@@ -414,6 +456,16 @@ public:
   // Returns the index'th element, null if the index is greater than the array's
   // length.
   Variant operator[](uint32_t index) const { return array_get(index); }
+
+  // If this array stores its elements packed, gives direct access to them.
+  bool int64_span(const int64_t **elms_out, uint32_t *length_out) const {
+    return array_int64_span(elms_out, length_out);
+  }
+
+  // If this array stores its elements packed, gives direct access to them.
+  bool float64_span(const double **elms_out, uint32_t *length_out) const {
+    return array_float64_span(elms_out, length_out);
+  }
 };
 
 // An iterator that allows you to scan through all the mappings in a map.
@@ -627,6 +679,14 @@ public:
   // Creates and returns a new mutable array value.
   virtual Array new_array(uint32_t init_capacity) = 0;
 
+  // Creates and returns a new mutable array that can only hold integers, which
+  // are stored packed rather than as variants.
+  virtual Array new_int64_array(uint32_t init_capacity) = 0;
+
+  // Creates and returns a new mutable array that can only hold floats, which
+  // are stored packed rather than as variants.
+  virtual Array new_float64_array(uint32_t init_capacity) = 0;
+
   // Creates and returns a new mutable seed value. If a type is specified it
   // is used to initialize the result.
   virtual Seed new_seed(AbstractSeedType *type = NULL) = 0;
@@ -673,6 +733,15 @@ public:
   // that takes an explicit encoding for more details.
   virtual String new_string(uint32_t length) = 0;
 
+  // Returns a frozen string with the default encoding and the given contents.
+  // A factory that interns strings returns the same string each time it is
+  // given the same contents, which saves memory and makes the strings cheap to
+  // compare; otherwise this is the same as new_string. Readers use this for
+  // the strings they decode.
+  virtual String new_interned_string(const char *str, uint32_t length) {
+    return new_string(str, length);
+  }
+
   // Allocates a raw chunk of memory. Typically you don't want to use this
   // directly but through the 'new' operator, which calls it.
   virtual void *alloc_raw(size_t size) = 0;
@@ -771,10 +840,26 @@ private:
 // shared.
 class ArenaData : public tclib::refcount_shared_t, VariantOwner {
 public:
+  // A position within an arena that the arena can later be rewound to.
+  struct Mark {
+    size_t next_page;
+    uint8_t *cursor;
+    uint8_t *limit;
+    size_t large_block_count;
+    size_t adopted_count;
+    size_t cleanup_count;
+    size_t interned_count;
+  };
+
+  ArenaData();
   ~ArenaData();
   void adopt_ownership(VariantOwner *other);
   void register_cleanup(tclib::callback_t<void(void)> callback);
 
+  // Returns true iff this data has been adopted by another owner and hence
+  // must be kept alive as it is.
+  bool is_adopted() { return adopter_count_ > 0; }
+
 protected:
   void mark_adopted();
   void unmark_adopted();
@@ -784,18 +869,103 @@ protected:
 private:
   friend class Arena;
 
+  // Allocations are bump allocated from pages. The first page has this size
+  // and each subsequent page is twice as large as the previous one, up to the
+  // max page size.
+  static const size_t kMinPageSize = 1024;
+  static const size_t kMaxPageSize = 256 * 1024;
+
+  // Allocations larger than this are given their own block rather than being
+  // allocated from the current page.
+  static const size_t kMaxPagedAllocSize = 16 * 1024;
+
+  // All allocations are aligned to this many bytes.
+  static const size_t kAlignment = 8;
+
+  // Released chunks are kept in free lists by size class where class i holds
+  // chunks of at least 2^i bytes. Chunks too large for any class are dropped.
+  static const size_t kChunkSizeClassCount = 32;
+
   // Allocates and returns a block of memory that holds at least the given
   // number of bytes.
-  void *alloc_raw(size_t bytes);
+  inline void *alloc_raw(size_t bytes);
+
+  // Allocates a block of memory when the current page can't hold it, either
+  // by moving on to the next page or by giving the allocation a block of its
+  // own.
+  void *alloc_raw_slow(size_t bytes);
+
+  // Allocates a chunk of memory that can later be grown using grow_chunk or
+  // released using free_chunk. Chunks are used for the element storage of
+  // growable values like arrays and maps.
+  void *alloc_chunk(size_t bytes);
+
+  // Returns a chunk of at least new_bytes that holds the first old_bytes of
+  // the given chunk. If the chunk is the most recent allocation it is extended
+  // in place, otherwise the contents are moved to a new chunk and the old one
+  // is released.
+  void *grow_chunk(void *chunk, size_t old_bytes, size_t new_bytes);
+
+  // Releases a chunk of memory that is no longer in use such that it can be
+  // reused by a subsequent chunk allocation.
+  void free_chunk(void *chunk, size_t bytes);
+
+  // Returns the index of the smallest size class that holds the given number
+  // of bytes.
+  static size_t chunk_size_class(size_t bytes);
 
-  // The raw pages of memory allocated for this arena.
-  std::vector<blob_t> blocks_;
+  // Allocates a new block of memory from the system.
+  static blob_t alloc_block(size_t bytes);
+
+  // Zaps and frees a block returned by alloc_block.
+  static void free_block(blob_t block);
+
+  // Returns the string with the given contents that has been interned in
+  // this arena, interning a copy created by the given owner if there is none.
+  String intern_string(Factory *owner, const char *str, uint32_t length);
+
+  // Returns the current position within this arena.
+  Mark mark();
+
+  // Releases everything allocated since the given mark was returned, keeping
+  // the pages such that they can be reused.
+  void rewind(const Mark &mark);
+
+  // The pages of memory allocations are bump allocated from. Pages are kept
+  // when the arena is rewound so an arena that gets reused will eventually
+  // stop allocating new pages.
+  std::vector<blob_t> pages_;
+
+  // Allocations too large to go in a page.
+  std::vector<blob_t> large_blocks_;
+
+  // The index of the page to move on to once the current one is full.
+  size_t next_page_;
+
+  // The next free byte in the current page and the end of the current page.
+  uint8_t *cursor_;
+  uint8_t *limit_;
+
+  // The size of the next page to allocate.
+  size_t next_page_size_;
+
+  // Heads of the lists of released chunks, linked through their first word.
+  void *free_chunks_[kChunkSizeClassCount];
+
+  // The number of owners that have adopted this one.
+  size_t adopter_count_;
 
   // Other arenas this one has adopted.
   std::vector<VariantOwner*> adopted_;
 
   // Callbacks to call when the arena is disposed.
   std::vector< tclib::callback_t<void(void)> > cleanups_;
+
+  // The strings interned in this arena in the order they were interned, such
+  // that rewinding can forget the ones that are being released, and the index
+  // of each of them in that list.
+  std::vector<Variant> interned_;
+  platform_hash_map<Variant, size_t, Variant::Hasher> interned_indices_;
 };
 
 // An arena within which plankton values can be allocated. Once the values are
@@ -817,6 +987,21 @@ public:
   template <typename T>
   T *alloc_value();
 
+  // Allocates storage for the given number of values that can later be grown
+  // using grow_values or released using free_values. Public for testing only.
+  template <typename T>
+  T *alloc_growable_values(uint32_t elms);
+
+  // Grows storage returned by alloc_growable_values, in place if possible. The
+  // first old_elms values are preserved.
+  template <typename T>
+  T *grow_values(T *values, uint32_t old_elms, uint32_t new_elms);
+
+  // Releases storage returned by alloc_growable_values such that it can be
+  // reused.
+  template <typename T>
+  void free_values(T *values, uint32_t elms);
+
   // Creates a new native object of the given type.
   Native new_raw_native(void *object, AbstractSeedType *type);
 
@@ -826,6 +1011,12 @@ public:
   // Creates and returns a new mutable array value.
   Array new_array(uint32_t init_capacity);
 
+  // Creates and returns a new mutable array that can only hold integers.
+  Array new_int64_array(uint32_t init_capacity);
+
+  // Creates and returns a new mutable array that can only hold floats.
+  Array new_float64_array(uint32_t init_capacity);
+
   // Creates and returns a new mutable map value.
   Map new_map();
 
@@ -839,7 +1030,9 @@ public:
 
   // Creates and returns a new variant string with the default encoding. The
   // string is fully owned by the arena so the character array can be disposed
-  // after this call returns.
+  // after this call returns. The result is an external string whose
+  // characters live in the arena so it costs one allocation, however short
+  // the string is.
   String new_string(const char *str, uint32_t length);
 
   // Creates and returns a new variant string with the given encoding. The
@@ -861,6 +1054,20 @@ public:
   // non-null characters.
   String new_string(uint32_t length, pton_charset_t encoding);
 
+  // Strings longer than this are never interned since they're unlikely to be
+  // repeated and expensive to hash.
+  static const uint32_t kMaxInternedLength = 64;
+
+  // Sets whether new_interned_string shares strings with the same contents.
+  // Values decoded into an arena that interns strings share their repeated
+  // keys, headers, and so on rather than each having a copy. The default is
+  // to not intern.
+  void set_intern_strings(bool value) { intern_strings_ = value; }
+
+  // Returns a frozen string with the given contents, shared with previous
+  // calls if this arena interns strings.
+  String new_interned_string(const char *str, uint32_t length);
+
   // Creates and returns a new variant blob. The contents it copied into this
   // arena so the data array can be disposed after this call returns.
   Blob new_blob(const void *data, uint32_t size);
@@ -893,6 +1100,30 @@ public:
   // Register a callback to be invoked when this factory is disposed.
   virtual void register_cleanup(tclib::callback_t<void(void)> callback);
 
+  // A position within this arena, see mark().
+  typedef ArenaData::Mark Mark;
+
+  // Returns the current position within this arena such that the arena can
+  // later be rewound to this point, releasing everything allocated in the
+  // meantime.
+  Mark mark();
+
+  // Releases all values allocated since the given mark was returned and runs
+  // the cleanups registered since then. The memory is kept by the arena and
+  // reused by subsequent allocations. A mark is invalidated by rewinding past
+  // it or resetting the arena. Values created before the mark must not be
+  // modified in a way that allocates, like adding to an array, between marking
+  // and rewinding. If this arena's values have been adopted by another owner
+  // they have to stay alive so nothing is released and false is returned.
+  bool rewind(Mark mark);
+
+  // Releases all the values in this arena and runs all cleanups, keeping the
+  // memory for reuse. This lets a long-running loop use the same arena over
+  // and over without allocating. If the values have been adopted by another
+  // owner they are left to that owner and this arena starts over with fresh
+  // memory.
+  void reset();
+
   // Given a C arena, returns the C++ view of it.
   static Arena *from_c(pton_arena_t *c_arena) {
     return static_cast<Arena*>(c_arena);
@@ -914,6 +1145,22 @@ private:
   // Allocates the backing storage for a sink value.
   template <typename S>
   S *alloc_sink();
+
+  bool intern_strings_;
+};
+
+// Marks an arena when created and rewinds it to that mark when destroyed, such
+// that anything allocated within the scope is released when the scope exits.
+class ArenaScope {
+public:
+  explicit ArenaScope(Arena *arena)
+    : arena_(arena)
+    , mark_(arena->mark()) { }
+  ~ArenaScope() { arena_->rewind(mark_); }
+
+private:
+  Arena *arena_;
+  Arena::Mark mark_;
 };
 
 } // namespace plankton
@@ -8,6 +8,7 @@ import base64
 import collections
 import codecs
 import operator
+import struct
 
 
 _INT32_TAG = 0
@@ -20,6 +21,13 @@ _FALSE_TAG = 6
 _SEED_TAG = 7
 _REFERENCE_TAG = 8
 _BLOB_TAG = 12
+_INDEXED_ARRAY_TAG = 14
+_INDEXED_MAP_TAG = 15
+_INT64_ARRAY_TAG = 16
+_FLOAT64_TAG = 17
+_FLOAT64_ARRAY_TAG = 18
+_COLUMNS_TAG = 19
+_TABLE_STRING_TAG = 20
 _STRING_TAG = 13
 
 
@@ -33,6 +41,8 @@ def visit_data(data, visitor):
   t = type(data)
   if t == int:
     return visitor.visit_int(data)
+  elif t == float:
+    return visitor.visit_float(data)
   elif is_string(data):
     return visitor.visit_string(data)
   elif (t == list) or (t == tuple):
@@ -104,6 +114,11 @@ class DataOutputStream(object):
     self.assm.tag(_INT32_TAG)
     self.assm.int32(obj)
 
+  # Emit a tagged 64-bit float.
+  def visit_float(self, obj):
+    self.assm.tag(_FLOAT64_TAG)
+    self.assm.blob(struct.pack('<d', obj))
+
   # Emit a tagged string.
   def visit_string(self, value):
     (bytes, encoding) = self.string_codec.encode(value)
@@ -120,8 +135,13 @@ class DataOutputStream(object):
     self.assm.uint32(len(value))
     self.assm.blob(value)
 
-  # Emit a tagged array.
+  # Emit a tagged array. Arrays that hold only floats are packed.
   def visit_array(self, value):
+    if value and all(type(elm) == float for elm in value):
+      self.assm.tag(_FLOAT64_ARRAY_TAG)
+      self.assm.uint32(len(value))
+      self.assm.blob(struct.pack('<%id' % len(value), *value))
+      return
     self.assm.tag(_ARRAY_TAG)
     self.assm.uint32(len(value))
     for elm in value:
@@ -188,8 +208,9 @@ class DataOutputStream(object):
 # Encapsulates state relevant to reading plankton data.
 class DataInputStream(object):
 
-  def __init__(self, bytes, default_object, string_codec):
+  def __init__(self, bytes, default_object, string_codec, string_table=None):
     self.bytes = bytes
+    self.string_table = string_table
     self.cursor = 0
     self.object_index = {}
     self.object_offset = 0
@@ -221,6 +242,20 @@ class DataInputStream(object):
       return self._decode_reference()
     elif tag == _BLOB_TAG:
       return self._decode_blob()
+    elif tag == _INDEXED_ARRAY_TAG:
+      return self._decode_indexed_array()
+    elif tag == _INDEXED_MAP_TAG:
+      return self._decode_indexed_map()
+    elif tag == _INT64_ARRAY_TAG:
+      return self._decode_int64_array()
+    elif tag == _FLOAT64_TAG:
+      return self._decode_float64()
+    elif tag == _FLOAT64_ARRAY_TAG:
+      return self._decode_float64_array()
+    elif tag == _COLUMNS_TAG:
+      return self._decode_columns()
+    elif tag == _TABLE_STRING_TAG:
+      return self.string_table[self._decode_uint32()]
     else:
       raise Exception(tag)
 
@@ -244,6 +279,20 @@ class DataInputStream(object):
       return self._disassemble_seed(indent)
     elif tag == _REFERENCE_TAG:
       return self._disassemble_reference(indent)
+    elif tag == _INDEXED_ARRAY_TAG:
+      return self._disassemble_array(indent, True)
+    elif tag == _INDEXED_MAP_TAG:
+      return self._disassemble_map(indent, True)
+    elif tag == _INT64_ARRAY_TAG:
+      return "%sint64 array %s" % (indent, self._decode_int64_array())
+    elif tag == _FLOAT64_TAG:
+      return "%sfloat64 %r" % (indent, self._decode_float64())
+    elif tag == _FLOAT64_ARRAY_TAG:
+      return "%sfloat64 array %s" % (indent, self._decode_float64_array())
+    elif tag == _COLUMNS_TAG:
+      return self._disassemble_columns(indent)
+    elif tag == _TABLE_STRING_TAG:
+      return "%stable string %i" % (indent, self._decode_uint32())
     else:
       return str(tag)
 
@@ -292,6 +341,14 @@ class DataInputStream(object):
       bytes.append(self._get_byte())
     return bytes
 
+  # Skips the offset index of an indexed array or map with the given number of
+  # entries. We always read sequentially so the index isn't needed.
+  def _skip_index(self, count):
+    layout = self._get_byte()
+    if (layout >> 4) != 0:
+      raise Exception(layout)
+    self.cursor += (count + 1) << (layout & 0x0F)
+
   # Reads a naked array from the stream.
   def _decode_array(self):
     length = self._decode_uint32()
@@ -300,8 +357,55 @@ class DataInputStream(object):
       result.append(self.read_object())
     return result
 
-  def _disassemble_array(self, indent):
+  def _decode_indexed_array(self):
+    length = self._decode_uint32()
+    self._skip_index(length)
+    result = []
+    for i in xrange(0, length):
+      result.append(self.read_object())
+    return result
+
+  # Reads a packed array of integers, either fixed-width or deltas.
+  def _decode_int64_array(self):
     length = self._decode_uint32()
+    layout = self._get_byte()
+    size = self._decode_uint32()
+    end = self.cursor + size
+    result = []
+    if (layout >> 4) == 0:
+      width = 1 << (layout & 0x0F)
+      for i in xrange(0, length):
+        value = 0
+        for j in xrange(0, width):
+          value |= self._get_byte() << (8 * j)
+        if value >= (1 << (8 * width - 1)):
+          value -= (1 << (8 * width))
+        result.append(value)
+    elif (layout >> 4) == 1:
+      value = 0
+      for i in xrange(0, length):
+        value += self._decode_int32()
+        value = ((value + (1 << 63)) % (1 << 64)) - (1 << 63)
+        result.append(value)
+    else:
+      raise Exception(layout)
+    if self.cursor != end:
+      raise Exception(size)
+    return result
+
+  # Reads a naked little-endian 64-bit float from the stream.
+  def _decode_float64(self):
+    return struct.unpack('<d', self._get_bytes(8))[0]
+
+  # Reads a packed array of 64-bit floats.
+  def _decode_float64_array(self):
+    length = self._decode_uint32()
+    return list(struct.unpack('<%id' % length, self._get_bytes(8 * length)))
+
+  def _disassemble_array(self, indent, is_indexed=False):
+    length = self._decode_uint32()
+    if is_indexed:
+      self._skip_index(length)
     children = []
     for i in xrange(0, length):
       new_indent = "%s%-2i" % (indent, i)
@@ -321,8 +425,15 @@ class DataInputStream(object):
     length = self._decode_uint32()
     return self._decode_map_contents(length)
 
-  def _disassemble_map(self, indent):
+  def _decode_indexed_map(self):
+    length = self._decode_uint32()
+    self._skip_index(length)
+    return self._decode_map_contents(length)
+
+  def _disassemble_map(self, indent, is_indexed=False):
     length = self._decode_uint32()
+    if is_indexed:
+      self._skip_index(length)
     children = []
     for i in xrange(0, length):
       key = self.disassemble_object(indent + ": ")
@@ -359,6 +470,67 @@ class DataInputStream(object):
     payload = self.disassemble_object(indent + "  ")
     return "%sobject (@%i)\n%s\n%s" % (indent, index, header, payload)
 
+  # Reads naked columns from the stream. With no header the rows are maps,
+  # otherwise they're objects that all have the same header.
+  def _decode_columns(self):
+    rows = self._decode_uint32()
+    headerc = self._decode_uint32()
+    keyc = self._decode_uint32()
+    if headerc == 0:
+      instances = None
+    else:
+      # Like an object each row gets its index before its contents are read.
+      indices = [self.grab_index() for i in xrange(0, rows)]
+      for index in indices:
+        self.object_index[index] = None
+      headers = []
+      for i in xrange(0, headerc):
+        headers.append(self.read_object())
+      header = headers[0]
+      meta_info = _CLASS_REGISTRY.get_meta_info_by_header(header)
+      instances = []
+      for index in indices:
+        if not meta_info is None:
+          instance = meta_info.new_empty_instance(header)
+        else:
+          instance = (self.default_object)(header)
+        self.object_index[index] = instance
+        instances.append(instance)
+    keys = [self.read_object() for i in xrange(0, keyc)]
+    payloads = [{} for i in xrange(0, rows)]
+    for key in keys:
+      for payload in payloads:
+        payload[key] = self.read_object()
+    if instances is None:
+      return payloads
+    for (instance, payload) in zip(instances, payloads):
+      if not meta_info is None:
+        meta_info.set_instance_contents(instance, payload)
+      else:
+        instance.set_contents(payload)
+    return instances
+
+  def _disassemble_columns(self, indent):
+    rows = self._decode_uint32()
+    headerc = self._decode_uint32()
+    keyc = self._decode_uint32()
+    children = []
+    if headerc > 0:
+      first = self.object_offset
+      self.object_offset += rows
+      for i in xrange(0, headerc):
+        children.append(self.disassemble_object(indent + "^ "))
+    keys = [self.disassemble_object(indent + ": ") for i in xrange(0, keyc)]
+    for key in keys:
+      children.append(key)
+      for i in xrange(0, rows):
+        children.append(self.disassemble_object("%s  %-2i" % (indent, i)))
+    if headerc > 0:
+      label = "columns %i (@%i-@%i)" % (rows, first, first + rows - 1)
+    else:
+      label = "columns %i" % rows
+    return "%s%s\n%s" % (indent, label, "\n".join(children))
+
   # Acquires the next object index.
   def grab_index(self):
     result = self.object_offset
@@ -383,6 +555,15 @@ class DataInputStream(object):
     self.cursor += 1
     return result
 
+  # Reads the given number of bytes from the stream.
+  def _get_bytes(self, count):
+    end = self.cursor + count
+    if end > len(self.bytes):
+      raise Exception(count)
+    result = self.bytes[self.cursor:end]
+    self.cursor = end
+    return bytes(result)
+
 
 # Returns the fully qualified class name of a class object.
 def class_name(klass):
@@ -828,6 +1009,9 @@ class Stringifier(object):
   def visit_int(self, value):
     return str(value)
 
+  def visit_float(self, value):
+    return repr(value)
+
   def visit_null(self, value):
     return "null"
 
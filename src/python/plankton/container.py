@@ -8,10 +8,31 @@ from . import codec
 import Queue
 from abc import ABCMeta, abstractmethod
 import codecs
+import struct
 
 
 _SET_DEFAULT_STRING_ENCODING = 1
 _SEND_VALUE = 2
+_ADD_TABLE_STRING = 3
+_BIND_STREAM = 4
+
+
+# The framing formats. In v1 each instruction is an opcode followed by varint
+# sized values, in v2 each instruction is a frame with a fixed-size header and
+# streams are referred to by indices bound the first time they're used.
+FRAMING_V1 = 1
+FRAMING_V2 = 2
+
+
+_HEADER_START = "pt\xf6n"
+_FRAME_HEADER = "<BBHI"
+_FRAME_LONG_SIZE = 0x01
+
+
+# The sending end never puts longer strings, or more of them, in its string
+# table so input that does is invalid.
+_MAX_TABLE_STRING_LENGTH = 64
+_MAX_TABLE_SIZE = 1024
 
 
 # Abstract implementation of a stream.
@@ -25,7 +46,8 @@ class AbstractStream(object):
   # by this stream. The default implementation parses the data and passes the
   # result to receive_value.
   def receive_block(self, block):
-    value = codec.DataInputStream(block, None, self.socket.string_codec).read_object()
+    value = codec.DataInputStream(block, None, self.socket.string_codec,
+        self.socket.string_table).read_object()
     self.receive_value(value)
 
   # Custom handling of a new value being passed to this stream.
@@ -54,16 +76,22 @@ class DefaultStream(AbstractStream):
 class OutputSocket(object):
 
   # Creates a new output stream that writes to the given file (-like object).
-  def __init__(self, file):
+  def __init__(self, file, framing_version=FRAMING_V1):
     self.file = file
     self.cursor = 0
     self.default_string_encoding = None
+    self.framing_version = framing_version
+    self.stream_indices = {}
     self._write_header()
 
   # Writes the given ascii string value as the default string encoding.
   def set_default_string_encoding(self, encoding):
     enum = codec.StringCodec.get_encoding_enum(encoding)
     self.default_string_encoding = enum
+    if self.framing_version == FRAMING_V2:
+      self._write_frame(_SET_DEFAULT_STRING_ENCODING, 0,
+          codec.Encoder().encode(enum))
+      return
     self._write_byte(_SET_DEFAULT_STRING_ENCODING)
     self._write_uint32(enum)
     self._write_padding()
@@ -71,11 +99,39 @@ class OutputSocket(object):
   # Sends the given value to the stream with the given id. If no id is given
   # the value is sent to the root stream.
   def send_value(self, value, stream_id=None):
+    if self.framing_version == FRAMING_V2:
+      index = self._get_stream_index(stream_id)
+      self._write_frame(_SEND_VALUE, index, codec.Encoder().encode(value))
+      return
     self._write_byte(_SEND_VALUE)
     self._write_value(stream_id)
     self._write_value(value)
     self._write_padding()
 
+  # Returns the index of the stream with the given id, binding it first if
+  # it hasn't been used before.
+  def _get_stream_index(self, stream_id):
+    if stream_id is None:
+      return 0
+    data = codec.Encoder().encode(stream_id)
+    key = str(data)
+    index = self.stream_indices.get(key, None)
+    if index is None:
+      index = len(self.stream_indices) + 1
+      self.stream_indices[key] = index
+      self._write_frame(_BIND_STREAM, index, data)
+    return index
+
+  # Writes a v2 frame holding the given encoded value.
+  def _write_frame(self, opcode, stream_index, data):
+    size = len(data)
+    flags = _FRAME_LONG_SIZE if size > 0xFFFFFFFF else 0
+    header = struct.pack(_FRAME_HEADER, opcode, flags, 0, stream_index)
+    header += struct.pack("<Q" if flags else "<I", size)
+    self._write_blob(header)
+    self._write_blob(data)
+    self._write_padding()
+
   # Writes the given value to this stream.
   def _write_value(self, value):
     data = codec.Encoder().encode(value)
@@ -88,7 +144,8 @@ class OutputSocket(object):
     self._write_blob(assm.bytes)
 
   def _write_header(self):
-    self.file.write("pt\xf6n\00\00\00\00")
+    version = 0 if self.framing_version == FRAMING_V1 else self.framing_version
+    self.file.write(_HEADER_START + chr(version) + "\00\00\00")
 
   def _write_byte(self, byte):
     self.file.write(chr(byte))
@@ -109,8 +166,11 @@ class InputSocket(object):
   def __init__(self, file):
     self.file = file
     self.string_codec = None
+    self.string_table = []
     self.cursor = 0
     self.streams = {}
+    self.bound_streams = []
+    self.framing_version = FRAMING_V1
     self.stream_factory = DefaultStream
 
   # Sets the function that will be called to produce new stream objects. Streams
@@ -124,9 +184,13 @@ class InputSocket(object):
   # appropriately. Returns True if initialization succeeds.
   def init(self):
     header = self._read_blob(8)
-    if header == "pt\xf6n\00\00\00\00":
+    versions = {"\00": FRAMING_V1, chr(FRAMING_V2): FRAMING_V2}
+    if (header[:4] == _HEADER_START and header[5:] == "\00\00\00"
+        and header[4] in versions):
+      self.framing_version = versions[header[4]]
       root_stream = (self.stream_factory)(self)
       self._register_stream(None, root_stream)
+      self.bound_streams.append(root_stream)
       return True
     else:
       self.file = None
@@ -137,6 +201,8 @@ class InputSocket(object):
   # delivered to a stream. Returns True if an instruction was processed, False
   # if input was in valid or if there is no more input to fecth.
   def process_next_instruction(self):
+    if self.framing_version == FRAMING_V2:
+      return self._process_next_frame()
     opcode = self._get_byte()
     if opcode == _SET_DEFAULT_STRING_ENCODING:
       value = self._read_uint32()
@@ -151,13 +217,59 @@ class InputSocket(object):
       if not stream is None:
         stream.receive_block(block)
       return True
+    elif opcode == _ADD_TABLE_STRING:
+      # Strings are added in the order they arrive so they get the same
+      # indices as on the sending end.
+      value = self._read_value()
+      self._read_padding()
+      return self._add_table_string(value)
     else:
       return False
 
+  def _process_next_frame(self):
+    header = self._read_blob(struct.calcsize(_FRAME_HEADER))
+    if len(header) < struct.calcsize(_FRAME_HEADER):
+      return False
+    (opcode, flags, _, stream_index) = struct.unpack(_FRAME_HEADER, header)
+    size_format = "<Q" if (flags & _FRAME_LONG_SIZE) else "<I"
+    size_data = self._read_blob(struct.calcsize(size_format))
+    if len(size_data) < struct.calcsize(size_format):
+      return False
+    (size,) = struct.unpack(size_format, size_data)
+    block = bytearray(self._read_blob(size))
+    self._read_padding()
+    if opcode == _SET_DEFAULT_STRING_ENCODING:
+      self.string_codec = codec.StringCodec(self._decode(block))
+    elif opcode == _SEND_VALUE:
+      if stream_index < len(self.bound_streams):
+        stream = self.bound_streams[stream_index]
+        if not stream is None:
+          stream.receive_block(block)
+    elif opcode == _ADD_TABLE_STRING:
+      return self._add_table_string(self._decode(block))
+    elif opcode == _BIND_STREAM:
+      # Indices are bound in order.
+      if stream_index != len(self.bound_streams):
+        return False
+      self.bound_streams.append(self.streams.get(self._decode(block), None))
+    else:
+      return False
+    return True
+
   # Returns the root stream, the stream that receives messages sent to null.
   def get_root_stream(self):
     return self.streams.get(None, None)
 
+  def _add_table_string(self, value):
+    # The limit is on the encoded length but no string has more characters
+    # than bytes so this never rejects valid input.
+    if (not isinstance(value, basestring)
+        or len(value) > _MAX_TABLE_STRING_LENGTH
+        or len(self.string_table) >= _MAX_TABLE_SIZE):
+      return False
+    self.string_table.append(value)
+    return True
+
   def _register_stream(self, id, stream):
     self.streams[id] = stream
 
@@ -185,5 +297,7 @@ class InputSocket(object):
     return codec.DataInputStream.decode_uint32_from(self)
 
   def _read_value(self):
-    block = self._read_block()
+    return self._decode(self._read_block())
+
+  def _decode(self, block):
     return codec.DataInputStream(block, None, self.string_codec).read_object()
@@ -23,6 +23,49 @@ TEST(arena_cpp, alloc_values) {
   }
 }
 
+TEST(arena_cpp, alloc_sizes) {
+  Arena arena;
+  // Empty allocations give valid memory, also as the first allocation.
+  ASSERT_FALSE(arena.alloc_raw(0) == NULL);
+  // Mix small allocations with ones that span pages and ones large enough to
+  // get their own blocks and check that they don't overlap and are aligned.
+  static const size_t kCount = 200;
+  uint8_t *blocks[kCount];
+  size_t sizes[kCount];
+  for (size_t i = 0; i < kCount; i++) {
+    size_t size = (i % 7 == 0) ? (i * 331) : (i % 13);
+    uint8_t *memory = static_cast<uint8_t*>(arena.alloc_raw(size));
+    ASSERT_EQ(0, reinterpret_cast<uintptr_t>(memory) % 8);
+    memset(memory, static_cast<int>(i), size);
+    blocks[i] = memory;
+    sizes[i] = size;
+  }
+  for (size_t i = 0; i < kCount; i++) {
+    for (size_t j = 0; j < sizes[i]; j++)
+      ASSERT_EQ(static_cast<uint8_t>(i), blocks[i][j]);
+  }
+}
+
+TEST(arena_cpp, grow_values) {
+  Arena arena;
+  int64_t *values = arena.alloc_growable_values<int64_t>(4);
+  for (int64_t i = 0; i < 4; i++)
+    values[i] = i;
+  // The most recent allocation gets extended in place.
+  int64_t *grown = arena.grow_values<int64_t>(values, 4, 8);
+  ASSERT_PTREQ(values, grown);
+  // Once something else has been allocated the values have to move.
+  int64_t *other = arena.alloc_growable_values<int64_t>(4);
+  int64_t *moved = arena.grow_values<int64_t>(grown, 8, 16);
+  ASSERT_TRUE(moved != grown);
+  for (int64_t i = 0; i < 4; i++)
+    ASSERT_EQ(i, moved[i]);
+  // The abandoned storage gets reused.
+  ASSERT_PTREQ(grown, arena.alloc_growable_values<int64_t>(8));
+  arena.free_values<int64_t>(other, 4);
+  ASSERT_PTREQ(other, arena.alloc_growable_values<int64_t>(3));
+}
+
 TEST(arena_cpp, array) {
   Arena arena;
   Array array = arena.new_array();
@@ -51,6 +94,57 @@ TEST(arena_cpp, array) {
   ASSERT_EQ(0, null_array.length());
 }
 
+TEST(arena_cpp, int64_array) {
+  Arena arena;
+  Array array = arena.new_int64_array(0);
+  ASSERT_TRUE(array.is_array());
+  for (int64_t i = 0; i < 100; i++)
+    ASSERT_TRUE(array.add(i * 3));
+  // Only integers fit.
+  ASSERT_FALSE(array.add("foo"));
+  ASSERT_FALSE(array.add(Variant::null()));
+  ASSERT_EQ(100, array.length());
+  ASSERT_EQ(99 * 3, array[99].integer_value());
+  ASSERT_TRUE(array[100].is_null());
+  const int64_t *elms = NULL;
+  uint32_t length = 0;
+  ASSERT_TRUE(array.int64_span(&elms, &length));
+  ASSERT_EQ(100, length);
+  ASSERT_EQ(42, elms[14]);
+  ASSERT_FALSE(arena.new_array().int64_span(&elms, &length));
+  // Frozen packed arrays hash the same as ordinary ones.
+  Array plain = arena.new_array();
+  for (int64_t i = 0; i < 100; i++)
+    plain.add(i * 3);
+  array.ensure_frozen();
+  plain.ensure_frozen();
+  ASSERT_FALSE(array.add(1));
+  ASSERT_TRUE(array.structural_hash() == plain.structural_hash());
+}
+
+TEST(arena_cpp, float64_array) {
+  Arena arena;
+  Array array = arena.new_float64_array(0);
+  ASSERT_TRUE(array.is_array());
+  for (int64_t i = 0; i < 100; i++)
+    ASSERT_TRUE(array.add(Variant::float64(i * 0.5)));
+  // Only floats fit, not even integers.
+  ASSERT_FALSE(array.add(1));
+  ASSERT_FALSE(array.add(Variant::null()));
+  ASSERT_EQ(100, array.length());
+  ASSERT_TRUE(array[99].is_float());
+  ASSERT_TRUE(array[99].float64_value() == 49.5);
+  ASSERT_TRUE(array[100].is_null());
+  const double *elms = NULL;
+  uint32_t length = 0;
+  ASSERT_TRUE(array.float64_span(&elms, &length));
+  ASSERT_EQ(100, length);
+  ASSERT_TRUE(elms[14] == 7.0);
+  ASSERT_FALSE(arena.new_int64_array(0).float64_span(&elms, &length));
+  array.ensure_frozen();
+  ASSERT_FALSE(array.add(Variant::float64(1)));
+}
+
 TEST(arena_cpp, map) {
   Arena arena;
   Map map = arena.new_map();
@@ -79,6 +173,77 @@ TEST(arena_cpp, map) {
   ASSERT_EQ(0, null_map.size());
 }
 
+TEST(arena_cpp, map_index) {
+  Arena arena;
+  Map map = arena.new_map();
+  char buf[16];
+  for (size_t i = 0; i < 1000; i++) {
+    sprintf(buf, "key%i", static_cast<int>(i));
+    ASSERT_TRUE(map.set(arena.new_string(buf, strlen(buf)), i));
+    // Lookups in between additions see the index as it grows.
+    ASSERT_TRUE(map.has(arena.new_string(buf, strlen(buf))));
+  }
+  // Duplicates are kept but lookups find the first one.
+  ASSERT_TRUE(map.set("key10", 12345));
+  ASSERT_EQ(1001, map.size());
+  ASSERT_EQ(10, map["key10"].integer_value());
+  // Setting a key through a sink also gets picked up.
+  Sink key;
+  Sink value;
+  ASSERT_TRUE(map.set(&key, &value));
+  ASSERT_TRUE(key.set("late"));
+  ASSERT_TRUE(value.set(8));
+  ASSERT_EQ(8, map["late"].integer_value());
+  map.ensure_frozen();
+  for (size_t i = 0; i < 1000; i++) {
+    sprintf(buf, "key%i", static_cast<int>(i));
+    ASSERT_EQ(i, map[static_cast<const char*>(buf)].integer_value());
+  }
+  ASSERT_FALSE(map.has("key1000"));
+  ASSERT_FALSE(map.has(5));
+}
+
+TEST(arena_cpp, map_index_sinks) {
+  Arena arena;
+  Arena::Mark before = arena.mark();
+  Map map = arena.new_map();
+  Sink keys[64];
+  Sink values[64];
+  for (size_t i = 0; i < 64; i++)
+    ASSERT_TRUE(map.set(&keys[i], &values[i]));
+  // Until their keys are set the entries are all under null.
+  ASSERT_TRUE(map.has(Variant::null()));
+  // Fill in the keys back to front, every other one with a duplicate.
+  for (size_t i = 64; i > 0; i--) {
+    ASSERT_TRUE(keys[i - 1].set(static_cast<int64_t>((i - 1) / 2)));
+    ASSERT_TRUE(values[i - 1].set(static_cast<int64_t>(i - 1)));
+  }
+  ASSERT_FALSE(map.has(Variant::null()));
+  for (size_t i = 0; i < 32; i++)
+    ASSERT_EQ(2 * i, map[static_cast<int64_t>(i)].integer_value());
+  ASSERT_FALSE(map.has(32));
+  // The index lives in the arena's memory so nothing has to be cleaned up.
+  ASSERT_EQ(before.cleanup_count, arena.mark().cleanup_count);
+}
+
+TEST(arena_cpp, string) {
+  Arena arena;
+  char chars[4] = "foo";
+  plankton::String str = arena.new_string(chars, 3);
+  chars[0] = 'g';
+  ASSERT_TRUE(str.is_frozen());
+  ASSERT_TRUE(str.encoding() == Variant::default_string_encoding());
+  ASSERT_EQ(3, str.length());
+  ASSERT_EQ(0, strcmp("foo", str.chars()));
+  ASSERT_TRUE(str == Variant("foo"));
+  plankton::String sjis = arena.new_string("foo", 3, PTON_CHARSET_SHIFT_JIS);
+  ASSERT_TRUE(sjis.encoding() == PTON_CHARSET_SHIFT_JIS);
+  ASSERT_EQ(0, strcmp("foo", sjis.chars()));
+  plankton::String empty = arena.new_string(static_cast<const char*>(NULL), 0);
+  ASSERT_EQ(0, empty.length());
+  ASSERT_EQ(0, strcmp("", empty.chars()));
+}
+
 TEST(arena_cpp, mutstring) {
   Arena arena;
   plankton::String varu8 = arena.new_string(3);
@@ -117,3 +282,131 @@ TEST(arena_cpp, adopt_inner) {
   ASSERT_EQ(5, arr[1].integer_value());
   ASSERT_EQ(4, arr[2].integer_value());
 }
+
+TEST(arena_cpp, rewind) {
+  Arena arena;
+  Array before = arena.new_array();
+  before.add(1);
+  Arena::Mark mark = arena.mark();
+  uint8_t *first = arena.alloc_values<uint8_t>(64);
+  for (size_t i = 0; i < 1000; i++)
+    arena.alloc_values<uint8_t>(64);
+  uint8_t *large = arena.alloc_values<uint8_t>(64 * 1024);
+  ASSERT_TRUE(large != NULL);
+  ASSERT_TRUE(arena.rewind(mark));
+  // Memory handed out after the mark is reused, what came before it is kept.
+  ASSERT_PTREQ(first, arena.alloc_values<uint8_t>(64));
+  ASSERT_EQ(1, before.length());
+  ASSERT_EQ(1, before[0].integer_value());
+}
+
+class CleanupCounter {
+public:
+  CleanupCounter(int *count) : count_(count) { }
+  ~CleanupCounter() { (*count_)++; }
+private:
+  int *count_;
+};
+
+TEST(arena_cpp, rewind_cleanups) {
+  Arena arena;
+  int count = 0;
+  new (arena.alloc_and_register<CleanupCounter>()) CleanupCounter(&count);
+  {
+    ArenaScope scope(&arena);
+    new (arena.alloc_and_register<CleanupCounter>()) CleanupCounter(&count);
+    new (arena.alloc_and_register<CleanupCounter>()) CleanupCounter(&count);
+    ASSERT_EQ(0, count);
+  }
+  ASSERT_EQ(2, count);
+  arena.reset();
+  ASSERT_EQ(3, count);
+}
+
+TEST(arena_cpp, reset_adopted) {
+  Arena outer;
+  Arena inner;
+  Array arr = inner.new_array();
+  arr.add(8);
+  outer.adopt_ownership(&inner);
+  // The values are owned by the outer arena so resetting the inner one must
+  // leave them alone.
+  ASSERT_FALSE(inner.rewind(inner.mark()));
+  inner.reset();
+  Array other = inner.new_array();
+  other.add(9);
+  ASSERT_EQ(1, arr.length());
+  ASSERT_EQ(8, arr[0].integer_value());
+  ASSERT_EQ(9, other[0].integer_value());
+}
+
+TEST(arena_cpp, grow_many) {
+  Arena arena;
+  Array arr = arena.new_array();
+  Map map = arena.new_map();
+  for (int64_t i = 0; i < 100000; i++) {
+    arr.add(i);
+    if ((i % 100) == 0)
+      map.set(i, i + 1);
+  }
+  ASSERT_EQ(100000, arr.length());
+  for (int64_t i = 0; i < 100000; i++)
+    ASSERT_EQ(i, arr[i].integer_value());
+  ASSERT_EQ(1000, map.size());
+  ASSERT_EQ(501, map[500].integer_value());
+}
+
+TEST(arena_cpp, interned_strings) {
+  Arena arena;
+  // Without interning every string is new.
+  String a = arena.new_interned_string("foo", 3);
+  String b = arena.new_interned_string("foo", 3);
+  ASSERT_TRUE(a == b);
+  ASSERT_FALSE(a.string_chars() == b.string_chars());
+  arena.set_intern_strings(true);
+  String c = arena.new_interned_string("foo", 3);
+  ASSERT_PTREQ(c.string_chars(), arena.new_interned_string("foo", 3).string_chars());
+  ASSERT_FALSE(c.string_chars() == arena.new_interned_string("fo", 2).string_chars());
+  ASSERT_TRUE(c.is_frozen());
+  // Long strings aren't interned.
+  char chars[Arena::kMaxInternedLength + 1];
+  memset(chars, 'x', sizeof(chars));
+  ASSERT_FALSE(arena.new_interned_string(chars, sizeof(chars)).string_chars()
+      == arena.new_interned_string(chars, sizeof(chars)).string_chars());
+  // Rewinding forgets the strings interned since the mark.
+  Arena::Mark mark = arena.mark();
+  String d = arena.new_interned_string("bar", 3);
+  ASSERT_PTREQ(d.string_chars(), arena.new_interned_string("bar", 3).string_chars());
+  ASSERT_TRUE(arena.rewind(mark));
+  String e = arena.new_interned_string("bar", 3);
+  ASSERT_TRUE(e == Variant("bar"));
+  ASSERT_PTREQ(c.string_chars(), arena.new_interned_string("foo", 3).string_chars());
+  arena.reset();
+  ASSERT_TRUE(arena.new_interned_string("foo", 3) == Variant("foo"));
+}
+
+TEST(arena_cpp, interned_decoding) {
+  Arena arena;
+  arena.set_intern_strings(true);
+  TextReader text_reader(SOURCE_SYNTAX, &arena);
+  const char *source = "[{name: a, size: 1}, {name: b, size: 2}]";
+  Array decoded = text_reader.parse(source, strlen(source));
+  ASSERT_EQ(2, decoded.length());
+  BinaryWriter writer;
+  writer.write(decoded);
+  BinaryReader binary_reader(&arena);
+  Array binary = binary_reader.parse(*writer, writer.size());
+  Array lazy = binary_reader.parse_lazy(*writer, writer.size());
+  Variant values[3] = {decoded, binary, lazy};
+  const char *name = NULL;
+  for (size_t i = 0; i < 3; i++) {
+    Array array = values[i];
+    for (size_t j = 0; j < 2; j++) {
+      Map map = array[j];
+      Map::Iterator iter = map.begin();
+      if (name == NULL)
+        name = iter->key().string_chars();
+      ASSERT_PTREQ(name, iter->key().string_chars());
+    }
+  }
+}
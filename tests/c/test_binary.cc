@@ -7,6 +7,8 @@
 #include "utils/callback.hh"
 #include "variant-inl.hh"
 
+#include <math.h>
+
 using namespace plankton;
 
 #define DEBUG_PRINT 0
@@ -76,3 +78,946 @@ TEST(binary, string_encodings) {
   Variant decoded = reader.parse(*writer, writer.size());
   ASSERT_EQ(PTON_CHARSET_SHIFT_JIS, decoded.string_encoding());
 }
+
+TEST(binary, borrow_input) {
+  Arena arena;
+  Array array = arena.new_array();
+  array.add("foo");
+  array.add(Variant::blob("\1\2\3\0\4", 5));
+  array.add(arena.new_string("bar", 3, PTON_CHARSET_SHIFT_JIS));
+  BinaryWriter writer;
+  writer.write(array);
+  const uint8_t *start = *writer;
+  const uint8_t *end = start + writer.size();
+  BinaryReader reader(&arena);
+  reader.set_borrow_strings(true);
+  reader.set_borrow_blobs(true);
+  Array decoded = reader.parse(*writer, writer.size());
+  ASSERT_EQ(3, decoded.length());
+  ASSERT_TRUE(decoded[0] == Variant("foo"));
+  ASSERT_TRUE(decoded[1] == array[1]);
+  ASSERT_TRUE(decoded[2] == array[2]);
+  // The default encoded string and the blob point into the input, the string
+  // with a custom encoding had to be copied.
+  const uint8_t *chars = reinterpret_cast<const uint8_t*>(decoded[0].string_chars());
+  ASSERT_TRUE(start <= chars && chars < end);
+  const uint8_t *data = static_cast<const uint8_t*>(decoded[1].blob_data());
+  ASSERT_TRUE(start <= data && data < end);
+  ASSERT_EQ(PTON_CHARSET_SHIFT_JIS, decoded[2].string_encoding());
+}
+
+TEST(binary, references) {
+  Arena arena;
+  Seed shared = arena.new_seed();
+  shared.set_header("shared");
+  shared.set_field("x", 10);
+  Array array = arena.new_array();
+  for (size_t i = 0; i < 3; i++)
+    array.add(shared);
+  BinaryWriter plain;
+  plain.write(array);
+  BinaryWriter writer;
+  writer.set_emit_references(true);
+  writer.write(array);
+  ASSERT_TRUE(writer.size() < plain.size());
+  ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+  BinaryReader reader(&arena);
+  Array decoded = reader.parse(*writer, writer.size());
+  ASSERT_EQ(3, decoded.length());
+  Seed first = decoded[0];
+  ASSERT_TRUE(first.header() == Variant("shared"));
+  ASSERT_EQ(10, first.get_field("x").integer_value());
+  for (size_t i = 1; i < 3; i++)
+    ASSERT_PTREQ(first.to_c().payload_.as_arena_seed_,
+        decoded[i].to_c().payload_.as_arena_seed_);
+}
+
+TEST(binary, cyclic_references) {
+  Arena arena;
+  Seed seed = arena.new_seed();
+  seed.set_header("cycle");
+  seed.set_field("self", seed);
+  BinaryWriter writer;
+  writer.set_emit_references(true);
+  writer.write(seed);
+  BinaryReader reader(&arena);
+  Seed decoded = reader.parse(*writer, writer.size());
+  ASSERT_TRUE(decoded.header() == Variant("cycle"));
+  Variant self = decoded.get_field("self");
+  ASSERT_PTREQ(decoded.to_c().payload_.as_arena_seed_,
+      self.to_c().payload_.as_arena_seed_);
+  // Without references a seed within itself is still written as one, rather
+  // than the writer recursing forever.
+  BinaryWriter plain;
+  plain.write(seed);
+  ASSERT_EQ(writer.size(), plain.size());
+  ASSERT_EQ(0, memcmp(*writer, *plain, plain.size()));
+  // The same goes for a cycle that comes from the input and for columns.
+  BinaryWriter rewriter;
+  rewriter.write(decoded);
+  ASSERT_EQ(writer.size(), rewriter.size());
+  Array rows = arena.new_array();
+  Seed row = arena.new_seed();
+  row.set_header("row");
+  row.set_field("rows", rows);
+  rows.add(row);
+  rows.add(row);
+  BinaryWriter columns;
+  columns.set_columns_threshold(2);
+  columns.write(rows);
+  Array rows_decoded = reader.parse(*columns, columns.size());
+  ASSERT_EQ(2, rows_decoded.length());
+  Seed row_decoded = rows_decoded[0];
+  ASSERT_TRUE(row_decoded.header() == Variant("row"));
+  ASSERT_EQ(2, Array(row_decoded.get_field("rows")).length());
+  // Text has no references so the inner occurrence can't be written.
+  TextWriter text;
+  text.write(decoded);
+  ASSERT_EQ(0, strcmp("@cycle(self: ?)", *text));
+}
+
+// Feeds the given input to an incremental reader in chunks of the given size
+// and returns the result.
+static Variant read_in_chunks(Arena *arena, const uint8_t *data, size_t size,
+    size_t chunk_size) {
+  BinaryReader config(arena);
+  IncrementalBinaryReader reader(&config);
+  size_t cursor = 0;
+  while (cursor < size) {
+    size_t next = size - cursor;
+    if (next > chunk_size)
+      next = chunk_size;
+    size_t consumed = 0;
+    IncrementalBinaryReader::Status status = reader.feed(data + cursor, next,
+        &consumed);
+    ASSERT_EQ(next, consumed);
+    cursor += next;
+    if (cursor < size) {
+      ASSERT_EQ(IncrementalBinaryReader::NEED_MORE, status);
+    } else {
+      ASSERT_EQ(IncrementalBinaryReader::DONE, status);
+    }
+  }
+  return reader.result();
+}
+
+TEST(binary, incremental) {
+  Arena arena;
+  Map map = arena.new_map();
+  map.set("a", 1);
+  map.set("b", arena.new_string(2000));
+  Array array = arena.new_array();
+  array.add(map);
+  array.add(arena.new_blob(5000));
+  array.add(arena.new_string("foo", 3, PTON_CHARSET_SHIFT_JIS));
+  array.add(Variant::id64(0xFABACAEA));
+  array.add(Variant::id(8, 0x42));
+  array.add(arena.new_array());
+  Seed seed = arena.new_seed();
+  seed.set_header("point");
+  seed.set_field("x", -100000);
+  array.add(seed);
+  BinaryWriter writer;
+  writer.write(array);
+  TextWriter expected;
+  expected.write(array);
+  size_t chunk_sizes[5] = {1, 2, 7, 100, writer.size()};
+  for (size_t i = 0; i < 5; i++) {
+    Arena decoded_arena;
+    Variant decoded = read_in_chunks(&decoded_arena, *writer, writer.size(),
+        chunk_sizes[i]);
+    ASSERT_TRUE(decoded.is_frozen());
+    TextWriter found;
+    found.write(decoded);
+    ASSERT_EQ(0, strcmp(*expected, *found));
+  }
+}
+
+TEST(binary, incremental_trailing) {
+  Arena arena;
+  BinaryReader config(&arena);
+  IncrementalBinaryReader reader(&config);
+  // An array of two integers followed by some unrelated bytes.
+  uint8_t data[6] = {BinaryImplUtils::boArray, 2, BinaryImplUtils::boInteger,
+      4, BinaryImplUtils::boNull, 0xFF};
+  size_t consumed = 0;
+  ASSERT_EQ(IncrementalBinaryReader::NEED_MORE, reader.feed(data, 3, &consumed));
+  ASSERT_EQ(3, consumed);
+  ASSERT_TRUE(reader.result().is_null());
+  ASSERT_EQ(IncrementalBinaryReader::DONE, reader.feed(data + 3, 3, &consumed));
+  ASSERT_EQ(2, consumed);
+  Array result = reader.result();
+  ASSERT_EQ(2, result.length());
+  ASSERT_EQ(2, result[0].integer_value());
+  ASSERT_TRUE(result[1].is_null());
+  reader.reset();
+  ASSERT_TRUE(reader.result().is_null());
+  ASSERT_EQ(IncrementalBinaryReader::FAILED, reader.feed(data + 5, 1));
+}
+
+// Feeds the given bytes to a fresh incremental reader and returns the status.
+static IncrementalBinaryReader::Status feed_fresh(const uint8_t *data,
+    size_t size) {
+  Arena arena;
+  BinaryReader config(&arena);
+  IncrementalBinaryReader reader(&config);
+  return reader.feed(data, size);
+}
+
+TEST(binary, incremental_invalid) {
+  // Headers that are invalid fail as soon as that's clear, they don't wait
+  // for more input.
+  uint8_t bad_opcode[1] = {0xFF};
+  ASSERT_EQ(IncrementalBinaryReader::FAILED, feed_fresh(bad_opcode, 1));
+  uint8_t bad_layout[3] = {BinaryImplUtils::boIndexedArray, 2, 0x70};
+  ASSERT_EQ(IncrementalBinaryReader::FAILED, feed_fresh(bad_layout, 3));
+  uint8_t bad_id[2] = {BinaryImplUtils::boId, 3};
+  ASSERT_EQ(IncrementalBinaryReader::FAILED, feed_fresh(bad_id, 2));
+  uint8_t long_length[6] = {BinaryImplUtils::boArray, 0xFF, 0xFF, 0xFF, 0xFF,
+      0xFF};
+  ASSERT_EQ(IncrementalBinaryReader::FAILED, feed_fresh(long_length, 6));
+  uint8_t long_int[11] = {BinaryImplUtils::boInteger, 0xFF, 0xFF, 0xFF, 0xFF,
+      0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  ASSERT_EQ(IncrementalBinaryReader::FAILED, feed_fresh(long_int, 11));
+  // Headers that are valid as far as they go wait for more.
+  ASSERT_EQ(IncrementalBinaryReader::NEED_MORE, feed_fresh(long_length, 5));
+  ASSERT_EQ(IncrementalBinaryReader::NEED_MORE, feed_fresh(long_int, 10));
+  ASSERT_EQ(IncrementalBinaryReader::NEED_MORE, feed_fresh(bad_layout, 2));
+  ASSERT_EQ(IncrementalBinaryReader::NEED_MORE, feed_fresh(bad_id, 1));
+  uint8_t id8[3] = {BinaryImplUtils::boId, 1, 0x42};
+  ASSERT_EQ(IncrementalBinaryReader::NEED_MORE, feed_fresh(id8, 2));
+  ASSERT_EQ(IncrementalBinaryReader::DONE, feed_fresh(id8, 3));
+}
+
+TEST(binary, incremental_claimed_length) {
+  // Contents that claim to be huge only cost as much memory as has arrived.
+  uint8_t opcodes[3] = {BinaryImplUtils::boBlob,
+      BinaryImplUtils::boDefaultString, BinaryImplUtils::boFloat64Array};
+  for (size_t i = 0; i < 3; i++) {
+    uint8_t data[32];
+    memset(data, 0, 32);
+    data[0] = opcodes[i];
+    BinaryImplUtils::encode_varint(0x1FFFFFF0, data + 1);
+    ASSERT_EQ(IncrementalBinaryReader::NEED_MORE, feed_fresh(data, 32));
+  }
+  // Once all the contents have arrived they're delivered as usual.
+  Arena arena;
+  BinaryReader config(&arena);
+  IncrementalBinaryReader reader(&config);
+  uint8_t data[210];
+  data[0] = BinaryImplUtils::boBlob;
+  size_t header_size = 1 + BinaryImplUtils::encode_varint(200, data + 1);
+  for (size_t i = 0; i < 200; i++)
+    data[header_size + i] = static_cast<uint8_t>(i);
+  ASSERT_EQ(IncrementalBinaryReader::NEED_MORE, reader.feed(data, 100));
+  ASSERT_EQ(IncrementalBinaryReader::DONE, reader.feed(data + 100,
+      header_size + 100));
+  Blob blob = reader.result();
+  ASSERT_EQ(200, blob.size());
+  ASSERT_EQ(0, memcmp(data + header_size, blob.data(), 200));
+}
+
+TEST(binary, cursor_events) {
+  Arena arena;
+  Map map = arena.new_map();
+  map.set("id", 8);
+  map.set("args", arena.new_array());
+  Seed seed = arena.new_seed();
+  seed.set_header("point");
+  seed.set_field("x", 3);
+  Array array = arena.new_array();
+  array.add(map);
+  array.add(seed);
+  array.add("end");
+  BinaryWriter writer;
+  writer.write(array);
+  BinaryCursor cursor(*writer, writer.size());
+  pton_cursor_event_t expected[20] = {
+    PTON_CURSOR_BEGIN,  // [
+    PTON_CURSOR_BEGIN,  //   {
+    PTON_CURSOR_ATOM,   //     "id"
+    PTON_CURSOR_ATOM,   //     8
+    PTON_CURSOR_ATOM,   //     "args"
+    PTON_CURSOR_BEGIN,  //     [
+    PTON_CURSOR_END,    //     ]
+    PTON_CURSOR_END,    //   }
+    PTON_CURSOR_BEGIN,  //   @point(
+    PTON_CURSOR_ATOM,   //     "point"
+    PTON_CURSOR_ATOM,   //     "x"
+    PTON_CURSOR_ATOM,   //     3
+    PTON_CURSOR_END,    //   )
+    PTON_CURSOR_ATOM,   //   "end"
+    PTON_CURSOR_END,    // ]
+    PTON_CURSOR_DONE,
+    PTON_CURSOR_DONE
+  };
+  pton_instr_t instr;
+  for (size_t i = 0; i < 17; i++) {
+    ASSERT_EQ(expected[i], cursor.next(&instr));
+    if (i == 3)
+      ASSERT_EQ(8, instr.payload.int64_value);
+  }
+  ASSERT_EQ(writer.size(), cursor.offset());
+  ASSERT_FALSE(cursor.skip_value());
+}
+
+TEST(binary, cursor_skip) {
+  Arena arena;
+  Map message = arena.new_map();
+  Array big = arena.new_array();
+  for (size_t i = 0; i < 100; i++)
+    big.add(arena.new_string("padding"));
+  message.set("payload", big);
+  message.set("serial", 17);
+  BinaryWriter writer;
+  writer.write(message);
+  // Find the serial without looking inside the payload.
+  BinaryCursor cursor(*writer, writer.size());
+  pton_instr_t instr;
+  ASSERT_EQ(PTON_CURSOR_BEGIN, cursor.next(&instr));
+  ASSERT_EQ(2, instr.payload.map_size);
+  ASSERT_EQ(PTON_CURSOR_ATOM, cursor.next(&instr));
+  ASSERT_TRUE(cursor.skip_value());
+  ASSERT_EQ(PTON_CURSOR_ATOM, cursor.next(&instr));
+  ASSERT_EQ(PTON_OPCODE_DEFAULT_STRING, instr.opcode);
+  ASSERT_EQ(0, strncmp("serial",
+      reinterpret_cast<const char*>(instr.payload.default_string_data.contents),
+      6));
+  ASSERT_EQ(PTON_CURSOR_ATOM, cursor.next(&instr));
+  ASSERT_EQ(17, instr.payload.int64_value);
+  ASSERT_FALSE(cursor.skip_value());
+  ASSERT_EQ(PTON_CURSOR_END, cursor.next(&instr));
+  ASSERT_EQ(PTON_CURSOR_DONE, cursor.next(&instr));
+  // Skipping the whole value.
+  BinaryCursor whole(*writer, writer.size());
+  ASSERT_TRUE(whole.skip_value());
+  ASSERT_EQ(writer.size(), whole.offset());
+  ASSERT_EQ(PTON_CURSOR_DONE, whole.next(&instr));
+  // Truncated input.
+  BinaryCursor truncated(*writer, writer.size() - 1);
+  ASSERT_EQ(PTON_CURSOR_BEGIN, truncated.next(&instr));
+  ASSERT_EQ(PTON_CURSOR_ATOM, truncated.next(&instr));
+  ASSERT_TRUE(truncated.skip_value());
+  ASSERT_EQ(PTON_CURSOR_ATOM, truncated.next(&instr));
+  ASSERT_EQ(PTON_CURSOR_ERROR, truncated.next(&instr));
+  ASSERT_FALSE(truncated.skip_value());
+}
+
+TEST(binary, lazy) {
+  Arena arena;
+  Map map = arena.new_map();
+  Array big = arena.new_array();
+  for (size_t i = 0; i < 50; i++)
+    big.add(Variant::integer(i));
+  map.set("big", big);
+  map.set("name", "foo");
+  Seed seed = arena.new_seed();
+  seed.set_header("point");
+  seed.set_field("x", 3);
+  seed.set_field("y", 4);
+  map.set("point", seed);
+  map.set("blob", arena.new_blob("abc", 3));
+  map.set("encoded", arena.new_string("bar", 3, PTON_CHARSET_SHIFT_JIS));
+  BinaryWriter writer;
+  writer.write(map);
+  Arena decoded_arena;
+  BinaryReader reader(&decoded_arena);
+  Map lazy = reader.parse_lazy(*writer, writer.size());
+  ASSERT_TRUE(lazy.is_map());
+  // Reading a lazy value changes it internally so it isn't frozen.
+  ASSERT_FALSE(lazy.is_frozen());
+  ASSERT_EQ(5, lazy.size());
+  // Lookups out of order.
+  ASSERT_TRUE(lazy["name"] == Variant("foo"));
+  Array lazy_big = lazy["big"];
+  ASSERT_TRUE(lazy_big.is_array());
+  ASSERT_EQ(50, lazy_big.length());
+  ASSERT_EQ(49, lazy_big[49].integer_value());
+  ASSERT_EQ(7, lazy_big[7].integer_value());
+  ASSERT_TRUE(lazy_big[50].is_null());
+  Seed point = lazy["point"];
+  ASSERT_TRUE(point.is_seed());
+  ASSERT_EQ(4, point.get_field("y").integer_value());
+  ASSERT_TRUE(point.header() == Variant("point"));
+  ASSERT_EQ(2, point.field_count());
+  ASSERT_TRUE(lazy.has("encoded"));
+  ASSERT_FALSE(lazy.has("missing"));
+  // Looking the same thing up twice gives the same value.
+  ASSERT_TRUE(lazy["big"] == lazy_big);
+  // Lazy values can't be modified.
+  ASSERT_FALSE(lazy.set("new", 1));
+  ASSERT_FALSE(lazy_big.add(1));
+  ASSERT_FALSE(point.set_field("z", 5));
+  ASSERT_FALSE(point.set_header("other"));
+  ASSERT_TRUE(point.header() == Variant("point"));
+  // Everything else works like the eagerly decoded value.
+  TextWriter expected;
+  expected.write(map);
+  TextWriter found;
+  found.write(lazy);
+  ASSERT_EQ(0, strcmp(*expected, *found));
+  Map eager = reader.parse(*writer, writer.size());
+  ASSERT_TRUE(lazy_big.structural_hash() == eager["big"].structural_hash());
+}
+
+TEST(binary, lazy_references) {
+  Arena arena;
+  Seed shared = arena.new_seed();
+  shared.set_header("shared");
+  Seed cycle = arena.new_seed();
+  cycle.set_header("cycle");
+  cycle.set_field("self", cycle);
+  Array array = arena.new_array();
+  array.add(shared);
+  array.add(cycle);
+  array.add(shared);
+  BinaryWriter writer;
+  writer.set_emit_references(true);
+  writer.write(array);
+  Arena decoded_arena;
+  BinaryReader reader(&decoded_arena);
+  Array lazy = reader.parse_lazy(*writer, writer.size());
+  // Access the reference before the value it refers to.
+  Seed last = lazy[2];
+  ASSERT_TRUE(last.header() == Variant("shared"));
+  ASSERT_PTREQ(last.to_c().payload_.as_arena_seed_,
+      lazy[0].to_c().payload_.as_arena_seed_);
+  Seed self = lazy[1];
+  ASSERT_PTREQ(self.to_c().payload_.as_arena_seed_,
+      self.get_field("self").to_c().payload_.as_arena_seed_);
+}
+
+TEST(binary, lazy_invalid) {
+  Arena arena;
+  BinaryReader reader(&arena);
+  // An array of three integers that is cut short after two.
+  uint8_t data[5] = {BinaryImplUtils::boArray, 3, BinaryImplUtils::boInteger,
+      2, BinaryImplUtils::boInteger};
+  ASSERT_TRUE(reader.parse_lazy(data, 5).is_null());
+  Array array = arena.new_array();
+  array.add(arena.new_array());
+  array.add(8);
+  BinaryWriter writer;
+  writer.write(array);
+  // Corrupt the second element.
+  uint8_t *corrupt = new uint8_t[writer.size()];
+  memcpy(corrupt, *writer, writer.size());
+  corrupt[writer.size() - 2] = 0xFF;
+  Array lazy = reader.parse_lazy(corrupt, writer.size());
+  ASSERT_TRUE(lazy.is_null());
+  delete[] corrupt;
+}
+
+TEST(binary, indexed) {
+  Arena arena;
+  Map map = arena.new_map();
+  Array big = arena.new_array();
+  for (int64_t i = 0; i < 300; i++)
+    big.add(arena.new_string("padding"));
+  Array small = arena.new_array();
+  small.add(1);
+  small.add(2);
+  map.set("big", big);
+  map.set("small", small);
+  map.set("empty", arena.new_array());
+  map.set("serial", 17);
+  BinaryWriter writer;
+  writer.set_index_threshold(4);
+  writer.write(map);
+  ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+  TextWriter expected;
+  expected.write(map);
+  // Read eagerly.
+  Arena decoded_arena;
+  BinaryReader reader(&decoded_arena);
+  TextWriter eager;
+  eager.write(reader.parse(*writer, writer.size()));
+  ASSERT_EQ(0, strcmp(*expected, *eager));
+  // Read incrementally one byte at a time.
+  TextWriter incremental;
+  incremental.write(read_in_chunks(&decoded_arena, *writer, writer.size(), 1));
+  ASSERT_EQ(0, strcmp(*expected, *incremental));
+  // Both the map and the big array are indexed and need two-byte entries.
+  pton_instr_t instr;
+  BinaryCursor cursor(*writer, writer.size());
+  ASSERT_EQ(PTON_CURSOR_BEGIN, cursor.next(&instr));
+  ASSERT_EQ(PTON_OPCODE_BEGIN_INDEXED_MAP, instr.opcode);
+  ASSERT_EQ(4, instr.payload.indexed_data.count);
+  ASSERT_EQ(2, instr.payload.indexed_data.entry_size);
+  ASSERT_EQ(PTON_CURSOR_ATOM, cursor.next(&instr));
+  ASSERT_EQ(PTON_CURSOR_BEGIN, cursor.next(&instr));
+  ASSERT_EQ(PTON_OPCODE_BEGIN_INDEXED_ARRAY, instr.opcode);
+  ASSERT_EQ(300, instr.payload.indexed_data.count);
+  ASSERT_EQ(2, instr.payload.indexed_data.entry_size);
+  // Skip the whole value in one step.
+  BinaryCursor whole(*writer, writer.size());
+  ASSERT_TRUE(whole.skip_value());
+  ASSERT_EQ(writer.size(), whole.offset());
+  // Below the threshold nothing is indexed.
+  BinaryWriter plain;
+  plain.write(map);
+  BinaryCursor plain_cursor(*plain, plain.size());
+  ASSERT_EQ(PTON_CURSOR_BEGIN, plain_cursor.next(&instr));
+  ASSERT_EQ(PTON_OPCODE_BEGIN_MAP, instr.opcode);
+  ASSERT_TRUE(writer.size() > plain.size());
+}
+
+TEST(binary, indexed_access) {
+  Arena arena;
+  Array array = arena.new_array();
+  for (int64_t i = 0; i < 100; i++) {
+    Array pair = arena.new_array();
+    pair.add(i);
+    pair.add(i * i);
+    array.add(pair);
+  }
+  BinaryWriter writer;
+  writer.set_index_threshold(10);
+  writer.write(array);
+  Arena decoded_arena;
+  BinaryReader reader(&decoded_arena);
+  Array lazy = reader.parse_lazy(*writer, writer.size());
+  ASSERT_EQ(100, lazy.length());
+  // Elements can be accessed in any order.
+  ASSERT_EQ(99 * 99, Array(lazy[99])[1].integer_value());
+  ASSERT_EQ(3, Array(lazy[3])[0].integer_value());
+  ASSERT_TRUE(lazy[50] == lazy[50]);
+  ASSERT_TRUE(lazy[100].is_null());
+  TextWriter expected;
+  expected.write(array);
+  TextWriter found;
+  found.write(lazy);
+  ASSERT_EQ(0, strcmp(*expected, *found));
+  // An index that doesn't match the contents is invalid.
+  uint8_t *corrupt = new uint8_t[writer.size()];
+  memcpy(corrupt, *writer, writer.size());
+  BinaryCursor cursor(corrupt, writer.size());
+  pton_instr_t instr;
+  ASSERT_EQ(PTON_CURSOR_BEGIN, cursor.next(&instr));
+  size_t entry = instr.payload.indexed_data.table - corrupt;
+  corrupt[entry + 1]++;
+  ASSERT_FALSE(BinaryReader::validate(corrupt, writer.size()));
+  delete[] corrupt;
+}
+
+TEST(binary, measure) {
+  Arena arena;
+  Map map = arena.new_map();
+  Array big = arena.new_array();
+  for (int64_t i = 0; i < 300; i++)
+    big.add(i * 1000);
+  Seed shared = arena.new_seed();
+  shared.set_header("shared");
+  map.set("big", big);
+  map.set("a", shared);
+  map.set("b", shared);
+  map.set("id", Variant::id64(0xFACE));
+  map.set("blob", arena.new_blob("xyz", 3));
+  for (size_t i = 0; i < 4; i++) {
+    BinaryWriter writer;
+    writer.set_emit_references((i & 1) != 0);
+    writer.set_index_threshold((i & 2) ? 2 : 0);
+    size_t size = writer.measure(map);
+    writer.write(map);
+    ASSERT_EQ(size, writer.size());
+    // Writing into memory supplied by the caller gives the same result.
+    uint8_t *dest = new uint8_t[size];
+    ASSERT_EQ(size, writer.write(map, dest, size - 1));
+    ASSERT_EQ(size, writer.write(map, dest, size));
+    ASSERT_EQ(0, memcmp(*writer, dest, size));
+    delete[] dest;
+    // Release hands over the buffer.
+    uint8_t *released = writer.release();
+    ASSERT_EQ(0, writer.size());
+    ASSERT_TRUE(*writer == NULL);
+    delete[] released;
+  }
+  BinaryWriter writer;
+  writer.write(big);
+  ASSERT_EQ(writer.size(), pton_binary_size(big.to_c()));
+}
+
+TEST(binary, varints) {
+  uint64_t values[] = {0, 1, 0x7F, 0x80, 16511, 16512, 0xFFFFFFFF,
+      0x7FFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL};
+  for (size_t i = 0; i < sizeof(values) / sizeof(uint64_t); i++) {
+    uint8_t encoded[BinaryImplUtils::kMaxVarintSize];
+    size_t size = BinaryImplUtils::encode_varint(values[i], encoded);
+    ASSERT_TRUE(size <= BinaryImplUtils::kMaxVarintSize);
+    uint64_t decoded = 0;
+    ASSERT_EQ(size, BinaryImplUtils::decode_varint(encoded, size, &decoded));
+    ASSERT_EQ(values[i], decoded);
+    // Cutting off the last byte makes it invalid.
+    ASSERT_EQ(0, BinaryImplUtils::decode_varint(encoded, size - 1, &decoded));
+  }
+  uint8_t two[2] = {0x80, 0x00};
+  uint64_t decoded = 0;
+  ASSERT_EQ(2, BinaryImplUtils::decode_varint(two, 2, &decoded));
+  ASSERT_EQ(128, decoded);
+  // Varints can't go on forever.
+  uint8_t endless[12];
+  memset(endless, 0xFF, 12);
+  ASSERT_EQ(0, BinaryImplUtils::decode_varint(endless, 12, &decoded));
+}
+
+// Writes the given values as a packed array and checks that they're read back
+// the same way by all the readers.
+static void check_int64_array(const int64_t *values, uint32_t count) {
+  Arena arena;
+  Array array = arena.new_int64_array(count);
+  for (uint32_t i = 0; i < count; i++)
+    array.add(values[i]);
+  BinaryWriter writer;
+  writer.write(array);
+  ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+  BinaryReader reader(&arena);
+  Variant decoded[3] = {
+    reader.parse(*writer, writer.size()),
+    reader.parse_lazy(*writer, writer.size()),
+    read_in_chunks(&arena, *writer, writer.size(), 1)
+  };
+  for (size_t i = 0; i < 3; i++) {
+    const int64_t *elms = NULL;
+    uint32_t length = 0;
+    ASSERT_TRUE(decoded[i].array_int64_span(&elms, &length));
+    ASSERT_EQ(count, length);
+    for (uint32_t j = 0; j < count; j++)
+      ASSERT_EQ(values[j], elms[j]);
+  }
+}
+
+TEST(binary, int64_array) {
+  int64_t small[5] = {1, -1, 127, -128, 0};
+  check_int64_array(small, 5);
+  int64_t wide[4] = {INT64_MIN, INT64_MAX, 0, -1};
+  check_int64_array(wide, 4);
+  int64_t empty[1] = {0};
+  check_int64_array(empty, 0);
+  // Values that change slowly but are large are written as deltas.
+  int64_t timestamps[1000];
+  for (size_t i = 0; i < 1000; i++)
+    timestamps[i] = 1400000000000LL + i * 7;
+  check_int64_array(timestamps, 1000);
+  Arena arena;
+  Array packed = arena.new_int64_array(1000);
+  Array plain = arena.new_array(1000);
+  for (size_t i = 0; i < 1000; i++) {
+    packed.add(timestamps[i]);
+    plain.add(timestamps[i]);
+  }
+  BinaryWriter packed_writer;
+  packed_writer.write(packed);
+  BinaryWriter plain_writer;
+  plain_writer.write(plain);
+  ASSERT_TRUE(packed_writer.size() * 4 < plain_writer.size());
+  pton_instr_t instr;
+  ASSERT_TRUE(pton_decode_next_instruction(*packed_writer, packed_writer.size(),
+      &instr));
+  ASSERT_EQ(PTON_OPCODE_INT64_ARRAY, instr.opcode);
+  ASSERT_EQ(BinaryImplUtils::iaDeltas << 4, instr.payload.int64_array_data.layout);
+  // Deltas that run past the end of the contents are invalid.
+  uint8_t overrun[6] = {BinaryImplUtils::boInt64Array, 2,
+      BinaryImplUtils::iaDeltas << 4, 2, 0x80, 0x80};
+  ASSERT_FALSE(BinaryReader::validate(overrun, 6));
+  BinaryReader reader(&arena);
+  ASSERT_TRUE(reader.parse(overrun, 6).is_null());
+  ASSERT_TRUE(reader.parse_lazy(overrun, 6).is_null());
+}
+
+TEST(binary, floats) {
+  double values[8] = {0.0, -0.0, 1.5, -2.25, 0.1, 1e300, -1e-300, 1.0 / 3};
+  for (size_t i = 0; i < 8; i++)
+    CHECK_BINARY(Variant::float64(values[i]));
+  // Floats are stored as the opcode followed by 8 little-endian bytes.
+  BinaryWriter writer;
+  writer.write(Variant::float64(-2.0));
+  uint8_t expected[9] = {BinaryImplUtils::boFloat64, 0, 0, 0, 0, 0, 0, 0, 0xC0};
+  ASSERT_EQ(9, writer.size());
+  ASSERT_EQ(0, memcmp(expected, *writer, 9));
+  // Floats are distinct from integers with the same value.
+  ASSERT_FALSE(Variant::float64(1.0) == Variant::integer(1));
+  ASSERT_TRUE(Variant::float64(0.0) == Variant::float64(-0.0));
+  ASSERT_TRUE(Variant::float64(0.0).hash() == Variant::float64(-0.0).hash());
+  Variant nan = Variant::float64(NAN);
+  ASSERT_TRUE(nan == Variant::float64(NAN));
+  ASSERT_TRUE(nan.hash() == Variant::float64(NAN).hash());
+  Arena arena;
+  BinaryReader reader(&arena);
+  ASSERT_TRUE(reader.parse(expected, 9) == Variant::float64(-2.0));
+  Map map = arena.new_map();
+  map.set(nan, 1);
+  map.set(Variant::float64(2.5), 2);
+  ASSERT_EQ(1, map[Variant::float64(NAN)].integer_value());
+  ASSERT_EQ(2, map[Variant::float64(2.5)].integer_value());
+  // A truncated float is invalid.
+  uint8_t truncated[5] = {BinaryImplUtils::boFloat64, 0, 0, 0, 0};
+  ASSERT_FALSE(BinaryReader::validate(truncated, 5));
+}
+
+TEST(binary, float64_array) {
+  double values[5] = {0.5, -1.25, 1e100, 0.0, 3.0};
+  for (uint32_t count = 0; count <= 5; count++) {
+    Arena arena;
+    Array array = arena.new_float64_array(count);
+    for (uint32_t i = 0; i < count; i++)
+      ASSERT_TRUE(array.add(Variant::float64(values[i])));
+    BinaryWriter writer;
+    writer.write(array);
+    ASSERT_EQ(2 + 8 * count, writer.size());
+    ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+    BinaryReader reader(&arena);
+    Variant decoded[3] = {
+      reader.parse(*writer, writer.size()),
+      reader.parse_lazy(*writer, writer.size()),
+      read_in_chunks(&arena, *writer, writer.size(), 3)
+    };
+    for (size_t i = 0; i < 3; i++) {
+      const double *elms = NULL;
+      uint32_t length = 0;
+      ASSERT_TRUE(decoded[i].array_float64_span(&elms, &length));
+      ASSERT_EQ(count, length);
+      for (uint32_t j = 0; j < count; j++)
+        ASSERT_TRUE(values[j] == elms[j]);
+    }
+  }
+  // Packed arrays that are cut short are invalid.
+  uint8_t truncated[6] = {BinaryImplUtils::boFloat64Array, 1, 0, 0, 0, 0};
+  ASSERT_FALSE(BinaryReader::validate(truncated, 6));
+}
+
+// Checks that the given encoded value reads back as the expected value
+// eagerly, lazily, and incrementally.
+static void check_reads_as(Variant expected_value, BinaryWriter &writer) {
+  ASSERT_TRUE(BinaryReader::validate(*writer, writer.size()));
+  TextWriter expected;
+  expected.write(expected_value);
+  Arena arena;
+  BinaryReader reader(&arena);
+  Variant decoded[3] = {
+    reader.parse(*writer, writer.size()),
+    reader.parse_lazy(*writer, writer.size()),
+    read_in_chunks(&arena, *writer, writer.size(), 1)
+  };
+  for (size_t i = 0; i < 3; i++) {
+    TextWriter found;
+    found.write(decoded[i]);
+    ASSERT_EQ(0, strcmp(*expected, *found));
+  }
+}
+
+TEST(binary, columns) {
+  Arena arena;
+  Array rows = arena.new_array();
+  for (int64_t i = 0; i < 10; i++) {
+    Map row = arena.new_map();
+    row.set("name", "row");
+    row.set("index", i);
+    row.set("odd", Variant::boolean((i % 2) == 1));
+    rows.add(row);
+  }
+  BinaryWriter plain;
+  plain.write(rows);
+  BinaryWriter writer;
+  writer.set_columns_threshold(2);
+  writer.write(rows);
+  ASSERT_TRUE(writer.size() < plain.size());
+  check_reads_as(rows, writer);
+  pton_instr_t instr;
+  BinaryCursor cursor(*writer, writer.size());
+  ASSERT_EQ(PTON_CURSOR_BEGIN, cursor.next(&instr));
+  ASSERT_EQ(PTON_OPCODE_BEGIN_COLUMNS, instr.opcode);
+  ASSERT_EQ(10, instr.payload.columns_data.rows);
+  ASSERT_EQ(0, instr.payload.columns_data.headerc);
+  ASSERT_EQ(3, instr.payload.columns_data.keyc);
+  BinaryCursor whole(*writer, writer.size());
+  ASSERT_TRUE(whole.skip_value());
+  ASSERT_EQ(writer.size(), whole.offset());
+  // Below the threshold the rows are written one at a time.
+  BinaryWriter short_writer;
+  short_writer.set_columns_threshold(11);
+  short_writer.write(rows);
+  ASSERT_EQ(plain.size(), short_writer.size());
+  // Rows with different keys, or keys in a different order, also are.
+  Map odd = arena.new_map();
+  odd.set("index", 10);
+  odd.set("name", "row");
+  odd.set("odd", Variant::no());
+  rows.add(odd);
+  BinaryWriter mixed;
+  mixed.set_columns_threshold(2);
+  mixed.write(rows);
+  BinaryCursor mixed_cursor(*mixed, mixed.size());
+  ASSERT_EQ(PTON_CURSOR_BEGIN, mixed_cursor.next(&instr));
+  ASSERT_EQ(PTON_OPCODE_BEGIN_ARRAY, instr.opcode);
+  check_reads_as(rows, mixed);
+}
+
+TEST(binary, seed_columns) {
+  Arena arena;
+  Seed shared = arena.new_seed();
+  shared.set_header("shared");
+  Array rows = arena.new_array();
+  for (int64_t i = 0; i < 4; i++) {
+    Seed row = arena.new_seed();
+    row.set_header("point");
+    row.set_field("x", i);
+    row.set_field("y", -i);
+    row.set_field("tag", shared);
+    rows.add(row);
+  }
+  Seed last = arena.new_seed();
+  last.set_header("last");
+  last.set_field("first", rows[0]);
+  Array outer = arena.new_array();
+  outer.add(rows);
+  outer.add(shared);
+  outer.add(last);
+  BinaryWriter writer;
+  writer.set_columns_threshold(2);
+  writer.set_emit_references(true);
+  writer.write(outer);
+  check_reads_as(outer, writer);
+  // References into the rows and to values within them resolve to the same
+  // objects.
+  BinaryReader reader(&arena);
+  Array lazy = reader.parse_lazy(*writer, writer.size());
+  Array eager = reader.parse(*writer, writer.size());
+  Variant decoded[2] = {lazy, eager};
+  for (size_t i = 0; i < 2; i++) {
+    Array outer_decoded = decoded[i];
+    Array rows_decoded = outer_decoded[0];
+    ASSERT_EQ(4, rows_decoded.length());
+    Seed first = rows_decoded[0];
+    ASSERT_TRUE(first.header() == Variant("point"));
+    ASSERT_EQ(0, first.get_field("y").integer_value());
+    ASSERT_EQ(-3, Seed(rows_decoded[3]).get_field("y").integer_value());
+    ASSERT_PTREQ(first.to_c().payload_.as_arena_seed_,
+        Seed(outer_decoded[2]).get_field("first").to_c().payload_.as_arena_seed_);
+    ASSERT_PTREQ(first.get_field("tag").to_c().payload_.as_arena_seed_,
+        outer_decoded[1].to_c().payload_.as_arena_seed_);
+  }
+  // An array where the same seed occurs twice isn't written by column.
+  Array twice = arena.new_array();
+  twice.add(rows[0]);
+  twice.add(rows[0]);
+  BinaryWriter twice_writer;
+  twice_writer.set_columns_threshold(2);
+  twice_writer.set_emit_references(true);
+  twice_writer.write(twice);
+  pton_instr_t instr;
+  BinaryCursor cursor(*twice_writer, twice_writer.size());
+  ASSERT_EQ(PTON_CURSOR_BEGIN, cursor.next(&instr));
+  ASSERT_EQ(PTON_OPCODE_BEGIN_ARRAY, instr.opcode);
+  check_reads_as(twice, twice_writer);
+  // Columns with rows but no keys are invalid.
+  uint8_t no_keys[4] = {BinaryImplUtils::boColumns, 2, 0, 0};
+  ASSERT_FALSE(BinaryReader::validate(no_keys, 4));
+}
+
+TEST(binary, seed_columns_forward_references) {
+  // Values in the first column can refer to rows that haven't been read yet.
+  Arena arena;
+  Array rows = arena.new_array();
+  for (int64_t i = 0; i < 4; i++) {
+    Seed row = arena.new_seed();
+    row.set_header("node");
+    rows.add(row);
+  }
+  for (uint32_t i = 0; i < 4; i++) {
+    Seed row = rows[i];
+    row.set_field("next", (i < 3) ? rows[i + 1] : Variant::null());
+    row.set_field("index", i);
+  }
+  BinaryWriter writer;
+  writer.set_columns_threshold(2);
+  writer.set_emit_references(true);
+  writer.write(rows);
+  pton_instr_t instr;
+  BinaryCursor cursor(*writer, writer.size());
+  ASSERT_EQ(PTON_CURSOR_BEGIN, cursor.next(&instr));
+  ASSERT_EQ(PTON_OPCODE_BEGIN_COLUMNS, instr.opcode);
+  BinaryReader reader(&arena);
+  Variant decoded[2] = {reader.parse_lazy(*writer, writer.size()),
+      reader.parse(*writer, writer.size())};
+  for (size_t i = 0; i < 2; i++) {
+    Array rows_decoded = decoded[i];
+    ASSERT_EQ(4, rows_decoded.length());
+    for (uint32_t j = 0; j < 3; j++) {
+      Seed row = rows_decoded[j];
+      ASSERT_EQ(j, row.get_field("index").integer_value());
+      ASSERT_PTREQ(rows_decoded[j + 1].to_c().payload_.as_arena_seed_,
+          row.get_field("next").to_c().payload_.as_arena_seed_);
+    }
+    ASSERT_TRUE(Seed(rows_decoded[3]).get_field("next").is_null());
+  }
+}
+
+TEST(binary, columns_claimed_rows) {
+  // A short input that claims to have millions of rows fails without
+  // creating them.
+  uint8_t data[8] = {BinaryImplUtils::boColumns};
+  size_t size = 1 + BinaryImplUtils::encode_varint(20000000, data + 1);
+  data[size++] = 0;
+  data[size++] = 1;
+  data[size++] = BinaryImplUtils::boNull;
+  Arena arena;
+  BinaryReader reader(&arena);
+  ASSERT_TRUE(reader.parse(data, size).is_null());
+  Variant lazy = reader.parse_lazy(data, size);
+  ASSERT_EQ(0, lazy.array_length());
+  BinaryReader config(&arena);
+  IncrementalBinaryReader incremental(&config);
+  ASSERT_EQ(IncrementalBinaryReader::NEED_MORE, incremental.feed(data, size));
+}
+
+TEST(binary, blob_gaps) {
+  Arena arena;
+  uint8_t big_data[100];
+  for (size_t i = 0; i < 100; i++)
+    big_data[i] = static_cast<uint8_t>(i);
+  Array array = arena.new_array();
+  Array plain_part = arena.new_array();
+  plain_part.add(Variant::blob(big_data, 100));
+  plain_part.add(Variant::blob("xyz", 3));
+  plain_part.add(Variant::blob(big_data + 50, 50));
+  array.add(plain_part);
+  Array indexed = arena.new_array();
+  for (size_t i = 0; i < 4; i++)
+    indexed.add(Variant::blob(big_data, 100));
+  array.add(indexed);
+  BinaryWriter plain;
+  plain.set_index_threshold(4);
+  plain.write(array);
+  std::vector<BlobGap> gaps;
+  BinaryWriter writer;
+  writer.set_index_threshold(4);
+  writer.set_blob_gaps(50, &gaps);
+  size_t size = writer.measure(array);
+  ASSERT_EQ(plain.size(), size);
+  uint8_t *dest = new uint8_t[size];
+  size_t written = writer.write_measured(array, dest, size);
+  // Only the large blobs outside the indexed array are left out.
+  ASSERT_EQ(2, gaps.size());
+  ASSERT_EQ(size - 150, written);
+  ASSERT_TRUE(gaps[0].data == big_data);
+  ASSERT_EQ(100, gaps[0].size);
+  ASSERT_TRUE(gaps[1].data == big_data + 50);
+  ASSERT_EQ(50, gaps[1].size);
+  // Putting the blobs back where the gaps are gives the full value.
+  std::vector<uint8_t> joined;
+  size_t start = 0;
+  for (size_t i = 0; i < gaps.size(); i++) {
+    joined.insert(joined.end(), dest + start, dest + gaps[i].offset);
+    const uint8_t *data = static_cast<const uint8_t*>(gaps[i].data);
+    joined.insert(joined.end(), data, data + gaps[i].size);
+    start = gaps[i].offset;
+  }
+  joined.insert(joined.end(), dest + start, dest + written);
+  ASSERT_EQ(size, joined.size());
+  ASSERT_EQ(0, memcmp(*plain, joined.data(), size));
+  // Writing into the internal buffer doesn't leave gaps.
+  writer.write(array);
+  ASSERT_EQ(2, gaps.size());
+  ASSERT_EQ(0, memcmp(*plain, *writer, size));
+  delete[] dest;
+}
@@ -5,12 +5,14 @@
 #include "test/unittest.hh"
 #include "plankton-binary.hh"
 #include "marshal-inl.hh"
+#include "sync/thread.hh"
 
 BEGIN_C_INCLUDES
 #include "utils/strbuf.h"
 END_C_INCLUDES
 
 using namespace plankton;
+using namespace tclib;
 
 class Point {
 public:
@@ -244,6 +246,148 @@ TEST(marshal, partial_encode) {
   ASSERT_PTREQ(NULL, r2->bottom_right());
 }
 
+// A type whose encoding is different, and larger, every time it is encoded.
+class Counter {
+public:
+  Counter() : encode_count_(0) { }
+  int64_t encode_count() { return encode_count_; }
+  static SeedType<Counter> *seed_type() { return &kType; }
+private:
+  static Counter *new_instance(Variant header, Factory* factory);
+  void init(Seed payload, Factory* factory) { }
+  Variant to_seed(Factory *factory);
+  static SeedType<Counter> kType;
+  int64_t encode_count_;
+};
+
+Counter *Counter::new_instance(Variant header, Factory* factory) {
+  return new (*factory) Counter();
+}
+
+Variant Counter::to_seed(Factory *factory) {
+  Seed obj = factory->new_seed(Counter::seed_type());
+  encode_count_++;
+  obj.set_field("count", encode_count_ << (8 * encode_count_));
+  return obj;
+}
+
+SeedType<Counter> Counter::kType("binary.Counter",
+    tclib::new_callback(Counter::new_instance),
+    tclib::new_callback(&Counter::init),
+    tclib::new_callback(&Counter::to_seed));
+
+TEST(marshal, encode_once) {
+  // Natives are encoded once per write, even though the value is measured
+  // before it is written, so what's written is what was measured.
+  Counter counter;
+  Arena arena;
+  Array array = arena.new_array();
+  array.add(arena.new_native(&counter));
+  array.add(arena.new_native(&counter));
+  BinaryWriter out;
+  out.write(array);
+  ASSERT_EQ(2, counter.encode_count());
+  BinaryReader in(&arena);
+  Array value = in.parse(*out, out.size());
+  ASSERT_EQ(1 << 8, Seed(value[0]).get_field("count").integer_value());
+  ASSERT_EQ(2 << 16, Seed(value[1]).get_field("count").integer_value());
+  uint8_t dest[256];
+  size_t size = out.write(array, dest, 256);
+  ASSERT_EQ(4, counter.encode_count());
+  value = in.parse(dest, size);
+  ASSERT_EQ(3 << 24, Seed(value[0]).get_field("count").integer_value());
+  ASSERT_EQ(int64_t(4) << 32, Seed(value[1]).get_field("count").integer_value());
+}
+
+TEST(marshal, columns) {
+  Point points[3] = {Point(1, 2), Point(3, 4), Point(5, 6)};
+  Arena arena;
+  Array array = arena.new_array();
+  for (size_t i = 0; i < 3; i++)
+    array.add(Point::seed_type()->encode_instance(arena.new_native(&points[i]),
+        &arena));
+  BinaryWriter out;
+  out.set_columns_threshold(2);
+  out.write(array);
+  TypeRegistry registry;
+  registry.register_type<Point>();
+  BinaryReader in(&arena);
+  in.set_type_registry(&registry);
+  Array value = in.parse(*out, out.size());
+  ASSERT_EQ(3, value.length());
+  for (size_t i = 0; i < 3; i++) {
+    Native native = value[i];
+    ASSERT_TRUE(native.is_native());
+    ASSERT_EQ(points[i].x(), native.as<Point>()->x());
+    ASSERT_EQ(points[i].y(), native.as<Point>()->y());
+  }
+}
+
+TEST(marshal, registry_fallback) {
+  TypeRegistry fallback;
+  TypeRegistry registry;
+  registry.add_fallback(&fallback);
+  {
+    // Resolution results are cached but the cache must not depend on the
+    // header staying alive.
+    Arena arena;
+    ASSERT_TRUE(registry.resolve_type(arena.new_string("binary.Point")) == NULL);
+  }
+  ASSERT_TRUE(registry.resolve_type("binary.Point") == NULL);
+  // Changing the fallback invalidates what was cached.
+  fallback.register_type<Point>();
+  ASSERT_TRUE(registry.resolve_type("binary.Point") == Point::seed_type());
+  ASSERT_TRUE(registry.resolve_type("binary.Point") == Point::seed_type());
+  ASSERT_TRUE(registry.resolve_type(Variant::id64(10)) == NULL);
+  ASSERT_TRUE(registry.resolve_type("blah") == NULL);
+}
+
+TEST(marshal, registry_indirect_fallback) {
+  TypeRegistry inner;
+  TypeRegistry outer;
+  outer.add_fallback(&inner);
+  TypeRegistry registry;
+  registry.add_fallback(&outer);
+  ASSERT_TRUE(registry.resolve_type("binary.Point") == NULL);
+  // Changes to fallbacks of fallbacks also invalidate the cache.
+  inner.register_type<Point>();
+  ASSERT_TRUE(registry.resolve_type("binary.Point") == Point::seed_type());
+  {
+    // A registry that is gone isn't told about changes anymore.
+    TypeRegistry temporary;
+    temporary.add_fallback(&inner);
+    ASSERT_TRUE(temporary.resolve_type("binary.Rect") == NULL);
+  }
+  inner.register_type<Rect>();
+  ASSERT_TRUE(registry.resolve_type("binary.Rect") == Rect::seed_type());
+  // Once the cache is full resolutions keep working, they're just not
+  // cached.
+  for (int64_t i = 0; i < 3000; i++)
+    ASSERT_TRUE(registry.resolve_type(i) == NULL);
+  ASSERT_TRUE(registry.resolve_type("binary.Point") == Point::seed_type());
+}
+
+static opaque_t resolve_concurrently(TypeRegistry *registry) {
+  for (int64_t i = 0; i < 2000; i++) {
+    ASSERT_TRUE(registry->resolve_type("binary.Point") == Point::seed_type());
+    ASSERT_TRUE(registry->resolve_type(i % 500) == NULL);
+  }
+  return o0();
+}
+
+TEST(marshal, registry_threads) {
+  TypeRegistry fallback;
+  fallback.register_type<Point>();
+  TypeRegistry registry;
+  registry.add_fallback(&fallback);
+  NativeThread first(new_callback(resolve_concurrently, &registry));
+  NativeThread second(new_callback(resolve_concurrently, &registry));
+  ASSERT_TRUE(first.start());
+  ASSERT_TRUE(second.start());
+  ASSERT_TRUE(first.join(NULL));
+  ASSERT_TRUE(second.join(NULL));
+}
+
 TEST(marshal, variant_map) {
   VariantMap<int> ints;
   ASSERT_TRUE(ints["foo"] == NULL);
@@ -265,6 +409,12 @@ TEST(marshal, variant_map) {
   ASSERT_EQ(5, *ints["foo"]);
   ASSERT_EQ(4, *ints[Variant::yes()]);
   ASSERT_EQ(7, *ints[Variant::null()]);
+  for (int64_t i = 0; i < 1000; i++)
+    ints.set(Variant::id64(i), static_cast<int>(i + 10));
+  ASSERT_EQ(1003, ints.size());
+  for (int64_t i = 0; i < 1000; i++)
+    ASSERT_EQ(i + 10, *ints[Variant::id64(i)]);
+  ASSERT_TRUE(ints[Variant::integer(10)] == NULL);
 }
 
 class A {
@@ -305,3 +305,56 @@ TEST(rpc, async_service) {
   ASSERT_TRUE(inc->is_fulfilled());
   ASSERT_EQ(54, inc->peek_value(Variant::null()).integer_value());
 }
+
+// An input stream that counts how often it is read from.
+class ReadCountingStream : public tclib::InStream {
+public:
+  ReadCountingStream(const std::vector<byte_t> &data)
+    : in(data.data(), data.size())
+    , read_count(0) { }
+  virtual void default_destroy() { default_delete_concrete(this); }
+  virtual bool read_sync(read_iop_state_t *op) {
+    read_count++;
+    return in.read_sync(op);
+  }
+  ByteInStream in;
+  size_t read_count;
+};
+
+TEST(rpc, read_ahead) {
+  // The client reads responses from a buffer that starts out holding only a
+  // socket header, what the server sends after its header is added later.
+  ByteOutStream header;
+  OutputSocket(&header).init();
+  size_t header_size = header.data().size();
+  ByteBufferStream back(65536);
+  ASSERT_TRUE(back.initialize());
+  WriteIop header_iop(&back, header.data().data(), header_size);
+  ASSERT_TRUE(header_iop.execute());
+  ByteOutStream requests;
+  StreamServiceConnector client(&back, &requests);
+  ASSERT_TRUE(client.init(empty_callback()));
+  IncomingResponse responses[10];
+  for (int64_t i = 0; i < 10; i++) {
+    Variant arg = i;
+    OutgoingRequest req(Variant::null(), "echo", 1, &arg);
+    responses[i] = client.socket()->send_request(&req);
+  }
+  // With read-ahead the server reads the requests in a few large reads.
+  EchoService echo;
+  ReadCountingStream in(requests.data());
+  ByteOutStream out;
+  StreamServiceConnector server(&in, &out);
+  server.set_read_ahead_size(4096);
+  ASSERT_TRUE(server.init(echo.handler()));
+  ASSERT_TRUE(server.process_all_messages());
+  ASSERT_TRUE(in.read_count < 5);
+  const std::vector<byte_t> &sent = out.data();
+  ASSERT_EQ(0, memcmp(header.data().data(), sent.data(), header_size));
+  WriteIop sent_iop(&back, sent.data() + header_size, sent.size() - header_size);
+  ASSERT_TRUE(sent_iop.execute());
+  ASSERT_TRUE(back.close());
+  ASSERT_TRUE(client.process_all_messages());
+  for (int64_t i = 0; i < 10; i++)
+    ASSERT_EQ(i, responses[i]->peek_value(Variant::null()).integer_value());
+}
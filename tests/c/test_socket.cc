@@ -3,6 +3,8 @@
 
 #include "test/asserts.hh"
 #include "test/unittest.hh"
+#include "plankton-binary.hh"
+#include "marshal-inl.hh"
 #include "plankton-inl.hh"
 #include "socket.hh"
 
@@ -80,3 +82,685 @@ TEST(socket, push_stream) {
     ;
   ASSERT_EQ(3, call_count);
 }
+
+// Adopts the values of every other message into the given arena.
+static void adopt_push_message(Arena *arena, std::vector<Variant> *kept,
+    ParsedMessage *message) {
+  if ((kept->size() % 2) == 0)
+    arena->adopt_ownership(message->owner());
+  kept->push_back(message->value());
+}
+
+static InputStream *new_adopting_stream(Arena *arena,
+    std::vector<Variant> *kept, InputStreamConfig *config) {
+  return new PushInputStream(config, tclib::new_callback(adopt_push_message,
+      arena, kept));
+}
+
+TEST(socket, push_stream_adopted) {
+  ByteOutStream out;
+  OutputSocket outsock(&out);
+  outsock.init();
+  byte_t data[256];
+  for (size_t i = 0; i < 256; i++)
+    data[i] = static_cast<byte_t>(i);
+  for (size_t i = 0; i < 6; i++)
+    outsock.send_value(Variant::blob(data + i, 200));
+  Arena arena;
+  std::vector<Variant> kept;
+  {
+    ByteInStream in(out.data().data(), out.data().size());
+    InputSocket insock(&in);
+    insock.set_stream_factory(tclib::new_callback(new_adopting_stream, &arena,
+        &kept));
+    ASSERT_TRUE(insock.init());
+    while (insock.process_next_instruction(NULL))
+      ;
+  }
+  // The adopted blobs point into their messages which are still alive after
+  // the socket is gone.
+  ASSERT_EQ(6, kept.size());
+  for (size_t i = 0; i < 6; i += 2) {
+    ASSERT_EQ(200, kept[i].blob_size());
+    ASSERT_EQ(0, memcmp(data + i, kept[i].blob_data(), 200));
+  }
+}
+
+// Returns a request-like seed with the given serial.
+static Variant new_request(Arena *arena, int64_t serial, const char *payload) {
+  Seed request = arena->new_seed();
+  request.set_header("rpc.Request");
+  request.set_field("serial", serial);
+  request.set_field("selector", "do_something");
+  request.set_field("arguments", payload);
+  return request;
+}
+
+TEST(socket, string_table) {
+  ByteOutStream plain_out;
+  OutputSocket plain(&plain_out);
+  plain.init();
+  ByteOutStream out;
+  OutputSocket outsock(&out);
+  ASSERT_TRUE(outsock.set_use_string_table(true));
+  outsock.init();
+  ASSERT_FALSE(outsock.set_use_string_table(false));
+  Arena arena;
+  char payload[32];
+  for (int64_t i = 0; i < 20; i++) {
+    sprintf(payload, "payload %i", static_cast<int>(i));
+    plain.send_value(new_request(&arena, i, payload));
+    outsock.send_value(new_request(&arena, i, payload));
+  }
+  // The header, keys, and selector are only sent in full twice, the payloads
+  // that are all different always are.
+  size_t plain_size = plain_out.data().size();
+  size_t size = out.data().size();
+  ASSERT_TRUE(3 * size < 2 * plain_size);
+  std::vector<Variant> requests;
+  Arena interning;
+  interning.set_intern_strings(true);
+  {
+    ByteInStream in(out.data().data(), size);
+    InputSocket insock(&in);
+    ASSERT_TRUE(insock.init());
+    while (insock.process_next_instruction(NULL))
+      ;
+    BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+    for (int64_t i = 0; i < 20; i++) {
+      ASSERT_FALSE(root_stream->is_empty());
+      requests.push_back(root_stream->pull_message(&interning));
+    }
+    ASSERT_TRUE(root_stream->is_empty());
+  }
+  // The values are still valid after the socket, and its table, are gone.
+  Variant previous_selector;
+  for (int64_t i = 0; i < 20; i++) {
+    Seed request = requests[i];
+    ASSERT_TRUE(request.header() == Variant("rpc.Request"));
+    ASSERT_EQ(i, request.get_field("serial").integer_value());
+    sprintf(payload, "payload %i", static_cast<int>(i));
+    ASSERT_TRUE(request.get_field("arguments") == Variant(payload));
+    Variant selector = request.get_field("selector");
+    ASSERT_EQ(0, strcmp("do_something", selector.string_chars()));
+    // Once the selector is in the table every request shares the same string
+    // when the arena interns strings.
+    if (i > 2)
+      ASSERT_PTREQ(previous_selector.string_chars(), selector.string_chars());
+    previous_selector = selector;
+  }
+}
+
+// Returns the status of processing a v2 stream that adds the given string to
+// the receiver's string table.
+static bool add_table_string_succeeds(Arena *arena, String str) {
+  BinaryWriter writer;
+  writer.write(str);
+  std::vector<byte_t> data;
+  byte_t header[8] = {'p', 't', 0xF6, 'n', FRAMING_V2, 0, 0, 0};
+  data.insert(data.end(), header, header + 8);
+  byte_t frame[12] = {kAddTableString, 0, 0, 0, 0, 0, 0, 0,
+      static_cast<byte_t>(writer.size()), 0, 0, 0};
+  data.insert(data.end(), frame, frame + 12);
+  data.insert(data.end(), *writer, *writer + writer.size());
+  data.resize((data.size() + 7) & ~7, 0);
+  ByteInStream in(data.data(), data.size());
+  InputSocket insock(&in);
+  if (!insock.init())
+    return false;
+  InputSocket::ProcessInstrStatus status;
+  insock.process_next_instruction(&status);
+  return !status.is_error();
+}
+
+TEST(socket, string_table_receiver_limits) {
+  Arena arena;
+  ASSERT_TRUE(add_table_string_succeeds(&arena, arena.new_string("foo")));
+  // The receiver rejects strings the sender would never have added.
+  String long_string = arena.new_string(StringTable::kMaxLength + 1);
+  ASSERT_FALSE(add_table_string_succeeds(&arena, long_string));
+  // Only so many strings fit in the table.
+  StringTable table;
+  char str[16];
+  for (uint32_t i = 0; i < StringTable::kMaxSize; i++) {
+    sprintf(str, "%i", static_cast<int>(i));
+    ASSERT_TRUE(table.can_add(arena.new_string(str)));
+    table.add(arena.new_string(str));
+  }
+  ASSERT_FALSE(table.can_add(arena.new_string("one more")));
+}
+
+TEST(socket, string_table_limits) {
+  StringTable table;
+  Arena arena;
+  // Strings become candidates the second time they're written.
+  table.note_written(arena.new_string("foo"));
+  std::vector<String> candidates;
+  table.take_candidates(&candidates);
+  ASSERT_EQ(0, candidates.size());
+  table.note_written(arena.new_string("foo"));
+  table.note_written(arena.new_string("foo"));
+  table.take_candidates(&candidates);
+  ASSERT_EQ(1, candidates.size());
+  ASSERT_EQ(0, table.add(candidates[0]));
+  ASSERT_EQ(0, table.add(arena.new_string("foo")));
+  uint32_t index = 1;
+  ASSERT_TRUE(table.find(arena.new_string("foo"), &index));
+  ASSERT_EQ(0, index);
+  ASSERT_FALSE(table.find(arena.new_string("bar"), &index));
+  // Long strings are never candidates.
+  String long_string = arena.new_string(StringTable::kMaxLength + 1);
+  table.note_written(long_string);
+  table.note_written(long_string);
+  candidates.clear();
+  table.take_candidates(&candidates);
+  ASSERT_EQ(0, candidates.size());
+  // Without a table, input that refers to one is invalid.
+  uint8_t code[2] = {BinaryImplUtils::boTableString, 0};
+  BinaryReader reader(&arena);
+  ASSERT_TRUE(reader.parse(code, 2).is_null());
+  reader.set_string_table(&table);
+  ASSERT_TRUE(reader.parse(code, 2) == Variant("foo"));
+  ASSERT_TRUE(reader.parse_lazy(code, 2) == Variant("foo"));
+  code[1] = 1;
+  ASSERT_TRUE(reader.parse(code, 2).is_null());
+}
+
+// An output stream that counts how often it is written to and flushed.
+class CountingOutStream : public tclib::OutStream {
+public:
+  CountingOutStream() : write_count(0), flush_count(0) { }
+  virtual void default_destroy() { default_delete_concrete(this); }
+  virtual bool write_sync(write_iop_state_t *op) {
+    write_count++;
+    write_sizes.push_back(op->src_size);
+    return out.write_sync(op);
+  }
+  virtual bool flush() {
+    flush_count++;
+    return out.flush();
+  }
+  ByteOutStream out;
+  size_t write_count;
+  size_t flush_count;
+  std::vector<size_t> write_sizes;
+};
+
+TEST(socket, flush_policy) {
+  CountingOutStream out;
+  OutputSocket outsock(&out);
+  outsock.init();
+  // The header is written at once.
+  ASSERT_EQ(1, out.write_count);
+  ASSERT_EQ(16, out.out.data().size());
+  Arena arena;
+  Array array = arena.new_array();
+  for (int64_t i = 0; i < 10; i++)
+    array.add(i);
+  // By default each value is one write.
+  outsock.send_value(array);
+  ASSERT_EQ(2, out.write_count);
+  ASSERT_EQ(2, out.flush_count);
+  // Flushing manually holds everything back until flush is called.
+  outsock.set_flush_policy(OutputSocket::FLUSH_MANUALLY);
+  outsock.send_value(array);
+  outsock.send_value("foo");
+  ASSERT_EQ(2, out.write_count);
+  outsock.flush();
+  ASSERT_EQ(3, out.write_count);
+  ASSERT_EQ(3, out.flush_count);
+  // Flushing when full writes once enough has been buffered.
+  outsock.set_flush_policy(OutputSocket::FLUSH_WHEN_FULL);
+  outsock.set_buffer_size(64);
+  size_t size_before = out.out.data().size();
+  while (out.write_count == 3)
+    outsock.send_value(array);
+  ASSERT_TRUE(out.out.data().size() - size_before >= 64);
+  // Everything that was written reads back.
+  outsock.send_value(Variant::null());
+  outsock.flush();
+  ByteInStream in(out.out.data().data(), out.out.data().size());
+  InputSocket insock(&in);
+  ASSERT_TRUE(insock.init());
+  while (insock.process_next_instruction(NULL))
+    ;
+  BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+  ASSERT_EQ(10, Array(root_stream->pull_message(&arena)).length());
+  ASSERT_EQ(10, Array(root_stream->pull_message(&arena)).length());
+  ASSERT_TRUE(root_stream->pull_message(&arena) == Variant("foo"));
+  Variant last;
+  while (!root_stream->is_empty())
+    last = root_stream->pull_message(&arena);
+  ASSERT_TRUE(last.is_null());
+}
+
+TEST(socket, flush_on_destroy) {
+  CountingOutStream out;
+  {
+    OutputSocket outsock(&out);
+    outsock.set_flush_policy(OutputSocket::FLUSH_MANUALLY);
+    outsock.init();
+    ASSERT_EQ(1, out.write_count);
+    outsock.send_value("foo");
+    ASSERT_EQ(1, out.write_count);
+  }
+  // Whatever was buffered is written when the socket goes away.
+  ASSERT_EQ(2, out.write_count);
+  ASSERT_EQ(2, out.flush_count);
+  ByteInStream in(out.out.data().data(), out.out.data().size());
+  InputSocket insock(&in);
+  ASSERT_TRUE(insock.init());
+  while (insock.process_next_instruction(NULL))
+    ;
+  BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+  Arena arena;
+  ASSERT_TRUE(root_stream->pull_message(&arena) == Variant("foo"));
+  // A socket with nothing buffered doesn't touch the destination.
+  CountingOutStream idle_out;
+  {
+    OutputSocket idle(&idle_out);
+    idle.init();
+  }
+  ASSERT_EQ(1, idle_out.write_count);
+  ASSERT_EQ(1, idle_out.flush_count);
+}
+
+// A native object that is encoded as a large blob.
+class LargeBlob {
+public:
+  static SeedType<LargeBlob> *seed_type() { return &kType; }
+  static const uint32_t kSize = 40000;
+private:
+  static LargeBlob *new_instance(Variant header, Factory* factory);
+  void init(Seed payload, Factory* factory) { }
+  Variant to_seed(Factory *factory);
+  static SeedType<LargeBlob> kType;
+};
+
+LargeBlob *LargeBlob::new_instance(Variant header, Factory* factory) {
+  return new (*factory) LargeBlob();
+}
+
+Variant LargeBlob::to_seed(Factory *factory) {
+  Blob blob = factory->new_blob(kSize);
+  byte_t *data = static_cast<byte_t*>(blob.mutable_data());
+  for (uint32_t i = 0; i < kSize; i++)
+    data[i] = static_cast<byte_t>(i % 253);
+  return blob;
+}
+
+SeedType<LargeBlob> LargeBlob::kType("socket.LargeBlob",
+    tclib::new_callback(LargeBlob::new_instance),
+    tclib::new_callback(&LargeBlob::init),
+    tclib::new_callback(&LargeBlob::to_seed));
+
+TEST(socket, direct_blobs) {
+  CountingOutStream out;
+  OutputSocket outsock(&out);
+  outsock.init();
+  std::vector<byte_t> data;
+  for (size_t i = 0; i < 5000; i++)
+    data.push_back(static_cast<byte_t>(i % 251));
+  Arena arena;
+  Array array = arena.new_array();
+  array.add(Variant::blob(data.data(), data.size()));
+  array.add(Variant::blob("abc", 3));
+  // The large blob is written directly from the value, between what comes
+  // before and after it.
+  outsock.send_value(array);
+  ASSERT_EQ(4, out.write_count);
+  ASSERT_EQ(5000, out.write_sizes[2]);
+  // Held back values are copied since they may be gone when the buffer is
+  // flushed.
+  outsock.set_flush_policy(OutputSocket::FLUSH_MANUALLY);
+  outsock.send_value(array);
+  outsock.flush();
+  ASSERT_EQ(5, out.write_count);
+  // What natives are encoded as only lives while the value is being written
+  // so large blobs within it are written in place.
+  outsock.set_flush_policy(OutputSocket::FLUSH_PER_MESSAGE);
+  LargeBlob large;
+  outsock.send_value(arena.new_native(&large));
+  ASSERT_EQ(6, out.write_count);
+  ByteInStream in(out.out.data().data(), out.out.data().size());
+  InputSocket insock(&in);
+  ASSERT_TRUE(insock.init());
+  while (insock.process_next_instruction(NULL))
+    ;
+  BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+  for (size_t i = 0; i < 2; i++) {
+    Array value = root_stream->pull_message(&arena);
+    ASSERT_EQ(2, value.length());
+    ASSERT_EQ(5000, value[0].blob_size());
+    ASSERT_EQ(0, memcmp(data.data(), value[0].blob_data(), 5000));
+    ASSERT_EQ(3, value[1].blob_size());
+  }
+  Blob large_value = root_stream->pull_message(&arena);
+  ASSERT_EQ(LargeBlob::kSize, large_value.size());
+  const byte_t *large_data = static_cast<const byte_t*>(large_value.data());
+  for (uint32_t i = 0; i < LargeBlob::kSize; i++)
+    ASSERT_EQ(i % 253, large_data[i]);
+  ASSERT_TRUE(root_stream->is_empty());
+}
+
+// An input stream that counts how often it is read from and returns at most
+// a given number of bytes per read. If stalling every other read returns no
+// data without being at the end.
+class CountingInStream : public tclib::InStream {
+public:
+  CountingInStream(const std::vector<byte_t> &data, size_t max_read,
+      bool stall = false)
+    : in(data.data(), data.size())
+    , max_read(max_read)
+    , stall(stall)
+    , read_count(0) { }
+  virtual void default_destroy() { default_delete_concrete(this); }
+  virtual bool read_sync(read_iop_state_t *op) {
+    read_count++;
+    if (stall && (read_count % 2) == 1) {
+      read_iop_state_deliver(op, 0, false);
+      return true;
+    }
+    if (op->dest_size_ > max_read)
+      op->dest_size_ = max_read;
+    return in.read_sync(op);
+  }
+  ByteInStream in;
+  size_t max_read;
+  bool stall;
+  size_t read_count;
+};
+
+// Reads back what was written by the read_ahead test, returns the number of
+// reads it took.
+static size_t read_back(const std::vector<byte_t> &data, size_t max_read,
+    size_t read_ahead_size, bool stall = false) {
+  CountingInStream in(data, max_read, stall);
+  InputSocket insock(&in);
+  insock.set_read_ahead_size(read_ahead_size);
+  ASSERT_TRUE(insock.init());
+  InputSocket::ProcessInstrStatus status;
+  while (insock.process_next_instruction(&status))
+    ;
+  ASSERT_FALSE(status.is_error());
+  BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+  Arena arena;
+  for (int64_t i = 0; i < 100; i++) {
+    Variant value = root_stream->pull_message(&arena);
+    ASSERT_EQ(i * 1000, value.integer_value());
+  }
+  Variant blob = root_stream->pull_message(&arena);
+  ASSERT_EQ(10000, blob.blob_size());
+  const byte_t *blob_data = static_cast<const byte_t*>(blob.blob_data());
+  for (size_t i = 0; i < 10000; i++)
+    ASSERT_EQ(i % 251, blob_data[i]);
+  ASSERT_TRUE(root_stream->pull_message(&arena) == Variant("foo"));
+  ASSERT_TRUE(root_stream->is_empty());
+  return in.read_count;
+}
+
+TEST(socket, read_ahead) {
+  ByteOutStream out;
+  OutputSocket outsock(&out);
+  outsock.init();
+  for (int64_t i = 0; i < 100; i++)
+    outsock.send_value(i * 1000);
+  std::vector<byte_t> blob;
+  for (size_t i = 0; i < 10000; i++)
+    blob.push_back(static_cast<byte_t>(i % 251));
+  outsock.send_value(Variant::blob(blob.data(), blob.size()));
+  outsock.send_value("foo");
+  const std::vector<byte_t> &data = out.data();
+  // Reading ahead takes few reads even though there are many small values,
+  // the large blob is read directly.
+  ASSERT_TRUE(read_back(data, data.size(), 4096) < 5);
+  // Without read-ahead every part of every instruction is read separately.
+  ASSERT_TRUE(read_back(data, data.size(), 0) > 300);
+  // Sources that return less than asked for, including in the middle of
+  // varints and blobs, still read back right.
+  ASSERT_TRUE(read_back(data, 3, 4096) >= data.size() / 3);
+  ASSERT_TRUE(read_back(data, 1, 16) >= data.size());
+  // Reads that return nothing don't end the input.
+  ASSERT_TRUE(read_back(data, 7, 4096, true) >= 2 * data.size() / 7);
+  ASSERT_TRUE(read_back(data, data.size(), 0, true) > 600);
+  // But a source that keeps returning nothing is eventually given up on.
+  CountingInStream empty(data, 0);
+  InputSocket empty_sock(&empty);
+  ASSERT_FALSE(empty_sock.init());
+  ASSERT_TRUE(empty.read_count <= 64);
+}
+
+TEST(socket, read_ahead_truncated) {
+  ByteOutStream out;
+  OutputSocket outsock(&out);
+  outsock.init();
+  outsock.send_value(Variant("foo"));
+  outsock.send_value(Variant("bar"));
+  // Dropping the last bytes means the first value is delivered but the socket
+  // reaches the end before the second.
+  std::vector<byte_t> data = out.data();
+  data.resize(data.size() - 5);
+  ByteInStream in(data.data(), data.size());
+  InputSocket insock(&in);
+  ASSERT_TRUE(insock.init());
+  // The default string encoding and the first value.
+  ASSERT_TRUE(insock.process_next_instruction(NULL));
+  ASSERT_TRUE(insock.process_next_instruction(NULL));
+  ASSERT_FALSE(insock.process_next_instruction(NULL));
+  BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+  Arena arena;
+  ASSERT_TRUE(root_stream->pull_message(&arena) == Variant("foo"));
+}
+
+TEST(socket, message_pool) {
+  MessagePool *pool = MessagePool::create();
+  // Released blocks are reused for requests of the same size class.
+  byte_t *first = pool->allocate(100);
+  memset(first, 0xFF, 100);
+  MessagePool::release(first);
+  ASSERT_EQ(1, pool->free_block_count());
+  byte_t *second = pool->allocate(80);
+  ASSERT_TRUE(first == second);
+  ASSERT_EQ(0, pool->free_block_count());
+  // A block is only recycled once all references are gone.
+  MessagePool::retain(second);
+  MessagePool::release(second);
+  ASSERT_EQ(0, pool->free_block_count());
+  MessagePool::release(second);
+  ASSERT_EQ(1, pool->free_block_count());
+  // Other size classes get their own blocks.
+  byte_t *small = pool->allocate(10);
+  ASSERT_FALSE(small == first);
+  MessagePool::release(small);
+  ASSERT_EQ(2, pool->free_block_count());
+  // Very large blocks aren't kept.
+  byte_t *huge = pool->allocate(1 << 20);
+  memset(huge, 0, 1 << 20);
+  MessagePool::release(huge);
+  ASSERT_EQ(2, pool->free_block_count());
+  // Blocks can outlive the owner's claim on the pool.
+  byte_t *held = pool->allocate(10);
+  pool->dispose();
+  MessagePool::release(held);
+}
+
+// An input stream that holds on to the messages it receives.
+class HoldingInputStream : public InputStream {
+public:
+  HoldingInputStream(InputStreamConfig *config) : InputStream(config) { }
+  virtual void receive_block(MessageData *message) {
+    // Keep a shared copy to check that the data stays valid after the
+    // original has been disposed.
+    MessageData *shared = message->share();
+    // Pooled data is shared without allocating a new message data.
+    ASSERT_TRUE(shared == message);
+    messages.push_back(shared);
+    message->dispose();
+  }
+  static InputStream *new_instance(std::vector<MessageData*> *held,
+      InputStreamConfig *config) {
+    HoldingInputStream *result = new HoldingInputStream(config);
+    result->held = held;
+    return result;
+  }
+  virtual ~HoldingInputStream() {
+    held->insert(held->end(), messages.begin(), messages.end());
+  }
+  std::vector<MessageData*> messages;
+  std::vector<MessageData*> *held;
+};
+
+TEST(socket, held_messages) {
+  ByteOutStream out;
+  OutputSocket outsock(&out);
+  outsock.init();
+  for (int64_t i = 0; i < 10; i++)
+    outsock.send_value(Variant::integer(i));
+  std::vector<MessageData*> held;
+  {
+    ByteInStream in(out.data().data(), out.data().size());
+    InputSocket insock(&in);
+    insock.set_stream_factory(tclib::new_callback(HoldingInputStream::new_instance,
+        &held));
+    ASSERT_TRUE(insock.init());
+    while (insock.process_next_instruction(NULL))
+      ;
+  }
+  // The messages are still valid after the socket is gone.
+  ASSERT_EQ(10, held.size());
+  Arena arena;
+  for (size_t i = 0; i < held.size(); i++) {
+    BinaryReader reader(&arena);
+    Variant value = reader.parse(held[i]->data(), held[i]->size());
+    ASSERT_EQ(static_cast<int64_t>(i), value.integer_value());
+    held[i]->dispose();
+  }
+}
+
+TEST(socket, framing_v2) {
+  ByteOutStream out;
+  OutputSocket outsock(&out);
+  ASSERT_TRUE(outsock.set_framing_version(FRAMING_V2));
+  ASSERT_TRUE(outsock.set_use_string_table(true));
+  outsock.init();
+  ASSERT_FALSE(outsock.set_framing_version(FRAMING_V1));
+  const std::vector<byte_t> &data = out.data();
+  ASSERT_EQ(FRAMING_V2, data[4]);
+  // A value sent to the root stream is a single frame: the fixed header, the
+  // 32-bit size, the value, and padding.
+  size_t before = data.size();
+  outsock.send_value(Variant::integer(1));
+  ASSERT_EQ(16, data.size() - before);
+  ASSERT_EQ(kSendValue, data[before]);
+  ASSERT_EQ(0, data[before + 1]);
+  ASSERT_EQ(0, data[before + 4]);
+  ASSERT_EQ(2, data[before + 8]);
+  ASSERT_EQ(0, data[before + 9]);
+  // Other streams are bound to an index the first time they're used.
+  before = data.size();
+  outsock.send_value(Variant::integer(2), "other");
+  ASSERT_EQ(kBindStream, data[before]);
+  ASSERT_EQ(1, data[before + 4]);
+  size_t first_size = data.size() - before;
+  before = data.size();
+  outsock.send_value(Variant::integer(3), "other");
+  ASSERT_EQ(16, data.size() - before);
+  ASSERT_EQ(kSendValue, data[before]);
+  ASSERT_EQ(1, data[before + 4]);
+  ASSERT_TRUE(first_size > 16);
+  // Ids are looked up by value so they don't have to be kept alive.
+  char other[6] = "other";
+  outsock.send_value(Variant::integer(4), Variant::string(other, 5));
+  other[0] = 'x';
+  before = data.size();
+  outsock.send_value(Variant::integer(5), "other");
+  ASSERT_EQ(16, data.size() - before);
+  ASSERT_EQ(1, data[before + 4]);
+  // Arrays with the same contents are the same stream.
+  Arena ids;
+  Array first_id = ids.new_array();
+  first_id.add("other");
+  Array second_id = ids.new_array();
+  second_id.add("other");
+  before = data.size();
+  outsock.send_value(Variant::integer(6), first_id);
+  ASSERT_EQ(kBindStream, data[before]);
+  ASSERT_EQ(2, data[before + 4]);
+  before = data.size();
+  outsock.send_value(Variant::integer(7), second_id);
+  ASSERT_EQ(16, data.size() - before);
+  ASSERT_EQ(2, data[before + 4]);
+  before = data.size();
+  outsock.send_value(Variant::integer(8), Variant::integer(9));
+  ASSERT_EQ(kBindStream, data[before]);
+  ASSERT_EQ(3, data[before + 4]);
+  // Floats that are equivalent but encoded differently are different streams.
+  outsock.send_value(Variant::integer(10), Variant::float64(0.0));
+  before = data.size();
+  outsock.send_value(Variant::integer(11), Variant::float64(-0.0));
+  ASSERT_EQ(kBindStream, data[before]);
+  ASSERT_EQ(5, data[before + 4]);
+  before = data.size();
+  outsock.send_value(Variant::integer(12), Variant::float64(0.0));
+  ASSERT_EQ(kSendValue, data[before]);
+  ASSERT_EQ(4, data[before + 4]);
+  for (int64_t i = 0; i < 10; i++)
+    outsock.send_value("a string sent over and over");
+  // The receiver understands v2, also when the data arrives a byte at a time.
+  for (size_t max_read = 1; max_read <= data.size(); max_read += data.size() - 1) {
+    CountingInStream in(data, max_read);
+    InputSocket insock(&in);
+    ASSERT_TRUE(insock.init());
+    InputSocket::ProcessInstrStatus status;
+    while (insock.process_next_instruction(&status))
+      ;
+    ASSERT_FALSE(status.is_error());
+    BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+    Arena arena;
+    ASSERT_EQ(1, root_stream->pull_message(&arena).integer_value());
+    // There is no stream with the other id so those values are dropped.
+    for (size_t i = 0; i < 10; i++)
+      ASSERT_TRUE(root_stream->pull_message(&arena) == Variant("a string sent over and over"));
+    ASSERT_TRUE(root_stream->is_empty());
+  }
+}
+
+TEST(socket, framing_v2_invalid) {
+  byte_t unknown_version[8] = {'p', 't', 0xF6, 'n', 7, 0, 0, 0};
+  ByteInStream unknown_in(unknown_version, 8);
+  InputSocket unknown_sock(&unknown_in);
+  ASSERT_FALSE(unknown_sock.init());
+  // Stream indices must be bound in order.
+  byte_t out_of_order[24] = {
+    'p', 't', 0xF6, 'n', FRAMING_V2, 0, 0, 0,
+    kBindStream, 0, 0, 0, 5, 0, 0, 0,
+    1, 0, 0, 0, BinaryImplUtils::boNull, 0, 0, 0
+  };
+  ByteInStream out_of_order_in(out_of_order, 24);
+  InputSocket out_of_order_sock(&out_of_order_in);
+  ASSERT_TRUE(out_of_order_sock.init());
+  InputSocket::ProcessInstrStatus status;
+  ASSERT_FALSE(out_of_order_sock.process_next_instruction(&status));
+  ASSERT_TRUE(status.is_error());
+}
+
+TEST(socket, framing_v2_long_size) {
+  // Frames with a 64-bit size are read like any other, whatever the size.
+  byte_t data[32] = {
+    'p', 't', 0xF6, 'n', FRAMING_V2, 0, 0, 0,
+    kSendValue, kFrameLongSize, 0, 0, 0, 0, 0, 0,
+    2, 0, 0, 0, 0, 0, 0, 0,
+    BinaryImplUtils::boInteger, 14, 0, 0, 0, 0, 0, 0
+  };
+  ByteInStream in(data, 32);
+  InputSocket insock(&in);
+  ASSERT_TRUE(insock.init());
+  InputSocket::ProcessInstrStatus status;
+  ASSERT_TRUE(insock.process_next_instruction(&status));
+  ASSERT_FALSE(status.is_error());
+  ASSERT_FALSE(insock.process_next_instruction(&status));
+  ASSERT_FALSE(status.is_error());
+  BufferInputStream *root_stream = static_cast<BufferInputStream*>(insock.root_stream());
+  Arena arena;
+  ASSERT_EQ(7, root_stream->pull_message(&arena).integer_value());
+}
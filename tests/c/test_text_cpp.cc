@@ -7,6 +7,8 @@
 #include "test/unittest.hh"
 #include "utils/string-inl.h"
 
+#include <math.h>
+
 using namespace plankton;
 
 static void check_syntax(TextSyntax syntax, const char *exp_src, Variant var) {
@@ -82,6 +84,31 @@ TEST(text_cpp, primitive) {
   check_ascii("%[]", NULL, Variant::blob(NULL, 0));
 }
 
+TEST(text_cpp, floats) {
+  check_ascii("0.5", NULL, Variant::float64(0.5));
+  check_ascii("-2.25", NULL, Variant::float64(-2.25));
+  check_ascii("0.1", NULL, Variant::float64(0.1));
+  check_ascii("1.0", NULL, Variant::float64(1.0));
+  check_ascii("-0.0", NULL, Variant::float64(-0.0));
+  check_ascii("1e+100", NULL, Variant::float64(1e100));
+  check_ascii("2.5e-08", NULL, Variant::float64(2.5e-8));
+  check_ascii("0.30000000000000004", NULL, Variant::float64(0.1 + 0.2));
+  check_ascii("%inf", NULL, Variant::float64(HUGE_VAL));
+  check_ascii("%-inf", NULL, Variant::float64(-HUGE_VAL));
+  check_ascii("%nan", NULL, Variant::float64(NAN));
+  Arena arena;
+  Array mixed = arena.new_array();
+  mixed.add(1);
+  mixed.add(Variant::float64(1.5));
+  mixed.add(Variant::float64(NAN));
+  mixed.add(Variant::null());
+  check_ascii("[1, 1.5, %nan, %n]", "[1 1.5 %nan %n]", mixed);
+  check_ascii_read("1.5E3", NULL, Variant::float64(1500));
+  check_ascii_read("3e2", NULL, Variant::float64(300));
+  // Integers stay integers.
+  check_ascii_read("12", NULL, Variant::integer(12));
+}
+
 TEST(text_cpp, arrays) {
   Arena arena;
   Array a0 = arena.new_array();
@@ -167,6 +194,24 @@ TEST(text_cpp, seeds) {
       "@File(--foo bar --3 %t --long asdfkjasaslasdfsaddkjfhkasldjfhlaskdjfhlaskdjfhaasdfl)", s0);
 }
 
+TEST(text_cpp, cyclic_seeds) {
+  Arena arena;
+  Seed leaf = arena.new_seed();
+  leaf.set_header("Leaf");
+  Seed node = arena.new_seed();
+  node.set_header("Node");
+  node.set_field("self", node);
+  // A seed that occurs twice without containing itself is written twice.
+  node.set_field("a", leaf);
+  node.set_field("b", leaf);
+  TextWriter source(SOURCE_SYNTAX);
+  source.write(node);
+  ASSERT_EQ(0, strcmp("@Node(self: ?, a: @Leaf(), b: @Leaf())", *source));
+  TextWriter command(COMMAND_SYNTAX);
+  command.write(node);
+  ASSERT_EQ(0, strcmp("@Node(--self ? --a @Leaf() --b @Leaf())", *command));
+}
+
 static void check_syntax_rewrite(TextSyntax syntax, const char *src,
     const char *expected) {
   TextReader parser(syntax);
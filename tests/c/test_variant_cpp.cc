@@ -71,6 +71,98 @@ TEST(variant_cpp, equality) {
   ASSERT_FALSE(id0 == id2);
 }
 
+TEST(variant_cpp, hash) {
+  Arena arena;
+  ASSERT_EQ(Variant::integer(5).hash(), Variant::integer(5).hash());
+  ASSERT_FALSE(Variant::integer(5).hash() == Variant::integer(6).hash());
+  ASSERT_FALSE(Variant::integer(5).hash() == Variant::integer(5).hash(1));
+  Variant sx0 = "xyzzy";
+  Variant sx1 = arena.new_string("xyzzy");
+  ASSERT_EQ(sx0.hash(), sx1.hash());
+  ASSERT_FALSE(sx0.hash() == Variant("xyzzz").hash());
+  // Strings and blobs may contain nulls and the hash must look past them.
+  Variant n0 = Variant::string("a\0b", 3);
+  Variant n1 = Variant::string("a\0c", 3);
+  ASSERT_FALSE(n0 == n1);
+  ASSERT_FALSE(n0.hash() == n1.hash());
+  ASSERT_FALSE(Variant::blob("xyzzy", 5).hash() == sx0.hash());
+  ASSERT_EQ(Variant::id64(0xDEADBEEF).hash(), Variant::id64(0xDEADBEEF).hash());
+  ASSERT_FALSE(Variant::id64(0xDEADBEEF).hash() == Variant::id32(0xDEADBEEF).hash());
+  ASSERT_FALSE(Variant::null().hash() == Variant::no().hash());
+  // Arrays and maps are hashed by identity, like they're compared, so the hash
+  // doesn't change when they're modified or frozen.
+  Array a0 = arena.new_array();
+  Array a1 = arena.new_array();
+  uint64_t a0_hash = a0.hash();
+  for (int64_t i = 0; i < 10; i++) {
+    a0.add(i);
+    a1.add(i);
+  }
+  a0.ensure_frozen();
+  a1.ensure_frozen();
+  ASSERT_EQ(a0_hash, a0.hash());
+  ASSERT_FALSE(a0.hash() == a1.hash());
+  Map m0 = arena.new_map();
+  uint64_t m0_hash = m0.hash();
+  m0.set("a", a0);
+  m0.ensure_frozen();
+  ASSERT_EQ(m0_hash, m0.hash());
+  platform_hash_map<Variant, int, Variant::Hasher> array_map;
+  Array key = arena.new_array();
+  array_map[key] = 1;
+  key.add(1);
+  key.ensure_frozen();
+  ASSERT_EQ(1, array_map[key]);
+  // Empty strings and blobs can be hashed.
+  ASSERT_EQ(Variant("").hash(), Variant("").hash());
+  ASSERT_FALSE(Variant("").hash() == Variant::blob("", 0).hash());
+  // Variants can be used as hash map keys.
+  platform_hash_map<Variant, int, Variant::Hasher> map;
+  map[sx0] = 1;
+  map[Variant::integer(7)] = 2;
+  ASSERT_EQ(1, map[sx1]);
+  ASSERT_EQ(2, map[Variant::integer(7)]);
+}
+
+TEST(variant_cpp, structural_hash) {
+  Arena arena;
+  // Atomic values hash structurally like they do normally.
+  ASSERT_EQ(Variant("foo").hash(), Variant("foo").structural_hash());
+  ASSERT_EQ(Variant::integer(7).hash(), Variant::integer(7).structural_hash());
+  // Frozen arrays and maps are hashed by their contents.
+  Array a0 = arena.new_array();
+  Array a1 = arena.new_array();
+  for (int64_t i = 0; i < 10; i++) {
+    a0.add(i);
+    a1.add(i);
+  }
+  ASSERT_FALSE(a0.structural_hash() == a1.structural_hash());
+  a0.ensure_frozen();
+  a1.ensure_frozen();
+  ASSERT_EQ(a0.structural_hash(), a1.structural_hash());
+  ASSERT_FALSE(a0.structural_hash(1) == a1.structural_hash(2));
+  Map m0 = arena.new_map();
+  m0.set("a", a0);
+  m0.ensure_frozen();
+  Map m1 = arena.new_map();
+  m1.set("a", a1);
+  m1.ensure_frozen();
+  ASSERT_EQ(m0.structural_hash(), m1.structural_hash());
+  Map m2 = arena.new_map();
+  m2.set("b", a1);
+  m2.ensure_frozen();
+  ASSERT_FALSE(m0.structural_hash() == m2.structural_hash());
+  // Deeply nested values still hash.
+  Array nested = arena.new_array();
+  for (size_t i = 0; i < 100; i++) {
+    Array outer = arena.new_array();
+    outer.add(nested);
+    outer.ensure_frozen();
+    nested = outer;
+  }
+  ASSERT_EQ(nested.structural_hash(), nested.structural_hash());
+}
+
 TEST(variant_cpp, as_bool) {
   size_t ticks = 0;
   if (Variant::null())
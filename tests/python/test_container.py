@@ -6,6 +6,7 @@
 import plankton
 import unittest
 import StringIO
+import struct
 
 
 class ContainerTest(unittest.TestCase):
@@ -28,6 +29,37 @@ class ContainerTest(unittest.TestCase):
     self.assertEquals([1, 2, 3], values.next())
     self.assertEquals({"a": 3}, values.next())
 
+  def test_socket_framing_v2(self):
+    outstr = StringIO.StringIO()
+    out = plankton.OutputSocket(outstr, plankton.FRAMING_V2)
+    out.set_default_string_encoding("UTF-8")
+    out.send_value([1, 2, 3])
+    out.send_value("dropped", "other")
+    out.send_value("dropped", "other")
+    out.send_value({"a": 3})
+    data = outstr.getvalue()
+    self.assertEquals("pt\xf6n\02\00\00\00", data[:8])
+    instr = plankton.InputSocket(StringIO.StringIO(data))
+    self.assertTrue(instr.init())
+    values = self._read_socket(instr)
+    self.assertEquals([1, 2, 3], values.next())
+    self.assertEquals({"a": 3}, values.next())
+
+  def _add_table_string(self, value):
+    block = plankton.Encoder().encode(value)
+    data = "pt\xf6n\02\00\00\00" + struct.pack("<BBHII", 3, 0, 0, 0, len(block))
+    data += str(block)
+    data += "\00" * ((8 - len(data) % 8) % 8)
+    instr = plankton.InputSocket(StringIO.StringIO(data))
+    self.assertTrue(instr.init())
+    return instr.process_next_instruction()
+
+  def test_string_table_limits(self):
+    self.assertTrue(self._add_table_string("foo"))
+    # The receiver rejects strings the sender would never have added.
+    self.assertFalse(self._add_table_string("x" * 65))
+    self.assertFalse(self._add_table_string(10))
+
 
 if __name__ == '__main__':
   runner = unittest.TextTestRunner(verbosity=0)